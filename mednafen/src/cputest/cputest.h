@@ -44,6 +44,7 @@ extern "C" {
 #define CPUTEST_FLAG_AVX          0x4000 ///< AVX functions: requires OS support even if YMM registers aren't used
 
 #define CPUTEST_FLAG_CMOV	  0x8000 // CMOVcc support (Mednafen addition)
+#define CPUTEST_FLAG_AVX2	 0x10000 // AVX2 functions (Mednafen addition)
 
 //#define CPUTEST_FLAG_IWMMXT       0x0100 ///< XScale IWMMXT
 #define CPUTEST_FLAG_ALTIVEC      0x0001 ///< standard
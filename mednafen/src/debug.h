@@ -203,6 +203,17 @@ struct DebuggerInfoStruct
 
  void (*SetLogFunc)(void (*logfunc)(const char *type, const char *text));
 
+ // Optional; starts a compact binary instruction trace to the file at "path"(replacing any trace in progress), or stops it if "path" is NULL.
+ void (*SetBinaryTrace)(const char* path);
+
+ // Optional; per-address access counters for the memory debugger's heatmap.  EnableAccessStats() starts or stops counting(the
+ // counts are kept while stopped).  GetAccessStats() fills in the counts for each byte of an address space range, and returns
+ // false if that address space has no counters.  DumpAccessStats() writes the counters out as CSV, and may throw.
+ void (*EnableAccessStats)(bool enable);
+ bool (*GetAccessStats)(const char* name, uint32 Address, uint32 Length, uint64* reads, uint64* writes, uint64* execs);
+ void (*ResetAccessStats)(void);
+ void (*DumpAccessStats)(const char* path);
+
  // Game emulation code shouldn't touch these directly.
  std::vector<AddressSpaceType> *AddressSpaces;
  std::vector<const RegGroupType*> *RegGroups;
@@ -39,6 +39,7 @@ static std::unique_ptr<FileStream> TraceLog;
 static std::string TraceLogSpec;
 static int64 TraceLogEnd;
 static unsigned TraceLogRTO;
+static bool BinaryTraceActive;
 
 static bool NeedInit;
 static bool WatchLogical; // Watch logical memory addresses, not physical
@@ -660,7 +661,7 @@ class DebuggerPrompt : public HappyPrompt
                   }
 		  else if(InPrompt == TraceLogPrompt)
 		  {
-		   if(pstring != TraceLogSpec || !TraceLog)
+		   if(pstring != TraceLogSpec || !(TraceLog || BinaryTraceActive))
 		   {
 		    TraceLogSpec = pstring;
 
@@ -670,10 +671,31 @@ class DebuggerPrompt : public HappyPrompt
 		     UpdateCoreHooks();
 		    }
 
+		    if(BinaryTraceActive)
+		    {
+		     CurGame->Debugger->SetBinaryTrace(NULL);
+		     BinaryTraceActive = false;
+		    }
+
 		    unsigned int endpc;
 		    char tmpfn[256];
 		    int num = trio_sscanf(tmp_c_str, "%255s %x", tmpfn, &endpc);
-		    if(num >= 1)
+		    size_t fnlen = (num >= 1) ? strlen(tmpfn) : 0;
+
+		    // A ".bintrace" file gets the system's compact binary trace(recorded by the emulation core; end_pc is not supported), if it has one.
+		    if(num >= 1 && CurGame->Debugger->SetBinaryTrace && fnlen >= 9 && !MDFN_strazicmp(tmpfn + fnlen - 9, ".bintrace"))
+		    {
+		     try
+		     {
+		      CurGame->Debugger->SetBinaryTrace(tmpfn);
+		      BinaryTraceActive = true;
+		     }
+		     catch(std::exception& e)
+		     {
+		      MDFND_OutputNotice(MDFN_NOTICE_ERROR, e.what());
+		     }
+		    }
+		    else if(num >= 1)
 		    {
 		     try
 		     {
@@ -2041,6 +2063,7 @@ void Debugger_Init(void)
 	TraceLogSpec = "";
 	TraceLogEnd = 0;
 	TraceLogRTO = 0;
+	BinaryTraceActive = false;
 
 	NeedInit = true;
 	WatchLogical = true;
@@ -2085,6 +2108,8 @@ void Debugger_Kill(void)
 	if(TraceLog)
 	 TraceLog.reset(nullptr);
 
+	BinaryTraceActive = false;	// The core stops its own trace when the game is closed.
+
 	if(memdbg != NULL)
 	{
 	 delete memdbg;
@@ -0,0 +1,660 @@
+/* Mednafen - Multi-system Emulator
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ Headless batch runner, for regression testing:
+
+	mednafen -headless [options] <game> [<game> ...]
+
+ Each game is loaded and run for a fixed number of frames as fast as possible, without opening a video or audio
+ device, optionally replaying a movie.  After every frame, a line is written to the hash file:
+
+	<frame> <video CRC32> <audio CRC32> [<memory region CRC32> ...]
+
+ The video CRC covers the display rectangle(and its size) of a 32bpp ABGR framebuffer, the audio CRC covers the
+ frame's 48KHz 16-bit samples, both in host byte order.  Lines beginning with '#' are comments.
+
+ Settings come from the core defaults, not from mednafen.cfg, so that the results don't depend on who runs them;
+ use "-config" and "-set" to change that.  Save game memory is still loaded from and written back to the
+ base directory, so point "-basedir" at a scratch directory for reproducible runs.
+
+ Two settings get headless defaults of their own, which "-config" and "-set" override like any other:
+
+	wswan.nileswan.tf_cow 1		TF card writes stay in memory, so runs neither modify nileswan.img nor race
+					each other writing it with "-jobs".
+	wswan.rtc.epoch 946684800	The cartridge RTC starts at 2000-01-01 00:00:00, not at the host's clock.
+*/
+
+#include "main.h"
+#include "headless.h"
+
+#include <mednafen/FileStream.h>
+#include <mednafen/movie.h>
+#include <mednafen/string/string.h>
+#include <zlib.h>
+
+#ifdef HAVE_FORK
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <map>
+#endif
+
+bool HeadlessMode = false;
+
+enum
+{
+ HEADLESS_OK = 0,
+ HEADLESS_MISMATCH = 1,
+ HEADLESS_ERROR = 2
+};
+
+struct MemRegion
+{
+ std::string space;
+ uint32 address;
+ uint32 length;
+};
+
+static bool Verbose;
+static uint32 NumFrames;
+static const char* ForceModule;
+static std::string BaseDir;
+static std::string ConfigPath;
+static std::string MoviePattern;
+static std::string OutPattern;
+static std::string ComparePattern;
+static std::vector<std::pair<std::string, std::string>> SettingOverrides;
+static std::vector<MemRegion> MemRegions;
+static std::vector<std::string> Games;
+static unsigned NumJobs;
+
+static void PrintUsage(const char* argv0)
+{
+ printf(_("Usage: %s -headless [options] <game> [<game> ...]\n\n"), argv0);
+ puts(_(" -frames N              Number of frames to run(default 600).\n"
+	" -movie FILE            Movie to replay; input stays at its last value if the movie ends early.\n"
+	" -out FILE              Hash file to write(default \"%s.hashes\" unless -compare is given).\n"
+	" -compare FILE          Golden hash file to compare against; the exit status is 1 on a mismatch.\n"
+	" -mem SPACE:ADDR:LEN    Also hash a memory region from a debugger address space, ADDR and LEN in hex;\n"
+	"                        may be given more than once.\n"
+	" -set NAME VALUE        Change a setting; may be given more than once.\n"
+	" -config FILE           Load settings from FILE before applying -set.\n"
+	" -basedir DIR           Base directory for firmware and save game memory(default as for the GUI).\n"
+	" -force_module NAME     Force the emulation module.\n"
+	" -jobs N                Run up to N games at once, each in its own process.\n"
+	" -verbose               Show the emulator's informational output.\n\n"
+	" In FILE arguments, \"%s\" is replaced with the game's path minus its extension.\n"
+	" A nileswan \".ipl0\" boot image picks up \"nileswan.spi\" and \"nileswan.img\" from its directory."));
+}
+
+void Headless_OutputNotice(MDFN_NoticeType t, const char* s) noexcept
+{
+ if(t == MDFN_NOTICE_STATUS && !Verbose)
+  return;
+
+ fprintf(stderr, "%s\n", s);
+}
+
+void Headless_OutputInfo(const char* s) noexcept
+{
+ if(!Verbose)
+  return;
+
+ fputs(s, stderr);
+}
+
+bool Headless_Wanted(int argc, char* argv[])
+{
+ return argc >= 2 && (!MDFN_strazicmp(argv[1], "-headless") || !MDFN_strazicmp(argv[1], "--headless"));
+}
+
+static bool ParseUInt(const char* s, uint32* v, int base = 10)
+{
+ char* end = NULL;
+ unsigned long long tmp;
+
+ if(!*s || *s == '-')
+  return false;
+
+ errno = 0;
+ tmp = strtoull(s, &end, base);
+
+ if(errno || *end || tmp > 0xFFFFFFFF)
+  return false;
+
+ *v = tmp;
+
+ return true;
+}
+
+static bool ParseMemRegion(const char* s, MemRegion* mr)
+{
+ std::vector<std::string> parts = MDFN_strsplit(s, ":");
+
+ if(parts.size() != 3 || parts[0].empty())
+  return false;
+
+ mr->space = parts[0];
+
+ return ParseUInt(parts[1].c_str(), &mr->address, 16) && ParseUInt(parts[2].c_str(), &mr->length, 16) && mr->length;
+}
+
+static bool ParseArgs(int argc, char* argv[])
+{
+ NumFrames = 600;
+ NumJobs = 1;
+
+ for(int i = 2; i < argc; i++)
+ {
+  const char* const arg = argv[i];
+  const bool has_param = (i + 1) < argc;
+
+  if(arg[0] != '-')
+  {
+   Games.push_back(arg);
+   continue;
+  }
+
+  const char* name = arg + 1 + (arg[1] == '-');
+
+  if(!strcmp(name, "verbose"))
+  {
+   Verbose = true;
+   continue;
+  }
+
+  if(!strcmp(name, "help"))
+   return false;
+
+  if(!strcmp(name, "set"))
+  {
+   if((i + 2) >= argc)
+   {
+    fprintf(stderr, _("Option \"%s\" requires a setting name and value.\n"), arg);
+    return false;
+   }
+
+   SettingOverrides.push_back({ argv[i + 1], argv[i + 2] });
+   i += 2;
+   continue;
+  }
+
+  if(!has_param)
+  {
+   fprintf(stderr, _("Unknown option \"%s\", or it requires a parameter.\n"), arg);
+   return false;
+  }
+
+  const char* const param = argv[++i];
+
+  if(!strcmp(name, "frames"))
+  {
+   if(!ParseUInt(param, &NumFrames) || !NumFrames)
+   {
+    fprintf(stderr, _("Invalid frame count \"%s\".\n"), param);
+    return false;
+   }
+  }
+  else if(!strcmp(name, "jobs"))
+  {
+   uint32 tmp;
+
+   if(!ParseUInt(param, &tmp) || !tmp || tmp > 1024)
+   {
+    fprintf(stderr, _("Invalid job count \"%s\".\n"), param);
+    return false;
+   }
+
+   NumJobs = tmp;
+  }
+  else if(!strcmp(name, "mem"))
+  {
+   MemRegion mr;
+
+   if(!ParseMemRegion(param, &mr))
+   {
+    fprintf(stderr, _("Invalid memory region \"%s\"; expected SPACE:ADDRESS:LENGTH with a hexadecimal address and length.\n"), param);
+    return false;
+   }
+
+   MemRegions.push_back(mr);
+  }
+  else if(!strcmp(name, "movie"))
+   MoviePattern = param;
+  else if(!strcmp(name, "out"))
+   OutPattern = param;
+  else if(!strcmp(name, "compare"))
+   ComparePattern = param;
+  else if(!strcmp(name, "config"))
+   ConfigPath = param;
+  else if(!strcmp(name, "basedir"))
+   BaseDir = param;
+  else if(!strcmp(name, "force_module"))
+   ForceModule = param;
+  else
+  {
+   fprintf(stderr, _("Unknown option \"%s\".\n"), arg);
+   return false;
+  }
+ }
+
+ if(Games.empty())
+ {
+  fprintf(stderr, _("No game specified.\n"));
+  return false;
+ }
+
+ if(OutPattern.empty() && ComparePattern.empty())
+  OutPattern = "%s.hashes";
+
+ return true;
+}
+
+static std::string ExpandPath(const std::string& pattern, const std::string& game_path)
+{
+ std::string stem = game_path;
+ std::string ret;
+ size_t sep = stem.find_last_of("/\\");
+ size_t dot = stem.find_last_of('.');
+
+ if(dot != std::string::npos && (sep == std::string::npos || dot > sep))
+  stem.resize(dot);
+
+ for(size_t i = 0; i < pattern.size(); i++)
+ {
+  if(pattern[i] == '%' && (i + 1) < pattern.size() && pattern[i + 1] == 's')
+  {
+   ret += stem;
+   i++;
+  }
+  else
+   ret += pattern[i];
+ }
+
+ return ret;
+}
+
+static void LoadGolden(const std::string& path, std::vector<std::string>* lines)
+{
+ FileStream fp(path, FileStream::MODE_READ);
+ std::string line;
+
+ while(fp.get_line(line) >= 0)
+ {
+  MDFN_trim(&line);
+
+  if(line.empty() || line[0] == '#')
+   continue;
+
+  lines->push_back(line);
+ }
+}
+
+static const char* DescribeMismatch(const std::string& expected, const std::string& got)
+{
+ static const char* const fields[3] = { "frame number", "video", "audio" };
+ std::vector<std::string> ef = MDFN_strsplit(expected, " ");
+ std::vector<std::string> gf = MDFN_strsplit(got, " ");
+
+ if(ef.size() != gf.size())
+  return "number of memory regions";
+
+ for(size_t i = 0; i < ef.size(); i++)
+ {
+  if(ef[i] != gf[i])
+   return (i < 3) ? fields[i] : "memory";
+ }
+
+ return "";
+}
+
+static uint32 HashVideo(const EmulateSpecStruct& espec)
+{
+ const MDFN_Surface* const surface = espec.surface;
+ const MDFN_Rect& rect = espec.DisplayRect;
+ uint8 dims[8];
+ uLong crc = crc32(0, Z_NULL, 0);
+
+ MDFN_en32lsb(&dims[0], rect.w);
+ MDFN_en32lsb(&dims[4], rect.h);
+ crc = crc32(crc, dims, sizeof(dims));
+
+ for(int32 y = rect.y; y < rect.y + rect.h; y++)
+ {
+  const int32 w = (espec.LineWidths[0] == ~0) ? rect.w : espec.LineWidths[y];
+
+  crc = crc32(crc, (const Bytef*)(surface->pix<uint32>() + y * surface->pitchinpix + rect.x), w * sizeof(uint32));
+ }
+
+ return crc;
+}
+
+static int RunGame(const std::string& game_path)
+{
+ MDFNGI* gi;
+ std::unique_ptr<FileStream> out;
+ std::vector<std::string> golden;
+ std::string out_path, compare_path;
+ int ret = HEADLESS_OK;
+
+ try
+ {
+  if(!OutPattern.empty())
+  {
+   out_path = ExpandPath(OutPattern, game_path);
+   out.reset(new FileStream(out_path, FileStream::MODE_WRITE));
+  }
+
+  if(!ComparePattern.empty())
+  {
+   compare_path = ExpandPath(ComparePattern, game_path);
+   LoadGolden(compare_path, &golden);
+  }
+ }
+ catch(std::exception& e)
+ {
+  fprintf(stderr, "%s: %s\n", game_path.c_str(), e.what());
+  return HEADLESS_ERROR;
+ }
+
+ if(!(gi = MDFNI_LoadGame(ForceModule, &::Mednafen::NVFS, game_path.c_str())))
+ {
+  fprintf(stderr, _("%s: Error loading game.\n"), game_path.c_str());
+  return HEADLESS_ERROR;
+ }
+
+ try
+ {
+  std::vector<const AddressSpaceType*> mem_spaces;
+  std::vector<uint8> mem_buf;
+
+  for(auto const& mr : MemRegions)
+  {
+   const AddressSpaceType* as = NULL;
+
+   #ifdef WANT_DEBUGGER
+   if(gi->Debugger)
+   {
+    for(auto const& a : *gi->Debugger->AddressSpaces)
+     if(a.name == mr.space)
+      as = &a;
+   }
+   #endif
+
+   if(!as)
+    throw MDFN_Error(0, _("No \"%s\" address space to hash."), mr.space.c_str());
+
+   mem_spaces.push_back(as);
+   mem_buf.resize(std::max<size_t>(mem_buf.size(), mr.length));
+  }
+
+  //
+  // Use each port's default device; the data stays zeroed unless a movie supplies it.
+  //
+  for(unsigned port = 0; port < gi->PortInfo.size(); port++)
+  {
+   const InputPortInfoStruct* const pi = &gi->PortInfo[port];
+   unsigned device = 0;
+
+   for(unsigned d = 0; d < pi->DeviceInfo.size(); d++)
+   {
+    if(!MDFN_strazicmp(pi->DeviceInfo[d].ShortName, pi->DefaultDevice))
+     device = d;
+   }
+
+   MDFNI_SetInput(port, device);
+  }
+
+  std::unique_ptr<MDFN_Surface> surface(new MDFN_Surface(NULL, gi->fb_width, gi->fb_height, gi->fb_width, MDFN_PixelFormat::ABGR32_8888));
+  std::unique_ptr<int32[]> lw(new int32[gi->fb_height]);
+  const double sound_rate = 48000;
+  const int32 sound_max = 500 * sound_rate / 1000;
+  std::unique_ptr<int16[]> sound_buf(new int16[sound_max * std::max<unsigned>(1, gi->soundchan)]);
+
+  surface->Fill(0, 0, 0, 0);
+  memset(lw.get(), 0, sizeof(int32) * gi->fb_height);
+
+  if(!MoviePattern.empty())
+  {
+   std::string movie_path = ExpandPath(MoviePattern, game_path);
+
+   MDFNI_LoadMovie(&movie_path[0]);
+
+   if(!MDFNMOV_IsPlaying())
+    throw MDFN_Error(0, _("Error playing movie \"%s\"."), movie_path.c_str());
+  }
+
+  if(out)
+   out->print_format("# %s, %u frames\n", game_path.c_str(), NumFrames);
+
+  const int64 start_time = Time::MonoUS();
+  uint32 frame;
+
+  for(frame = 0; frame < NumFrames; frame++)
+  {
+   EmulateSpecStruct espec;
+   std::string line;
+
+   lw[0] = ~0;
+   espec.surface = surface.get();
+   espec.LineWidths = lw.get();
+   espec.SoundRate = sound_rate;
+   espec.SoundBuf = sound_buf.get();
+   espec.SoundBufMaxSize = sound_max;
+
+   MDFNI_Emulate(&espec);
+
+   line = MDFN_sprintf("%u %08x %08x", frame, HashVideo(espec), (uint32)crc32(0, (const Bytef*)espec.SoundBuf, espec.SoundBufSize * gi->soundchan * sizeof(int16)));
+
+   for(size_t i = 0; i < MemRegions.size(); i++)
+   {
+    const MemRegion& mr = MemRegions[i];
+
+    mem_spaces[i]->GetAddressSpaceBytes(mr.space.c_str(), mr.address, mr.length, mem_buf.data());
+    line += MDFN_sprintf(" %08x", (uint32)crc32(0, mem_buf.data(), mr.length));
+   }
+
+   if(out)
+    out->print_format("%s\n", line.c_str());
+
+   if(!ComparePattern.empty() && ret == HEADLESS_OK)
+   {
+    if(frame >= golden.size())
+    {
+     printf(_("%s: MISMATCH, \"%s\" ends at frame %u.\n"), game_path.c_str(), compare_path.c_str(), (unsigned)golden.size());
+     ret = HEADLESS_MISMATCH;
+    }
+    else if(golden[frame] != line)
+    {
+     printf(_("%s: MISMATCH in %s at frame %u; expected \"%s\", got \"%s\".\n"), game_path.c_str(), DescribeMismatch(golden[frame], line), frame, golden[frame].c_str(), line.c_str());
+     ret = HEADLESS_MISMATCH;
+    }
+
+    // Nothing more to learn by running on.
+    if(ret != HEADLESS_OK && !out)
+    {
+     frame++;
+     break;
+    }
+   }
+  }
+
+  if(!ComparePattern.empty() && ret == HEADLESS_OK && golden.size() > frame)
+  {
+   printf(_("%s: MISMATCH, \"%s\" has %u frames, only %u were run.\n"), game_path.c_str(), compare_path.c_str(), (unsigned)golden.size(), frame);
+   ret = HEADLESS_MISMATCH;
+  }
+
+  if(out)
+   out->close();
+
+  if(ret == HEADLESS_OK)
+  {
+   const double seconds = std::max<double>(1, Time::MonoUS() - start_time) / 1000000;
+
+   printf(_("%s: %s, %u frames in %.2f seconds(%.0f frames per second).\n"), game_path.c_str(), ComparePattern.empty() ? "done" : "ok", frame, seconds, frame / seconds);
+  }
+ }
+ catch(std::exception& e)
+ {
+  fprintf(stderr, "%s: %s\n", game_path.c_str(), e.what());
+  ret = HEADLESS_ERROR;
+ }
+
+ MDFNI_CloseGame();
+ fflush(stdout);
+
+ return ret;
+}
+
+static int RunGames(const std::vector<std::string>& games)
+{
+ int ret = HEADLESS_OK;
+
+ if(!MDFNI_Init())
+  return HEADLESS_ERROR;
+
+ if(!MDFNI_InitFinalize(BaseDir.c_str()))
+  return HEADLESS_ERROR;
+
+ try
+ {
+  NVFS.create_missing_dirs(BaseDir + PSS);
+ }
+ catch(std::exception& e)
+ {
+  fprintf(stderr, _("Error creating base directory: %s\n"), e.what());
+  return HEADLESS_ERROR;
+ }
+
+ // Defaults that would otherwise make runs depend on the host, or on each other; "-config" and "-set" still win.
+ MDFNI_SetSetting("wswan.nileswan.tf_cow", "1");
+ MDFNI_SetSetting("wswan.rtc.epoch", "946684800");
+
+ if(!ConfigPath.empty() && MDFNI_LoadSettings(ConfigPath.c_str()) != 1)
+ {
+  fprintf(stderr, _("Error loading settings from \"%s\".\n"), ConfigPath.c_str());
+  return HEADLESS_ERROR;
+ }
+
+ for(auto const& so : SettingOverrides)
+ {
+  if(!MDFNI_SetSetting(so.first, so.second))
+   return HEADLESS_ERROR;
+ }
+
+ for(auto const& game : games)
+  ret = std::max<int>(ret, RunGame(game));
+
+ MDFNI_Kill();
+
+ return ret;
+}
+
+#ifdef HAVE_FORK
+static int RunJobs(void)
+{
+ std::map<pid_t, std::string> running;
+ size_t next = 0;
+ int ret = HEADLESS_OK;
+
+ fflush(stdout);
+ fflush(stderr);
+
+ while(next < Games.size() || running.size())
+ {
+  if(next < Games.size() && running.size() < NumJobs)
+  {
+   const std::string& game = Games[next++];
+   const pid_t pid = fork();
+
+   if(pid == 0)
+   {
+    const int code = RunGames({ game });
+
+    fflush(stdout);
+    fflush(stderr);
+    _exit(code);
+   }
+
+   if(pid < 0)
+   {
+    fprintf(stderr, _("%s: fork() failed: %s\n"), game.c_str(), ErrnoHolder(errno).StrError());
+    ret = HEADLESS_ERROR;
+    continue;
+   }
+
+   running[pid] = game;
+  }
+  else
+  {
+   int status;
+   const pid_t pid = waitpid(-1, &status, 0);
+
+   if(pid < 0)
+   {
+    if(errno == EINTR)
+     continue;
+
+    fprintf(stderr, _("waitpid() failed: %s\n"), ErrnoHolder(errno).StrError());
+    return HEADLESS_ERROR;
+   }
+
+   auto it = running.find(pid);
+
+   if(it == running.end())
+    continue;
+
+   if(WIFEXITED(status))
+    ret = std::max<int>(ret, std::min<int>(HEADLESS_ERROR, WEXITSTATUS(status)));
+   else
+   {
+    if(WIFSIGNALED(status))
+     fprintf(stderr, _("%s: Terminated by signal %d.\n"), it->second.c_str(), WTERMSIG(status));
+
+    ret = HEADLESS_ERROR;
+   }
+
+   running.erase(it);
+  }
+ }
+
+ return ret;
+}
+#endif
+
+int Headless_Main(int argc, char* argv[])
+{
+ HeadlessMode = true;
+
+ if(!ParseArgs(argc, argv))
+ {
+  PrintUsage(argv[0]);
+  return HEADLESS_ERROR;
+ }
+
+ if(BaseDir.empty())
+  BaseDir = GetBaseDirectory();
+
+ #ifdef HAVE_FORK
+ if(NumJobs > 1 && Games.size() > 1)
+  return RunJobs();
+ #endif
+
+ return RunGames(Games);
+}
@@ -0,0 +1,12 @@
+#ifndef __MDFN_DRIVERS_HEADLESS_H
+#define __MDFN_DRIVERS_HEADLESS_H
+
+MDFN_HIDE extern bool HeadlessMode;
+
+bool Headless_Wanted(int argc, char* argv[]);
+int Headless_Main(int argc, char* argv[]) MDFN_COLD;
+
+void Headless_OutputNotice(MDFN_NoticeType t, const char* s) noexcept;
+void Headless_OutputInfo(const char* s) noexcept;
+
+#endif
@@ -56,6 +56,7 @@
 #include "remote.h"
 #include "ers.h"
 #include "rmdui.h"
+#include "headless.h"
 #include <mednafen/qtrecord.h>
 #include <mednafen/tests.h>
 #include <mednafen/testsexp.h>
@@ -425,6 +426,12 @@ void Mednafen::MDFND_OutputNotice(MDFN_NoticeType t, const char* s) noexcept
 {
  bool did_message_box = false;
 
+ if(HeadlessMode)
+ {
+  Headless_OutputNotice(t, s);
+  return;
+ }
+
  if(RemoteOn)
  {
   if(t == MDFN_NOTICE_ERROR)
@@ -477,7 +484,9 @@ void Mednafen::MDFND_OutputNotice(MDFN_NoticeType t, const char* s) noexcept
 
 void Mednafen::MDFND_OutputInfo(const char *s) noexcept
 {
- if(RemoteOn)
+ if(HeadlessMode)
+  Headless_OutputInfo(s);
+ else if(RemoteOn)
   Remote_SendInfoMessage(s);
  else
  {
@@ -2069,6 +2078,9 @@ int main(int argc, char *argv[])
 	//
 	//
 	//
+	if(Headless_Wanted(argc, argv))
+	 return Headless_Main(argc, argv);
+
 	if(argc >= 3 && (!MDFN_strazicmp(argv[1], "-remote") || !MDFN_strazicmp(argv[1], "--remote")))
 	{
 	 RemoteOn = true;
@@ -2540,6 +2552,9 @@ void Mednafen::MDFND_MidSync(EmulateSpecStruct *espec, const unsigned flags)
 {
  //printf("MidSync; flags=0x%08x --- SoundBufSize_DriverProcessed=0x%08x, SoundBufSize=0x%08x\n", flags, espec->SoundBufSize_DriverProcessed, espec->SoundBufSize);
  //
+ if(HeadlessMode)	// No throttling, sound output, or live input to deal with.
+  return;
+
  if(MDFN_UNLIKELY(StateRCTest || StateFuzzTest))
  {
   // TODO: Make state rewind consistency checking compatible with midsync, instead of this quick workaround.
@@ -2687,11 +2702,27 @@ static bool MDFND_Update(int WhichVideoBuffer, int16 *Buffer, int Count)
 
 void Mednafen::MDFND_SetStateStatus(StateStatusStruct *status) noexcept
 {
+ if(HeadlessMode)
+ {
+  if(status)
+  {
+   delete[] status->gfx;
+   delete status;
+  }
+  return;
+ }
+
  SendCEvent(CEVT_SET_STATE_STATUS, status, NULL);
 }
 
 void Mednafen::MDFND_SetMovieStatus(StateStatusStruct *status) noexcept
 {
+ if(HeadlessMode)
+ {
+  MDFND_SetStateStatus(status);
+  return;
+ }
+
  SendCEvent(CEVT_SET_MOVIE_STATUS, status, NULL);
 }
 
@@ -52,6 +52,7 @@ void RefreshThrottleFPS(double);
 void PumpWrap(void);
 void MainRequestExit(void);
 bool MainExitPending(void);
+std::string GetBaseDirectory(void);
 
 MDFN_HIDE extern bool pending_save_state, pending_ssnapshot, pending_snapshot, pending_save_movie;
 
@@ -223,6 +223,10 @@ void MemDebugger::PromptFinish(const std::string &pstring)
 
 	  MDFNI_SetSetting(std::string(CurGame->shortname) + "." + "debugger.memcharenc", pstring);
 	 }
+	 else if(which == DumpAccessStats)
+	 {
+	  CurGame->Debugger->DumpAccessStats(pstring.c_str());
+	 }
          else if(which == DumpMem)
          {
           uint32 A1, A2, tmpsize;
@@ -734,6 +738,31 @@ static const int32 byte_minrows = 1;
 static const int32 byte_maxrows = 24;
 static const int32 byte_prerows = 8;
 
+static const char* const HeatModeNames[] = { NULL, "All accesses", "Reads", "Writes", "Executes" };
+
+// Fill "heat" with the access counts selected by HeatMode for the byte_bpr bytes at A; false if this address space
+// has no counters.
+bool MemDebugger::GetHeat(uint32 A, uint64* heat)
+{
+ uint64 reads[byte_bpr], writes[byte_bpr], execs[byte_bpr];
+
+ if(!CurGame->Debugger->GetAccessStats || !CurGame->Debugger->GetAccessStats(ASpace->name.c_str(), A, byte_bpr, reads, writes, execs))
+  return false;
+
+ for(int32 i = 0; i < byte_bpr; i++)
+ {
+  switch(HeatMode)
+  {
+   default: heat[i] = reads[i] + writes[i] + execs[i]; break;
+   case 2: heat[i] = reads[i]; break;
+   case 3: heat[i] = writes[i]; break;
+   case 4: heat[i] = execs[i]; break;
+  }
+ }
+
+ return true;
+}
+
 
 // Call this function from the game thread
 void MemDebugger::Draw(MDFN_Surface *surface, const MDFN_Rect *rect, const MDFN_Rect *screen_rect)
@@ -749,6 +778,9 @@ void MemDebugger::Draw(MDFN_Surface *surface, const MDFN_Rect *rect, const MDFN_
  uint8 endian = ASpace->Endianness;
 
  DrawText(surface, 0, text_y, ASpace->long_name, pf_cache.MakeColor(0x20, 0xFF, 0x20, 0xFF), MDFN_FONT_9x18_18x18, rect->w);
+
+ if(HeatMode)
+  DrawText(surface, addr_left_padding, text_y + 3, std::string("Heatmap: ") + HeatModeNames[HeatMode], pf_cache.MakeColor(0xFF, 0x80, 0x40, 0xFF), MDFN_FONT_6x13_12x13);
  text_y += 21;
 
  if(ASpace->IsWave && SizeCache[CurASpace] <= 128 && ASpace->WaveBits <= 6)
@@ -780,6 +812,8 @@ void MemDebugger::Draw(MDFN_Surface *surface, const MDFN_Rect *rect, const MDFN_
  for(int y = 0; y < numrows; y++)
  {
   uint8 byte_buffer[byte_bpr];
+  uint64 heat[byte_bpr];
+  bool have_heat = false;
   char abuf[32];
   uint32 disp_addr;
 
@@ -787,6 +821,9 @@ void MemDebugger::Draw(MDFN_Surface *surface, const MDFN_Rect *rect, const MDFN_
 
   ASpace->GetAddressSpaceBytes(ASpace->name.c_str(), Ameow, byte_bpr, byte_buffer);
 
+  if(HeatMode)
+   have_heat = GetHeat(Ameow, heat);
+
   if (wordsize == 2)
    disp_addr = Ameow >> 1;
   else
@@ -957,6 +994,20 @@ void MemDebugger::Draw(MDFN_Surface *surface, const MDFN_Rect *rect, const MDFN_
     }
    }
 
+   // Heatmap background, from dark blue for a single access to red for 2^24 or more.
+   if(have_heat && !ASpace->IsPalette)
+   {
+    const uint64 count = (wordsize == 2) ? (heat[x * 2] + heat[x * 2 + 1]) : heat[x];
+
+    if(count)
+    {
+     const uint32 level = std::min<uint32>(24, 64 - MDFN_lzcount64(count));
+     const uint32 hx = alen + x * wordsize * byte_hex_spacing + ((x / 4) * byte_hex_group_pad);
+
+     MDFN_DrawFillRect(surface, hx - 1, text_y, wordsize * 2 * byte_hex_font_width + 2, 13, pf_cache.MakeColor(0x20 + level * 0xA0 / 24, 0x10, 0x80 - level * 0x70 / 24, 0xFF));
+    }
+   }
+
    // hex display
    if ((ASpace->IsPalette) && (ASpace->PaletteType == PALETTE_PCE))
    {
@@ -1341,6 +1392,30 @@ int MemDebugger::Event(const SDL_Event *event)
 		}
 		break;
 
+	 case SDLK_m:
+		if(!CurGame->Debugger->EnableAccessStats)
+		{
+		 error_string = trio_aprintf(_("Access statistics are not supported for this system."));
+		 error_time = -1;
+		}
+		else if(event->key.keysym.mod & KMOD_CTRL)
+		 CurGame->Debugger->ResetAccessStats();
+		else
+		{
+		 HeatMode = (HeatMode + 1) % (sizeof(HeatModeNames) / sizeof(HeatModeNames[0]));
+		 CurGame->Debugger->EnableAccessStats(HeatMode != 0);
+		}
+		break;
+
+	 case SDLK_v:
+		if(CurGame->Debugger->DumpAccessStats)
+		{
+		 InPrompt = DumpAccessStats;
+		 myprompt = new MemDebuggerPrompt(this, "Save Access Statistics (CSV filename)", "");
+		 PromptTAKC = event->key.keysym.sym;
+		}
+		break;
+
 	 case SDLK_c:
 		InPrompt = SetCharset;
 		myprompt = new MemDebuggerPrompt(this, "Charset", GameCode);
@@ -1433,7 +1508,7 @@ int MemDebugger::Event(const SDL_Event *event)
 
 // Called after a game is loaded.
 MemDebugger::MemDebugger() : AddressSpaces(NULL), ASpace(NULL), IsActive(false), CurASpace(0),
-			     Digitnum(1), InEditMode(false), InTextArea(false), error_string(NULL), error_time(-1),
+			     Digitnum(1), InEditMode(false), InTextArea(false), HeatMode(0), error_string(NULL), error_time(-1),
 			     ict_game_to_utf8((iconv_t)-1), ict_utf8_to_game((iconv_t)-1), InPrompt(None), myprompt(NULL), PromptTAKC(SDLK_UNKNOWN)
 {
  if(CurGame->Debugger)
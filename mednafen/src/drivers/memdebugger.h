@@ -49,6 +49,7 @@ class MemDebugger
  bool DoRSearch(const std::vector<uint8>& thebytes);
 
 
+ bool GetHeat(uint32 A, uint64* heat);
  int32 DrawWaveform(MDFN_Surface* surface, const int32 base_y, const uint32 hcenterw);
  void DrawAtCursorInfo(MDFN_Surface* surface, const int32 base_y, const uint32 hcenterw);
 
@@ -67,6 +68,7 @@ class MemDebugger
  uint8 Digitnum;
  bool InEditMode;
  bool InTextArea; // Right side text vs left side numbers, selected via TAB
+ int HeatMode;	// Access heatmap overlay(see HeatModeNames), cycled with M.
 
  std::string BSS_String, RS_String, TS_String;
  char *error_string;
@@ -84,6 +86,7 @@ class MemDebugger
   LoadMem,
   DumpHex,
   SetCharset,
+  DumpAccessStats,
  } PromptType;
 
  iconv_t ict_game_to_utf8;
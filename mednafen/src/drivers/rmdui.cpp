@@ -21,6 +21,7 @@
 
 #include "main.h"
 #include "rmdui.h"
+#include "headless.h"
 
 #include <trio/trio.h>
 
@@ -248,6 +249,9 @@ void RMDUI_Kill(void) noexcept
 
 void Mednafen::MDFND_MediaSetNotification(uint32 drive_idx, uint32 state_idx, uint32 media_idx, uint32 orientation_idx)
 {
+ if(HeadlessMode)
+  return;
+
  const RMD_Layout* rmd = CurGame->RMD;
  const RMD_Drive* rd = &rmd->Drives[drive_idx];
  const RMD_State* rs = &rd->PossibleStates[state_idx];
@@ -16,16 +16,31 @@
  */
 
 #include "wswan.h"
+#include "comm.h"
+#include "gfx.h"
 
 #include <unistd.h>
 #include <fcntl.h>
 #include <sys/types.h>
 
+#if defined(HAVE_FORK) || defined(HAVE_POSIX_SOCKETS)
+#include <sys/uio.h>
+#endif
+
 #ifdef HAVE_FORK
 #include <sys/wait.h>
 #include <signal.h>
 #endif
 
+#ifdef HAVE_POSIX_SOCKETS
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <netdb.h>
+#endif
+
 // #define WS_COMM_DEBUG
 
 #ifdef WS_COMM_DEBUG
@@ -41,25 +56,224 @@ static uint8 Control;
 static uint8 SendBuf, RecvBuf;
 static bool SendLatched, RecvLatched;
 
+//
+// Host side of the link.  The emulated serial port and the nileswan USB CDC exchange bytes with
+// userspace rings; the backend file descriptors are only touched by Comm_Sync(), once per frame,
+// with one non-blocking readv()/writev() each way.
+//
+enum : uint32 { RING_SIZE = 0x10000 };
+
+struct Ring
+{
+ uint8 data[RING_SIZE];
+ uint32 rd, wr;	// Free-running; wr - rd bytes are buffered.
+};
+
+static Ring RxRing, TxRing;
+
+static unsigned Transport;
 static int child_pid = -1;
-static int stdin_pipes[2] = { -1, -1 };
-static int stdout_pipes[2] = { -1, -1 };
+static int rd_fd = -1;		// Backend descriptors; the same socket or PTY master for both except
+static int wr_fd = -1;		// with COMM_TRANSPORT_PROGRAM, where they are the child's stdout/stdin pipes.
+static int listen_fd = -1;	// COMM_TRANSPORT_UNIX/TCP: waiting for a host tool to connect.
 
-void Comm_Init(const char *wfence_path)
+static INLINE uint32 RingCount(const Ring* r)
 {
- child_pid = -1;
+ return r->wr - r->rd;
+}
+
+static uint32 RingPush(Ring* r, const uint8* buf, uint32 len)
+{
+ len = std::min<uint32>(len, RING_SIZE - RingCount(r));
+
+ for(uint32 i = 0; i < len; i++)
+  r->data[(r->wr + i) & (RING_SIZE - 1)] = buf[i];
+ r->wr += len;
+
+ return len;
+}
+
+static uint32 RingPop(Ring* r, uint8* buf, uint32 len)
+{
+ len = std::min<uint32>(len, RingCount(r));
+
+ for(uint32 i = 0; i < len; i++)
+  buf[i] = r->data[(r->rd + i) & (RING_SIZE - 1)];
+ r->rd += len;
+
+ return len;
+}
+
+#if defined(HAVE_FORK) || defined(HAVE_POSIX_SOCKETS)
+static void SetNonBlocking(int fd)
+{
+ fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+}
+#endif
+
+static void CloseFD(int* fd)
+{
+ if(*fd != -1)
+ {
+  close(*fd);
+  *fd = -1;
+ }
+}
+
+static void Disconnect(void)
+{
+ if(wr_fd != rd_fd)
+  CloseFD(&wr_fd);
+ CloseFD(&rd_fd);
+ wr_fd = -1;
+}
+
+#ifdef HAVE_POSIX_SOCKETS
+static void Listen(unsigned transport, const char* path)
+{
+ int fd = -1;
+
+ if(transport == COMM_TRANSPORT_UNIX)
+ {
+  struct sockaddr_un sa;
+
+  memset(&sa, 0, sizeof(sa));
+  sa.sun_family = AF_UNIX;
+  if(strlen(path) >= sizeof(sa.sun_path))
+   throw MDFN_Error(0, _("Serial socket path \"%s\" is too long."), path);
+  strcpy(sa.sun_path, path);
+
+  // Only clear away a stale socket left by an earlier run, never some other file that happens to have the name.
+  {
+   struct stat st;
+
+   if(!lstat(path, &st))
+   {
+    if(!S_ISSOCK(st.st_mode))
+     throw MDFN_Error(EEXIST, _("Serial socket path \"%s\" exists and is not a socket."), path);
+
+    unlink(path);
+   }
+  }
+
+  if((fd = socket(AF_UNIX, SOCK_STREAM, 0)) == -1 || bind(fd, (struct sockaddr*)&sa, sizeof(sa)) == -1)
+  {
+   ErrnoHolder ene(errno);
+
+   if(fd != -1)
+    close(fd);
+   throw MDFN_Error(ene.Errno(), _("Error listening on serial socket \"%s\": %s"), path, ene.StrError());
+  }
+ }
+ else
+ {
+  std::string host = "localhost";
+  std::string port = path;
+  const size_t colon = port.rfind(':');
+  struct addrinfo hints, *res = NULL;
+  int gai_err;
+
+  if(colon != std::string::npos)
+  {
+   host = port.substr(0, colon);
+   port = port.substr(colon + 1);
+  }
+
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  hints.ai_flags = AI_PASSIVE;
+
+  if((gai_err = getaddrinfo(host.c_str(), port.c_str(), &hints, &res)))
+   throw MDFN_Error(0, _("Error resolving serial socket address \"%s\": %s"), path, gai_strerror(gai_err));
+
+  if((fd = socket(res->ai_family, res->ai_socktype, res->ai_protocol)) != -1)
+  {
+   int opt = 1;
+
+   setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+  }
+
+  if(fd == -1 || bind(fd, res->ai_addr, res->ai_addrlen) == -1)
+  {
+   ErrnoHolder ene(errno);
+
+   freeaddrinfo(res);
+   if(fd != -1)
+    close(fd);
+   throw MDFN_Error(ene.Errno(), _("Error listening on serial socket \"%s\": %s"), path, ene.StrError());
+  }
+  freeaddrinfo(res);
+ }
+
+ if(listen(fd, 1) == -1)
+ {
+  ErrnoHolder ene(errno);
+
+  close(fd);
+  throw MDFN_Error(ene.Errno(), _("Error listening on serial socket \"%s\": %s"), path, ene.StrError());
+ }
+
+ SetNonBlocking(fd);
+ listen_fd = fd;
+ MDFN_printf(_("Serial port: waiting for connections on \"%s\".\n"), path);
+}
+
+static void Accept(void)
+{
+ const int fd = accept(listen_fd, NULL, NULL);
+
+ if(fd == -1)
+  return;
+
+ if(Transport == COMM_TRANSPORT_TCP)
+ {
+  int opt = 1;
 
- stdin_pipes[0] = -1;
- stdin_pipes[1] = -1;
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(opt));
+ }
+#ifdef SO_NOSIGPIPE
+ {
+  int opt = 1;
+
+  setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &opt, sizeof(opt));
+ }
+#endif
 
- stdout_pipes[0] = -1;
- stdout_pipes[1] = -1;
+ SetNonBlocking(fd);
+ rd_fd = wr_fd = fd;
+}
+#endif
+
+void Comm_Init(unsigned transport, const char *path)
+{
+ Transport = COMM_TRANSPORT_NONE;
+ child_pid = -1;
+ rd_fd = wr_fd = listen_fd = -1;
+ RxRing.rd = RxRing.wr = 0;
+ TxRing.rd = TxRing.wr = 0;
 
 #ifdef HAVE_FORK
- if(wfence_path != NULL)
+ if(transport == COMM_TRANSPORT_PROGRAM)
  {
-  pipe(stdin_pipes);
-  pipe(stdout_pipes);
+  int stdin_pipes[2];
+  int stdout_pipes[2];
+
+  if(pipe(stdin_pipes) == -1)
+  {
+   ErrnoHolder ene(errno);
+
+   throw MDFN_Error(ene.Errno(), _("Error creating pipe: %s"), ene.StrError());
+  }
+
+  if(pipe(stdout_pipes) == -1)
+  {
+   ErrnoHolder ene(errno);
+
+   close(stdin_pipes[0]);
+   close(stdin_pipes[1]);
+   throw MDFN_Error(ene.Errno(), _("Error creating pipe: %s"), ene.StrError());
+  }
 
   child_pid = fork();
 
@@ -69,13 +283,42 @@ void Comm_Init(const char *wfence_path)
   {
    dup2(stdin_pipes[0], 0);
    dup2(stdout_pipes[1], 1);
-   execlp(wfence_path, wfence_path, "ASDF", (char*)NULL);
+   execlp(path, path, "ASDF", (char*)NULL);
    abort();
   }
 
-  fcntl(stdout_pipes[0], F_SETFL, fcntl(stdout_pipes[0], F_GETFL) | O_NONBLOCK);
+  close(stdin_pipes[0]);
+  close(stdout_pipes[1]);
+  rd_fd = stdout_pipes[0];
+  wr_fd = stdin_pipes[1];
+  SetNonBlocking(rd_fd);
+  SetNonBlocking(wr_fd);
  }
+ else if(transport == COMM_TRANSPORT_PTY)
+ {
+  int fd = posix_openpt(O_RDWR | O_NOCTTY);
+
+  if(fd == -1 || grantpt(fd) == -1 || unlockpt(fd) == -1)
+  {
+   ErrnoHolder ene(errno);
+
+   if(fd != -1)
+    close(fd);
+   throw MDFN_Error(ene.Errno(), _("Error creating serial PTY: %s"), ene.StrError());
+  }
+
+  SetNonBlocking(fd);
+  rd_fd = wr_fd = fd;
+  MDFN_printf(_("Serial port: PTY at \"%s\".\n"), ptsname(fd));
+ }
+#endif
+
+#ifdef HAVE_POSIX_SOCKETS
+ if(transport == COMM_TRANSPORT_UNIX || transport == COMM_TRANSPORT_TCP)
+  Listen(transport, path);
 #endif
+
+ Transport = transport;
 }
 
 void Comm_Kill(void)
@@ -92,20 +335,107 @@ void Comm_Kill(void)
  }
 #endif
 
- for(unsigned i = 0; i < 2; i++)
+ Disconnect();
+ CloseFD(&listen_fd);
+ Transport = COMM_TRANSPORT_NONE;
+}
+
+// The serial port moves a byte each way at most once per line, at line starts, while it has one to move.
+static bool Pending(void)
+{
+ return (Control & 0x80) && (SendLatched || (!RecvLatched && RingCount(&RxRing)));
+}
+
+static void Schedule(void)
+{
+ WSwan_SetEvent(WSEVENT_SERIAL, Pending() ? WSwan_GfxNextLineTS() : WSEVENT_NEVER);
+}
+
+// Moves data between the rings and the backend; called once per frame.
+void Comm_Sync(void)
+{
+#if defined(HAVE_FORK) || defined(HAVE_POSIX_SOCKETS)
+#ifdef HAVE_POSIX_SOCKETS
+ if(rd_fd == -1 && listen_fd != -1)
+  Accept();
+#endif
+
+ if(rd_fd == -1)
+ {
+  // Nothing is listening, so the bytes go nowhere, as with no cable attached.
+  TxRing.rd = TxRing.wr;
+  return;
+ }
+
+ for(unsigned dir = 0; dir < 2; dir++)
  {
-  if(stdin_pipes[i] != -1)
+  Ring* const r = dir ? &TxRing : &RxRing;
+  const uint32 avail = dir ? RingCount(r) : RING_SIZE - RingCount(r);
+  const uint32 pos = (dir ? r->rd : r->wr) & (RING_SIZE - 1);
+  const uint32 first = std::min<uint32>(avail, RING_SIZE - pos);
+  struct iovec iov[2];
+  ssize_t done;
+
+  if(!avail)
+   continue;
+
+  iov[0].iov_base = &r->data[pos];
+  iov[0].iov_len = first;
+  iov[1].iov_base = &r->data[0];
+  iov[1].iov_len = avail - first;
+
+  if(dir)
   {
-   close(stdin_pipes[i]);
-   stdin_pipes[i] = -1;
+#if defined(HAVE_POSIX_SOCKETS) && defined(MSG_NOSIGNAL)
+   if(listen_fd != -1)
+   {
+    struct msghdr msg;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = 2;
+    done = sendmsg(wr_fd, &msg, MSG_NOSIGNAL);
+   }
+   else
+#endif
+    done = writev(wr_fd, iov, 2);
+
+   if(done > 0)
+    r->rd += done;
   }
+  else if((done = readv(rd_fd, iov, 2)) > 0)
+   r->wr += done;
 
-  if(stdout_pipes[i] != -1)
+  // The host tool went away; wait for the next one on a socket.
+  if((!dir && done == 0) || (done == -1 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR))
   {
-   close(stdout_pipes[i]);
-   stdout_pipes[i] = -1;
+   if(listen_fd != -1)
+   {
+    Disconnect();
+    break;
+   }
   }
  }
+#else
+ TxRing.rd = TxRing.wr;
+#endif
+
+ Schedule();
+}
+
+uint32 Comm_SendBytes(const uint8* buf, uint32 len)
+{
+ return RingPush(&TxRing, buf, len);
+}
+
+uint32 Comm_RecvBytes(uint8* buf, uint32 len)
+{
+ return RingPop(&RxRing, buf, len);
+}
+
+uint32 Comm_RecvAvailable(void)
+{
+ return RingCount(&RxRing);
 }
 
 void Comm_Reset(void)
@@ -120,42 +450,33 @@ void Comm_Reset(void)
 
  WSwan_InterruptAssert(WSINT_SERIAL_RECV, RecvLatched);
 
+ Schedule();
+
  //if(child_pid != -1)
  // kill(child_pid, SIGUSR1);
 }
 
 bool Comm_SendByte(uint8 V)
 {
- if(stdin_pipes[1] != -1)
+ if(Comm_SendBytes(&V, 1))
  {
-  if(write(stdin_pipes[1], &V, 1) == 1)
-  {
-   Comm_debug_printf("SENT: %02x %d\n", V, RecvLatched);
-   return true;
-  }
-  return false;
- }
- else
- {
-  Comm_debug_printf("DummySend: %02x %d\n", V, RecvLatched);
+  Comm_debug_printf("SENT: %02x %d\n", V, RecvLatched);
   return true;
  }
+ return false;
 }
 
 bool Comm_RecvByte(uint8 *V)
 {
- if(stdout_pipes[0] != -1)
+ if(Comm_RecvBytes(V, 1))
  {
-  if(read(stdout_pipes[0], V, 1) == 1)
-  {
-   Comm_debug_printf("RECEIVED: %02x\n", *V);
-   return true;
-  }
+  Comm_debug_printf("RECEIVED: %02x\n", *V);
+  return true;
  }
  return false;
 }
 
-void Comm_Process(void)
+static void Process(void)
 {
  if (!(Control & 0x80))
   return;
@@ -179,6 +500,14 @@ void Comm_Process(void)
  }
 }
 
+void Comm_Event(uint32 timestamp)
+{
+ Process();
+
+ if(Pending())
+  WSwan_SetEvent(WSEVENT_SERIAL, timestamp + 256);
+}
+
 uint8 Comm_Read(uint8 A)
 {
  Comm_debug_printf("Read: %02x\n", A);
@@ -189,6 +518,7 @@ uint8 Comm_Read(uint8 A)
   {
    RecvLatched = false;
    WSwan_InterruptAssert(WSINT_SERIAL_RECV, RecvLatched);
+   Schedule();
   }
 
   return(RecvBuf);
@@ -232,6 +562,8 @@ void Comm_Write(uint8 A, uint8 V)
     Control &= ~0x02;
   }
  }
+
+ Schedule();
 }
 
 void Comm_StateAction(StateMem *sm, const unsigned load, const bool data_only)
@@ -268,6 +600,9 @@ void Comm_StateAction(StateMem *sm, const unsigned load, const bool data_only)
    WSwan_InterruptAssert(WSINT_SERIAL_RECV, RecvLatched);
   }
  }
+
+ if(load)
+  Schedule();
 }
 
 }
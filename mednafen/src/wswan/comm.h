@@ -18,14 +18,27 @@
 namespace MDFN_IEN_WSWAN
 {
 
-void Comm_Init(const char *wfence_path) MDFN_COLD;
+enum
+{
+ COMM_TRANSPORT_NONE = 0,
+ COMM_TRANSPORT_PROGRAM,	// Child process on stdin/stdout (wonderfence).
+ COMM_TRANSPORT_UNIX,		// Listening UNIX domain socket.
+ COMM_TRANSPORT_TCP,		// Listening TCP socket, "[host:]port".
+ COMM_TRANSPORT_PTY		// Pseudo-terminal; the slave name is printed at startup.
+};
+
+void Comm_Init(unsigned transport, const char *path) MDFN_COLD;
 void Comm_Kill(void) MDFN_COLD;
 void Comm_Reset(void);
 void Comm_StateAction(StateMem *sm, const unsigned load, const bool data_only);
 
-void Comm_Process(void);
+void Comm_Event(uint32 timestamp);
+void Comm_Sync(void);
 bool Comm_SendByte(uint8 V);
 bool Comm_RecvByte(uint8 *V);
+uint32 Comm_SendBytes(const uint8* buf, uint32 len);
+uint32 Comm_RecvBytes(uint8* buf, uint32 len);
+uint32 Comm_RecvAvailable(void);
 
 uint8 Comm_Read(uint8 A);
 void Comm_Write(uint8 A, uint8 V);
@@ -23,6 +23,11 @@
 #include "gfx.h"
 #include "nileswan.h"
 #include <trio/trio.h>
+#include <mednafen/AtomicFIFO.h>
+#include <mednafen/MThreading.h>
+#include <mednafen/Time.h>
+#include <mednafen/compress/GZFileStream.h>
+#include <atomic>
 
 namespace MDFN_IEN_WSWAN
 {
@@ -69,88 +74,275 @@ void WSwanDBG_IRQ(int level)
  }
 }
 
-static uint8 ReadHandler(uint32 A)
+// Read/write watchpoints as one bit per address, rebuilt from the lists above whenever they change.
+// The CPU core only calls the handlers below for accesses to 64KiB pages that hold a watched address.
+static uint8 WatchRead[0x100000 / 8], WatchWrite[0x100000 / 8];
+static uint8 WatchIORead[0x100 / 8], WatchIOWrite[0x100 / 8];
+static uint16 WatchReadPages, WatchWritePages;
+
+static uint16 BuildWatchMap(uint8* map, const std::vector<WSWAN_BPOINT>& bps)
 {
- std::vector<WSWAN_BPOINT>::iterator bpit;
- uint8 ret;
+ uint16 pages = 0;
 
- for(bpit = BreakPointsRead.begin(); bpit != BreakPointsRead.end(); bpit++)
+ memset(map, 0, 0x100000 / 8);
+
+ for(auto const& bp : bps)
  {
-  unsigned int testA = A;
+  const uint32 end = std::min<uint32>(bp.A[1], 0xFFFFF);
 
-  if(testA >= bpit->A[0] && testA <= bpit->A[1])
+  for(uint32 a = bp.A[0]; a <= end; a++)
   {
-   FoundBPoint = 1;
-   break;
+   map[a >> 3] |= 1 << (a & 7);
+   pages |= 1 << (a >> 16);
   }
  }
 
- WS_InDebug++;
- ret = WSwan_readmem20(A);
- WS_InDebug--;
+ return pages;
+}
 
- return(ret);
+static void BuildIOWatchMap(uint8* map, const std::vector<WSWAN_BPOINT>& bps)
+{
+ memset(map, 0, 0x100 / 8);
+
+ for(auto const& bp : bps)
+ {
+  for(unsigned a = bp.A[0] & 0xFF; a <= (bp.A[1] & 0xFF); a++)
+   map[a >> 3] |= 1 << (a & 7);
+ }
+}
+
+static INLINE bool Watched(const uint8* map, uint32 A)
+{
+ return (map[A >> 3] >> (A & 7)) & 1;
+}
+
+// A hit only sets FoundBPoint; the access itself goes ahead, and CPUHandler() breaks before the next instruction.
+static void ReadHandler(uint32 A)
+{
+ if(Watched(WatchRead, A & 0xFFFFF))
+  FoundBPoint = true;
 }
 
 static void WriteHandler(uint32 A, uint8 V)
 {
- std::vector<WSWAN_BPOINT>::iterator bpit;
+ if(Watched(WatchWrite, A & 0xFFFFF))
+  FoundBPoint = true;
+}
+
+static void PortReadHandler(uint32 A)
+{
+ if(Watched(WatchIORead, A & 0xFF))
+  FoundBPoint = true;
+}
 
- for(bpit = BreakPointsWrite.begin(); bpit != BreakPointsWrite.end(); bpit++)
+static void PortWriteHandler(uint32 A, uint8 V)
+{
+ if(Watched(WatchIOWrite, A & 0xFF))
+  FoundBPoint = true;
+}
+
+//
+// Binary CPU trace.  One record per instruction, before it executes:
+//
+//  uint8 flags
+//   [flags & BT_CS]	uint16 PS
+//  varint zigzag(IP - previous IP)
+//  varint cycles since the previous record
+//   [flags & BT_CODE]	16 bytes at PS:IP..PS:IP+15 (only when they differ from what the trace last recorded there)
+//   [flags & BT_REGS]	uint16 mask of changed registers (BinaryTraceRegs order), then each changed register as uint16
+//
+// All multi-byte values are little-endian, and all "previous" state starts out as zero.  The file begins with
+// "WSTRACE" followed by a version byte, and is gzip-compressed by a writer thread so the game thread only
+// encodes records.  tests/wswan/tracedis.cpp decodes and disassembles it.
+//
+enum
+{
+ BT_CS = 0x01,
+ BT_CODE = 0x02,
+ BT_REGS = 0x04
+};
+
+enum : unsigned { BT_BLOCK_SIZE = 65536, BT_BLOCK_COUNT = 64, BT_RECORD_MAX = 64, BT_CODE_SIZE = 16 };
+
+static const int BinaryTraceRegs[] = { NEC_AW, NEC_CW, NEC_DW, NEC_BW, NEC_SP, NEC_BP, NEC_IX, NEC_IY, NEC_DS1, NEC_SS, NEC_DS0, NEC_FLAGS };
+
+struct BinaryTraceState
+{
+ std::unique_ptr<GZFileStream> gzs;
+ std::unique_ptr<uint8[]> shadow;	// Code bytes as last recorded, by physical address.
+ std::unique_ptr<uint8[]> blocks;
+ AtomicFIFO<uint32, BT_BLOCK_COUNT> fifo;	// Lengths of filled blocks, in order.
+ unsigned write_block;
+ unsigned read_block;
+ uint32 fill;
+
+ MThreading::Sem* wake_sem;
+ MThreading::Thread* thread;
+ std::atomic<bool> stop;
+ std::atomic<bool> failed;
+ std::string error;
+
+ uint16 prev_cs, prev_ip;
+ uint16 prev_regs[12];
+ uint32 prev_ts;
+ uint64 records;
+};
+
+static BinaryTraceState* BinaryTrace = NULL;
+
+static INLINE uint8* BT_Block(unsigned index)
+{
+ return &BinaryTrace->blocks[(size_t)index * BT_BLOCK_SIZE];
+}
+
+static int BinaryTraceThreadEntry(void* data)
+{
+ BinaryTraceState* bt = (BinaryTraceState*)data;
+ bool exiting = false;
+
+ while(!exiting)
  {
-  unsigned int testA = A;
+  exiting = bt->stop.load(std::memory_order_acquire);
 
-  if(testA >= bpit->A[0] && testA <= bpit->A[1])
+  while(bt->fifo.CanRead())
   {
-   FoundBPoint = 1;
-   break;
+   const uint32 len = bt->fifo.Peek();
+
+   if(!bt->failed.load(std::memory_order_relaxed))
+   {
+    try
+    {
+     bt->gzs->write(&bt->blocks[(size_t)bt->read_block * BT_BLOCK_SIZE], len);
+    }
+    catch(std::exception& e)
+    {
+     bt->error = e.what();
+     bt->failed.store(true, std::memory_order_release);
+    }
+   }
+   bt->read_block = (bt->read_block + 1) % BT_BLOCK_COUNT;
+   bt->fifo.AdvanceRead(1);
   }
+
+  if(!exiting)
+   MThreading::Sem_TimedWait(bt->wake_sem, 10);
  }
+
+ return 0;
 }
 
-static uint8 PortReadHandler(uint32 A)
+// Hands the current block to the writer thread, and waits for it if every block is in use; records are never dropped.
+static void BinaryTraceFlushBlock(void)
 {
- std::vector<WSWAN_BPOINT>::iterator bpit;
- uint8 ret;
+ BinaryTraceState* bt = BinaryTrace;
 
- for(bpit = BreakPointsIORead.begin(); bpit != BreakPointsIORead.end(); bpit++)
+ if(!bt->fill)
+  return;
+
+ bt->fifo.Write(bt->fill);
+ bt->write_block = (bt->write_block + 1) % BT_BLOCK_COUNT;
+ bt->fill = 0;
+ MThreading::Sem_Post(bt->wake_sem);
+
+ while(!bt->fifo.CanWrite())
+  Time::SleepMS(1);
+}
+
+static INLINE uint8* BT_PutVarint(uint8* p, uint32 v)
+{
+ while(v >= 0x80)
  {
-  unsigned int testA = A & 0xFF;
+  *p++ = v | 0x80;
+  v >>= 7;
+ }
+ *p++ = v;
 
-  if(testA >= (bpit->A[0] & 0xFF) && testA <= (bpit->A[1] & 0xFF))
-  {
-   FoundBPoint = 1;
-   break;
-  }
+ return p;
+}
+
+static void BinaryTraceRecord(void)
+{
+ BinaryTraceState* bt = BinaryTrace;
+ uint8* const start = BT_Block(bt->write_block) + bt->fill;
+ uint8* p = start + 1;
+ uint8 flags = 0;
+ const uint16 cs = v30mz_get_reg(NEC_PS);
+ const uint16 ip = v30mz_get_reg(NEC_PC);
+ const int16 ip_delta = ip - bt->prev_ip;
+ uint8 code[BT_CODE_SIZE];
+ bool code_changed = false;
+ uint16 reg_mask = 0;
+ uint16 regs[12];
+
+ if(cs != bt->prev_cs)
+ {
+  flags |= BT_CS;
+  MDFN_en16lsb(p, cs);
+  p += 2;
+  bt->prev_cs = cs;
  }
 
+ p = BT_PutVarint(p, ((uint32)ip_delta << 1) ^ (uint32)(ip_delta >> 15));
+ p = BT_PutVarint(p, v30mz_timestamp - bt->prev_ts);
+ bt->prev_ip = ip;
+ bt->prev_ts = v30mz_timestamp;
+
  WS_InDebug++;
- ret = WSwan_readport(A);
+ for(unsigned i = 0; i < BT_CODE_SIZE; i++)
+ {
+  const uint32 A = ((cs << 4) + (uint16)(ip + i)) & 0xFFFFF;
+
+  code[i] = WSwan_readmem20(A);
+  code_changed |= (code[i] != bt->shadow[A]);
+  bt->shadow[A] = code[i];
+ }
  WS_InDebug--;
 
- return(ret);
-}
+ if(code_changed)
+ {
+  flags |= BT_CODE;
+  memcpy(p, code, BT_CODE_SIZE);
+  p += BT_CODE_SIZE;
+ }
 
-static void PortWriteHandler(uint32 A, uint8 V)
-{
- std::vector<WSWAN_BPOINT>::iterator bpit;
+ for(unsigned i = 0; i < 12; i++)
+ {
+  regs[i] = v30mz_get_reg(BinaryTraceRegs[i]);
+  reg_mask |= (regs[i] != bt->prev_regs[i]) << i;
+ }
 
- for(bpit = BreakPointsIOWrite.begin(); bpit != BreakPointsIOWrite.end(); bpit++)
+ if(reg_mask)
  {
-  unsigned int testA = A & 0xFF;
+  flags |= BT_REGS;
+  MDFN_en16lsb(p, reg_mask);
+  p += 2;
 
-  if(testA >= (bpit->A[0] & 0xFF) && testA <= (bpit->A[1] & 0xFF))
+  for(unsigned i = 0; i < 12; i++)
   {
-   FoundBPoint = 1;
-   break;
+   if(reg_mask & (1U << i))
+   {
+    MDFN_en16lsb(p, regs[i]);
+    p += 2;
+    bt->prev_regs[i] = regs[i];
+   }
   }
  }
+
+ *start = flags;
+ bt->fill += p - start;
+ bt->records++;
+
+ if(bt->fill > BT_BLOCK_SIZE - BT_RECORD_MAX)
+  BinaryTraceFlushBlock();
 }
 
 static void CPUHandler(uint32 PC)
 {
  std::vector<WSWAN_BPOINT>::iterator bpit;
 
+ if(BinaryTrace)
+  BinaryTraceRecord();
+
  if(!FoundBPoint)
   for(bpit = BreakPointsPC.begin(); bpit != BreakPointsPC.end(); bpit++)
   {
@@ -174,16 +366,22 @@ static void CPUHandler(uint32 PC)
 
 static void RedoDH(void)
 {
- bool needch = CPUHook || BreakPointsPC.size() || BreakPointsRead.size() || BreakPointsAux0Read.size() || 
+ WatchReadPages = BuildWatchMap(WatchRead, BreakPointsRead);
+ WatchWritePages = BuildWatchMap(WatchWrite, BreakPointsWrite);
+ BuildIOWatchMap(WatchIORead, BreakPointsIORead);
+ BuildIOWatchMap(WatchIOWrite, BreakPointsIOWrite);
+
+ bool needch = CPUHook || BinaryTrace || BreakPointsPC.size() || BreakPointsRead.size() || BreakPointsAux0Read.size() || 
 	BreakPointsWrite.size() || BreakPointsAux0Write.size() ||
 	BreakPointsIORead.size() || BreakPointsIOWrite.size();
 
  v30mz_debug(needch ? CPUHandler : NULL,
-        (BreakPointsRead.size() || BreakPointsAux0Read.size()) ? ReadHandler : NULL,
-        (BreakPointsWrite.size() || BreakPointsAux0Write.size()) ? WriteHandler : 0,
+        WatchReadPages ? ReadHandler : NULL,
+        WatchWritePages ? WriteHandler : NULL,
 	(BreakPointsIORead.size()) ? PortReadHandler : NULL,
 	(BreakPointsIOWrite.size()) ? PortWriteHandler : NULL,
-        BTEnabled ? WSwanDBG_AddBranchTrace : NULL);
+        BTEnabled ? WSwanDBG_AddBranchTrace : NULL,
+	WatchReadPages, WatchWritePages);
 }
 
 void WSwanDBG_SetCPUCallback(void (*callb)(uint32 PC, bool bpoint), bool continuous)
@@ -193,6 +391,65 @@ void WSwanDBG_SetCPUCallback(void (*callb)(uint32 PC, bool bpoint), bool continu
  RedoDH();
 }
 
+void WSwanDBG_SetBinaryTrace(const char* path)
+{
+ if(BinaryTrace)
+ {
+  BinaryTraceState* bt = BinaryTrace;
+
+  BinaryTraceFlushBlock();
+  bt->stop.store(true, std::memory_order_release);
+  MThreading::Sem_Post(bt->wake_sem);
+  MThreading::Thread_Wait(bt->thread, NULL);
+  MThreading::Sem_Destroy(bt->wake_sem);
+
+  BinaryTrace = NULL;
+  RedoDH();
+
+  try
+  {
+   if(!bt->failed)
+    bt->gzs->close();
+  }
+  catch(std::exception& e)
+  {
+   bt->error = e.what();
+   bt->failed = true;
+  }
+
+  if(bt->failed)
+   MDFN_printf(_("Binary CPU trace failed: %s\n"), bt->error.c_str());
+  else
+   MDFN_printf(_("Binary CPU trace: %llu instructions recorded.\n"), (unsigned long long)bt->records);
+
+  delete bt;
+ }
+
+ if(path)
+ {
+  std::unique_ptr<BinaryTraceState> bt(new BinaryTraceState());
+  static const uint8 magic[8] = { 'W', 'S', 'T', 'R', 'A', 'C', 'E', 1 };
+
+  bt->gzs.reset(new GZFileStream(path, GZFileStream::MODE::WRITE, 1));
+  bt->gzs->write(magic, sizeof(magic));
+  bt->shadow.reset(new uint8[0x100000]());
+  bt->blocks.reset(new uint8[(size_t)BT_BLOCK_SIZE * BT_BLOCK_COUNT]);
+  bt->prev_ts = v30mz_timestamp;
+
+  bt->wake_sem = MThreading::Sem_Create();
+  bt->thread = MThreading::Thread_Create(BinaryTraceThreadEntry, bt.get(), "WSwan CPU trace");
+
+  BinaryTrace = bt.release();
+  RedoDH();
+ }
+}
+
+void WSwanDBG_ResetTS(uint32 ts_base)
+{
+ if(BinaryTrace)
+  BinaryTrace->prev_ts -= ts_base;
+}
+
 void WSwanDBG_FlushBreakPoints(int type)
 {
  if(type == BPOINT_READ)
@@ -320,6 +577,11 @@ std::vector<BranchTraceResult> WSwanDBG_GetBranchTrace(void)
  return(ret);
 }
 
+void WSwanDBG_SetLogFunc(void (*func)(const char *, const char *))
+{
+ nile_trace_set_log_func(func);
+}
+
 
 void WSwanDBG_CheckBP(int type, uint32 address, unsigned int len)
 {
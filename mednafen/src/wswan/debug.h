@@ -19,6 +19,9 @@ void WSwanDBG_Disassemble(uint32 &a, uint32 SpecialA, char *);
 void WSwanDBG_AddBranchTrace(uint16 old_CS, uint16 old_IP, uint16 CS, uint16 IP, bool interrupt);
 void WSwanDBG_EnableBranchTrace(bool enable);
 std::vector<BranchTraceResult> WSwanDBG_GetBranchTrace(void);
+void WSwanDBG_SetLogFunc(void (*func)(const char *, const char *));
+void WSwanDBG_SetBinaryTrace(const char* path);
+void WSwanDBG_ResetTS(uint32 ts_base);
 
 void WSwanDBG_CheckBP(int type, uint32 address, unsigned int len);
 
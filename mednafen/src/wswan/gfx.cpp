@@ -25,27 +25,47 @@
 #include "v30mz.h"
 #include "rtc.h"
 #include "comm.h"
+#include "nileswan.h"
+#include "profile.h"
 #include <mednafen/video.h>
 #include <trio/trio.h>
+#include <mednafen/cputest/cputest.h>
+
+#include "blit.inc"
 
 namespace MDFN_IEN_WSWAN
 {
 
-static void wsScanline(MDFN_Surface* surface);
+static void wsScanline(MDFN_Surface* surface, const unsigned line);
+static void wsBuildSpriteLines(const unsigned which);
+static void wsUpdateRAMWatch(void);
 
 static uint32 wsMonoPal[16][4];
 static uint32 wsColors[8];
 static uint32 wsCols[16][16];
 
-static uint32 ColorMapG[16];
 static uint32 ColorMap[16*16*16];
+static BlitMap ColorMapPal;		// ColorMap[wsCols[pal][color]], and the grayscale ramp as palette 16
+static BlitFuncs<uint32> Blit32;
+static BlitFuncs<uint16> Blit16;
+static uint8 wsMonoShade[16][4];	// wsColors[wsMonoPal[pal][color]]
 static uint32 LayerEnabled;
 
 static uint8 wsLine;                 /*current scanline*/
-static uint8 weppy;
+
+// Lazy rendering: due lines [PendingStart, PendingEnd) are only recorded, and drawn together at
+// VBlank or just before anything they depend on changes (see WSwan_GfxCheckRAMWrite()).
+static bool LazyRender;
+static MDFN_Surface* PendingSurface;
+static uint8 PendingStart, PendingEnd;
+bool wsGfxPending;
+uint8 wsGfxRAMWatch[0x100];
+static uint8 weppy;	// For debugger save states made mid-line: 0 between lines, 1 before the line counter step, 3 after it.
 
 static uint8 SpriteTable[2][0x80][4];
 static uint32 SpriteCountCache[2];
+static uint16 SpriteLineStart[2][144 + 1];
+static uint8 SpriteLineList[2][0x80 * 8];
 static bool FrameWhichActive;
 static uint8 DispControl;
 static uint8 BGColor;
@@ -68,6 +88,36 @@ static uint16 VBTimerPeriod;
 static uint16 HBCounter, VBCounter;
 static uint8 VideoMode;
 
+// Each line is 256 cycles long, from LineTS, the start of the line whose start has been processed(the current line,
+// or between lines the last one).  Line starts and the other points of a line are at exact timestamps, with the CPU
+// running up to them, so LineTS is also v30mz_timestamp + v30mz_ICount when a line starts.
+static uint32 LineTS;
+
+// HBCounter counts down at each line start while the HBlank timer runs; it is only brought up to date by
+// HBTimerSync(), from HBCounterTS, the line start it was last correct at.  WSEVENT_HBTIMER is where it reaches 0.
+static uint32 HBCounterTS;
+
+static void HBTimerSync(void)
+{
+ if((BTimerControl & 0x01) && HBCounter)
+ {
+  const int32 lines = (int32)(LineTS - HBCounterTS) / 256;
+
+  if(lines > 0)
+  {
+   HBCounter -= lines;
+   HBCounterTS += lines * 256;
+  }
+ }
+ else
+  HBCounterTS = LineTS;
+}
+
+static void HBTimerSchedule(void)
+{
+ WSwan_SetEvent(WSEVENT_HBTIMER, ((BTimerControl & 0x01) && HBCounter) ? HBCounterTS + 256 * HBCounter : WSEVENT_NEVER);
+}
+
 #ifdef WANT_DEBUGGER
 
 enum
@@ -173,6 +223,7 @@ uint32 WSwan_GfxGetRegister(const unsigned id, char* special, const uint32 speci
 	return(VBTimerPeriod);
 
   case GFX_GSREG_HBCOUNTER:
+	HBTimerSync();
 	return(HBCounter);
 
   case GFX_GSREG_VBCOUNTER:
@@ -245,6 +296,9 @@ uint32 WSwan_GfxGetRegister(const unsigned id, char* special, const uint32 speci
 
 void WSwan_GfxSetRegister(const unsigned id, uint32 value)
 {
+ if(wsGfxPending)
+  WSwan_GfxFlush();
+
  switch(id)
  {
   case GFX_GSREG_DISPCONTROL:
@@ -269,11 +323,15 @@ void WSwan_GfxSetRegister(const unsigned id, uint32 value)
 	break;
 
   case GFX_GSREG_BTIMERCONTROL:
+	HBTimerSync();
 	BTimerControl = value;
+	HBTimerSchedule();
 	break;
 
   case GFX_GSREG_HBTIMERPERIOD:
+	HBTimerSync();
 	HBTimerPeriod = value;
+	HBTimerSchedule();
 	break;
 
   case GFX_GSREG_VBTIMERPERIOD:
@@ -281,7 +339,9 @@ void WSwan_GfxSetRegister(const unsigned id, uint32 value)
 	break;
 
   case GFX_GSREG_HBCOUNTER:
+	HBTimerSync();
 	HBCounter = value;
+	HBTimerSchedule();
 	break;
 
   case GFX_GSREG_VBCOUNTER:
@@ -382,28 +442,51 @@ static int GfxDecode_Pbn = 0;
 void WSwan_GfxInit(void)
 {
  LayerEnabled = 7; // BG, FG, sprites
+
+ Blit_Select(&Blit32, cputest_get_flags());
+ Blit_Select(&Blit16, cputest_get_flags());
  #ifdef WANT_DEBUGGER
  MDFNDBG_AddRegGroup(&WSwanGfxRegsGroup);
  #endif
 }
 
+static void wsUpdateMonoShades(void)
+{
+ for(unsigned i = 0; i < 16; i++)
+  for(unsigned j = 0; j < 4; j++)
+   wsMonoShade[i][j] = wsColors[wsMonoPal[i][j]];
+}
+
+static void wsUpdateColorMapPal(void)
+{
+ for(unsigned i = 0; i < 256; i++)
+  BlitMap_Set(&ColorMapPal, i, ColorMap[wsCols[i >> 4][i & 0xF]]);
+}
+
 void WSwan_GfxWSCPaletteRAMWrite(uint32 ws_offset, uint8 data)
 {
  ws_offset=(ws_offset&0xfffe)-0xfe00;
  wsCols[(ws_offset>>1)>>4][(ws_offset>>1)&15] = wsRAM[ws_offset+0xfe00] | ((wsRAM[ws_offset+0xfe01]&0x0f) << 8);
+ BlitMap_Set(&ColorMapPal, (ws_offset>>1)&0xFF, ColorMap[wsCols[(ws_offset>>1)>>4][(ws_offset>>1)&15]]);
 }
 
 void WSwan_GfxWrite(uint32 A, uint8 V)
 {
+ if(wsGfxPending && (A <= 0x01 || (A >= 0x07 && A <= 0x13) || (A >= 0x1C && A <= 0x3F) || A == 0x60))
+  WSwan_GfxFlush();
+
  if(A >= 0x1C && A <= 0x1F)
  {
   wsColors[(A - 0x1C) * 2 + 0] = 0xF - (V & 0xf);
   wsColors[(A - 0x1C) * 2 + 1] = 0xF - (V >> 4);
+  wsUpdateMonoShades();
  }
  else if(A >= 0x20 && A <= 0x3F)
  {
   wsMonoPal[(A - 0x20) >> 1][((A & 0x1) << 1) + 0] = V&7;
   wsMonoPal[(A - 0x20) >> 1][((A & 0x1) << 1) | 1] = (V>>4)&7;
+  wsMonoShade[(A - 0x20) >> 1][((A & 0x1) << 1) + 0] = wsColors[V&7];
+  wsMonoShade[(A - 0x20) >> 1][((A & 0x1) << 1) | 1] = wsColors[(V>>4)&7];
  }
  else switch(A)
  {
@@ -436,11 +519,13 @@ void WSwan_GfxWrite(uint32 A, uint8 V)
 	     //printf("VideoMode: %02x, %02x\n", V, V >> 5);
 	     break;
 
-  case 0xa2: BTimerControl = V; 
+  case 0xa2: HBTimerSync();
+	     BTimerControl = V; 
+	     HBTimerSchedule();
 	     //printf("%04x:%02x\n", A, V);
 	     break;
   case 0xa4: HBTimerPeriod &= 0xFF00; HBTimerPeriod |= (V << 0); /*printf("%04x:%02x, %d\n", A, V, wsLine);*/ break;
-  case 0xa5: HBTimerPeriod &= 0x00FF; HBTimerPeriod |= (V << 8); HBCounter = HBTimerPeriod; /*printf("%04x:%02x, %d\n", A, V, wsLine);*/ break;
+  case 0xa5: HBTimerSync(); HBTimerPeriod &= 0x00FF; HBTimerPeriod |= (V << 8); HBCounter = HBTimerPeriod; HBTimerSchedule(); /*printf("%04x:%02x, %d\n", A, V, wsLine);*/ break;
   case 0xa6: VBTimerPeriod &= 0xFF00; VBTimerPeriod |= (V << 0); /*printf("%04x:%02x, %d\n", A, V, wsLine);*/ break;
   case 0xa7: VBTimerPeriod &= 0x00FF; VBTimerPeriod |= (V << 8); VBCounter = VBTimerPeriod; /*printf("%04x:%02x, %d\n", A, V, wsLine);*/ break;
   //default: printf("%04x:%02x\n", A, V); break;
@@ -495,8 +580,8 @@ uint8 WSwan_GfxRead(uint32 A)
   case 0xa5: return((HBTimerPeriod >> 8) & 0xFF);
   case 0xa6: return((VBTimerPeriod >> 0) & 0xFF);
   case 0xa7: return((VBTimerPeriod >> 8) & 0xFF);
-  case 0xa8: /*printf("%04x\n", A);*/ return((HBCounter >> 0) & 0xFF);
-  case 0xa9: /*printf("%04x\n", A);*/ return((HBCounter >> 8) & 0xFF);
+  case 0xa8: /*printf("%04x\n", A);*/ HBTimerSync(); return((HBCounter >> 0) & 0xFF);
+  case 0xa9: /*printf("%04x\n", A);*/ HBTimerSync(); return((HBCounter >> 8) & 0xFF);
   case 0xaa: /*printf("%04x\n", A);*/ return((VBCounter >> 0) & 0xFF);
   case 0xab: /*printf("%04x\n", A);*/ return((VBCounter >> 8) & 0xFF);
   default: return(0);
@@ -504,95 +589,213 @@ uint8 WSwan_GfxRead(uint32 A)
  }
 }
 
-bool wsExecuteLine(MDFN_Surface *surface, bool skip)
+static uint32 EventTS[WSEVENT__COUNT];
+static uint32 NextEventTS;
+
+static void RecalcNextEvent(void)
 {
-	static const void* const WEP_Tab[4] = { &&WEP0, &&WEP1, &&WEP2, &&WEP3 };	// The things we do for debugger step mode save states!  If we ever add more entries, remember to change the mask stuff in StateAction
-        bool ret;
+ NextEventTS = WSEVENT_NEVER;
 
-	weppy = 0;
-        WEP0: ;
+ for(unsigned i = 0; i < WSEVENT__COUNT; i++)
+  NextEventTS = std::min<uint32>(NextEventTS, EventTS[i]);
+}
+
+void WSwan_SetEvent(unsigned which, uint32 timestamp)
+{
+ EventTS[which] = timestamp;
+ RecalcNextEvent();
+}
+
+void WSwan_EventResetTS(uint32 timestamp)
+{
+ for(unsigned i = 0; i < WSEVENT__COUNT; i++)
+ {
+  if(EventTS[i] != WSEVENT_NEVER)
+   EventTS[i] = (EventTS[i] > timestamp) ? (EventTS[i] - timestamp) : 0;
+ }
+
+ LineTS -= timestamp;
+ HBCounterTS -= timestamp;
+
+ RecalcNextEvent();
+}
+
+uint32 WSwan_GfxNextLineTS(void)
+{
+ return LineTS + 256;
+}
+
+static void LineEvent(void)
+{
+ wsLine = (wsLine + 1) % (std::max<uint8>(144, LCDVtotal) + 1);
+ if(wsLine == LineCompare)
+ {
+  WSwan_Interrupt(WSINT_LINE_HIT);
+  //printf("Line hit: %d\n", wsLine);
+ }
+
+ weppy = 3;
+}
+
+static void VBlankEvent(void)
+{
+ WSwan_Interrupt(WSINT_VBLANK);
+ //printf("VBlank: %d\n", wsLine);
+ if(VBCounter && (BTimerControl & 0x04))
+ {
+  VBCounter--;
+  if(!VBCounter)
+  {
+   if(BTimerControl & 0x08) // loop
+    VBCounter = VBTimerPeriod;
+   WSwan_Interrupt(WSINT_VBLANK_TIMER);
+  }
+ }
+}
+
+static void HBTimerEvent(uint32 timestamp)
+{
+ HBCounter = 0;
+ HBCounterTS = timestamp;
+
+ if(BTimerControl & 0x02) // loop
+  HBCounter = HBTimerPeriod;
+ WSwan_Interrupt(WSINT_HBLANK_TIMER);
+
+ HBTimerSchedule();
+}
+
+static void RunEvents(void)
+{
+ for(unsigned i = 0; i < WSEVENT__COUNT; i++)
+ {
+  if(EventTS[i] > v30mz_timestamp)
+   continue;
+
+  const uint32 event_ts = EventTS[i];
+
+  EventTS[i] = WSEVENT_NEVER;
+
+  switch(i)
+  {
+   case WSEVENT_NILE_SPI:
+	nileswan_update(v30mz_timestamp);
+	break;
+
+   case WSEVENT_SOUND_DMA:
+	WSwan_SoundDMAEvent(event_ts);
+	break;
+
+   case WSEVENT_NILE_USB:
+	nileswan_usb_frame(event_ts);
+	break;
+
+   case WSEVENT_PROFILE:
+	WSwan_ProfileSample(event_ts);
+	break;
+
+   case WSEVENT_LINE:
+	LineEvent();
+	break;
+
+   case WSEVENT_VBLANK:
+	VBlankEvent();
+	break;
+
+   case WSEVENT_HBTIMER:
+	HBTimerEvent(event_ts);
+	break;
+
+   case WSEVENT_SERIAL:
+	Comm_Event(event_ts);
+	break;
+
+   case WSEVENT_RTC:
+	RTC_Event(event_ts);
+	break;
+  }
+ }
+
+ RecalcNextEvent();
+}
+
+// Runs the CPU to the end of the current line, one event at a time; a halted CPU burns each chunk in one
+// v30mz_execute() call, so it skips straight from one event to the next.  Stops early if a debugger save state
+// load moved to between lines.
+static void RunLine(void)
+{
+ for(;;)
+ {
+  const int32 left = LineTS + 256 - (v30mz_timestamp + v30mz_ICount);
+
+  if(left <= 0 || !weppy)
+   break;
+
+  if(MDFN_UNLIKELY(NextEventTS <= v30mz_timestamp))
+   RunEvents();
 
-	ret = false;
+  const int64 until_event = (int64)NextEventTS - v30mz_timestamp - v30mz_ICount;
+
+  v30mz_execute((int32)std::max<int64>(1, std::min<int64>(left, until_event)));
+ }
+}
+
+bool wsExecuteLine(MDFN_Surface *surface, bool skip)
+{
+	bool ret;
+
+	do
+	{
+	 ret = false;
+	 LineTS = v30mz_timestamp + v30mz_ICount;
+	 WSwan_SetEvent(WSEVENT_LINE, LineTS + 224);
 
          #ifdef WANT_DEBUGGER
          if(GfxDecode_Buf && GfxDecode_Line >=0 && wsLine == GfxDecode_Line)
           DoGfxDecode();
          #endif
 
-	if(wsLine < 144)
-	{
-	 if(!skip)
-          wsScanline(surface);
-	}
+	 if(wsLine < 144)
+	 {
+	  if(skip)
+	   ;
+	  else if(!LazyRender)
+	   wsScanline(surface, wsLine);
+	  else
+	  {
+	   if(!wsGfxPending)
+	   {
+	    wsGfxPending = true;
+	    PendingSurface = surface;
+	    PendingStart = wsLine;
+	    wsUpdateRAMWatch();
+	   }
+	   PendingEnd = wsLine + 1;
+	  }
+	 }
 
-	Comm_Process();
-	WSwan_CheckSoundDMA();
+         // Update sprite data table
+         // Note: it's at 142 actually but it doesn't "update" until next frame
+         if(wsLine == 142)
+         {
+	  SpriteCountCache[!FrameWhichActive] = std::min<uint8>(0x80, SpriteCount);
+          memcpy(SpriteTable[!FrameWhichActive], &wsRAM[(SPRBase << 9) + (SpriteStart << 2)], SpriteCountCache[!FrameWhichActive] << 2);
+	  wsBuildSpriteLines(!FrameWhichActive);
+	 }
 
-        // Update sprite data table
-        // Note: it's at 142 actually but it doesn't "update" until next frame
-        if(wsLine == 142)
-        {
-	 SpriteCountCache[!FrameWhichActive] = std::min<uint8>(0x80, SpriteCount);
-         memcpy(SpriteTable[!FrameWhichActive], &wsRAM[(SPRBase << 9) + (SpriteStart << 2)], SpriteCountCache[!FrameWhichActive] << 2);
-	}
+         if(wsLine == 144)
+         {
+		if(wsGfxPending)
+		 WSwan_GfxFlush();
 
-        if(wsLine == 144)
-        {
 		FrameWhichActive = !FrameWhichActive;
                 ret = true;
-                WSwan_Interrupt(WSINT_VBLANK);
-                //printf("VBlank: %d\n", wsLine);
-                if(VBCounter && (BTimerControl & 0x04))
-                {
-                 VBCounter--;
-                 if(!VBCounter)
-                 {
-                  if(BTimerControl & 0x08) // loop
-                   VBCounter = VBTimerPeriod;
-                  WSwan_Interrupt(WSINT_VBLANK_TIMER);
-                 }
-                }
-        }
-
-
-        if(HBCounter && (BTimerControl & 0x01))
-        {
-         HBCounter--;
-         if(!HBCounter)
-         {
-          if(BTimerControl & 0x02) // loop
-           HBCounter = HBTimerPeriod;
-          WSwan_Interrupt(WSINT_HBLANK_TIMER);
+		WSwan_SetEvent(WSEVENT_VBLANK, LineTS);
          }
-        }
-
-	weppy = 1;
-        v30mz_execute(128);
-        goto *WEP_Tab[weppy];
-	WEP1: ;
-	//
-
-	WSwan_CheckSoundDMA();
-
-	//
-	weppy = 2;
-        v30mz_execute(96);
-        goto *WEP_Tab[weppy];
-	WEP2: ;
 
-	wsLine = (wsLine + 1) % (std::max<uint8>(144, LCDVtotal) + 1);
-        if(wsLine == LineCompare)
-        {
-         WSwan_Interrupt(WSINT_LINE_HIT);
-         //printf("Line hit: %d\n", wsLine);
-        }
-
-	weppy = 3;
-	v30mz_execute(32);
-	goto *WEP_Tab[weppy];
-	WEP3: ;
-
-	RTC_Clock(256);
+	 weppy = 1;
+	 RunLine();
+	} while(!weppy);	// The debugger loaded a save state made between lines.
 
 	weppy = 0;
         return(ret);
@@ -600,6 +803,9 @@ bool wsExecuteLine(MDFN_Surface *surface, bool skip)
 
 void WSwan_SetLayerEnableMask(uint64 mask)
 {
+ if(wsGfxPending)
+  WSwan_GfxFlush();
+
  LayerEnabled = mask;
 }
 
@@ -626,304 +832,311 @@ void WSwan_SetPixelFormat(const MDFN_PixelFormat &format)
   neo_g = (i) * 17;
   neo_b = (i) * 17;
 
-  ColorMapG[i] = format.MakeColor(neo_r, neo_g, neo_b); //(neo_r << rs) | (neo_g << gs) | (neo_b << bs);
+  BlitMap_Set(&ColorMapPal, 0x100 | i, format.MakeColor(neo_r, neo_g, neo_b)); //(neo_r << rs) | (neo_g << gs) | (neo_b << bs);
  }
+
+ wsUpdateColorMapPal();
+}
+
+// Which sprites of a latched table can appear on which lines.  Returns false for a sprite that is
+// never drawn, otherwise the first and last line (inclusive) it covers.
+static INLINE bool wsSpriteLines(const uint8* stab, int* first, int* last)
+{
+	int xs = stab[3];
+	int ys = stab[2];
+
+	if(xs >= 249) xs -= 256;
+	if(ys > 150) ys = (int8)ys;
+
+	*first = std::max<int>(0, ys);
+	*last = std::min<int>(143, ys + 7);
+
+	return xs < 224 && *first <= *last;
 }
 
-template<typename T>
-static INLINE void wsBlitScanline(T* MDFN_RESTRICT target, uint8* MDFN_RESTRICT bg, uint8* MDFN_RESTRICT bg_pal)
+// Sort a latched sprite table into per-line lists, keeping the back-to-front drawing order, so
+// the scanline renderer only visits the sprites on its line instead of all 128 of them.
+static void wsBuildSpriteLines(const unsigned which)
 {
-	if(wsIsColor())
+	uint16* const start = SpriteLineStart[which];
+	uint8* const list = SpriteLineList[which];
+	uint16 fill[144];
+	int first, last;
+
+	memset(SpriteLineStart[which], 0, sizeof(SpriteLineStart[which]));
+
+	for(int h = SpriteCountCache[which] - 1; h >= 0; h--)
+	 if(wsSpriteLines(SpriteTable[which][h], &first, &last))
+	  for(int l = first; l <= last; l++)
+	   start[l + 1]++;
+
+	for(unsigned l = 0; l < 144; l++)
 	{
-	 for(size_t l = 0; l < 224; l++)
-	  target[l] = ColorMap[wsCols[bg_pal[l]][bg[l] & 0xF]];
+	 start[l + 1] += start[l];
+	 fill[l] = start[l];
 	}
-	else
+
+	for(int h = SpriteCountCache[which] - 1; h >= 0; h--)
+	 if(wsSpriteLines(SpriteTable[which][h], &first, &last))
+	  for(int l = first; l <= last; l++)
+	   list[fill[l]++] = h;
+}
+
+//
+// Layer kernels.  The line buffers are offset by 7 pixels so that partially scrolled-in tiles can
+// be drawn without clipping; "pos" below is always a line buffer index.
+//
+template<bool bpp4>
+static INLINE bool wsOpaque(const uint8 pixel, const uint32 palette)
+{
+	return pixel || (!bpp4 && !(palette & 0x4));
+}
+
+template<bool color>
+static INLINE uint8 wsPixel(const uint8 pixel, const uint32 palette)
+{
+	return color ? pixel : wsMonoShade[palette][pixel];
+}
+
+template<bool color, bool bpp4>
+static INLINE void wsDrawBG(const unsigned line, uint8* MDFN_RESTRICT b_bg, uint8* MDFN_RESTRICT b_bg_pal)
+{
+	const uint32 start_tile_n = (line + BGYScroll) & 0xff;
+	const uint32 map_a = (((uint32)(FGBGLoc & 0xF)) << 11) + ((start_tile_n & 0xfff8) << 3);
+	uint32 startindex = BGXScroll >> 3;
+	uint32 pos = 7 - (BGXScroll & 7);
+
+	for(unsigned t = 0; t < 29; t++, pos += 8)
 	{
-	 for(size_t l = 0; l < 224; l++)
-	  target[l] = ColorMapG[bg[l] & 0xF];
+	 const uint32 b = MDFN_de16lsb(&wsRAM[map_a + (startindex << 1)]);
+	 const uint32 palette = (b >> 9) & 15;
+	 const uint8* const tile_row = wsGetTile(b & 0x1ff, start_tile_n & 7, b & 0x8000, b & 0x4000, b & 0x2000);
+
+	 startindex = (startindex + 1) & 31;
+
+	 for(unsigned x = 0; x < 8; x++)
+	 {
+	  if(wsOpaque<bpp4>(tile_row[x], palette))
+	  {
+	   b_bg[pos + x] = wsPixel<color>(tile_row[x], palette);
+	   if(color)
+	    b_bg_pal[pos + x] = palette;
+	  }
+	 }
 	}
 }
 
-static void wsScanline(MDFN_Surface* surface)
+template<bool color, bool bpp4, bool windowed>
+static INLINE void wsDrawFG(const unsigned line, uint8* MDFN_RESTRICT b_bg, uint8* MDFN_RESTRICT b_bg_pal, const uint8* MDFN_RESTRICT in_window)
 {
-	uint32		start_tile_n,map_a,startindex,adrbuf,b1,b2,j,t;
-	uint8		b_bg[256];
-	uint8		b_bg_pal[256];
+	const uint32 start_tile_n = (line + FGYScroll) & 0xff;
+	const uint32 map_a = (((uint32)((FGBGLoc >> 4) & 0xF)) << 11) + ((start_tile_n >> 3) << 6);
+	uint32 startindex = FGXScroll >> 3;
+	uint32 pos = 7 - (FGXScroll & 7);
 
-	if(!wsIsColor())
-		memset(b_bg, wsColors[BGColor&0x7]&0xF, 256);
-	else
+	for(unsigned t = 0; t < 29; t++, pos += 8)
 	{
-		memset(&b_bg[0], BGColor & 0xF, 256);
-		memset(&b_bg_pal[0], (BGColor>>4)  & 0xF, 256);
+	 const uint32 b = MDFN_de16lsb(&wsRAM[map_a + (startindex << 1)]);
+	 const uint32 palette = (b >> 9) & 15;
+
+	 startindex = (startindex + 1) & 31;
+
+	 if(windowed && !MDFN_de64lsb(&in_window[pos]))
+	  continue;
+
+	 const uint8* const tile_row = wsGetTile(b & 0x1ff, start_tile_n & 7, b & 0x8000, b & 0x4000, b & 0x2000);
+
+	 for(unsigned x = 0; x < 8; x++)
+	 {
+	  if(wsOpaque<bpp4>(tile_row[x], palette) && (!windowed || in_window[pos + x]))
+	  {
+	   b_bg[pos + x] = wsPixel<color>(tile_row[x], palette) | 0x10;
+	   if(color)
+	    b_bg_pal[pos + x] = palette;
+	  }
+	 }
 	}
-	start_tile_n=(wsLine+BGYScroll)&0xff;/*First line*/
-	map_a=(((uint32)(FGBGLoc&0xF))<<11)+((start_tile_n&0xfff8)<<3);
-	startindex = BGXScroll >> 3; /*First tile in row*/
-	adrbuf = 7-(BGXScroll&7); /*Pixel in tile*/
-	
-	if((DispControl & 0x01) && (LayerEnabled & 0x01)) /*BG layer*/
-        {
-	 for(t=0;t<29;t++)
+}
+
+template<bool color, bool bpp4>
+static INLINE void wsDrawSprites(const unsigned line, uint8* MDFN_RESTRICT b_bg, uint8* MDFN_RESTRICT b_bg_pal, const uint8* MDFN_RESTRICT in_window)
+{
+	const bool windowed = DispControl & 0x08;
+	const uint8* const list = SpriteLineList[FrameWhichActive];
+	const unsigned end = SpriteLineStart[FrameWhichActive][line + 1];
+
+	for(unsigned i = SpriteLineStart[FrameWhichActive][line]; i < end; i++)
+	{
+	 const uint8* stab = SpriteTable[FrameWhichActive][list[i]];
+	 const uint32 as = stab[1];
+	 const uint32 palette = 8 + ((as >> 1) & 0x7);
+	 const uint8 outside = (as >> 4) & 1;
+	 int xs = stab[3];
+	 int ys = stab[2];
+
+	 if(xs >= 249) xs -= 256;
+	 if(ys > 150) ys = (int8)ys;
+
+	 const uint32 pos = xs + 7;
+	 const uint8* const tile_row = wsGetTile(stab[0] | ((as & 1) << 8), line - ys, as & 0x80, as & 0x40, 0);
+
+	 for(unsigned x = 0; x < 8; x++)
 	 {
-	  b1=wsRAM[map_a+(startindex<<1)];
-	  b2=wsRAM[map_a+(startindex<<1)+1];
-	  uint32 palette=(b2>>1)&15;
-	  b2=(b2<<8)|b1;
-	  wsGetTile(b2&0x1ff,start_tile_n&7,b2&0x8000,b2&0x4000,b2&0x2000);
-
-          if(wsIsColor())
-          {
-           if(wsIs4bpp())
-	   {
-            for(int x = 0; x < 8; x++)
-             if(wsTileRow[x])
-             {
-              b_bg[adrbuf + x] = wsTileRow[x];
-              b_bg_pal[adrbuf + x] = palette;
-             }
-	   }
-	   else
-	   {
-            for(int x = 0; x < 8; x++)
-             if(wsTileRow[x] || !(palette & 0x4))
-             {
-              b_bg[adrbuf + x] = wsTileRow[x];
-              b_bg_pal[adrbuf + x] = palette;
-             }
-	   }
-          }
-          else
-          {
-           for(int x = 0; x < 8; x++)
-            if(wsTileRow[x] || !(palette & 4))
-            {
-             b_bg[adrbuf + x] = wsColors[wsMonoPal[palette][wsTileRow[x]]];
-            }
-          }
-	  adrbuf += 8;
-	  startindex=(startindex + 1)&31;
-	 } // end for(t = 0 ...
-	} // End BG layer drawing
-
-	if((DispControl & 0x02) && (LayerEnabled & 0x02))/*FG layer*/
+	  if(!wsOpaque<bpp4>(tile_row[x], palette))
+	   continue;
+
+	  if(!(as & 0x20) && (b_bg[pos + x] & 0x10))
+	   continue;
+
+	  if(windowed && in_window[pos + x] == outside)
+	   continue;
+
+	  b_bg[pos + x] = wsPixel<color>(tile_row[x], palette) | (b_bg[pos + x] & 0x10);
+	  if(color)
+	   b_bg_pal[pos + x] = palette;
+	 }
+	}
+}
+
+// Marks line buffer positions [x0, x1] (screen coordinates, clipped to "w" pixels) in a window mask.
+static INLINE void wsWindowSpan(uint8* in_window, const uint32 x0, const uint32 x1, const uint32 w, const uint8 value)
+{
+	const uint32 end = std::min<uint32>(x1 + 1, w);
+
+	if(x0 < end)
+	 memset(&in_window[7 + x0], value, end - x0);
+}
+
+template<bool color, bool bpp4>
+static void wsScanlineT(MDFN_Surface* surface, const unsigned line)
+{
+	alignas(8) uint8 b_bg[256];
+	alignas(8) uint8 b_bg_pal[256];
+	alignas(8) uint8 in_window[256 + 8*2];
+
+	if(!color)
+	 memset(b_bg, wsColors[BGColor & 0x7] & 0xF, sizeof(b_bg));
+	else
 	{
-	 uint8 windowtype = DispControl&0x30;
-         bool in_window[256 + 8*2];
+	 memset(b_bg, BGColor & 0xF, sizeof(b_bg));
+	 memset(b_bg_pal, (BGColor >> 4) & 0xF, sizeof(b_bg_pal));
+	}
 
-	 if(windowtype)
-         {
-          memset(in_window, 0, sizeof(in_window));
+	if((DispControl & 0x01) && (LayerEnabled & 0x01)) /*BG layer*/
+	 wsDrawBG<color, bpp4>(line, b_bg, b_bg_pal);
+
+	if((DispControl & 0x02) && (LayerEnabled & 0x02)) /*FG layer*/
+	{
+	 const uint8 windowtype = DispControl & 0x30;
+	 const bool in_y = (line >= FGy0) && (line <= FGy1);
 
-	  if(windowtype == 0x20) // Display FG only inside window
+	 if(!windowtype)
+	  wsDrawFG<color, bpp4, false>(line, b_bg, b_bg_pal, NULL);
+	 else if(windowtype == 0x20) // Display FG only inside window
+	 {
+	  if(in_y)
 	  {
-           if((wsLine >= FGy0) && (wsLine <= FGy1))
-            for(j = FGx0; j <= FGx1 && j < 224; j++)
-              in_window[7 + j] = 1;
+	   memset(in_window, 0, sizeof(in_window));
+	   wsWindowSpan(in_window, FGx0, FGx1, 224, 1);
+	   wsDrawFG<color, bpp4, true>(line, b_bg, b_bg_pal, in_window);
 	  }
-	  else if(windowtype == 0x30) // Display FG only outside window
-	  {
-	   for(j = 0; j < 224; j++)
-	   {
-	    if(!(j >= FGx0 && j <= FGx1) || !((wsLine >= FGy0) && (wsLine <= FGy1)))
-	     in_window[7 + j] = 1;
-	   }
- 	  }
+	 }
+	 else if(windowtype == 0x30) // Display FG only outside window
+	 {
+	  if(!in_y)
+	   wsDrawFG<color, bpp4, false>(line, b_bg, b_bg_pal, NULL);
 	  else
 	  {
-	   //puts("Who knows!");
+	   memset(in_window, 0, sizeof(in_window));
+	   memset(&in_window[7], 1, 224);
+	   wsWindowSpan(in_window, FGx0, FGx1, 224, 0);
+	   wsDrawFG<color, bpp4, true>(line, b_bg, b_bg_pal, in_window);
 	  }
-         }
-         else
-          memset(in_window, 1, sizeof(in_window));
-
-	 start_tile_n=(wsLine+FGYScroll)&0xff;
-	 map_a=(((uint32)((FGBGLoc>>4)&0xF))<<11)+((start_tile_n>>3)<<6);
-	 startindex = FGXScroll >> 3;
-	 adrbuf = 7-(FGXScroll&7);
+	 }
+	 else
+	 {
+	  //puts("Who knows!");
+	 }
+	}
 
-         for(t=0; t<29; t++)
-         {
-          b1=wsRAM[map_a+(startindex<<1)];
-          b2=wsRAM[map_a+(startindex<<1)+1];
-          uint32 palette=(b2>>1)&15;
-          b2=(b2<<8)|b1;
-          wsGetTile(b2&0x1ff,start_tile_n&7,b2&0x8000,b2&0x4000,b2&0x2000);
-
-          if(wsIsColor())
-          {
-	   if(wsIs4bpp())
-            for(int x = 0; x < 8; x++)
-	    {
-             if(wsTileRow[x] && in_window[adrbuf + x])
-             {
-              b_bg[adrbuf + x] = wsTileRow[x] | 0x10;
-              b_bg_pal[adrbuf + x] = palette;
-             }
-	    }
-	   else
-            for(int x = 0; x < 8; x++)
-	    {
-             if((wsTileRow[x] || !(palette & 0x4)) && in_window[adrbuf + x])
-             {
-              b_bg[adrbuf + x] = wsTileRow[x] | 0x10;
-              b_bg_pal[adrbuf + x] = palette;
-             }
-	    }
-          }
-          else
-          {
-           for(int x = 0; x < 8; x++)
-            if((wsTileRow[x] || !(palette & 4)) && in_window[adrbuf + x])
-            {
-             b_bg[adrbuf + x] = wsColors[wsMonoPal[palette][wsTileRow[x]]] | 0x10;
-            }
-          }
-          adrbuf += 8;
-          startindex=(startindex + 1)&31;
-         } // end for(t = 0 ...
-
-	} // end FG drawing
-
-	if((DispControl & 0x04) && SpriteCountCache[FrameWhichActive] && (LayerEnabled & 0x04))/*Sprites*/
+	if((DispControl & 0x04) && (LayerEnabled & 0x04)) /*Sprites*/
 	{
-	  bool in_window[256 + 8*2];
+	 if(DispControl & 0x08)
+	 {
+	  memset(in_window, 0, sizeof(in_window));
+	  if((line >= SPRy0) && (line <= SPRy1))
+	   wsWindowSpan(in_window, SPRx0, SPRx1, 256, 1);
+	 }
+
+	 wsDrawSprites<color, bpp4>(line, b_bg, b_bg_pal, in_window);
+	}
 
-          if(DispControl & 0x08)
-	  {
-	   memset(in_window, 0, sizeof(in_window));
-	   if((wsLine >= SPRy0) && (wsLine <= SPRy1))
-            for(j = SPRx0; j <= SPRx1 && j < 256; j++)
-	      in_window[7 + j] = 1;
-	  }
-	  else
-	   memset(in_window, 1, sizeof(in_window));
-
-		for(int h = SpriteCountCache[FrameWhichActive] - 1; h >= 0; h--)
-		{
-			const uint8* stab = SpriteTable[FrameWhichActive][h];
-			int ts = stab[0];
-			int as = stab[1];
-			int ysx = stab[2];
-			int xs = stab[3];
-			int ys;
-
-			if(xs >= 249) xs -= 256;
-
-			if(ysx > 150) 
-			 ys = (int8)ysx;
-			else 
-			 ys = ysx;
-
-			ys = wsLine - ys;
-
-			if(ys >= 0 && ys < 8 && xs < 224)
-			{
-			 uint32 palette = ((as >> 1) & 0x7);
-			 
-			 ts |= (as&1) << 8;
-			 wsGetTile(ts, ys, as & 0x80, as & 0x40, 0);
-
-			 if(wsIsColor())
-			 {
-			  if(wsIs4bpp())
-			  {
-			   for(int x = 0; x < 8; x++)
-			    if(wsTileRow[x])
-			    {
-		             if((as & 0x20) || !(b_bg[xs + x + 7] & 0x10))
-		             {
-			      bool drawthis = 0;
-
-			      if(!(DispControl & 0x08)) 
-			       drawthis = true;
-			      else if((as & 0x10) && !in_window[7 + xs + x])
-			       drawthis = true;
-			      else if(!(as & 0x10) && in_window[7 + xs + x])
-			       drawthis = true;
-
-			      if(drawthis)
-		              {
-		               b_bg[xs + x + 7] = wsTileRow[x] | (b_bg[xs + x + 7] & 0x10);
-		               b_bg_pal[xs + x + 7] = 8 + palette;
-		              }
-		             }
-		            }
-			  }
-			  else
-			  {
-                           for(int x = 0; x < 8; x++)
-                            if(wsTileRow[x] || !(palette & 0x4))
-                            {
-                             if((as & 0x20) || !(b_bg[xs + x + 7] & 0x10))
-                             {
-                              bool drawthis = 0;
-
-                              if(!(DispControl & 0x08))
-                               drawthis = true;
-                              else if((as & 0x10) && !in_window[7 + xs + x])
-                               drawthis = true;
-                              else if(!(as & 0x10) && in_window[7 + xs + x])
-                               drawthis = true;
-
-                              if(drawthis)
-                              {
-                               b_bg[xs + x + 7] = wsTileRow[x] | (b_bg[xs + x + 7] & 0x10);
-                               b_bg_pal[xs + x + 7] = 8 + palette;
-                              }
-                             }
-                            }
-
-			  }
-
-			 }
-			 else
-			 {
-                          for(int x = 0; x < 8; x++)
-                           if(wsTileRow[x] || !(palette & 4))
-                           {
-                            if((as & 0x20) || !(b_bg[xs + x + 7] & 0x10))
-                            {
-                             bool drawthis = 0;
-
-                             if(!(DispControl & 0x08))
-                              drawthis = true;
-                             else if((as & 0x10) && !in_window[7 + xs + x])
-                              drawthis = true;
-                             else if(!(as & 0x10) && in_window[7 + xs + x])
-                              drawthis = true;
-
-                             if(drawthis)
-                             //if((as & 0x10) || in_window[7 + xs + x])
-                             {
-		              b_bg[xs + x + 7] = wsColors[wsMonoPal[8 + palette][wsTileRow[x]]] | (b_bg[xs + x + 7] & 0x10);
-                             }
-                            }
-                           }
-
-			 }
-			}
-		}
-
-	}	// End sprite drawing
-	//
-	//
-	//
 	if(surface->format.opp == 4)
-	 wsBlitScanline<uint32>(surface->pix<uint32>() + wsLine * surface->pitchinpix, b_bg + 7, b_bg_pal + 7);
+	 Blit32.Line[color](&ColorMapPal, surface->pix<uint32>() + line * surface->pitchinpix, b_bg + 7, b_bg_pal + 7);
+	else
+	 Blit16.Line[color](&ColorMapPal, surface->pix<uint16>() + line * surface->pitchinpix, b_bg + 7, b_bg_pal + 7);
+}
+
+static void wsScanline(MDFN_Surface* surface, const unsigned line)
+{
+	if(!wsIsColor())
+	 wsScanlineT<false, false>(surface, line);
+	else if(wsIs4bpp())
+	 wsScanlineT<true, true>(surface, line);
+	else
+	 wsScanlineT<true, false>(surface, line);
+}
+
+// Marks the wsRAM pages the pending lines read: the BG and FG maps, the tile data of the current
+// video mode, and the WSC palettes.
+static void wsUpdateRAMWatch(void)
+{
+	memset(wsGfxRAMWatch, 0, sizeof(wsGfxRAMWatch));
+
+	memset(&wsGfxRAMWatch[(FGBGLoc & 0xF) << 3], 1, 8);
+	memset(&wsGfxRAMWatch[((FGBGLoc >> 4) & 0xF) << 3], 1, 8);
+
+	if(wsIs4bpp())
+	 memset(&wsGfxRAMWatch[0x40], 1, 0x80);
 	else
-	 wsBlitScanline<uint16>(surface->pix<uint16>() + wsLine * surface->pitchinpix, b_bg + 7, b_bg_pal + 7);
+	 memset(&wsGfxRAMWatch[0x20], 1, 0x40);
+
+	memset(&wsGfxRAMWatch[0xFE], 1, 2);
+}
+
+void WSwan_GfxFlush(void)
+{
+	for(unsigned l = PendingStart; l < PendingEnd; l++)
+	 wsScanline(PendingSurface, l);
+
+	wsGfxPending = false;
+}
+
+void WSwan_GfxSetLazyRender(bool enabled)
+{
+	if(wsGfxPending)
+	 WSwan_GfxFlush();
+
+	LazyRender = enabled;
 }
 
 void WSwan_GfxReset(void)
 {
  weppy = 0;
+ wsGfxPending = false;
+ LineTS = (uint32)-256;	// The CPU starts at the start of a line.
+ HBCounterTS = 0;
+
+ for(unsigned i = 0; i < WSEVENT__COUNT; i++)
+  EventTS[i] = WSEVENT_NEVER;
+ RecalcNextEvent();
  wsLine=0;
  wsSetVideo(0,true);
 
  memset(SpriteTable, 0, sizeof(SpriteTable));
  SpriteCountCache[0] = SpriteCountCache[1] = 0;
+ wsBuildSpriteLines(0);
+ wsBuildSpriteLines(1);
  FrameWhichActive = false;
  DispControl = 0;
  BGColor = 0;
@@ -961,10 +1174,18 @@ void WSwan_GfxReset(void)
   for(int u1=0;u1<16;u1++)
    wsCols[u0][u1]=0;
 
+ wsUpdateColorMapPal();
 }
 
 void WSwan_GfxStateAction(StateMem *sm, const unsigned load, const bool data_only)
 {
+ uint32 LinePos = v30mz_timestamp + v30mz_ICount - LineTS;	// How far into the current line the CPU is.
+
+ if(load)
+  LinePos = ~0U;
+ else
+  HBTimerSync();
+
  SFORMAT StateRegs[] =
  {
   SFVARN(wsMonoPal, "wsMonoPal"),
@@ -1013,6 +1234,7 @@ void WSwan_GfxStateAction(StateMem *sm, const unsigned load, const bool data_onl
   SFVAR(VideoMode),
 
   SFVAR(weppy),
+  SFVAR(LinePos),
   SFEND
  };
 
@@ -1033,16 +1255,39 @@ void WSwan_GfxStateAction(StateMem *sm, const unsigned load, const bool data_onl
   //
   weppy %= 4;
 
+  // Save states made before the line was event driven have only weppy; the CPU was somewhere in the slice it names.
+  if(LinePos == ~0U)
+  {
+   static const uint16 slice_end[4] = { 256, 128, 224, 256 };
+
+   LinePos = slice_end[weppy];
+  }
+
+  if(weppy == 2)
+   weppy = 1;
+
+  LineTS = v30mz_timestamp + v30mz_ICount - std::min<uint32>(LinePos, 256);
+  WSwan_SetEvent(WSEVENT_LINE, (weppy == 1) ? LineTS + 224 : WSEVENT_NEVER);
+  WSwan_SetEvent(WSEVENT_VBLANK, WSEVENT_NEVER);
+  HBCounterTS = LineTS;
+  HBTimerSchedule();
+
+  wsGfxPending = false;
+
   for(unsigned i = 0; i < 2; i++)
   {
    if(SpriteCountCache[i] > 0x80)
     SpriteCountCache[i] = 0x80;
+
+   wsBuildSpriteLines(i);
   }
 
   for(unsigned i = 0; i < 16; i++)
    for(unsigned j = 0; j < 4; j++)
     wsMonoPal[i][j] &= 0x7;
 
+  wsUpdateMonoShades();
+
   wsSetVideo(VideoMode >> 5, true);
  }
 }
@@ -1117,16 +1362,16 @@ static void DoGfxDecode(void)
     continue;
    }
 
-   wsGetTile(which_tile & 0x1FF, y&7, 0, 0, which_tile & 0x200);
+   const uint8* const tile_row = wsGetTile(which_tile & 0x1FF, y&7, 0, 0, which_tile & 0x200);
    if(wsIsColor())
    {
     for(int sx = 0; sx < 8; sx++)
-     target[x + sx] = neo_palette[wsTileRow[sx]];
+     target[x + sx] = neo_palette[tile_row[sx]];
    }
    else
    {
     for(int sx = 0; sx < 8; sx++)
-     target[x + sx] = neo_palette[wsTileRow[sx]];
+     target[x + sx] = neo_palette[tile_row[sx]];
    }
 
    uint32 address_base;
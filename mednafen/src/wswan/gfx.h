@@ -5,19 +5,20 @@ namespace MDFN_IEN_WSWAN
 {
 
 
-void WSWan_TCacheInvalidByAddr(uint32);
-
 MDFN_HIDE extern uint8	wsTCache[512*64];		  //tiles cache
 MDFN_HIDE extern uint8	wsTCacheFlipped[512*64];  	  //tiles cache (H flip)
-MDFN_HIDE extern uint8	wsTileRow[8];		  //extracted 8 pixels (tile row)
-MDFN_HIDE extern uint8	wsTCacheUpdate[512];	  //tiles cache flags
 MDFN_HIDE extern uint8	wsTCache2[512*64];		  //tiles cache
 MDFN_HIDE extern uint8	wsTCacheFlipped2[512*64];  	  //tiles cache (H flip)
-MDFN_HIDE extern uint8	wsTCacheUpdate2[512];	  //tiles cache flags
+MDFN_HIDE extern uint8	wsTCacheDirty[0x10000 >> 7];	  //tiles cache dirty bits, one per 16 bytes of wsRAM
 MDFN_HIDE extern int	wsVMode;			  //Video Mode	
 
+static INLINE void WSWan_TCacheInvalidByAddr(uint32 ws_offset)
+{
+ wsTCacheDirty[(ws_offset >> 7) & 0x1FF] |= 1 << ((ws_offset >> 4) & 7);
+}
+
 void wsMakeTiles(void);
-void wsGetTile(uint32,uint32,int,int,int);
+const uint8* wsGetTile(uint32,uint32,int,int,int);
 void wsSetVideo(int, bool);
 
 static inline bool wsIsColor(void) { return wsVMode & 0x04; }
@@ -38,6 +39,43 @@ void WSwan_GfxWSCPaletteRAMWrite(uint32 ws_offset, uint8 data);
 
 bool wsExecuteLine(MDFN_Surface *surface, bool skip);
 
+void WSwan_GfxSetLazyRender(bool enabled);
+void WSwan_GfxFlush(void);
+
+MDFN_HIDE extern bool wsGfxPending;		  //lines waiting to be drawn (lazy rendering)
+MDFN_HIDE extern uint8 wsGfxRAMWatch[0x100];	  //wsRAM pages (256 bytes) those lines read
+
+// Must be called before wsRAM[ws_offset] is modified, so that lines still waiting to be drawn see the old contents.
+static INLINE void WSwan_GfxCheckRAMWrite(uint32 ws_offset)
+{
+ if(MDFN_UNLIKELY(wsGfxPending) && wsGfxRAMWatch[(ws_offset >> 8) & 0xFF])
+  WSwan_GfxFlush();
+}
+
+// Events, at an exact v30mz_timestamp; wsExecuteLine() runs the CPU up to the earliest one at a time.  Events due
+// together run in this order.
+enum
+{
+ WSEVENT_NILE_SPI = 0,	// nileswan SPI transfer completion
+ WSEVENT_SOUND_DMA,	// next sound DMA transfer
+ WSEVENT_NILE_USB,	// nileswan USB frame, moving CDC packets between the host and the MCU
+ WSEVENT_PROFILE,	// guest profiler sample
+ WSEVENT_LINE,		// line counter step and line compare interrupt, 224 cycles into the line
+ WSEVENT_VBLANK,	// VBlank interrupt and VBlank timer, at the start of line 144
+ WSEVENT_HBTIMER,	// HBlank timer reaching 0, at a line start
+ WSEVENT_SERIAL,	// serial port transfers, at line starts while there is one to make
+ WSEVENT_RTC,		// RTC second
+ WSEVENT__COUNT
+};
+
+enum : uint32 { WSEVENT_NEVER = 0xFFFFFFFF };
+
+void WSwan_SetEvent(unsigned which, uint32 timestamp);
+void WSwan_EventResetTS(uint32 timestamp);
+
+// Timestamp of the start of the next line, for events that happen at line starts.
+uint32 WSwan_GfxNextLineTS(void);
+
 void WSwan_SetLayerEnableMask(uint64 mask);
 void WSwan_GfxStateAction(StateMem *sm, const unsigned load, const bool data_only);
 
@@ -38,6 +38,8 @@
 #include "eeprom.h"
 #include "debug.h"
 #include "nileswan.h"
+#include "profile.h"
+#include "memstats.h"
 
 namespace MDFN_IEN_WSWAN
 {
@@ -66,6 +68,11 @@ static void Reset(void)
 	RTC_Reset();
 	WSwan_EEPROMReset();
 
+	if(nileswan_is_active())
+	 nileswan_start_events();
+
+	WSwan_ProfileReset();
+
 	for(unsigned u0 = 0; u0 < 0xc8; u0++)
 	{
 	 if(u0 != 0xC4 && u0 != 0xC5 && u0 != 0xBA && u0 != 0xBB)
@@ -109,6 +116,22 @@ static void Emulate(EmulateSpecStruct *espec)
 
  espec->SoundBufSize = WSwan_SoundFlush(espec->SoundBuf, espec->SoundBufMaxSize);
 
+ Comm_Sync();
+
+ if(nileswan_is_active())
+  nileswan_flush();
+
+ if(nileswan_is_active())
+  nileswan_reset_ts(v30mz_timestamp);
+ WSwan_MemoryResetTS(v30mz_timestamp);
+ RTC_ResetTS(v30mz_timestamp);
+ WSwan_EventResetTS(v30mz_timestamp);
+ #ifdef WANT_DEBUGGER
+ WSwanDBG_ResetTS(v30mz_timestamp);
+ #endif
+
+ WSwan_MemStatsFrame(v30mz_timestamp);
+
  espec->MasterCycles = v30mz_timestamp;
  v30mz_timestamp = 0;
 
@@ -215,11 +238,19 @@ static bool TestMagic(GameFile* gf)
 
 static void Cleanup(void)
 {
+ #ifdef WANT_DEBUGGER
+ WSwanDBG_SetBinaryTrace(NULL);
+ #endif
+
  Comm_Kill();
  WSwan_MemoryKill();
+ WSwan_ProfileKill();
+ WSwan_MemStatsKill();
 
  WSwan_SoundKill();
 
+ nileswan_quit();
+
  if(wsCartROM)
  {
   delete[] wsCartROM;
@@ -230,6 +261,14 @@ static void Cleanup(void)
 
 static void CloseGame(void)
 {
+ {
+  uint64 idle_skips, idle_cycles;
+
+  v30mz_get_idle_stats(&idle_skips, &idle_cycles);
+  if(idle_skips)
+   MDFN_printf(_("Idle loop skipping: %llu skips, %llu CPU cycles skipped.\n"), (unsigned long long)idle_skips, (unsigned long long)idle_cycles);
+ }
+
  if(!IsWSR)
  {
   try
@@ -242,6 +281,24 @@ static void CloseGame(void)
   }
  }
 
+ try
+ {
+  WSwan_ProfileSave();
+ }
+ catch(std::exception &e)
+ {
+  MDFND_OutputNotice(MDFN_NOTICE_ERROR, e.what());
+ }
+
+ try
+ {
+  WSwan_MemStatsSave();
+ }
+ catch(std::exception &e)
+ {
+  MDFND_OutputNotice(MDFN_NOTICE_ERROR, e.what());
+ }
+
  Cleanup();
 }
 
@@ -397,8 +454,10 @@ static void Load(GameFile* gf)
   {
     IsNile = true;
     nileswan_init();
+    nile_trace_init(MDFN_GetSettingS("wswan.nileswan.trace").c_str(), MDFN_GetSettingS("wswan.nileswan.trace.path").c_str());
     nileswan_open_spi((gf->dir + "/nileswan.spi").c_str());
-    nileswan_open_tf((gf->dir + "/nileswan.img").c_str());
+    nileswan_open_tf((gf->dir + "/nileswan.img").c_str(), MDFN_GetSettingB("wswan.nileswan.tf_cow"));
+    nileswan_configure_usb(MDFN_GetSettingUI("wswan.nileswan.usb.packet_size"), MDFN_GetSettingUI("wswan.nileswan.usb.frame_interval"), MDFN_GetSettingUI("wswan.nileswan.usb.fifo_depth"));
   }
 
   MDFNMP_Init(16384, (1 << 20) / 1024);
@@ -408,18 +467,28 @@ static void Load(GameFile* gf)
   #endif
 
   WSwan_MemoryInit(MDFN_GetSettingB("wswan.language"), wsc, SRAMSize, IsWW, IsNile);
+  v30mz_set_prefetch(MDFN_GetSettingB("wswan.prefetch"));
+  v30mz_set_decode_cache(MDFN_GetSettingB("wswan.decode_cache"));
+  v30mz_set_idle_skip(MDFN_GetSettingB("wswan.idle_skip"));
+  WSwan_GfxSetLazyRender(MDFN_GetSettingB("wswan.lazy_render"));
 
   if(!IsWSR)
    WSwan_MemoryLoadNV();
 
-  Comm_Init(MDFN_GetSettingB("wswan.excomm") ? MDFN_GetSettingS("wswan.excomm.path").c_str() : NULL);
+  Comm_Init(MDFN_GetSettingB("wswan.excomm") ? MDFN_GetSettingUI("wswan.excomm.transport") : COMM_TRANSPORT_NONE, MDFN_GetSettingS("wswan.excomm.path").c_str());
+
+  if(MDFN_GetSettingS("wswan.profile").size())
+   WSwan_ProfileInit(MDFN_GetSettingS("wswan.profile"), MDFN_GetSettingS("wswan.profile.symbols"), MDFN_GetSettingUI("wswan.profile.interval"));
+
+  if(MDFN_GetSettingS("wswan.memstats").size())
+   WSwan_MemStatsInit(MDFN_GetSettingS("wswan.memstats"));
 
   WSwan_GfxInit();
   MDFNGameInfo->fps = (uint32)((uint64)3072000 * 65536 * 256 / (159*256));
 
   WSwan_SoundInit();
 
-  RTC_Init();
+  RTC_Init(MDFN_GetSettingI("wswan.rtc.epoch"));
 
   wsMakeTiles();
 
@@ -493,6 +562,9 @@ static void StateAction(StateMem *sm, const unsigned load, const bool data_only)
  // Call MemoryStateAction before others StateActions...
  WSwan_MemoryStateAction(sm, load, data_only);
 
+ if(nileswan_is_active())
+  nileswan_state_action(sm, load, data_only);
+
  WSwan_GfxStateAction(sm, load, data_only);
 
  RTC_StateAction(sm, load, data_only);
@@ -504,6 +576,9 @@ static void StateAction(StateMem *sm, const unsigned load, const bool data_only)
  WSwan_EEPROMStateAction(sm, load, data_only);
 
  Comm_StateAction(sm, load, data_only);
+
+ if(load)
+  WSwan_ProfileReset();	// The call stack is stale, and the sample event isn't saved.
 }
 
 static void DoSimpleCommand(int cmd)
@@ -553,6 +628,16 @@ static const MDFNSetting_EnumList LanguageList[] =
  { NULL, 0 },
 };
 
+static const MDFNSetting_EnumList ExCommTransportList[] =
+{
+ { "program", COMM_TRANSPORT_PROGRAM, gettext_noop("Run the program named by wswan.excomm.path, connected to its stdin/stdout.") },
+ { "unix", COMM_TRANSPORT_UNIX, gettext_noop("Listen on the UNIX domain socket named by wswan.excomm.path.") },
+ { "tcp", COMM_TRANSPORT_TCP, gettext_noop("Listen on the TCP \"[host:]port\" given by wswan.excomm.path.") },
+ { "pty", COMM_TRANSPORT_PTY, gettext_noop("Create a pseudo-terminal; its name is printed when the game is loaded.") },
+
+ { NULL, 0 },
+};
+
 static const MDFNSetting WSwanSettings[] =
 {
  { "wswan.language", MDFNSF_EMU_STATE | MDFNSF_UNTRUSTED_SAFE, gettext_noop("Language games should display text in."), gettext_noop("The only game this setting is known to affect is \"Digimon Tamers - Battle Spirit\"."), MDFNST_ENUM, "english", NULL, NULL, NULL, NULL, LanguageList },
@@ -563,8 +648,31 @@ static const MDFNSetting WSwanSettings[] =
  { "wswan.sex", MDFNSF_EMU_STATE | MDFNSF_UNTRUSTED_SAFE, gettext_noop("Sex"), NULL, MDFNST_ENUM, "F", NULL, NULL, NULL, NULL, SexList },
  { "wswan.blood", MDFNSF_EMU_STATE | MDFNSF_UNTRUSTED_SAFE, gettext_noop("Blood Type"), NULL, MDFNST_ENUM, "O", NULL, NULL, NULL, NULL, BloodList },
 
+ { "wswan.decode_cache", MDFNSF_NOFLAGS, gettext_noop("Cache decoded instructions."), gettext_noop("Keeps the ModRM operand and immediates of recently run instructions, by physical address, checked against memory before each use."), MDFNST_BOOL, "0" },
+ { "wswan.prefetch", MDFNSF_EMU_STATE | MDFNSF_UNTRUSTED_SAFE, gettext_noop("Emulate the contents of the CPU prefetch queue."), gettext_noop("Instruction bytes already in the 8-byte queue are not affected by later writes, which matters for some self-modifying code.  Slower."), MDFNST_BOOL, "0" },
+
+ { "wswan.idle_skip", MDFNSF_NOFLAGS, gettext_noop("Skip ahead in idle loops."), gettext_noop("Loops that only poll memory or side-effect-free I/O ports, with nothing changing between iterations, are fast-forwarded to the end of the current CPU slice.  Emulation results are unaffected; the number of skips is printed when the game is closed."), MDFNST_BOOL, "1" },
+
+ { "wswan.lazy_render", MDFNSF_NOFLAGS, gettext_noop("Draw scanlines in batches."), gettext_noop("Scanlines are drawn at VBlank, or earlier when a display register, or the video RAM they use, is about to be written, instead of one at a time as the CPU reaches them.  The output is identical."), MDFNST_BOOL, "1" },
+
+ { "wswan.rtc.epoch", MDFNSF_EMU_STATE | MDFNSF_UNTRUSTED_SAFE | MDFNSF_SUPPRESS_DOC, gettext_noop("Time to start the cartridge RTC at, in seconds since 1970-01-01 00:00:00 UTC."), gettext_noop("-1 starts it at the host's local time."), MDFNST_INT, "-1", "-1", "253402300799" },
+
  { "wswan.excomm", MDFNSF_EMU_STATE | MDFNSF_SUPPRESS_DOC, gettext_noop("Enable comms to external program."), NULL, MDFNST_BOOL, "0" },
- { "wswan.excomm.path", MDFNSF_EMU_STATE | MDFNSF_SUPPRESS_DOC, gettext_noop("Comms external program path."), NULL, MDFNST_STRING, "wonderfence" },
+ { "wswan.excomm.transport", MDFNSF_EMU_STATE | MDFNSF_SUPPRESS_DOC, gettext_noop("Comms transport."), gettext_noop("Used for both the serial port and the nileswan USB serial port.  Data is exchanged with the host once per frame, without blocking."), MDFNST_ENUM, "program", NULL, NULL, NULL, NULL, ExCommTransportList },
+ { "wswan.excomm.path", MDFNSF_EMU_STATE | MDFNSF_SUPPRESS_DOC, gettext_noop("Comms external program path, or socket address."), NULL, MDFNST_STRING, "wonderfence" },
+
+ { "wswan.profile", MDFNSF_SUPPRESS_DOC, gettext_noop("Profile guest code, writing the results in callgrind format to this file when the game is closed; empty to disable."), gettext_noop("Cycles are sampled per PC and per call path; with wswan.profile.symbols, they are grouped by function."), MDFNST_STRING, "" },
+ { "wswan.profile.symbols", MDFNSF_SUPPRESS_DOC, gettext_noop("Symbol file for the profiler: an ELF file, a GNU ld map file, nm output, or \"address name\" lines."), NULL, MDFNST_STRING, "" },
+ { "wswan.profile.interval", MDFNSF_SUPPRESS_DOC, gettext_noop("Profiler sampling interval, in CPU cycles."), NULL, MDFNST_UINT, "256", "16", "65536" },
+
+ { "wswan.memstats", MDFNSF_SUPPRESS_DOC, gettext_noop("Count memory and I/O port accesses, writing them as CSV to this file when the game is closed; empty to disable."), gettext_noop("Reads, writes and instruction fetches are counted per 16-byte block of RAM, cartridge SRAM and ROM(PSRAM on nileswan), and per port; a second file, with \"-frames.csv\" in place of \".csv\", gets the bytes accessed by the CPU, DMA and sound DMA in each frame.  Emulation is considerably slower while counting."), MDFNST_STRING, "" },
+
+ { "wswan.nileswan.tf_cow", MDFNSF_EMU_STATE | MDFNSF_SUPPRESS_DOC, gettext_noop("Keep nileswan TF card writes in memory instead of writing them to nileswan.img."), NULL, MDFNST_BOOL, "0" },
+ { "wswan.nileswan.usb.packet_size", MDFNSF_EMU_STATE | MDFNSF_SUPPRESS_DOC, gettext_noop("nileswan USB CDC bulk packet size, in bytes."), NULL, MDFNST_UINT, "64", "8", "64" },
+ { "wswan.nileswan.usb.frame_interval", MDFNSF_EMU_STATE | MDFNSF_SUPPRESS_DOC, gettext_noop("nileswan USB frame interval, in microseconds; one CDC packet moves each way per frame."), NULL, MDFNST_UINT, "1000", "125", "100000" },
+ { "wswan.nileswan.usb.fifo_depth", MDFNSF_EMU_STATE | MDFNSF_SUPPRESS_DOC, gettext_noop("Size of each nileswan MCU USB CDC FIFO, in bytes."), NULL, MDFNST_UINT, "512", "64", "4096" },
+ { "wswan.nileswan.trace", MDFNSF_SUPPRESS_DOC, gettext_noop("nileswan trace levels, e.g. \"info,tf=debug\"; categories are spi, tf, flash, mcu, cdc and fpga, levels are off, error, info and debug."), NULL, MDFNST_STRING, "error" },
+ { "wswan.nileswan.trace.path", MDFNSF_SUPPRESS_DOC, gettext_noop("File to write the nileswan trace to; empty for stdout."), NULL, MDFNST_STRING, "" },
 
  { NULL }
 };
@@ -656,6 +764,12 @@ static DebuggerInfoStruct DBGInfo =
  WSwanDBG_EnableBranchTrace,
  WSwanDBG_GetBranchTrace,
  WSwan_GfxSetGraphicsDecode,
+ WSwanDBG_SetLogFunc,
+ WSwanDBG_SetBinaryTrace,
+ WSwan_MemStatsEnable,
+ WSwan_MemStatsGet,
+ WSwan_MemStatsClear,
+ WSwan_MemStatsWriteCSV,
 };
 #endif
 
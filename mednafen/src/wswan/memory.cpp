@@ -32,6 +32,8 @@
 #include <time.h>
 #include <trio/trio.h>
 #include "nileswan.h"
+#include "nileswan_hardware.h"
+#include "memstats.h"
 
 namespace MDFN_IEN_WSWAN
 {
@@ -55,7 +57,8 @@ static uint8 DMAControl;
 static uint32 SoundDMASource, SoundDMASourceSaved;
 static uint32 SoundDMALength, SoundDMALengthSaved;
 static uint8 SoundDMAControl;
-static uint8 SoundDMATimer;
+static uint8 SoundDMATimer;	// Only read from save states that predate SoundDMANextTS
+static uint32 SoundDMANextTS;	// When the next sound DMA transfer happens, while SoundDMAControl & 0x80
 
 static uint8 SystemControl;
 
@@ -98,6 +101,7 @@ static INLINE void WriteMem(uint32 A, uint8 V)
  if(!bank) /*RAM*/
  {
   WSwan_SoundCheckRAMWrite(offset);
+  WSwan_GfxCheckRAMWrite(offset);
   wsRAM[offset] = V;
 
   WSWan_TCacheInvalidByAddr(offset);
@@ -204,12 +208,121 @@ static INLINE uint8 ReadMem(uint32 A)
  }
 }
 
+//
+// Rebuild the CPU page table; must be called whenever the cartridge banking changes.
+//
+void WSwan_MemoryUpdatePages(void)
+{
+ for(unsigned bank = 0; bank < 16; bank++)
+ {
+  uint8* read_ptr = NULL;
+  uint8* write_ptr = NULL;
+
+  if(!bank)
+   read_ptr = wsRAM;	// Writes go through WriteMem() for the sound, tile cache and palette side effects.
+  else if(IsNile)
+   nileswan_get_page(bank, &read_ptr, &write_ptr);
+  else if(bank == 1)
+  {
+   if(!(IsWW && WW_FlashLock) && sram_size >= 0x10000)
+    read_ptr = write_ptr = wsSRAM + ((BankSelector[1] << 16) & (sram_size - 1));
+  }
+  else if(rom_size >= 0x10000)
+  {
+   uint32 rom_bank;
+
+   if(bank == 2 || bank == 3)
+    rom_bank = BankSelector[bank];
+   else
+    rom_bank = ((BankSelector[0] & 0xF) << 4) | bank;
+
+   read_ptr = wsCartROM + ((rom_bank & ((rom_size >> 16) - 1)) << 16);
+  }
+
+  v30mz_set_page(bank, read_ptr, write_ptr);
+ }
+}
+
+//
+// Map a CPU physical address to the MEMSTATS_* address space and offset it accesses, without side effects; returns -1
+// for anything else(nileswan IPC and buffers, open bus).
+//
+int WSwan_MemoryResolve(uint32 A, bool write, uint32* offset)
+{
+ const uint32 bank = (A >> 16) & 0xF;
+
+ if(!bank)
+ {
+  *offset = A & 0xFFFF;
+  return MEMSTATS_RAM;
+ }
+
+ if(IsNile)
+ {
+  const uint8* p = nileswan_cart_resolve(A, write);
+
+  if(p >= nile_psram && p < nile_psram + nile_psram_size)
+  {
+   *offset = p - nile_psram;
+   return MEMSTATS_ROM;
+  }
+
+  if(p >= nile_sram && p < nile_sram + nile_sram_size)
+  {
+   *offset = p - nile_sram;
+   return MEMSTATS_SRAM;
+  }
+
+  return -1;
+ }
+
+ if(bank == 1)
+ {
+  const uint32 address = (A & 0xFFFF) | (BankSelector[1] << 16);
+
+  if(IsWW && WW_FlashLock)
+  {
+   *offset = address & (rom_size - 1);
+   return MEMSTATS_ROM;
+  }
+
+  if(!sram_size)
+   return -1;
+
+  *offset = address & (sram_size - 1);
+  return MEMSTATS_SRAM;
+ }
+
+ if(bank == 2 || bank == 3)
+  *offset = (A & 0xFFFF) + ((BankSelector[bank] & ((rom_size >> 16) - 1)) << 16);
+ else
+  *offset = (((((BankSelector[0] & 0xF) << 4) | bank) & ((rom_size >> 16) - 1)) << 16) | (A & 0xFFFF);
+
+ return MEMSTATS_ROM;
+}
+
+uint32 WSwan_MemoryGetSpaceSize(unsigned space)
+{
+ switch(space)
+ {
+  case MEMSTATS_RAM: return wsRAMSize;
+  case MEMSTATS_SRAM: return IsNile ? nile_sram_size : sram_size;
+  case MEMSTATS_ROM: return IsNile ? nile_psram_size : rom_size;
+ }
+
+ return 0;
+}
+
 static void ws_CheckDMA(void)
 {
  if(DMAControl & 0x80)
  {
   while(DMALength)
   {
+   WSwan_MemStatsDMA(MEMSTATS_GDMA, DMASource, false);
+   WSwan_MemStatsDMA(MEMSTATS_GDMA, DMASource + 1, false);
+   WSwan_MemStatsDMA(MEMSTATS_GDMA, DMADest, true);
+   WSwan_MemStatsDMA(MEMSTATS_GDMA, DMADest + 1, true);
    WSwan_writemem20(DMADest, WSwan_readmem20(DMASource));
    WSwan_writemem20(DMADest+1, WSwan_readmem20(DMASource+1));
 
@@ -230,58 +343,69 @@ static void ws_CheckDMA(void)
  DMAControl &= ~0x80;
 }
 
-void WSwan_CheckSoundDMA(void)
+// Sound DMA moves one byte every 6/4/2/1 ticks of a 128-cycle clock (4/6/12/24 kHz).  Each
+// transfer is a scheduled event, so the sample reaches the sound unit at its exact timestamp.
+static INLINE uint32 SoundDMAPeriod(void)
+{
+ static const uint8 ticks[4] = { 6, 4, 2, 1 };
+
+ return 128 * ticks[SoundDMAControl & 3];
+}
+
+static void ScheduleSoundDMA(void)
+{
+ WSwan_SetEvent(WSEVENT_SOUND_DMA, (SoundDMAControl & 0x80) ? SoundDMANextTS : WSEVENT_NEVER);
+}
+
+void WSwan_SoundDMAEvent(uint32 timestamp)
 {
  if(!(SoundDMAControl & 0x80))
   return;
 
- if(!SoundDMATimer)
+ uint8 zebyte = 0;
+ if(!(SoundDMAControl & 0x04))
  {
-  uint8 zebyte = 0;
-  if(!(SoundDMAControl & 0x04))
-    zebyte = WSwan_readmem20(SoundDMASource);
+   WSwan_MemStatsDMA(MEMSTATS_SDMA, SoundDMASource, false);
+   zebyte = WSwan_readmem20(SoundDMASource);
+ }
 
-  if(SoundDMAControl & 0x10)
-   WSwan_SoundWrite(0x95, zebyte); // Pick a port, any port?!
-  else
-   WSwan_SoundWrite(0x89, zebyte);
+ if(SoundDMAControl & 0x10)
+  WSwan_SoundDMAWrite(0x95, zebyte, timestamp); // Pick a port, any port?!
+ else
+  WSwan_SoundDMAWrite(0x89, zebyte, timestamp);
 
-  if(!(SoundDMAControl & 0x04))
-  {
-    if(SoundDMAControl & 0x40)
-     SoundDMASource--;
-    else
-     SoundDMASource++;
-    SoundDMASource &= 0x000FFFFF;
+ if(!(SoundDMAControl & 0x04))
+ {
+   if(SoundDMAControl & 0x40)
+    SoundDMASource--;
+   else
+    SoundDMASource++;
+   SoundDMASource &= 0x000FFFFF;
 
-    SoundDMALength--;
-    SoundDMALength &= 0x000FFFFF;
-    if(!SoundDMALength)
+   SoundDMALength--;
+   SoundDMALength &= 0x000FFFFF;
+   if(!SoundDMALength)
+   {
+    if(SoundDMAControl & 0x08)
     {
-     if(SoundDMAControl & 0x08)
-     {
-       SoundDMALength = SoundDMALengthSaved;
-       SoundDMASource = SoundDMASourceSaved;
-     }
-     else
-     {
-      SoundDMAControl &= ~0x80;
-     }
+      SoundDMALength = SoundDMALengthSaved;
+      SoundDMASource = SoundDMASourceSaved;
     }
-  }
-
-  switch(SoundDMAControl & 3)
-  {
-    case 0: SoundDMATimer = 5; break;
-    case 1: SoundDMATimer = 3; break;
-    case 2: SoundDMATimer = 1; break;
-    case 3: SoundDMATimer = 0; break;
-  }
- }
- else
- {
-  SoundDMATimer--;
+    else
+    {
+     SoundDMAControl &= ~0x80;
+    }
+   }
  }
+
+ SoundDMANextTS = timestamp + SoundDMAPeriod();
+ ScheduleSoundDMA();
+}
+
+void WSwan_MemoryResetTS(uint32 timestamp)
+{
+ if(SoundDMAControl & 0x80)
+  SoundDMANextTS = (SoundDMANextTS > timestamp) ? (SoundDMANextTS - timestamp) : 0;
 }
 
 template<bool WW>
@@ -421,7 +545,10 @@ static INLINE void WritePort(uint32 IOPort, uint8 V)
                            SoundDMALengthSaved &= 0x00FFFF; SoundDMALengthSaved |= ((V & 0xF) << 16);
                            break;
 
-		case 0x52: SoundDMAControl = V & ~0x20;
+		case 0x52: if(!(SoundDMAControl & 0x80) && (V & 0x80))
+			    SoundDMANextTS = v30mz_timestamp + 128;
+			   SoundDMAControl = V & ~0x20;
+			   ScheduleSoundDMA();
 			   break;
 
 	case 0xA0: SystemControl = (SystemControl & 0x81) | (V & 0x0D); break;
@@ -437,14 +564,17 @@ static INLINE void WritePort(uint32 IOPort, uint8 V)
 	           WSwan_UpdateButtonReadLatch();
                    break;
 
-   case 0xC0: BankSelector[0] = V & 0xF; break;
-   case 0xC1: BankSelector[1] = V; break;
-   case 0xC2: BankSelector[2] = V; break;
-   case 0xC3: BankSelector[3] = V; break;
+   case 0xC0: BankSelector[0] = V & 0xF; WSwan_MemoryUpdatePages(); break;
+   case 0xC1: BankSelector[1] = V; WSwan_MemoryUpdatePages(); break;
+   case 0xC2: BankSelector[2] = V; WSwan_MemoryUpdatePages(); break;
+   case 0xC3: BankSelector[3] = V; WSwan_MemoryUpdatePages(); break;
  }
 
  if(WW && IOPort == 0xCE)
+ {
   WW_FlashLock = V & 0x01;
+  WSwan_MemoryUpdatePages();
+ }
 }
 
 MDFN_FASTCALL void WSwan_writemem20(uint32 A, uint8 V)
@@ -620,6 +750,8 @@ static void PutAddressSpaceBytes(const char *name, uint32 Address, uint32 Length
   while(Length--)
   {
    Address &= wsRAMSize - 1;
+   WSwan_SoundCheckRAMWrite(Address);
+   WSwan_GfxCheckRAMWrite(Address);
    wsRAM[Address] = *Buffer;
    WSWan_TCacheInvalidByAddr(Address);
    if(Address >= 0xfe00)
@@ -645,6 +777,7 @@ static void PutAddressSpaceBytes(const char *name, uint32 Address, uint32 Length
   {
    Address &= nile_psram_size - 1;
    nile_psram[Address] = *Buffer;
+   nileswan_mark_written(&nile_psram[Address]);
    Address++;
    Buffer++;
   }
@@ -665,6 +798,7 @@ static void PutAddressSpaceBytes(const char *name, uint32 Address, uint32 Length
   {
    Address &= nile_sram_size - 1;
    nile_sram[Address] = *Buffer;
+   nileswan_mark_written(&nile_sram[Address]);
    Address++;
    Buffer++;
   }
@@ -714,7 +848,9 @@ static void PutAddressSpaceBytes(const char *name, uint32 Address, uint32 Length
      { nileswan_cart_write(Address, *Buffer); }
    else switch(bank)
    {
-    case 0:  wsRAM[offset & (wsRAMSize - 1)] = *Buffer;
+    case 0:  WSwan_SoundCheckRAMWrite(offset & (wsRAMSize - 1));
+	     WSwan_GfxCheckRAMWrite(offset & (wsRAMSize - 1));
+	     wsRAM[offset & (wsRAMSize - 1)] = *Buffer;
 	     WSWan_TCacheInvalidByAddr(offset & (wsRAMSize - 1));
 	     if(Address >= 0xfe00)
 	      WSwan_GfxWSCPaletteRAMWrite(offset & (wsRAMSize - 1), *Buffer);
@@ -840,12 +976,17 @@ void WSwan_MemorySetRegister(const unsigned int id, uint32 value)
         WW_FlashLock = value;
         break;
  }
+
+ WSwan_MemoryUpdatePages();
 }
 
 #endif
 
 static void Cleanup(void)
 {
+ for(unsigned bank = 0; bank < 16; bank++)
+  v30mz_set_page(bank, NULL, NULL);
+
  if(wsSRAM)
  {
   delete[] wsSRAM;
@@ -926,6 +1067,50 @@ void WSwan_MemorySaveNV(void)
  }
 }
 
+// Ports that can be read without side effects and whose value only changes between CPU slices, so
+// polling them doesn't prevent idle loop skipping in the CPU core.  Must agree with ReadPort().
+static void SetIdlePorts(void)
+{
+ bool pure[256];
+
+ for(unsigned port = 0; port < 256; port++)
+ {
+  pure[port] = port <= 0x52 || port == 0x60 || (port >= 0xA0 && port <= 0xB0) || port == 0xB2 || (port >= 0xB4 && port <= 0xB6) || (port >= 0xC0 && port <= 0xC3);
+
+  // nileswan: only the bank, bank mask and power/emulation latches; SPI, IRQ and RTC registers change on their own.
+  if(IsNile && port >= 0xC0)
+  {
+   switch(port)
+   {
+    case IO_BANK_ROM_LINEAR:
+    case IO_BANK_RAM:
+    case IO_BANK_ROM0:
+    case IO_BANK_ROM1:
+    case IO_CART_FLASH:
+    case IO_BANK_2003_ROM_LINEAR:
+    case IO_BANK_2003_RAM:
+    case IO_BANK_2003_RAM + 1:
+    case IO_BANK_2003_ROM0:
+    case IO_BANK_2003_ROM0 + 1:
+    case IO_BANK_2003_ROM1:
+    case IO_BANK_2003_ROM1 + 1:
+    case IO_NILE_POW_CNT:
+    case IO_NILE_EMU_CNT:
+    case IO_NILE_SEG_MASK:
+    case IO_NILE_SEG_MASK + 1:
+	pure[port] = true;
+	break;
+
+    default:
+	pure[port] = false;
+	break;
+   }
+  }
+ }
+
+ v30mz_set_idle_ports(pure);
+}
+
 void WSwan_MemoryInit(bool lang, bool IsWSC, uint32 ssize, bool IsWW_arg, bool IsNile_arg)
 {
  IsWW = IsWW_arg;
@@ -988,6 +1173,9 @@ void WSwan_MemoryInit(bool lang, bool IsWSC, uint32 ssize, bool IsWW_arg, bool I
    v30mz_init(WSwan_readmem20_WW, WSwan_writemem20_WW, WSwan_readport_WW, WSwan_writeport_WW);
   else
    v30mz_init(WSwan_readmem20, WSwan_writemem20, WSwan_readport, WSwan_writeport);
+
+  SetIdlePorts();
+  WSwan_MemoryUpdatePages();
  }
  catch(...)
  {
@@ -1021,11 +1209,15 @@ void WSwan_MemoryReset(void)
  SoundDMALength = SoundDMALengthSaved = 0;
  SoundDMAControl = 0;
  SoundDMATimer = 0;
+ SoundDMANextTS = 0;
+ ScheduleSoundDMA();
 
  SystemControl = 0x85;
 
  WW_FlashLock = 0;
  WW_State = 0;
+
+ WSwan_MemoryUpdatePages();
 }
 
 void WSwan_MemoryStateAction(StateMem *sm, const unsigned load, const bool data_only)
@@ -1048,6 +1240,7 @@ void WSwan_MemoryStateAction(StateMem *sm, const unsigned load, const bool data_
   SFVAR(SoundDMALengthSaved),
   SFVAR(SoundDMAControl),
   SFVAR(SoundDMATimer),
+  SFVAR(SoundDMANextTS),
 
   SFVAR(BankSelector),
 
@@ -1058,6 +1251,11 @@ void WSwan_MemoryStateAction(StateMem *sm, const unsigned load, const bool data_
   SFEND
  };
 
+ if(!load)
+  SoundDMATimer = (SoundDMAControl & 0x80) ? std::min<uint32>(5, (SoundDMANextTS - std::min<uint32>(SoundDMANextTS, v30mz_timestamp)) / 128) : 0;
+ else
+  SoundDMANextTS = WSEVENT_NEVER;
+
  MDFNSS_StateAction(sm, load, data_only, StateRegs, "MEMR");
 
  if(load)
@@ -1093,10 +1291,16 @@ void WSwan_MemoryStateAction(StateMem *sm, const unsigned load, const bool data_
   SoundDMALength &= 0x000FFFFF;
   SoundDMALengthSaved &= 0x000FFFFF;
 
+  if(SoundDMANextTS == WSEVENT_NEVER)
+   SoundDMANextTS = v30mz_timestamp + 128 * (SoundDMATimer + 1);
+  ScheduleSoundDMA();
+
   for(uint32 A = 0xfe00; A <= 0xFFFF; A++)
   {
    WSwan_GfxWSCPaletteRAMWrite(A, wsRAM[A]);
   }
+
+  WSwan_MemoryUpdatePages();
  }
 }
 
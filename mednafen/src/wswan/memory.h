@@ -22,9 +22,13 @@ void WSwan_MemoryLoadNV(void);
 void WSwan_MemorySaveNV(void);
 
 void WSwan_UpdateButtonReadLatch(void);
-void WSwan_CheckSoundDMA(void);
+void WSwan_SoundDMAEvent(uint32 timestamp);
+void WSwan_MemoryResetTS(uint32 timestamp);
 void WSwan_MemoryStateAction(StateMem *sm, const unsigned load, const bool data_only);
 void WSwan_MemoryReset(void);
+void WSwan_MemoryUpdatePages(void);
+int WSwan_MemoryResolve(uint32 A, bool write, uint32* offset);
+uint32 WSwan_MemoryGetSpaceSize(unsigned space);
 MDFN_FASTCALL void WSwan_writeport(uint32 IOPort, uint8 V);
 MDFN_FASTCALL uint8 WSwan_readport(uint32 number);
 
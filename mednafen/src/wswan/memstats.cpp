@@ -0,0 +1,270 @@
+/* Mednafen - Multi-system Emulator
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+//
+// Memory access statistics: read/write/execute counts per 16-byte block of RAM, cartridge SRAM and ROM(PSRAM on nileswan)
+// and per I/O port, for the memory debugger's heatmap, plus per-frame access totals for each bus master.  CPU accesses
+// come from the bus hook in the CPU core, which sends every access through the memory handlers while it's set, so
+// counting is only on while the heatmap or wswan.memstats wants it.  DMA and sound DMA are counted in memory.cpp.
+//
+
+#include "wswan.h"
+#include "v30mz.h"
+#include "memory.h"
+#include "memstats.h"
+#include <mednafen/FileStream.h>
+#include <mednafen/string/string.h>
+
+namespace MDFN_IEN_WSWAN
+{
+
+enum : uint32 { BLOCK_SHIFT = 4 };
+
+struct BlockCounts
+{
+ uint64 reads;
+ uint64 writes;
+ uint64 execs;
+};
+
+// Bytes accessed during one frame.  DMA doesn't take bus cycles from the CPU in this emulator, so there are no cycle
+// counts to report for it.
+struct FrameCounts
+{
+ uint32 cycles;
+ uint32 cpu[5];		// Indexed by V30MZ_BUS_*.
+ uint32 gdma;
+ uint32 sdma;
+};
+
+static const char* const SpaceNames[MEMSTATS__COUNT] = { "ram", "sram", "rom", "ports" };
+
+bool WSwan_MemStatsActive = false;
+static bool SettingEnabled, DebuggerEnabled;
+static std::string OutPath;
+static std::vector<BlockCounts> Blocks[MEMSTATS__COUNT];
+static uint32 SpaceSize[MEMSTATS__COUNT];	// Powers of 2, or 0.
+static std::vector<FrameCounts> Frames;
+static FrameCounts CurFrame;
+
+static INLINE unsigned BlockShift(unsigned space)
+{
+ return (space == MEMSTATS_PORTS) ? 0 : BLOCK_SHIFT;
+}
+
+static INLINE void Count(unsigned space, uint32 offset, unsigned type)
+{
+ const uint32 block = offset >> BlockShift(space);
+
+ if(MDFN_UNLIKELY(block >= Blocks[space].size()))
+  return;
+
+ BlockCounts* b = &Blocks[space][block];
+
+ if(type == V30MZ_BUS_FETCH)
+  b->execs++;
+ else if(type == V30MZ_BUS_WRITE || type == V30MZ_BUS_PORT_WRITE)
+  b->writes++;
+ else
+  b->reads++;
+}
+
+static void BusHook(uint32 addr, unsigned type)
+{
+ uint32 offset;
+ int space;
+
+ CurFrame.cpu[type]++;
+
+ if(type == V30MZ_BUS_PORT_READ || type == V30MZ_BUS_PORT_WRITE)
+ {
+  space = MEMSTATS_PORTS;
+  offset = addr & 0xFF;
+ }
+ else
+  space = WSwan_MemoryResolve(addr, type == V30MZ_BUS_WRITE, &offset);
+
+ if(space >= 0)
+  Count(space, offset, type);
+}
+
+void WSwan_MemStatsDMAAccess(unsigned master, uint32 A, bool write)
+{
+ uint32 offset;
+ const int space = WSwan_MemoryResolve(A, write, &offset);
+
+ if(master == MEMSTATS_SDMA)
+  CurFrame.sdma++;
+ else
+  CurFrame.gdma++;
+
+ if(space >= 0)
+  Count(space, offset, write ? V30MZ_BUS_WRITE : V30MZ_BUS_READ);
+}
+
+static void Update(void)
+{
+ const bool active = SettingEnabled || DebuggerEnabled;
+
+ if(active && Blocks[MEMSTATS_RAM].empty())
+ {
+  for(unsigned space = 0; space < MEMSTATS__COUNT; space++)
+  {
+   SpaceSize[space] = (space == MEMSTATS_PORTS) ? 256 : WSwan_MemoryGetSpaceSize(space);
+   Blocks[space].assign(SpaceSize[space] >> BlockShift(space), BlockCounts({ 0, 0, 0 }));
+  }
+ }
+
+ if(active != WSwan_MemStatsActive)
+ {
+  memset(&CurFrame, 0, sizeof(CurFrame));
+  v30mz_set_bus_hook(active ? BusHook : NULL);
+ }
+
+ WSwan_MemStatsActive = active;
+}
+
+void WSwan_MemStatsEnable(bool enable)
+{
+ DebuggerEnabled = enable;
+ Update();
+}
+
+void WSwan_MemStatsClear(void)
+{
+ for(unsigned space = 0; space < MEMSTATS__COUNT; space++)
+  std::fill(Blocks[space].begin(), Blocks[space].end(), BlockCounts({ 0, 0, 0 }));
+
+ Frames.clear();
+ memset(&CurFrame, 0, sizeof(CurFrame));
+}
+
+void WSwan_MemStatsFrame(uint32 timestamp)
+{
+ if(!WSwan_MemStatsActive)
+  return;
+
+ CurFrame.cycles = timestamp;
+ Frames.push_back(CurFrame);
+ memset(&CurFrame, 0, sizeof(CurFrame));
+}
+
+bool WSwan_MemStatsGet(const char* name, uint32 Address, uint32 Length, uint64* reads, uint64* writes, uint64* execs)
+{
+ unsigned space = 0;
+
+ while(space < MEMSTATS__COUNT && strcmp(name, SpaceNames[space]))
+  space++;
+
+ if(space == MEMSTATS__COUNT || Blocks[space].empty())
+  return false;
+
+ for(uint32 i = 0; i < Length; i++)
+ {
+  const BlockCounts& b = Blocks[space][((Address + i) & (SpaceSize[space] - 1)) >> BlockShift(space)];
+
+  reads[i] = b.reads;
+  writes[i] = b.writes;
+  execs[i] = b.execs;
+ }
+
+ return true;
+}
+
+//
+// "path" gets one line per block that was accessed, and "path" with ".csv" replaced by "-frames.csv" one line per frame.
+//
+void WSwan_MemStatsWriteCSV(const char* path)
+{
+ std::string frames_path = path;
+
+ if(frames_path.size() >= 4 && !MDFN_strazicmp(frames_path.c_str() + frames_path.size() - 4, ".csv"))
+  frames_path.resize(frames_path.size() - 4);
+
+ frames_path += "-frames.csv";
+
+ {
+  FileStream fp(path, FileStream::MODE_WRITE);
+
+  fp.print_format("space,address,reads,writes,executes\n");
+
+  for(unsigned space = 0; space < MEMSTATS__COUNT; space++)
+  {
+   for(size_t block = 0; block < Blocks[space].size(); block++)
+   {
+    const BlockCounts& b = Blocks[space][block];
+
+    if(b.reads || b.writes || b.execs)
+     fp.print_format("%s,0x%06X,%llu,%llu,%llu\n", SpaceNames[space], (unsigned)(block << BlockShift(space)), (unsigned long long)b.reads, (unsigned long long)b.writes, (unsigned long long)b.execs);
+   }
+  }
+
+  fp.close();
+ }
+
+ {
+  FileStream fp(frames_path, FileStream::MODE_WRITE);
+
+  fp.print_format("frame,cycles,cpu_reads,cpu_writes,cpu_fetches,cpu_port_reads,cpu_port_writes,dma_bytes,sound_dma_bytes\n");
+
+  for(size_t i = 0; i < Frames.size(); i++)
+  {
+   const FrameCounts& f = Frames[i];
+
+   fp.print_format("%llu,%u,%u,%u,%u,%u,%u,%u,%u\n", (unsigned long long)i, f.cycles, f.cpu[V30MZ_BUS_READ], f.cpu[V30MZ_BUS_WRITE], f.cpu[V30MZ_BUS_FETCH], f.cpu[V30MZ_BUS_PORT_READ], f.cpu[V30MZ_BUS_PORT_WRITE], f.gdma, f.sdma);
+  }
+
+  fp.close();
+ }
+}
+
+void WSwan_MemStatsInit(const std::string& path)
+{
+ WSwan_MemStatsKill();
+
+ OutPath = path;
+ SettingEnabled = true;
+ Update();
+}
+
+void WSwan_MemStatsSave(void)
+{
+ if(!SettingEnabled)
+  return;
+
+ WSwan_MemStatsWriteCSV(OutPath.c_str());
+
+ MDFN_printf(_("Memory access statistics for %u frames written to \"%s\".\n"), (unsigned)Frames.size(), MDFN_strhumesc(OutPath).c_str());
+}
+
+void WSwan_MemStatsKill(void)
+{
+ SettingEnabled = DebuggerEnabled = false;
+ Update();
+
+ for(unsigned space = 0; space < MEMSTATS__COUNT; space++)
+ {
+  Blocks[space].clear();
+  Blocks[space].shrink_to_fit();
+  SpaceSize[space] = 0;
+ }
+
+ Frames.clear();
+ Frames.shrink_to_fit();
+}
+
+}
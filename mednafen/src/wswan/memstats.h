@@ -0,0 +1,63 @@
+/* Mednafen - Multi-system Emulator
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef __WSWAN_MEMSTATS_H
+#define __WSWAN_MEMSTATS_H
+
+namespace MDFN_IEN_WSWAN
+{
+
+// Address spaces with access counters; see WSwan_MemoryResolve().
+enum
+{
+ MEMSTATS_RAM = 0,
+ MEMSTATS_SRAM,
+ MEMSTATS_ROM,		// PSRAM on nileswan.
+ MEMSTATS_PORTS,
+ MEMSTATS__COUNT
+};
+
+// Bus masters, for the per-frame totals.
+enum
+{
+ MEMSTATS_CPU = 0,
+ MEMSTATS_GDMA,
+ MEMSTATS_SDMA
+};
+
+void WSwan_MemStatsInit(const std::string& path) MDFN_COLD;
+void WSwan_MemStatsSave(void) MDFN_COLD;
+void WSwan_MemStatsKill(void) MDFN_COLD;
+
+void WSwan_MemStatsEnable(bool enable);
+void WSwan_MemStatsClear(void);
+void WSwan_MemStatsFrame(uint32 timestamp);
+bool WSwan_MemStatsGet(const char* name, uint32 Address, uint32 Length, uint64* reads, uint64* writes, uint64* execs);
+void WSwan_MemStatsWriteCSV(const char* path);
+
+MDFN_HIDE extern bool WSwan_MemStatsActive;
+void WSwan_MemStatsDMAAccess(unsigned master, uint32 A, bool write);
+
+static INLINE void WSwan_MemStatsDMA(unsigned master, uint32 A, bool write)
+{
+ if(MDFN_UNLIKELY(WSwan_MemStatsActive))
+  WSwan_MemStatsDMAAccess(master, A, write);
+}
+
+}
+
+#endif
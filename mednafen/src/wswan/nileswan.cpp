@@ -2,6 +2,9 @@
 #include "memory.h"
 #include "comm.h"
 #include "rtc.h"
+#include "interrupt.h"
+#include "v30mz.h"
+#include "gfx.h"
 #include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -20,14 +23,23 @@ extern uint32_t rom_size;
 }
 using namespace MDFN_IEN_WSWAN;
 
-extern FILE *file_flash;
-extern FILE *file_tf;
+extern nile_image_t *image_flash;
+extern nile_image_t *image_tf;
 
 static uint16_t bank_rom0, bank_rom1, bank_romL, bank_ram;
 static uint8_t flash_enable;
 static uint8_t nile_pow_cnt, nile_emu_cnt;
 static uint16_t nile_spi_cnt, nile_bank_mask;
 static int8_t nile_fpga_core;
+static uint8_t nile_irq_enable, nile_irq_status;
+
+/* SPI transfers complete at nile_spi_done_ts, in v30mz_timestamp cycles. */
+static bool nile_spi_pending;
+static uint32_t nile_spi_done_ts;
+
+/* USB frames start every nile_usb_frame_cycles; the next one is at nile_usb_frame_ts. */
+static uint32_t nile_usb_frame_cycles = NILE_CPU_CLOCK_HZ / 1000;
+static uint32_t nile_usb_frame_ts;
 
 enum
 {
@@ -42,17 +54,48 @@ enum
 
 static uint8_t nile_ww_state;
 
-void spi_buffer_push(nile_spi_device_buffer_t *buffer, const uint8_t *data, uint32_t length) {
-    if (buffer->pos + length >= SPI_DEVICE_BUFFER_SIZE_BYTES) {
-        printf("nileswan/spi: !!! BUFFER OVERRUN !!! (%d + %d >= %d)\n", buffer->pos, length, SPI_DEVICE_BUFFER_SIZE_BYTES);
-        exit(1);
+bool spi_buffer_push(nile_spi_device_buffer_t *buffer, const uint8_t *data, uint32_t length) {
+    bool result = true;
+    if (buffer->pos + length > SPI_DEVICE_BUFFER_SIZE_BYTES) {
+        NILE_TRACE(NILE_TRACE_SPI, NILE_TRACE_ERROR, "!!! BUFFER OVERRUN !!! (%d + %d > %d), dropping excess bytes", buffer->pos, length, SPI_DEVICE_BUFFER_SIZE_BYTES);
+        length = SPI_DEVICE_BUFFER_SIZE_BYTES - buffer->pos;
+        result = false;
+    }
+
+    uint32_t tail = (buffer->head + buffer->pos) & SPI_DEVICE_BUFFER_MASK_BYTES;
+    uint32_t first_length = SPI_DEVICE_BUFFER_SIZE_BYTES - tail;
+    if (first_length > length) {
+        first_length = length;
     }
     if (data != NULL) {
-        memcpy(buffer->data + buffer->pos, data, length);
+        memcpy(buffer->data + tail, data, first_length);
+        memcpy(buffer->data, data + first_length, length - first_length);
     } else {
-        memset(buffer->data + buffer->pos, 0xFF, length);
+        memset(buffer->data + tail, 0xFF, first_length);
+        memset(buffer->data, 0xFF, length - first_length);
     }
     buffer->pos += length;
+    return result;
+}
+
+uint32_t spi_buffer_peek_bytes(const nile_spi_device_buffer_t *buffer, uint32_t offset, uint8_t *data, uint32_t length) {
+    uint32_t copy_length = 0;
+    if (offset < buffer->pos) {
+        copy_length = buffer->pos - offset;
+        if (copy_length > length) {
+            copy_length = length;
+        }
+    }
+
+    uint32_t start = (buffer->head + offset) & SPI_DEVICE_BUFFER_MASK_BYTES;
+    uint32_t first_length = SPI_DEVICE_BUFFER_SIZE_BYTES - start;
+    if (first_length > copy_length) {
+        first_length = copy_length;
+    }
+    memcpy(data, buffer->data + start, first_length);
+    memcpy(data + first_length, buffer->data, copy_length - first_length);
+    memset(data + copy_length, 0xFF, length - copy_length);
+    return copy_length;
 }
 
 bool spi_buffer_pop(nile_spi_device_buffer_t *buffer, uint8_t *data, uint32_t length) {
@@ -61,19 +104,11 @@ bool spi_buffer_pop(nile_spi_device_buffer_t *buffer, uint8_t *data, uint32_t le
         copy_length = buffer->pos;
     }
 
-    buffer->pos -= copy_length;
-    length -= copy_length;
     if (data != NULL) {
-        memcpy(data, buffer->data, copy_length);
-        data += copy_length;
-        while (length > 0) {
-            *(data++) = 0xFF;
-            length--;
-        }
-    }
-    if (buffer->pos > 0) {
-        memmove(buffer->data, buffer->data + copy_length, buffer->pos);
+        spi_buffer_peek_bytes(buffer, 0, data, length);
     }
+    buffer->head = (buffer->head + copy_length) & SPI_DEVICE_BUFFER_MASK_BYTES;
+    buffer->pos -= copy_length;
     return copy_length > 0;
 }
 
@@ -85,11 +120,27 @@ bool spi_buffer_pop(nile_spi_device_buffer_t *buffer, uint8_t *data, uint32_t le
 #define SRAM_MASK_BYTES (SRAM_SIZE_BYTES - 1)
 #define SPI_BUFFER_SIZE_BYTES 512
 #define SPI_BUFFER_MASK_BYTES (SPI_BUFFER_SIZE_BYTES - 1)
+#define MEMORY_FILL_VALUE 0xFF
 
 uint8_t *nile_psram, *nile_sram;
 uint32_t nile_psram_size, nile_sram_size;
 static bool nileswan_initialized = false;
 
+/*
+ * 64 KiB bank bitmaps. A bank is set in the map once it holds data other than the power-on
+ * fill; only mapped banks are saved in save states. The dirty set records banks written
+ * since the last save state and is folded into the map, then cleared, by each save.
+ * Clean, unmapped banks are left out of the CPU page table for writes, so the first write
+ * to one goes through nileswan_cart_write() and marks it.
+ */
+static uint8_t nile_psram_map[(PSRAM_MAX_BANK + 1) / 8];
+static uint8_t nile_sram_map[(SRAM_MAX_BANK + 1) / 8];
+static uint8_t nile_psram_dirty[(PSRAM_MAX_BANK + 1) / 8];
+static uint8_t nile_sram_dirty[(SRAM_MAX_BANK + 1) / 8];
+
+#define BANK_TEST(bitmap, bank) ((bitmap)[(bank) >> 3] & (1 << ((bank) & 7)))
+#define BANK_SET(bitmap, bank) ((bitmap)[(bank) >> 3] |= (1 << ((bank) & 7)))
+
 uint8_t nile_ipc[NILE_IPC_SIZE];
 static uint8_t nile_spi_rx[SPI_BUFFER_SIZE_BYTES * 2];
 static uint8_t nile_spi_tx[SPI_BUFFER_SIZE_BYTES * 2];
@@ -113,6 +164,10 @@ void nile_fpga_reset(void) {
     nile_bank_mask = 0xFFFF;
     nile_emu_cnt = 0;
     nile_ww_state = 0;
+    nile_irq_enable = 0;
+    nile_irq_status = 0;
+    nile_spi_pending = false;
+    WSwan_InterruptAssert(WSINT_RTC_ALARM, false);
 
     memset(&nile_ipc, 0, sizeof(nile_ipc));
 }
@@ -129,6 +184,12 @@ bool nileswan_init(void) {
         nile_psram_size = PSRAM_SIZE_BYTES;
         nile_sram = (uint8_t*) malloc(SRAM_SIZE_BYTES);
         nile_sram_size = SRAM_SIZE_BYTES;
+        memset(nile_psram, MEMORY_FILL_VALUE, PSRAM_SIZE_BYTES);
+        memset(nile_sram, MEMORY_FILL_VALUE, SRAM_SIZE_BYTES);
+        memset(nile_psram_map, 0, sizeof(nile_psram_map));
+        memset(nile_sram_map, 0, sizeof(nile_sram_map));
+        memset(nile_psram_dirty, 0, sizeof(nile_psram_dirty));
+        memset(nile_sram_dirty, 0, sizeof(nile_sram_dirty));
     }
     nileswan_initialized = true;
 
@@ -140,19 +201,85 @@ void nileswan_quit(void) {
         return;
     }
     nileswan_initialized = false;
+    nile_image_close(image_flash);
+    image_flash = NULL;
+    nile_image_close(image_tf);
+    image_tf = NULL;
     free(nile_psram);
     free(nile_sram);
+    nile_trace_kill();
 }
 
 void nileswan_open_spi(const char *path) {
-    file_flash = fopen(path, "r+b");
+    nile_image_close(image_flash);
+    image_flash = nile_image_open(path, false, SPI_FLASH_SIZE_BYTES);
+}
+
+void nileswan_open_tf(const char *path, bool copy_on_write) {
+    nile_image_close(image_tf);
+    image_tf = nile_image_open(path, copy_on_write, 0);
+}
+
+void nileswan_flush(void) {
+    nile_image_flush(image_flash);
+    nile_image_flush(image_tf);
+    nile_trace_frame_end();
+}
+
+/* === SPI transfer timing === */
+
+static void irq_update(void) {
+    // the cartridge IRQ line is wired to the RTC alarm interrupt
+    WSwan_InterruptAssert(WSINT_RTC_ALARM, (nile_irq_status & nile_irq_enable) != 0);
+}
+
+static uint32_t spi_transfer_cycles(uint32_t bytes) {
+    uint32_t clock = (nile_spi_cnt & NILE_SPI_390KHZ) ? NILE_SPI_CLOCK_SLOW_HZ : NILE_SPI_CLOCK_FAST_HZ;
+    return ((uint64_t) bytes * 8 * NILE_CPU_CLOCK_HZ + clock - 1) / clock;
+}
+
+static void spi_complete(void) {
+    nile_spi_pending = false;
+    nile_spi_cnt &= ~NILE_SPI_BUSY;
+    if ((nile_spi_cnt & NILE_SPI_DEV_MASK) == NILE_SPI_DEV_MCU && nile_spi_mcu_has_response()) {
+        nile_irq_status |= NILE_IRQ_MCU;
+        irq_update();
+    }
+}
+
+void nileswan_update(uint32_t timestamp) {
+    if (nile_spi_pending && timestamp >= nile_spi_done_ts)
+        spi_complete();
 }
 
-void nileswan_open_tf(const char *path) {
-    file_tf = fopen(path, "r+b");
+void nileswan_reset_ts(uint32_t timestamp) {
+    nileswan_update(timestamp);
+    if (nile_spi_pending)
+        nile_spi_done_ts -= timestamp;
+    nile_usb_frame_ts = nile_usb_frame_ts > timestamp ? nile_usb_frame_ts - timestamp : 0;
 }
 
-/* === IO handling === */
+/* === USB timing === */
+
+void nileswan_configure_usb(uint32_t packet_size, uint32_t frame_interval_us, uint32_t fifo_depth) {
+    nile_usb_frame_cycles = ((uint64_t) frame_interval_us * NILE_CPU_CLOCK_HZ + 999999) / 1000000;
+    nile_spi_mcu_configure_usb(packet_size, fifo_depth);
+}
+
+// WSwan_GfxReset() clears the event table, so this runs after it on every reset.
+void nileswan_start_events(void) {
+    nile_usb_frame_ts = v30mz_timestamp + nile_usb_frame_cycles;
+    WSwan_SetEvent(WSEVENT_NILE_USB, nile_usb_frame_ts);
+}
+
+void nileswan_usb_frame(uint32_t timestamp) {
+    if (nile_spi_mcu_usb_frame()) {
+        nile_irq_status |= NILE_IRQ_MCU;
+        irq_update();
+    }
+    nile_usb_frame_ts = timestamp + nile_usb_frame_cycles;
+    WSwan_SetEvent(WSEVENT_NILE_USB, nile_usb_frame_ts);
+}
 
 static uint32_t get_spi_bank_offset(bool is_swan) {
     bool is_back_buffer = (nile_spi_cnt & NILE_SPI_BUFFER_IDX) != 0;
@@ -172,6 +299,18 @@ static uint8_t spi_exchange(uint8_t tx) {
     }
 }
 
+static void spi_exchange_block(const uint8_t *tx, uint8_t *rx, uint32_t length) {
+    if ((nile_spi_cnt & NILE_SPI_DEV_MASK) == NILE_SPI_DEV_TF) {
+        nile_spi_tf_exchange_block(tx, rx, length);
+    } else if ((nile_spi_cnt & NILE_SPI_DEV_MASK) == NILE_SPI_DEV_FLASH) {
+        nile_spi_flash_exchange_block(tx, rx, length);
+    } else if ((nile_spi_cnt & NILE_SPI_DEV_MASK) == NILE_SPI_DEV_MCU) {
+        nile_spi_mcu_exchange_block(tx, rx, length);
+    } else if (rx != NULL) {
+        memset(rx, 0xFF, length);
+    }
+}
+
 static void spi_cnt_update(uint16_t prev_spi_cnt) {
     if (!(nile_spi_cnt & NILE_SPI_390KHZ) && !(nile_pow_cnt & NILE_POW_CLOCK))
         return;
@@ -193,51 +332,46 @@ static void spi_cnt_update(uint16_t prev_spi_cnt) {
         uint8_t *rx_buffer = nile_spi_rx + get_spi_bank_offset(false);
         uint32_t length = (nile_spi_cnt & 0x1FF) + 1;
         uint32_t pos = 0;
+        uint32_t bytes_skipped = 0;
         uint16_t mode = nile_spi_cnt & NILE_SPI_MODE_MASK;
         if (mode == NILE_SPI_MODE_WAIT_READ) {
             int32_t timeout = 8192;
-            uint32_t bytes_skipped = 0;
             while (--timeout) {
                 if ((rx_buffer[0] = spi_exchange(0xFF)) != 0xFF)
                     break;
                 bytes_skipped++;
             }
             if (timeout <= 0) {
-                printf("nileswan/spi: !!! WAIT_READ timeout for %s !!!\n", device_name);
+                NILE_TRACE(NILE_TRACE_SPI, NILE_TRACE_ERROR, "!!! WAIT_READ timeout for %s !!!", device_name);
                 return;
             } else if (bytes_skipped > 0) {
-                printf("nileswan/spi: skipped %d bytes\n", bytes_skipped);
+                NILE_TRACE(NILE_TRACE_SPI, NILE_TRACE_DEBUG, "skipped %d bytes", bytes_skipped);
             }
             pos++;
         }
         bool mode_reads = mode != NILE_SPI_MODE_WRITE;
         bool mode_writes = mode == NILE_SPI_MODE_WRITE || mode == NILE_SPI_MODE_EXCH;
-        for (; pos < length; pos++) {
-            uint8_t rx = spi_exchange(mode_writes ? tx_buffer[pos] : 0xFF);
-            if (mode_reads) rx_buffer[pos] = rx;
-        }
-        printf("nileswan/spi: %s %d bytes %s %s",
-            mode_reads ? (mode_writes ? "exchanging" : "reading") : (mode_writes ? "writing" : "???"),
-            length,
-            mode_reads ? (mode_writes ? "with" : "from") : (mode_writes ? "to" : "with"),
-            device_name
-        );
-        if (mode_writes) {
-            printf(" [%02x", tx_buffer[0]);
-            for(pos = 1; pos < length; pos++)
-                printf(" %02x", tx_buffer[pos]);
-            printf("]");
+        if (pos < length) {
+            spi_exchange_block(mode_writes ? tx_buffer + pos : NULL,
+                mode_reads ? rx_buffer + pos : NULL,
+                length - pos);
         }
-        if (mode_reads) {
-            printf(" [%02x", rx_buffer[0]);
-            for(pos = 1; pos < length; pos++)
-                printf(" %02x", rx_buffer[pos]);
-            printf("]");
+        if (nile_trace_enabled(NILE_TRACE_SPI, NILE_TRACE_DEBUG)) {
+            nile_trace_printf(NILE_TRACE_SPI, NILE_TRACE_DEBUG, "%s %d bytes %s %s",
+                mode_reads ? (mode_writes ? "exchanging" : "reading") : (mode_writes ? "writing" : "???"),
+                length,
+                mode_reads ? (mode_writes ? "with" : "from") : (mode_writes ? "to" : "with"),
+                device_name
+            );
+            if (mode_writes)
+                nile_trace_hexdump(NILE_TRACE_SPI, NILE_TRACE_DEBUG, tx_buffer, length);
+            if (mode_reads)
+                nile_trace_hexdump(NILE_TRACE_SPI, NILE_TRACE_DEBUG, rx_buffer, length);
         }
-        printf("\n");
-        nile_spi_cnt = nile_spi_cnt & ~NILE_SPI_BUSY;
+        nile_spi_pending = true;
+        nile_spi_done_ts = v30mz_timestamp + spi_transfer_cycles(length + bytes_skipped);
+        WSwan_SetEvent(WSEVENT_NILE_SPI, nile_spi_done_ts);
     }
-    fflush(stdout);
 }
 
 static void pow_cnt_update(uint8_t new_value) {
@@ -248,7 +382,7 @@ static void pow_cnt_update(uint8_t new_value) {
     }
     if (!(old_value & NILE_POW_MCU_RESET) && (new_value & NILE_POW_MCU_RESET)) {
         bool bootloader_mode = (new_value & NILE_POW_MCU_BOOT0) != 0;
-        printf("nileswan/mcu: reset, in %s mode\n", bootloader_mode ? "bootloader" : "native");
+        NILE_TRACE(NILE_TRACE_MCU, NILE_TRACE_INFO, "reset, in %s mode", bootloader_mode ? "bootloader" : "native");
         nile_spi_mcu_reset(true, bootloader_mode);
     }
 }
@@ -291,17 +425,51 @@ uint8_t nileswan_io_read(uint32_t index, bool is_debugger) {
         case IO_NILE_SEG_MASK + 1:
             return nile_bank_mask >> 8;
         case IO_NILE_SPI_CNT:
+            nileswan_update(v30mz_timestamp);
             return nile_spi_cnt;
         case IO_NILE_SPI_CNT + 1:
+            nileswan_update(v30mz_timestamp);
             return nile_spi_cnt >> 8;
         case IO_NILE_EMU_CNT:
             return nile_emu_cnt;
         case IO_NILE_BOARD_REVISION:
             return NILE_EMULATED_BOARD_REVISION;
+        case IO_NILE_IRQ_ENABLE:
+            return nile_irq_enable;
+        case IO_NILE_IRQ_STATUS:
+            return nile_irq_status;
     }
     return 0x00;
 }
 
+/*
+ * Whether a write to a port can change what resolve_bank() maps, and so the CPU page table.
+ * SPI, IRQ and RTC registers leave it alone.
+ */
+static bool io_changes_mapping(uint32_t index) {
+    switch (index) {
+        case IO_CART_FLASH:
+        case IO_BANK_ROM_LINEAR:
+        case IO_BANK_2003_ROM_LINEAR:
+        case IO_BANK_RAM:
+        case IO_BANK_2003_RAM:
+        case IO_BANK_2003_RAM+1:
+        case IO_BANK_ROM0:
+        case IO_BANK_2003_ROM0:
+        case IO_BANK_2003_ROM0+1:
+        case IO_BANK_ROM1:
+        case IO_BANK_2003_ROM1:
+        case IO_BANK_2003_ROM1+1:
+        case IO_NILE_POW_CNT:
+        case IO_NILE_WARMBOOT_CNT:
+        case IO_NILE_SEG_MASK:
+        case IO_NILE_SEG_MASK + 1:
+        case IO_NILE_EMU_CNT:
+            return true;
+    }
+    return false;
+}
+
 void nileswan_io_write(uint32_t index, uint8_t value) {
     if((index == 0xCA || index == 0xCB) && (nile_pow_cnt & NILE_POW_IO_2003))
         RTC_Write(index, value);
@@ -357,7 +525,7 @@ void nileswan_io_write(uint32_t index, uint8_t value) {
             break;
         case IO_NILE_WARMBOOT_CNT:
             nile_fpga_core = value & 0x3;
-            printf("nileswan/fpga: warmboot to core %d\n", nile_fpga_core);
+            NILE_TRACE(NILE_TRACE_FPGA, NILE_TRACE_INFO, "warmboot to core %d", nile_fpga_core);
             nile_fpga_reset();
             break;
         case IO_NILE_SEG_MASK:
@@ -370,9 +538,10 @@ void nileswan_io_write(uint32_t index, uint8_t value) {
             break;
         case IO_NILE_SPI_CNT: {
             if(!(nile_pow_cnt & NILE_POW_IO_NILE)) break;
+            nileswan_update(v30mz_timestamp);
             uint16_t new_nile_spi_cnt = (nile_spi_cnt & 0xFF00) | value;
             if (nile_spi_cnt & NILE_SPI_BUSY) {
-                printf("nileswan/spi: BUG trying to write to SPI control while transfer active (control %04X => %04X)\n",
+                NILE_TRACE(NILE_TRACE_SPI, NILE_TRACE_ERROR, "BUG trying to write to SPI control while transfer active (control %04X => %04X)",
                     nile_spi_cnt, new_nile_spi_cnt);
                 break;
             }
@@ -380,24 +549,39 @@ void nileswan_io_write(uint32_t index, uint8_t value) {
         } break;
         case IO_NILE_SPI_CNT + 1: {
             if(!(nile_pow_cnt & NILE_POW_IO_NILE)) break;
+            nileswan_update(v30mz_timestamp);
             uint16_t new_nile_spi_cnt = (nile_spi_cnt & 0xFF) | (value << 8);
             if (nile_spi_cnt != new_nile_spi_cnt && (new_nile_spi_cnt | NILE_SPI_BUSY) == nile_spi_cnt) {
-                printf("nileswan/spi: abort\n");
+                NILE_TRACE(NILE_TRACE_SPI, NILE_TRACE_INFO, "abort");
             } else if (nile_spi_cnt & NILE_SPI_BUSY) {
-                printf("nileswan/spi: BUG trying to write to SPI control while transfer active (control %04X => %04X)\n",
+                NILE_TRACE(NILE_TRACE_SPI, NILE_TRACE_ERROR, "BUG trying to write to SPI control while transfer active (control %04X => %04X)",
                     nile_spi_cnt, new_nile_spi_cnt);
                 break;
             }
             uint16_t old_spi_cnt = nile_spi_cnt;
             nile_spi_cnt = new_nile_spi_cnt;
-            printf("nileswan/spi: control = %04X\n", nile_spi_cnt);
+            nile_spi_pending = false;
+            NILE_TRACE(NILE_TRACE_SPI, NILE_TRACE_DEBUG, "control = %04X", nile_spi_cnt);
             spi_cnt_update(old_spi_cnt);
         } break;
         case IO_NILE_EMU_CNT:
             if(!(nile_pow_cnt & NILE_POW_IO_NILE)) break;
             nile_emu_cnt = value & 0x1F;
             break;
+        case IO_NILE_IRQ_ENABLE:
+            if(!(nile_pow_cnt & NILE_POW_IO_NILE)) break;
+            nile_irq_enable = value & NILE_IRQ_MCU;
+            irq_update();
+            break;
+        case IO_NILE_IRQ_STATUS:
+            if(!(nile_pow_cnt & NILE_POW_IO_NILE)) break;
+            nile_irq_status &= ~value;
+            irq_update();
+            break;
     }
+
+    if (io_changes_mapping(index))
+        WSwan_MemoryUpdatePages();
 }
 
 static inline void resolve_bank(uint32_t address, uint8_t **buffer, bool write, bool is_debugger) {
@@ -472,9 +656,76 @@ uint8_t nileswan_cart_read(uint32_t index, bool is_debugger) {
     }
 }
 
+static bool bank_has_data(const uint8_t *buffer) {
+    if (buffer >= nile_psram && buffer < nile_psram + PSRAM_SIZE_BYTES) {
+        uint32_t bank = (buffer - nile_psram) >> 16;
+        return BANK_TEST(nile_psram_map, bank) || BANK_TEST(nile_psram_dirty, bank);
+    }
+    if (buffer >= nile_sram && buffer < nile_sram + SRAM_SIZE_BYTES) {
+        uint32_t bank = (buffer - nile_sram) >> 16;
+        return BANK_TEST(nile_sram_map, bank) || BANK_TEST(nile_sram_dirty, bank);
+    }
+    return true;
+}
+
+/*
+ * Report the backing byte for a cartridge address without side effects, or NULL if there is none.
+ */
+uint8_t *nileswan_cart_resolve(uint32_t index, bool write) {
+    uint8_t *buffer;
+    resolve_bank(index, &buffer, write, false);
+    return buffer;
+}
+
+/*
+ * Report a CPU bank that maps linearly onto PSRAM or SRAM, for the CPU page table.
+ * Banks with side effects or mirroring are left NULL and go through the cart handlers.
+ */
+void nileswan_get_page(uint32_t cpu_bank, uint8_t **read_ptr, uint8_t **write_ptr) {
+    uint8_t *buffer;
+
+    *read_ptr = NULL;
+    *write_ptr = NULL;
+    if (cpu_bank == 1 && (nile_emu_cnt & NILE_EMU_FLASH_FSM) && flash_enable)
+        return;
+
+    resolve_bank(cpu_bank << 16, &buffer, true, false);
+    if (buffer == NULL)
+        return;
+    bool is_linear = (buffer >= nile_psram && buffer < nile_psram + PSRAM_SIZE_BYTES)
+        || (buffer >= nile_sram && buffer < nile_sram + SRAM_SIZE_BYTES && !(nile_emu_cnt & NILE_EMU_SRAM_32KB));
+    if (!is_linear)
+        return;
+
+    *read_ptr = buffer;
+    // direct writes would bypass the dirty tracking, so clean banks trap their first write
+    if (bank_has_data(buffer))
+        *write_ptr = buffer;
+}
+
+/*
+ * Record a CPU, DMA or debugger write to the byte at buffer.
+ */
+void nileswan_mark_written(const uint8_t *buffer) {
+    if (bank_has_data(buffer))
+        return;
+
+    if (buffer >= nile_psram && buffer < nile_psram + PSRAM_SIZE_BYTES)
+        BANK_SET(nile_psram_dirty, (buffer - nile_psram) >> 16);
+    else if (buffer >= nile_sram && buffer < nile_sram + SRAM_SIZE_BYTES)
+        BANK_SET(nile_sram_dirty, (buffer - nile_sram) >> 16);
+    else
+        return;
+
+    // the bank is now writable through the page table
+    WSwan_MemoryUpdatePages();
+}
+
 void nileswan_cart_write(uint32_t index, uint8_t value) {
     uint8_t *buffer;
     resolve_bank(index, &buffer, true, false);
+    if (buffer != NULL)
+        nileswan_mark_written(buffer);
     if ((nile_emu_cnt & NILE_EMU_FLASH_FSM) && flash_enable && (index & 0xF0000) == 0x10000) {
       if (nile_ww_state == WW_STATE_READ) {
         if (value == 0xAA) nile_ww_state = WW_STATE_UNLOCK_1;
@@ -514,3 +765,102 @@ void nileswan_cart_write(uint32_t index, uint8_t value) {
         *buffer = value;
     }
 }
+
+/* === Save states === */
+
+/*
+ * The bank bitmap goes in the NILE section; this section holds the data of each mapped bank,
+ * in bank order.
+ */
+static void state_action_banks(StateMem *sm, const unsigned load, const bool data_only,
+    uint8_t *memory, const uint8_t *map, uint32_t bank_count, const char *sname) {
+
+    SFORMAT StateRegs[PSRAM_MAX_BANK + 2];
+    char names[PSRAM_MAX_BANK + 1][8];
+    uint32_t count = 0;
+
+    for (uint32_t bank = 0; bank < bank_count; bank++) {
+        if (!BANK_TEST(map, bank))
+            continue;
+        snprintf(names[bank], sizeof(names[bank]), "bank%02X", bank);
+        StateRegs[count++] = SFPTR8N(memory + (bank << 16), 0x10000, SFORMAT::FORM::NVMEM, names[bank]);
+    }
+    StateRegs[count] = SFEND;
+
+    MDFNSS_StateAction(sm, load, data_only, StateRegs, sname);
+}
+
+static void reset_unmapped_banks(uint8_t *memory, const uint8_t *old_map, const uint8_t *old_dirty,
+    const uint8_t *map, uint32_t bank_count) {
+
+    // banks that gained data since the state was made go back to their power-on contents
+    for (uint32_t bank = 0; bank < bank_count; bank++) {
+        if ((BANK_TEST(old_map, bank) || BANK_TEST(old_dirty, bank)) && !BANK_TEST(map, bank))
+            memset(memory + (bank << 16), MEMORY_FILL_VALUE, 0x10000);
+    }
+}
+
+void nileswan_state_action(StateMem *sm, const unsigned load, const bool data_only) {
+    uint8_t psram_map[sizeof(nile_psram_map)];
+    uint8_t sram_map[sizeof(nile_sram_map)];
+
+    if (!load) {
+        for (uint32_t i = 0; i < sizeof(nile_psram_map); i++)
+            nile_psram_map[i] |= nile_psram_dirty[i];
+        for (uint32_t i = 0; i < sizeof(nile_sram_map); i++)
+            nile_sram_map[i] |= nile_sram_dirty[i];
+    }
+    memcpy(psram_map, nile_psram_map, sizeof(psram_map));
+    memcpy(sram_map, nile_sram_map, sizeof(sram_map));
+
+    SFORMAT StateRegs[] = {
+        SFVAR(bank_rom0),
+        SFVAR(bank_rom1),
+        SFVAR(bank_romL),
+        SFVAR(bank_ram),
+        SFVAR(flash_enable),
+        SFVAR(nile_pow_cnt),
+        SFVAR(nile_emu_cnt),
+        SFVAR(nile_spi_cnt),
+        SFVAR(nile_bank_mask),
+        SFVAR(nile_fpga_core),
+        SFVAR(nile_irq_enable),
+        SFVAR(nile_irq_status),
+        SFVAR(nile_spi_pending),
+        SFVAR(nile_spi_done_ts),
+        SFVAR(nile_usb_frame_ts),
+        SFVAR(nile_ww_state),
+        SFVAR(nile_ipc),
+        SFVAR(nile_spi_rx),
+        SFVAR(nile_spi_tx),
+        SFVAR(nile_psram_map),
+        SFVAR(nile_sram_map),
+        SFEND
+    };
+
+    MDFNSS_StateAction(sm, load, data_only, StateRegs, "NILE");
+
+    if (load) {
+        reset_unmapped_banks(nile_psram, psram_map, nile_psram_dirty, nile_psram_map, PSRAM_MAX_BANK + 1);
+        reset_unmapped_banks(nile_sram, sram_map, nile_sram_dirty, nile_sram_map, SRAM_MAX_BANK + 1);
+    }
+
+    state_action_banks(sm, load, data_only, nile_psram, nile_psram_map, PSRAM_MAX_BANK + 1, "NILEPSRM");
+    state_action_banks(sm, load, data_only, nile_sram, nile_sram_map, SRAM_MAX_BANK + 1, "NILESRAM");
+
+    // every save, rewind snapshots included, starts a new dirty set; a load takes the state's map as is
+    memset(nile_psram_dirty, 0, sizeof(nile_psram_dirty));
+    memset(nile_sram_dirty, 0, sizeof(nile_sram_dirty));
+
+    nile_spi_flash_state_action(sm, load, data_only);
+    nile_spi_tf_state_action(sm, load, data_only);
+    nile_spi_mcu_state_action(sm, load, data_only);
+
+    if (load) {
+        WSwan_MemoryUpdatePages();
+        WSwan_SetEvent(WSEVENT_NILE_SPI, nile_spi_pending ? nile_spi_done_ts : WSEVENT_NEVER);
+        if (nile_usb_frame_ts - v30mz_timestamp > nile_usb_frame_cycles)
+            nile_usb_frame_ts = v30mz_timestamp + nile_usb_frame_cycles;
+        WSwan_SetEvent(WSEVENT_NILE_USB, nile_usb_frame_ts);
+    }
+}
@@ -10,18 +10,80 @@
 #define NILE_EMULATED_MCU_MAJOR 1
 #define NILE_EMULATED_MCU_MINOR 0
 
-#define MCU_MAX_PER_USB_CDC_PACKET 128
+/* Full-speed USB bulk endpoints carry at most 64 bytes per packet. */
+#define NILE_USB_PACKET_SIZE_MAX 64
 
 #define TF_STOP_TRANSFER_BUSY_DELAY_BYTES 8
 #define TF_DATA_BLOCK_READ_DELAY_BYTES 16
 
+#define NILE_CPU_CLOCK_HZ 3072000
+#define NILE_SPI_CLOCK_FAST_HZ 25000000
+#define NILE_SPI_CLOCK_SLOW_HZ 390625
+
+#define SPI_FLASH_SIZE_BYTES 0x200000 /* W25Q16 */
+#define SPI_FLASH_PAGE_SIZE_BYTES 256
+
 #define SPI_DEVICE_BUFFER_SIZE_BYTES 4096
+#define SPI_DEVICE_BUFFER_MASK_BYTES (SPI_DEVICE_BUFFER_SIZE_BYTES - 1)
 
+#if (SPI_DEVICE_BUFFER_SIZE_BYTES & SPI_DEVICE_BUFFER_MASK_BYTES) != 0
+#error "SPI_DEVICE_BUFFER_SIZE_BYTES must be a power of two"
+#endif
+
+/* Ring buffer; pos is the number of bytes queued, starting at data[head]. */
 typedef struct {
     uint8_t data[SPI_DEVICE_BUFFER_SIZE_BYTES];
+    uint32_t head;
     uint32_t pos;
 } nile_spi_device_buffer_t;
 
+/* Backing image for the TF card and SPI flash; memory-mapped where possible.
+ * A file shorter than device_size is extended to it with 0xFF bytes, or in memory if it can't be written. */
+typedef struct nile_image nile_image_t;
+
+nile_image_t *nile_image_open(const char *path, bool copy_on_write, uint64_t device_size);
+void nile_image_close(nile_image_t *image);
+uint64_t nile_image_size(const nile_image_t *image);
+uint8_t *nile_image_data(nile_image_t *image);
+void nile_image_read(nile_image_t *image, uint64_t offset, uint8_t *data, uint32_t length);
+void nile_image_write(nile_image_t *image, uint64_t offset, const uint8_t *data, uint32_t length);
+void nile_image_fill(nile_image_t *image, uint64_t offset, uint8_t value, uint32_t length);
+void nile_image_flush(nile_image_t *image);
+
+/* Tracing; records are queued lock-free and written out off the emulation thread. */
+typedef enum {
+    NILE_TRACE_SPI = 0,
+    NILE_TRACE_TF,
+    NILE_TRACE_FLASH,
+    NILE_TRACE_MCU,
+    NILE_TRACE_CDC,
+    NILE_TRACE_FPGA,
+    NILE_TRACE_CATEGORY_COUNT
+} nile_trace_category_t;
+
+#define NILE_TRACE_OFF   0
+#define NILE_TRACE_ERROR 1
+#define NILE_TRACE_INFO  2
+#define NILE_TRACE_DEBUG 3
+
+#define NILE_TRACE_TEXT_SIZE 116
+
+extern uint8_t nile_trace_levels[NILE_TRACE_CATEGORY_COUNT];
+
+void nile_trace_init(const char *spec, const char *path);
+void nile_trace_kill(void);
+void nile_trace_set_log_func(void (*func)(const char *type, const char *text));
+void nile_trace_frame_end(void);
+void nile_trace_printf(uint8_t category, uint8_t level, const char *format, ...) MDFN_FORMATSTR(gnu_printf, 3, 4);
+void nile_trace_hexdump(uint8_t category, uint8_t level, const uint8_t *data, uint32_t length);
+
+#define nile_trace_enabled(category, level) MDFN_UNLIKELY(nile_trace_levels[category] >= (level))
+#define NILE_TRACE(category, level, ...) \
+    do { \
+        if (nile_trace_enabled(category, level)) \
+            nile_trace_printf(category, level, __VA_ARGS__); \
+    } while (0)
+
 extern uint8_t *nile_psram, *nile_sram;
 extern uint32_t nile_psram_size, nile_sram_size;
 #define NILE_IPC_SIZE 512
@@ -31,21 +93,59 @@ bool nileswan_is_active(void);
 bool nileswan_init(void);
 void nileswan_quit(void);
 void nileswan_open_spi(const char *path);
-void nileswan_open_tf(const char *path);
+void nileswan_open_tf(const char *path, bool copy_on_write);
+void nileswan_flush(void);
+void nileswan_update(uint32_t timestamp);
+void nileswan_reset_ts(uint32_t timestamp);
+void nileswan_configure_usb(uint32_t packet_size, uint32_t frame_interval_us, uint32_t fifo_depth);
+void nileswan_start_events(void);
+void nileswan_usb_frame(uint32_t timestamp);
+void nileswan_mark_written(const uint8_t *buffer);
+void nileswan_state_action(StateMem *sm, const unsigned load, const bool data_only);
 uint8_t nileswan_io_read(uint32_t index, bool is_debugger);
 void nileswan_io_write(uint32_t index, uint8_t value);
 uint8_t nileswan_cart_read(uint32_t index, bool is_debugger);
 void nileswan_cart_write(uint32_t index, uint8_t value);
+void nileswan_get_page(uint32_t cpu_bank, uint8_t **read_ptr, uint8_t **write_ptr);
+uint8_t *nileswan_cart_resolve(uint32_t index, bool write);
 bool nileswan_is_tf_powered(void);
 
-void spi_buffer_push(nile_spi_device_buffer_t *buffer, const uint8_t *data, uint32_t length);
+bool spi_buffer_push(nile_spi_device_buffer_t *buffer, const uint8_t *data, uint32_t length);
 bool spi_buffer_pop(nile_spi_device_buffer_t *buffer, uint8_t *data, uint32_t length);
+uint32_t spi_buffer_peek_bytes(const nile_spi_device_buffer_t *buffer, uint32_t offset, uint8_t *data, uint32_t length);
+
+static inline uint8_t spi_buffer_peek(const nile_spi_device_buffer_t *buffer, uint32_t offset) {
+    if (offset >= buffer->pos)
+        return 0xFF;
+    return buffer->data[(buffer->head + offset) & SPI_DEVICE_BUFFER_MASK_BYTES];
+}
+
+static inline void spi_buffer_clear(nile_spi_device_buffer_t *buffer) {
+    buffer->head = 0;
+    buffer->pos = 0;
+}
+
+static inline void spi_buffer_sanitize(nile_spi_device_buffer_t *buffer) {
+    buffer->head &= SPI_DEVICE_BUFFER_MASK_BYTES;
+    if (buffer->pos > SPI_DEVICE_BUFFER_SIZE_BYTES)
+        buffer->pos = SPI_DEVICE_BUFFER_SIZE_BYTES;
+}
 
+/* Block exchange: tx == NULL sends 0xFF bytes, rx == NULL discards received bytes. */
 uint8_t nile_spi_mcu_exchange(uint8_t tx);
+void nile_spi_mcu_exchange_block(const uint8_t *tx, uint8_t *rx, uint32_t length);
 void nile_spi_mcu_reset(bool full, bool bootloader_mode);
+bool nile_spi_mcu_has_response(void);
+void nile_spi_mcu_configure_usb(uint32_t packet_size, uint32_t fifo_depth);
+bool nile_spi_mcu_usb_frame(void);
+void nile_spi_mcu_state_action(StateMem *sm, const unsigned load, const bool data_only);
 uint8_t nile_spi_flash_exchange(uint8_t tx);
+void nile_spi_flash_exchange_block(const uint8_t *tx, uint8_t *rx, uint32_t length);
 void nile_spi_flash_reset(bool full);
+void nile_spi_flash_state_action(StateMem *sm, const unsigned load, const bool data_only);
 uint8_t nile_spi_tf_exchange(uint8_t tx);
+void nile_spi_tf_exchange_block(const uint8_t *tx, uint8_t *rx, uint32_t length);
 void nile_spi_tf_reset(bool full);
+void nile_spi_tf_state_action(StateMem *sm, const unsigned load, const bool data_only);
 
 #endif /* __NILESWAN_H__ */
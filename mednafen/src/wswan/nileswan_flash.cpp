@@ -21,31 +21,77 @@ struct {
     uint32_t position;
     bool sleeping;
 } spi_flash;
-FILE *file_flash;
+nile_image_t *image_flash;
 
 static const uint8_t spi_flash_mfr_id = 0xEF;
 static const uint8_t spi_flash_dev_id = 0x14;
 static const uint8_t spi_flash_jedec_id[] = { spi_flash_mfr_id, 0x40, 0x15 };
 static const uint8_t spi_flash_uuid[] = { 0x01, 0x23, 0x45, 0x67, 0x89, 0xAB, 0xCD, 0xEF };
 
+static void spi_flash_read(uint8_t *data, uint32_t length) {
+    while (length > 0) {
+        uint32_t address = spi_flash.position & (SPI_FLASH_SIZE_BYTES - 1);
+        uint32_t chunk = SPI_FLASH_SIZE_BYTES - address;
+        if (chunk > length)
+            chunk = length;
+        if (data != NULL) {
+            if (image_flash != NULL)
+                nile_image_read(image_flash, address, data, chunk);
+            else
+                memset(data, 0x90, chunk);
+            data += chunk;
+        }
+        length -= chunk;
+        // sequential reads wrap around at the end of the array
+        spi_flash.position = (address + chunk) & (SPI_FLASH_SIZE_BYTES - 1);
+    }
+}
+
+static void spi_flash_program(const uint8_t *data, uint32_t length) {
+    uint8_t page[SPI_FLASH_PAGE_SIZE_BYTES];
+
+    while (length > 0) {
+        uint32_t address = spi_flash.position & (SPI_FLASH_SIZE_BYTES - 1);
+        uint32_t page_offset = address & (SPI_FLASH_PAGE_SIZE_BYTES - 1);
+        uint32_t chunk = SPI_FLASH_PAGE_SIZE_BYTES - page_offset;
+        if (chunk > length)
+            chunk = length;
+        // programming can only clear bits
+        if (data != NULL && image_flash != NULL && (spi_flash.sr1 & NILE_FLASH_SR1_WEL)) {
+            nile_image_read(image_flash, address, page, chunk);
+            for (uint32_t i = 0; i < chunk; i++)
+                page[i] &= data[i];
+            nile_image_write(image_flash, address, page, chunk);
+        }
+        if (data != NULL)
+            data += chunk;
+        length -= chunk;
+        // the address wraps around within the page
+        spi_flash.position = (address & ~(SPI_FLASH_PAGE_SIZE_BYTES - 1))
+            | ((page_offset + chunk) & (SPI_FLASH_PAGE_SIZE_BYTES - 1));
+    }
+}
+
+static void spi_flash_erase(uint32_t address, uint32_t size) {
+    address &= (SPI_FLASH_SIZE_BYTES - 1) & ~(size - 1);
+    if (!(spi_flash.sr1 & NILE_FLASH_SR1_WEL)) {
+        NILE_TRACE(NILE_TRACE_FLASH, NILE_TRACE_ERROR, "!! erase at location %06X ignored, write not enabled !!", address);
+        return;
+    }
+    NILE_TRACE(NILE_TRACE_FLASH, NILE_TRACE_INFO, "erasing %d bytes at location %06X", size, address);
+    if (image_flash != NULL)
+        nile_image_fill(image_flash, address, 0xFF, size);
+    spi_flash.sr1 &= ~NILE_FLASH_SR1_WEL;
+}
+
 uint8_t nile_spi_flash_exchange(uint8_t tx) {
     uint8_t rx = 0xFF;
     uint32_t size = 0;
 
     if (spi_flash.mode == NILE_FLASH_CMD_READ) {
-        if (file_flash != NULL)
-            rx = feof(file_flash) ? 0xFF : fgetc(file_flash);
-        else
-            rx = 0x90;
-        spi_flash.position++;
+        spi_flash_read(&rx, 1);
     } else if (spi_flash.mode == NILE_FLASH_CMD_WRITE) {
-        // TODO: only set bits one way
-        // TODO: handle WEL
-        fseek(file_flash, spi_flash.position, SEEK_SET);
-        fputc(tx, file_flash);
-
-        // increment within page
-        spi_flash.position = ((spi_flash.position + 1) & 0xFF) | (spi_flash.position & 0xFFFFFF00);
+        spi_flash_program(&tx, 1);
     } else if (spi_flash.mode == NILE_FLASH_CMD_RDSR1) {
         return spi_flash.sr1;
     } else if (spi_flash.mode == NILE_FLASH_CMD_RDSR2) {
@@ -56,12 +102,12 @@ uint8_t nile_spi_flash_exchange(uint8_t tx) {
         spi_buffer_push(&spi_flash.rx, &tx, 1);
         spi_buffer_pop(&spi_flash.tx, &rx, 1);
 
-        if (spi_flash.sleeping && spi_flash.rx.data[0] != NILE_FLASH_CMD_WAKE_ID) {
-            printf("nileswan/spi/flash: !! byte %02X sent while asleep !!\n", spi_flash.rx.data[0]);
+        if (spi_flash.sleeping && spi_buffer_peek(&spi_flash.rx, 0) != NILE_FLASH_CMD_WAKE_ID) {
+            NILE_TRACE(NILE_TRACE_FLASH, NILE_TRACE_ERROR, "!! byte %02X sent while asleep !!", spi_buffer_peek(&spi_flash.rx, 0));
             return 0xFF;
         }
 
-        switch (spi_flash.rx.data[0]) {
+        switch (spi_buffer_peek(&spi_flash.rx, 0)) {
             case NILE_FLASH_CMD_ERASE_4K:
                 if (!size) size = 4096;
             case NILE_FLASH_CMD_ERASE_32K:
@@ -71,23 +117,36 @@ uint8_t nile_spi_flash_exchange(uint8_t tx) {
             case NILE_FLASH_CMD_WRITE:
             case NILE_FLASH_CMD_READ:
                 if (spi_flash.rx.pos >= 4) {
-                    spi_flash.mode = spi_flash.rx.data[0];
-                    spi_flash.position =
-                        (spi_flash.rx.data[1] << 16) |
-                        (spi_flash.rx.data[2] << 8) |
-                        spi_flash.rx.data[3];
+                    uint8_t cmd = spi_buffer_peek(&spi_flash.rx, 0);
+                    uint32_t address =
+                        (spi_buffer_peek(&spi_flash.rx, 1) << 16) |
+                        (spi_buffer_peek(&spi_flash.rx, 2) << 8) |
+                        spi_buffer_peek(&spi_flash.rx, 3);
                     spi_buffer_pop(&spi_flash.rx, NULL, 4);
-                    if (file_flash != NULL)
-                        fseek(file_flash, spi_flash.position, SEEK_SET);
-                    if (spi_flash.mode == NILE_FLASH_CMD_WRITE) printf("nileswan/spi/flash: write starting at location %06X\n", spi_flash.position);
-                    else if (spi_flash.mode == NILE_FLASH_CMD_READ) printf("nileswan/spi/flash: read starting at location %06X\n", spi_flash.position);
-                    else printf("nileswan/spi/flash: erasing %d bytes at location %06X\n", size, spi_flash.position);
+                    if (cmd == NILE_FLASH_CMD_WRITE) {
+                        if (!(spi_flash.sr1 & NILE_FLASH_SR1_WEL))
+                            NILE_TRACE(NILE_TRACE_FLASH, NILE_TRACE_ERROR, "!! write at location %06X ignored, write not enabled !!", address);
+                        else
+                            NILE_TRACE(NILE_TRACE_FLASH, NILE_TRACE_INFO, "write starting at location %06X", address);
+                        spi_flash.mode = cmd;
+                        spi_flash.position = address;
+                    } else if (cmd == NILE_FLASH_CMD_READ) {
+                        NILE_TRACE(NILE_TRACE_FLASH, NILE_TRACE_INFO, "read starting at location %06X", address);
+                        spi_flash.mode = cmd;
+                        spi_flash.position = address;
+                    } else {
+                        spi_flash_erase(address, size);
+                    }
                 }
                 break;
+            case NILE_FLASH_CMD_ERASE_ALL:
+                spi_buffer_pop(&spi_flash.rx, NULL, 1);
+                spi_flash_erase(0, SPI_FLASH_SIZE_BYTES);
+                break;
             case NILE_FLASH_CMD_RDSR1:
             case NILE_FLASH_CMD_RDSR2:
             case NILE_FLASH_CMD_RDSR3:
-                spi_flash.mode = spi_flash.rx.data[0];
+                spi_flash.mode = spi_buffer_peek(&spi_flash.rx, 0);
                 spi_buffer_pop(&spi_flash.rx, NULL, 1);
                 break;
             case NILE_FLASH_CMD_RDUUID:
@@ -107,41 +166,93 @@ uint8_t nile_spi_flash_exchange(uint8_t tx) {
                 spi_buffer_push(&spi_flash.tx, spi_flash_jedec_id, 3);
                 break;
             case NILE_FLASH_CMD_WAKE_ID:
-                printf("nileswan/spi/flash: waking\n");
+                NILE_TRACE(NILE_TRACE_FLASH, NILE_TRACE_INFO, "waking");
                 spi_flash.sleeping = false;
                 spi_buffer_pop(&spi_flash.rx, NULL, 1);
                 spi_buffer_push(&spi_flash.tx, NULL, 3);
                 spi_buffer_push(&spi_flash.tx, &spi_flash_dev_id, 1);
                 break;
             case NILE_FLASH_CMD_WRDI:
-                printf("nileswan/spi/flash: write disable\n");
+                NILE_TRACE(NILE_TRACE_FLASH, NILE_TRACE_INFO, "write disable");
                 spi_flash.sr1 &= ~NILE_FLASH_SR1_WEL;
                 spi_buffer_pop(&spi_flash.rx, NULL, 1);
                 break;
             case NILE_FLASH_CMD_WREN:
-                printf("nileswan/spi/flash: write enable\n");
+                NILE_TRACE(NILE_TRACE_FLASH, NILE_TRACE_INFO, "write enable");
                 spi_flash.sr1 |= NILE_FLASH_SR1_WEL;
                 spi_buffer_pop(&spi_flash.rx, NULL, 1);
                 break;
             case NILE_FLASH_CMD_SLEEP:
-                printf("nileswan/spi/flash: sleeping\n");
+                NILE_TRACE(NILE_TRACE_FLASH, NILE_TRACE_INFO, "sleeping");
                 spi_flash.sleeping = true;
                 spi_buffer_pop(&spi_flash.rx, NULL, 1);
                 break;
             default:
-                printf("nileswan/spi/flash: unknown command %02X\n", spi_flash.rx.data[0]);
-                spi_flash.rx.pos = 0;
+                NILE_TRACE(NILE_TRACE_FLASH, NILE_TRACE_ERROR, "unknown command %02X", spi_buffer_peek(&spi_flash.rx, 0));
+                spi_buffer_clear(&spi_flash.rx);
                 break;
         }
     }
     return rx;
 }
 
+void nile_spi_flash_exchange_block(const uint8_t *tx, uint8_t *rx, uint32_t length) {
+    if (spi_flash.mode == NILE_FLASH_CMD_READ) {
+        // fast path: stream data from the image
+        spi_flash_read(rx, length);
+        return;
+    } else if (spi_flash.mode == NILE_FLASH_CMD_WRITE) {
+        spi_flash_program(tx, length);
+        if (rx != NULL)
+            memset(rx, 0xFF, length);
+        return;
+    } else if (spi_flash.mode == NILE_FLASH_CMD_RDSR1
+        || spi_flash.mode == NILE_FLASH_CMD_RDSR2
+        || spi_flash.mode == NILE_FLASH_CMD_RDSR3) {
+        if (rx != NULL)
+            memset(rx, nile_spi_flash_exchange(0xFF), length);
+        return;
+    }
+
+    for (uint32_t i = 0; i < length; i++) {
+        uint8_t value = nile_spi_flash_exchange(tx != NULL ? tx[i] : 0xFF);
+        if (rx != NULL) rx[i] = value;
+    }
+}
+
 void nile_spi_flash_reset(bool full) {
     if (full) {
         memset(&spi_flash, 0, sizeof(spi_flash));
     }
-    spi_flash.tx.pos = 0;
-    spi_flash.rx.pos = 0;
+    // a page program ends when chip select is deasserted
+    if (spi_flash.mode == NILE_FLASH_CMD_WRITE)
+        spi_flash.sr1 &= ~NILE_FLASH_SR1_WEL;
+    spi_buffer_clear(&spi_flash.tx);
+    spi_buffer_clear(&spi_flash.rx);
     spi_flash.mode = 0;
 }
+
+void nile_spi_flash_state_action(StateMem *sm, const unsigned load, const bool data_only) {
+    SFORMAT StateRegs[] = {
+        SFVARN(spi_flash.tx.data, "tx.data"),
+        SFVARN(spi_flash.tx.head, "tx.head"),
+        SFVARN(spi_flash.tx.pos, "tx.pos"),
+        SFVARN(spi_flash.rx.data, "rx.data"),
+        SFVARN(spi_flash.rx.head, "rx.head"),
+        SFVARN(spi_flash.rx.pos, "rx.pos"),
+        SFVARN(spi_flash.sr1, "sr1"),
+        SFVARN(spi_flash.sr2, "sr2"),
+        SFVARN(spi_flash.sr3, "sr3"),
+        SFVARN(spi_flash.mode, "mode"),
+        SFVARN(spi_flash.position, "position"),
+        SFVARN(spi_flash.sleeping, "sleeping"),
+        SFEND
+    };
+
+    MDFNSS_StateAction(sm, load, data_only, StateRegs, "NILEFLSH");
+
+    if (load) {
+        spi_buffer_sanitize(&spi_flash.tx);
+        spi_buffer_sanitize(&spi_flash.rx);
+    }
+}
@@ -0,0 +1,281 @@
+#include "wswan.h"
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <map>
+#include <memory>
+#include "nileswan.h"
+
+#ifdef HAVE_MMAP
+#include <sys/mman.h>
+#endif
+
+// TF images are commonly 2 GiB or larger, past what fseek()/ftell() can address where long is 32-bit
+#ifdef WIN32
+#define image_fseek _fseeki64
+#define image_ftell _ftelli64
+#else
+#define image_fseek fseeko
+#define image_ftell ftello
+#endif
+
+#define IMAGE_CACHE_LINE_SIZE 4096
+#define IMAGE_CACHE_LINES 64
+
+typedef struct {
+    uint64_t line;
+    uint32_t last_used;
+    bool valid;
+    uint8_t data[IMAGE_CACHE_LINE_SIZE];
+} nile_image_cache_line_t;
+
+struct nile_image {
+    FILE *file;
+    uint64_t size;
+    uint64_t file_size;
+    bool copy_on_write;
+    bool dirty;
+
+    /* memory-mapped backend */
+    uint8_t *data;
+
+    /* buffered backend, used where mmap() is unavailable or fails */
+    nile_image_cache_line_t cache[IMAGE_CACHE_LINES];
+    uint32_t cache_clock;
+    std::map<uint64_t, std::unique_ptr<uint8_t[]>> overlay;
+};
+
+static void image_load_line(nile_image_t *image, uint64_t line, uint8_t *data) {
+    size_t length = 0;
+    if (!image_fseek(image->file, line * IMAGE_CACHE_LINE_SIZE, SEEK_SET))
+        length = fread(data, 1, IMAGE_CACHE_LINE_SIZE, image->file);
+    memset(data + length, 0xFF, IMAGE_CACHE_LINE_SIZE - length);
+}
+
+static uint8_t *image_get_line(nile_image_t *image, uint64_t line) {
+    if (image->copy_on_write) {
+        auto it = image->overlay.find(line);
+        if (it != image->overlay.end())
+            return it->second.get();
+    }
+
+    nile_image_cache_line_t *victim = &image->cache[0];
+    image->cache_clock++;
+    for (int i = 0; i < IMAGE_CACHE_LINES; i++) {
+        nile_image_cache_line_t *entry = &image->cache[i];
+        if (entry->valid && entry->line == line) {
+            entry->last_used = image->cache_clock;
+            return entry->data;
+        }
+        if (!entry->valid || (victim->valid && entry->last_used < victim->last_used))
+            victim = entry;
+    }
+
+    image_load_line(image, line, victim->data);
+    victim->line = line;
+    victim->valid = true;
+    victim->last_used = image->cache_clock;
+    return victim->data;
+}
+
+/*
+ * Extend the file from file_size to size with erased (0xFF) bytes.
+ */
+static bool image_extend(nile_image_t *image) {
+    uint8_t buffer[IMAGE_CACHE_LINE_SIZE];
+    uint64_t offset = image->file_size;
+
+    memset(buffer, 0xFF, sizeof(buffer));
+    if (image_fseek(image->file, offset, SEEK_SET))
+        return false;
+    while (offset < image->size) {
+        uint32_t chunk = (image->size - offset) > sizeof(buffer) ? sizeof(buffer) : (image->size - offset);
+        if (fwrite(buffer, 1, chunk, image->file) != chunk)
+            return false;
+        offset += chunk;
+    }
+    if (fflush(image->file))
+        return false;
+
+    image->file_size = image->size;
+    return true;
+}
+
+nile_image_t *nile_image_open(const char *path, bool copy_on_write, uint64_t device_size) {
+    FILE *file = fopen(path, copy_on_write ? "rb" : "r+b");
+    if (file == NULL && !copy_on_write) {
+        file = fopen(path, "rb");
+        if (file != NULL) {
+            printf("nileswan/image: %s is read-only, changes will not be saved\n", path);
+            copy_on_write = true;
+        }
+    }
+    if (file == NULL) {
+        printf("nileswan/image: could not open %s\n", path);
+        return NULL;
+    }
+
+    nile_image_t *image = new nile_image_t();
+    image->file = file;
+    image->copy_on_write = copy_on_write;
+    if (!image_fseek(file, 0, SEEK_END)) {
+        int64_t size = image_ftell(file);
+        if (size > 0)
+            image->file_size = size;
+    }
+    image->size = image->file_size > device_size ? image->file_size : device_size;
+
+    // the device's address space must be backed in full, or writes near its end would be lost
+    if (image->file_size < image->size) {
+        if (!copy_on_write && image_extend(image)) {
+            printf("nileswan/image: extended %s to %llu bytes\n", path, (unsigned long long) image->size);
+        } else {
+            if (!copy_on_write)
+                printf("nileswan/image: could not extend %s, changes will not be saved\n", path);
+            // reads past the end of the file come back erased, writes stay in the copy-on-write overlay
+            copy_on_write = true;
+            image->copy_on_write = true;
+        }
+    }
+
+#ifdef HAVE_MMAP
+    if (image->size > 0 && image->size == image->file_size && image->size <= SIZE_MAX) {
+        void *data = mmap(NULL, image->size, PROT_READ | PROT_WRITE,
+            copy_on_write ? MAP_PRIVATE : MAP_SHARED, fileno(file), 0);
+        if (data != MAP_FAILED)
+            image->data = (uint8_t*) data;
+    }
+#endif
+
+    printf("nileswan/image: opened %s (%llu bytes, %s%s)\n", path,
+        (unsigned long long) image->size,
+        image->data != NULL ? "memory-mapped" : "buffered",
+        copy_on_write ? ", copy-on-write" : "");
+    return image;
+}
+
+void nile_image_close(nile_image_t *image) {
+    if (image == NULL)
+        return;
+
+    nile_image_flush(image);
+#ifdef HAVE_MMAP
+    if (image->data != NULL)
+        munmap(image->data, image->size);
+#endif
+    fclose(image->file);
+    delete image;
+}
+
+uint64_t nile_image_size(const nile_image_t *image) {
+    return image->size;
+}
+
+uint8_t *nile_image_data(nile_image_t *image) {
+    return image->data;
+}
+
+void nile_image_read(nile_image_t *image, uint64_t offset, uint8_t *data, uint32_t length) {
+    if (offset >= image->size) {
+        memset(data, 0xFF, length);
+        return;
+    }
+    if (length > image->size - offset) {
+        uint32_t in_image = image->size - offset;
+        memset(data + in_image, 0xFF, length - in_image);
+        length = in_image;
+    }
+
+    if (image->data != NULL) {
+        memcpy(data, image->data + offset, length);
+        return;
+    }
+
+    while (length > 0) {
+        uint32_t line_offset = offset & (IMAGE_CACHE_LINE_SIZE - 1);
+        uint32_t chunk = IMAGE_CACHE_LINE_SIZE - line_offset;
+        if (chunk > length)
+            chunk = length;
+        memcpy(data, image_get_line(image, offset / IMAGE_CACHE_LINE_SIZE) + line_offset, chunk);
+        data += chunk;
+        offset += chunk;
+        length -= chunk;
+    }
+}
+
+void nile_image_write(nile_image_t *image, uint64_t offset, const uint8_t *data, uint32_t length) {
+    // the image covers the whole device, so this only drops accesses past the end of a TF card
+    if (offset >= image->size)
+        return;
+    if (length > image->size - offset)
+        length = image->size - offset;
+
+    image->dirty = true;
+    if (image->data != NULL) {
+        memcpy(image->data + offset, data, length);
+        return;
+    }
+
+    if (!image->copy_on_write) {
+        if (!image_fseek(image->file, offset, SEEK_SET))
+            fwrite(data, 1, length, image->file);
+    }
+
+    while (length > 0) {
+        uint64_t line = offset / IMAGE_CACHE_LINE_SIZE;
+        uint32_t line_offset = offset & (IMAGE_CACHE_LINE_SIZE - 1);
+        uint32_t chunk = IMAGE_CACHE_LINE_SIZE - line_offset;
+        if (chunk > length)
+            chunk = length;
+        if (image->copy_on_write && !image->overlay.count(line)) {
+            // dirty lines of a copy-on-write image must never be evicted
+            std::unique_ptr<uint8_t[]> copy(new uint8_t[IMAGE_CACHE_LINE_SIZE]);
+            memcpy(copy.get(), image_get_line(image, line), IMAGE_CACHE_LINE_SIZE);
+            image->overlay[line] = std::move(copy);
+        }
+        memcpy(image_get_line(image, line) + line_offset, data, chunk);
+        data += chunk;
+        offset += chunk;
+        length -= chunk;
+    }
+}
+
+void nile_image_fill(nile_image_t *image, uint64_t offset, uint8_t value, uint32_t length) {
+    uint8_t buffer[IMAGE_CACHE_LINE_SIZE];
+
+    if (offset >= image->size)
+        return;
+    if (length > image->size - offset)
+        length = image->size - offset;
+
+    if (image->data != NULL) {
+        image->dirty = true;
+        memset(image->data + offset, value, length);
+        return;
+    }
+
+    memset(buffer, value, sizeof(buffer));
+    while (length > 0) {
+        uint32_t chunk = length > sizeof(buffer) ? sizeof(buffer) : length;
+        nile_image_write(image, offset, buffer, chunk);
+        offset += chunk;
+        length -= chunk;
+    }
+}
+
+void nile_image_flush(nile_image_t *image) {
+    if (image == NULL || image->copy_on_write || !image->dirty)
+        return;
+
+    image->dirty = false;
+
+#ifdef HAVE_MMAP
+    if (image->data != NULL) {
+        msync(image->data, image->size, MS_ASYNC);
+        return;
+    }
+#endif
+    fflush(image->file);
+}
@@ -22,9 +22,14 @@ struct {
     uint8_t boot_step;
     uint16_t boot_erase_count;
     uint32_t boot_dest_address;
-    int16_t cdc_unget;
+    nile_spi_device_buffer_t cdc_rx; // host -> MCU, waiting for USB_CDC_READ
+    nile_spi_device_buffer_t cdc_tx; // MCU -> host, waiting for the next IN packet
 } spi_mcu;
 
+/* USB CDC link configuration; the FIFOs hold at most cdc_fifo_depth bytes each. */
+static uint32_t cdc_packet_size = NILE_USB_PACKET_SIZE_MAX;
+static uint32_t cdc_fifo_depth = 512;
+
 static bool spi_mcu_persistent_initialized = false;
 struct {
     uint8_t eeprom_mode;
@@ -53,12 +58,12 @@ uint8_t nile_spi_mcu_boot_exchange(uint8_t tx) {
     spi_buffer_push(&spi_mcu.rx, &tx, 1);
 
     if (spi_mcu.rx.pos) {
-        if ((spi_mcu.boot_waiting_ack || !spi_mcu.boot_step) && spi_mcu.rx.data[0] == NILE_MCU_BOOT_ACK) {
-            printf("nileswan/spi/mcu/boot: ack\n");
+        if ((spi_mcu.boot_waiting_ack || !spi_mcu.boot_step) && spi_buffer_peek(&spi_mcu.rx, 0) == NILE_MCU_BOOT_ACK) {
+            NILE_TRACE(NILE_TRACE_MCU, NILE_TRACE_INFO, "boot: ack");
             spi_mcu.boot_waiting_ack = false;
             spi_buffer_pop(&spi_mcu.rx, NULL, 1);
             if (spi_mcu.boot_cmd == NILE_MCU_BOOT_JUMP && spi_mcu.boot_step == 2) {
-                printf("nileswan/spi/mcu/boot: stub: jump to %08X\n", spi_mcu.boot_dest_address);
+                NILE_TRACE(NILE_TRACE_MCU, NILE_TRACE_INFO, "boot: stub: jump to %08X", spi_mcu.boot_dest_address);
                 spi_mcu.boot_mode = false;
             }
         } else if (spi_mcu.boot_waiting_ack) {
@@ -70,19 +75,19 @@ uint8_t nile_spi_mcu_boot_exchange(uint8_t tx) {
                 case NILE_MCU_BOOT_WRITE_MEMORY: {
                     if (spi_mcu.boot_step == 1) {
                         if (spi_mcu.rx.pos < 5) return rx;
-                        spi_mcu.boot_dest_address = (spi_mcu.rx.data[0] << 24)
-				| (spi_mcu.rx.data[1] << 16)
-				| (spi_mcu.rx.data[2] << 8)
-				| spi_mcu.rx.data[3];
+                        spi_mcu.boot_dest_address = (spi_buffer_peek(&spi_mcu.rx, 0) << 24)
+				| (spi_buffer_peek(&spi_mcu.rx, 1) << 16)
+				| (spi_buffer_peek(&spi_mcu.rx, 2) << 8)
+				| spi_buffer_peek(&spi_mcu.rx, 3);
                         spi_mcu.boot_step = 2;
                         spi_buffer_pop(&spi_mcu.rx, NULL, 5);
                         spi_mcu_boot_send_ack(true);
                     }
                     if (spi_mcu.boot_step == 2) {
                         if (spi_mcu.rx.pos < 1) return rx;
-                        int len = spi_mcu.rx.data[0] + 1;
+                        int len = spi_buffer_peek(&spi_mcu.rx, 0) + 1;
                         if (spi_mcu.rx.pos < len + 2) return rx;
-                        printf("nileswan/spi/mcu/boot: stub: write %d bytes to %08X\n", len, spi_mcu.boot_dest_address);
+                        NILE_TRACE(NILE_TRACE_MCU, NILE_TRACE_INFO, "boot: stub: write %d bytes to %08X", len, spi_mcu.boot_dest_address);
                         spi_mcu.boot_step = 0;
                         spi_buffer_pop(&spi_mcu.rx, NULL, len + 2);
                         spi_mcu_boot_send_ack(true);
@@ -91,18 +96,18 @@ uint8_t nile_spi_mcu_boot_exchange(uint8_t tx) {
                 case NILE_MCU_BOOT_READ_MEMORY: {
                     if (spi_mcu.boot_step == 1) {
                         if (spi_mcu.rx.pos < 5) return rx;
-                        spi_mcu.boot_dest_address = (spi_mcu.rx.data[0] << 24)
-				| (spi_mcu.rx.data[1] << 16)
-				| (spi_mcu.rx.data[2] << 8)
-				| spi_mcu.rx.data[3];
+                        spi_mcu.boot_dest_address = (spi_buffer_peek(&spi_mcu.rx, 0) << 24)
+				| (spi_buffer_peek(&spi_mcu.rx, 1) << 16)
+				| (spi_buffer_peek(&spi_mcu.rx, 2) << 8)
+				| spi_buffer_peek(&spi_mcu.rx, 3);
                         spi_mcu.boot_step = 2;
                         spi_buffer_pop(&spi_mcu.rx, NULL, 5);
                         spi_mcu_boot_send_ack(true);
                     }
                     if (spi_mcu.boot_step == 2) {
                         if (spi_mcu.rx.pos < 2) return rx;
-                        int len = spi_mcu.rx.data[0] + 1;
-                        printf("nileswan/spi/mcu/boot: stub: read %d bytes from %08X\n", len, spi_mcu.boot_dest_address);
+                        int len = spi_buffer_peek(&spi_mcu.rx, 0) + 1;
+                        NILE_TRACE(NILE_TRACE_MCU, NILE_TRACE_INFO, "boot: stub: read %d bytes from %08X", len, spi_mcu.boot_dest_address);
                         spi_mcu.boot_step = 0;
                         spi_buffer_pop(&spi_mcu.rx, NULL, 2);
                         spi_mcu_boot_send_ack(true);
@@ -112,23 +117,23 @@ uint8_t nile_spi_mcu_boot_exchange(uint8_t tx) {
                 case NILE_MCU_BOOT_ERASE_MEMORY: {
                     if (spi_mcu.boot_step == 1) {
                         if (spi_mcu.rx.pos < 3) return rx;
-                        spi_mcu.boot_erase_count = (spi_mcu.rx.data[0] << 8) | spi_mcu.rx.data[1];
+                        spi_mcu.boot_erase_count = (spi_buffer_peek(&spi_mcu.rx, 0) << 8) | spi_buffer_peek(&spi_mcu.rx, 1);
                         spi_mcu.boot_step = 2;
                         spi_buffer_pop(&spi_mcu.rx, NULL, 3);
                         spi_mcu_boot_send_ack(true);
                     }
                     if (spi_mcu.boot_step == 2) {
                         if (spi_mcu.rx.pos < spi_mcu.boot_erase_count*2+3) return rx;
-                        printf("nileswan/spi/mcu/boot: stub: erase %d sectors\n", spi_mcu.boot_erase_count);
+                        NILE_TRACE(NILE_TRACE_MCU, NILE_TRACE_INFO, "boot: stub: erase %d sectors", spi_mcu.boot_erase_count);
                         spi_mcu.boot_step = 0;
                         spi_buffer_pop(&spi_mcu.rx, NULL, spi_mcu.boot_erase_count*2+3);
                         spi_mcu_boot_send_ack(true);
                     }
                 } break;
             }
-        } else if (spi_mcu.rx.data[0] == NILE_MCU_BOOT_START) {
+        } else if (spi_buffer_peek(&spi_mcu.rx, 0) == NILE_MCU_BOOT_START) {
             if (!spi_mcu.boot_started) {
-                printf("nileswan/spi/mcu/boot: start\n");
+                NILE_TRACE(NILE_TRACE_MCU, NILE_TRACE_INFO, "boot: start");
                 spi_mcu_boot_send_ack(true);
                 spi_mcu.boot_started = true;
                 spi_buffer_pop(&spi_mcu.rx, NULL, 1);
@@ -136,40 +141,40 @@ uint8_t nile_spi_mcu_boot_exchange(uint8_t tx) {
             }
 
             if (spi_mcu.rx.pos < 3) return rx;
-            if ((spi_mcu.rx.data[1] ^ 0xFF) != spi_mcu.rx.data[2]) {
-                printf("nileswan/spi/mcu/boot: command ID transfer error (%02X %02X)\n", spi_mcu.rx.data[1], spi_mcu.rx.data[2]);
+            if ((spi_buffer_peek(&spi_mcu.rx, 1) ^ 0xFF) != spi_buffer_peek(&spi_mcu.rx, 2)) {
+                NILE_TRACE(NILE_TRACE_MCU, NILE_TRACE_ERROR, "boot: command ID transfer error (%02X %02X)", spi_buffer_peek(&spi_mcu.rx, 1), spi_buffer_peek(&spi_mcu.rx, 2));
                 spi_buffer_pop(&spi_mcu.rx, NULL, 3);
                 return rx;
             }
 
-            spi_mcu.boot_cmd = spi_mcu.rx.data[1];
-            switch (spi_mcu.rx.data[1]) {
+            spi_mcu.boot_cmd = spi_buffer_peek(&spi_mcu.rx, 1);
+            switch (spi_buffer_peek(&spi_mcu.rx, 1)) {
                 case NILE_MCU_BOOT_START: {
-                    printf("nileswan/spi/mcu/boot: start\n");
+                    NILE_TRACE(NILE_TRACE_MCU, NILE_TRACE_INFO, "boot: start");
                     spi_mcu_boot_send_ack(true);
                 } break;
                 case NILE_MCU_BOOT_ERASE_MEMORY: {
-                    printf("nileswan/spi/mcu/boot: erase memory\n");
+                    NILE_TRACE(NILE_TRACE_MCU, NILE_TRACE_INFO, "boot: erase memory");
                     spi_mcu.boot_step = 1;
                     spi_mcu_boot_send_ack(true);
                 } break;
                 case NILE_MCU_BOOT_WRITE_MEMORY: {
-                    printf("nileswan/spi/mcu/boot: write memory\n");
+                    NILE_TRACE(NILE_TRACE_MCU, NILE_TRACE_INFO, "boot: write memory");
                     spi_mcu.boot_step = 1;
                     spi_mcu_boot_send_ack(true);
                 } break;
                 case NILE_MCU_BOOT_READ_MEMORY: {
-                    printf("nileswan/spi/mcu/boot: read memory\n");
+                    NILE_TRACE(NILE_TRACE_MCU, NILE_TRACE_INFO, "boot: read memory");
                     spi_mcu.boot_step = 1;
                     spi_mcu_boot_send_ack(true);
                 } break;
                 case NILE_MCU_BOOT_JUMP: {
-                    printf("nileswan/spi/mcu/boot: jump\n");
+                    NILE_TRACE(NILE_TRACE_MCU, NILE_TRACE_INFO, "boot: jump");
                     spi_mcu.boot_step = 1;
                     spi_mcu_boot_send_ack(true);
                 } break;
                 default: {
-                    printf("nileswan/spi/mcu/boot: unknown command %02X\n", spi_mcu.rx.data[1]);
+                    NILE_TRACE(NILE_TRACE_MCU, NILE_TRACE_ERROR, "boot: unknown command %02X", spi_buffer_peek(&spi_mcu.rx, 1));
                     spi_mcu_boot_send_ack(false);
                 } break;
             }
@@ -189,7 +194,7 @@ static void rtc_transfer(uint8_t cmd, uint8_t* buf) {
     GenericRTC *rtc = RTC_Get();
     switch (cmd) {
         case 4:
-            printf("nileswan/spi/mcu/rtc: write date/time\n");
+            NILE_TRACE(NILE_TRACE_MCU, NILE_TRACE_INFO, "rtc: write date/time");
             rtc->year = buf[0];
             rtc->mon  = buf[1];
             rtc->mday = buf[2];
@@ -199,7 +204,7 @@ static void rtc_transfer(uint8_t cmd, uint8_t* buf) {
             rtc->sec  = buf[6];
             break;
         case 5:
-            printf("nileswan/spi/mcu/rtc: read date/time\n");
+            NILE_TRACE(NILE_TRACE_MCU, NILE_TRACE_INFO, "rtc: read date/time");
             buf[0] = rtc->year;
             buf[1] = rtc->mon;
             buf[2] = rtc->mday;
@@ -209,19 +214,19 @@ static void rtc_transfer(uint8_t cmd, uint8_t* buf) {
             buf[6] = rtc->sec;
             break;
         case 6:
-            printf("nileswan/spi/mcu/rtc: write time\n");
+            NILE_TRACE(NILE_TRACE_MCU, NILE_TRACE_INFO, "rtc: write time");
             rtc->hour = buf[0];
             rtc->min  = buf[1];
             rtc->sec  = buf[2];
             break;
         case 7:
-            printf("nileswan/spi/mcu/rtc: read time\n");
+            NILE_TRACE(NILE_TRACE_MCU, NILE_TRACE_INFO, "rtc: read time");
             buf[0] = rtc->hour;
             buf[1] = rtc->min;
             buf[2] = rtc->sec;
             break;
         default:
-            printf("nileswan/spi/mcu/rtc: TODO: command %X\n", cmd);
+            NILE_TRACE(NILE_TRACE_MCU, NILE_TRACE_ERROR, "rtc: TODO: command %X", cmd);
             memset(buf, 0, rtc_cmd_tx_size[cmd]);
             break;
     }
@@ -240,7 +245,7 @@ uint8_t nile_spi_mcu_exchange(uint8_t tx) {
 
     if (spi_mcu.rx.pos) {
         // synchronize to command
-        if (spi_mcu.rx.data[0] == 0xFF) {
+        if (spi_buffer_peek(&spi_mcu.rx, 0) == 0xFF) {
             spi_buffer_pop(&spi_mcu.rx, NULL, 1);
             return rx;
         }
@@ -248,24 +253,24 @@ uint8_t nile_spi_mcu_exchange(uint8_t tx) {
             return rx;
         }
 
-        uint16_t cmd = spi_mcu.rx.data[0] & 0x7F;
-        uint16_t arg = (spi_mcu.rx.data[0] >> 7) | spi_mcu.rx.data[1] << 1;
+        uint16_t cmd = spi_buffer_peek(&spi_mcu.rx, 0) & 0x7F;
+        uint16_t arg = (spi_buffer_peek(&spi_mcu.rx, 0) >> 7) | spi_buffer_peek(&spi_mcu.rx, 1) << 1;
         switch (cmd) {
             case MCU_SPI_CMD_FREQ: {
-                printf("nileswan/spi/mcu: set SPI speed to %d (no-op)\n", arg);
+                NILE_TRACE(NILE_TRACE_MCU, NILE_TRACE_INFO, "set SPI speed to %d (no-op)", arg);
                 spi_buffer_pop(&spi_mcu.rx, NULL, 2);
                 response[0] = 1;
                 spi_mcu_send_response(1, response);
             } break;
             case MCU_SPI_CMD_ID: {
-                printf("nileswan/spi/mcu: query MCU UID\n");
+                NILE_TRACE(NILE_TRACE_MCU, NILE_TRACE_INFO, "query MCU UID");
                 spi_buffer_pop(&spi_mcu.rx, NULL, 2);
                 for (int i = 0; i < 12; i++)
                     response[i] = i;
                 spi_mcu_send_response(12, response);
             } break;
             case MCU_SPI_CMD_VERSION: {
-                printf("nileswan/spi/mcu: query MCU firmware version\n");
+                NILE_TRACE(NILE_TRACE_MCU, NILE_TRACE_INFO, "query MCU firmware version");
                 spi_buffer_pop(&spi_mcu.rx, NULL, 2);
                 response[0] = NILE_EMULATED_MCU_MAJOR;
                 response[1] = NILE_EMULATED_MCU_MAJOR >> 8;
@@ -274,7 +279,7 @@ uint8_t nile_spi_mcu_exchange(uint8_t tx) {
                 spi_mcu_send_response(4, response);
             } break;
             case MCU_SPI_CMD_EEPROM_MODE: {
-                printf("nileswan/spi/mcu: set EEPROM mode to %d\n", arg);
+                NILE_TRACE(NILE_TRACE_MCU, NILE_TRACE_INFO, "set EEPROM mode to %d", arg);
                 spi_mcu_persistent.eeprom_mode = arg;
                 spi_buffer_pop(&spi_mcu.rx, NULL, 2);
                 response[0] = 1;
@@ -283,30 +288,30 @@ uint8_t nile_spi_mcu_exchange(uint8_t tx) {
             case MCU_SPI_CMD_EEPROM_READ: {
                 if (arg == 0) arg = 512;
                 if (spi_mcu.rx.pos < 4) break;
-                uint16_t address = spi_mcu.rx.data[2] | (spi_mcu.rx.data[3] << 8);
-                printf("nileswan/spi/mcu: read %d words from EEPROM address %04X\n", arg, address);
+                uint16_t address = spi_buffer_peek(&spi_mcu.rx, 2) | (spi_buffer_peek(&spi_mcu.rx, 3) << 8);
+                NILE_TRACE(NILE_TRACE_MCU, NILE_TRACE_INFO, "read %d words from EEPROM address %04X", arg, address);
                 spi_buffer_pop(&spi_mcu.rx, NULL, 4);
                 spi_mcu_send_response(2 * arg, spi_mcu_persistent.eeprom_data + address);
             } break;
             case MCU_SPI_CMD_EEPROM_GET_MODE: {
-                printf("nileswan/spi/mcu: get EEPROM mode (%d)\n", spi_mcu_persistent.eeprom_mode);
+                NILE_TRACE(NILE_TRACE_MCU, NILE_TRACE_INFO, "get EEPROM mode (%d)", spi_mcu_persistent.eeprom_mode);
                 spi_buffer_pop(&spi_mcu.rx, NULL, 2);
                 response[0] = spi_mcu_persistent.eeprom_mode;
                 spi_mcu_send_response(1, response);
             } break;
             case MCU_SPI_CMD_SET_SAVE_ID: {
                 if (spi_mcu.rx.pos < 6) break;
-                spi_mcu_persistent.save_id = spi_mcu.rx.data[2]
-                    | (spi_mcu.rx.data[3] << 8)
-                    | (spi_mcu.rx.data[4] << 16)
-                    | (spi_mcu.rx.data[5] << 24);
-                printf("nileswan/spi/mcu: set save ID to %d\n", spi_mcu_persistent.save_id);
+                spi_mcu_persistent.save_id = spi_buffer_peek(&spi_mcu.rx, 2)
+                    | (spi_buffer_peek(&spi_mcu.rx, 3) << 8)
+                    | (spi_buffer_peek(&spi_mcu.rx, 4) << 16)
+                    | (spi_buffer_peek(&spi_mcu.rx, 5) << 24);
+                NILE_TRACE(NILE_TRACE_MCU, NILE_TRACE_INFO, "set save ID to %d", spi_mcu_persistent.save_id);
                 spi_buffer_pop(&spi_mcu.rx, NULL, 6);
                 response[0] = 1;
                 spi_mcu_send_response(1, response);
             } break;
             case MCU_SPI_CMD_GET_SAVE_ID: {
-                printf("nileswan/spi/mcu: get save ID (%d)\n", spi_mcu_persistent.save_id);
+                NILE_TRACE(NILE_TRACE_MCU, NILE_TRACE_INFO, "get save ID (%d)", spi_mcu_persistent.save_id);
                 spi_buffer_pop(&spi_mcu.rx, NULL, 2);
                 response[0] = spi_mcu_persistent.save_id;
                 response[1] = spi_mcu_persistent.save_id >> 8;
@@ -316,51 +321,32 @@ uint8_t nile_spi_mcu_exchange(uint8_t tx) {
             } break;
             case MCU_SPI_CMD_USB_CDC_READ: {
                 if (arg == 0) arg = 512;
-                if (arg > MCU_MAX_PER_USB_CDC_PACKET) arg = MCU_MAX_PER_USB_CDC_PACKET;
                 spi_buffer_pop(&spi_mcu.rx, NULL, 2);
-                uint16_t len = 0;
-                for (; len < arg; len++) {
-                    if (spi_mcu.cdc_unget >= 0) {
-                        response[len] = spi_mcu.cdc_unget;
-                        spi_mcu.cdc_unget = -1;
-                        continue;
-                    }
-                    if (!Comm_RecvByte(response + len))
-                        break;
-                }
-                printf("nileswan/spi/mcu: USB serial read %d bytes, found %d\n", arg, len);
+                uint16_t len = arg < spi_mcu.cdc_rx.pos ? arg : spi_mcu.cdc_rx.pos;
+                spi_buffer_pop(&spi_mcu.cdc_rx, response, len);
+                NILE_TRACE(NILE_TRACE_CDC, NILE_TRACE_INFO, "USB serial read %d bytes, found %d", arg, len);
                 spi_mcu_send_response(len, response);
             } break;
             case MCU_SPI_CMD_USB_CDC_WRITE: {
                 if (arg == 0) arg = 512;
                 if (spi_mcu.rx.pos < 2+arg) break;
                 spi_buffer_pop(&spi_mcu.rx, NULL, 2);
-                printf("nileswan/spi/mcu: USB serial write %d bytes\n", arg);
-                int len = 0;
-                for (; len < arg; len++) {
-                    if (!Comm_SendByte(spi_mcu.rx.data[len]))
-                        break;
-                }
-                spi_buffer_pop(&spi_mcu.rx, NULL, arg);
+                spi_buffer_pop(&spi_mcu.rx, response, arg);
+                uint32_t space = cdc_fifo_depth - spi_mcu.cdc_tx.pos;
+                uint16_t len = arg < space ? arg : space;
+                spi_buffer_push(&spi_mcu.cdc_tx, response, len);
+                NILE_TRACE(NILE_TRACE_CDC, NILE_TRACE_INFO, "USB serial write %d bytes, accepted %d", arg, len);
                 spi_mcu_send_response(2, &len);
             } break;
             case MCU_SPI_CMD_USB_CDC_AVAILABLE: {
-                // TODO: implement
-                uint16_t len = spi_mcu.cdc_unget < 0 ? 0 : 1;
-                uint8_t c;
-                if (!len) {
-                    if (Comm_RecvByte(&c)) {
-                        spi_mcu.cdc_unget = c;
-                        len = 1;
-                    }
-                }
-                printf("nileswan/spi/mcu: USB serial available = %d\n", len);
+                uint16_t len = spi_mcu.cdc_rx.pos;
+                NILE_TRACE(NILE_TRACE_CDC, NILE_TRACE_INFO, "USB serial available = %d", len);
                 spi_buffer_pop(&spi_mcu.rx, NULL, 2);
                 spi_mcu_send_response(2, &len);
             } break;
             case MCU_SPI_CMD_USB_CDC_FLUSH: {
-                spi_mcu.cdc_unget = -1;
-                printf("nileswan/spi/mcu: USB serial flush\n");
+                // IN packets go out every USB frame, full or not, so there is nothing to push early.
+                NILE_TRACE(NILE_TRACE_CDC, NILE_TRACE_INFO, "USB serial flush (%d bytes queued)", spi_mcu.cdc_tx.pos);
                 spi_buffer_pop(&spi_mcu.rx, NULL, 2);
                 spi_mcu_send_response(0, response);
             } break;
@@ -382,16 +368,16 @@ uint8_t nile_spi_mcu_exchange(uint8_t tx) {
             } break;
             case MCU_SPI_CMD_ACCEL_POLL: {
                 if (arg) {
-                    printf("nileswan/spi/mcu: stub: enable accelerometer polling, %d Hz\n", arg);
+                    NILE_TRACE(NILE_TRACE_MCU, NILE_TRACE_INFO, "stub: enable accelerometer polling, %d Hz", arg);
                 } else {
-                    printf("nileswan/spi/mcu: stub: disable accelerometer polling\n");
+                    NILE_TRACE(NILE_TRACE_MCU, NILE_TRACE_INFO, "stub: disable accelerometer polling");
                 }
                 response[0] = 1;
                 spi_buffer_pop(&spi_mcu.rx, NULL, 2);
                 spi_mcu_send_response(1, response);
             } break;
             case MCU_SPI_CMD_ACCEL_READ: {
-                printf("nileswan/spi/mcu: stub: read accelerometer position\n");
+                NILE_TRACE(NILE_TRACE_MCU, NILE_TRACE_INFO, "stub: read accelerometer position");
                 response[0] = 0x00;
                 response[1] = 0x00;
                 response[2] = 0x00;
@@ -402,7 +388,7 @@ uint8_t nile_spi_mcu_exchange(uint8_t tx) {
                 spi_mcu_send_response(6, response);
             } break;
             default: {
-                printf("nileswan/spi/mcu: unknown command %02X %04X\n", cmd, arg);
+                NILE_TRACE(NILE_TRACE_MCU, NILE_TRACE_ERROR, "unknown command %02X %04X", cmd, arg);
                 spi_buffer_pop(&spi_mcu.rx, NULL, 2);
                 // send 0x0001 for error
                 response[0] = 0x01;
@@ -415,6 +401,46 @@ uint8_t nile_spi_mcu_exchange(uint8_t tx) {
     return rx;
 }
 
+void nile_spi_mcu_exchange_block(const uint8_t *tx, uint8_t *rx, uint32_t length) {
+    uint32_t pos = 0;
+
+    while (pos < length) {
+        if (!spi_mcu.boot_mode) {
+            if (spi_mcu.tx.pos) {
+                // fast path: stream out a queued response, ignoring incoming bytes
+                uint32_t chunk = spi_mcu.tx.pos;
+                if (chunk > length - pos)
+                    chunk = length - pos;
+                spi_buffer_pop(&spi_mcu.tx, rx != NULL ? rx + pos : NULL, chunk);
+                pos += chunk;
+                continue;
+            }
+
+            uint8_t cmd = spi_buffer_peek(&spi_mcu.rx, 0) & 0x7F;
+            if (spi_mcu.rx.pos >= 2 && spi_buffer_peek(&spi_mcu.rx, 0) != 0xFF
+                && (cmd == MCU_SPI_CMD_USB_CDC_WRITE || cmd == MCU_SPI_CMD_ECHO)) {
+                // fast path: accumulate a command payload, leaving the final byte to the byte-level path
+                uint32_t arg = (spi_buffer_peek(&spi_mcu.rx, 0) >> 7) | (spi_buffer_peek(&spi_mcu.rx, 1) << 1);
+                if (arg == 0) arg = 512;
+                if (spi_mcu.rx.pos + 1 < 2 + arg) {
+                    uint32_t chunk = 2 + arg - 1 - spi_mcu.rx.pos;
+                    if (chunk > length - pos)
+                        chunk = length - pos;
+                    spi_buffer_push(&spi_mcu.rx, tx != NULL ? tx + pos : NULL, chunk);
+                    if (rx != NULL)
+                        memset(rx + pos, 0xFF, chunk);
+                    pos += chunk;
+                    continue;
+                }
+            }
+        }
+
+        uint8_t value = nile_spi_mcu_exchange(tx != NULL ? tx[pos] : 0xFF);
+        if (rx != NULL) rx[pos] = value;
+        pos++;
+    }
+}
+
 void nile_spi_mcu_reset(bool full, bool boot_mode) {
     if (!spi_mcu_persistent_initialized || full) {
         memset(&spi_mcu_persistent, 0, sizeof(spi_mcu_persistent));
@@ -422,5 +448,92 @@ void nile_spi_mcu_reset(bool full, bool boot_mode) {
     }
     memset(&spi_mcu, 0, sizeof(spi_mcu));
     spi_mcu.boot_mode = boot_mode;
-    spi_mcu.cdc_unget = -1;
+}
+
+bool nile_spi_mcu_has_response(void) {
+    return spi_mcu.tx.pos > 0;
+}
+
+void nile_spi_mcu_configure_usb(uint32_t packet_size, uint32_t fifo_depth) {
+    if (packet_size < 8) packet_size = 8;
+    if (packet_size > NILE_USB_PACKET_SIZE_MAX) packet_size = NILE_USB_PACKET_SIZE_MAX;
+    if (fifo_depth < packet_size) fifo_depth = packet_size;
+    if (fifo_depth > SPI_DEVICE_BUFFER_SIZE_BYTES) fifo_depth = SPI_DEVICE_BUFFER_SIZE_BYTES;
+    cdc_packet_size = packet_size;
+    cdc_fifo_depth = fifo_depth;
+}
+
+/*
+ * One USB frame: at most one bulk OUT packet from the host into cdc_rx, and one IN packet
+ * from cdc_tx to the host.  OUT packets are NAKed while cdc_rx can't take a whole packet.
+ * Returns true if data arrived, which the firmware signals with NILE_IRQ_MCU.
+ */
+bool nile_spi_mcu_usb_frame(void) {
+    uint8_t packet[NILE_USB_PACKET_SIZE_MAX];
+    bool received = false;
+
+    if (spi_mcu.boot_mode)
+        return false;
+
+    if (cdc_fifo_depth - spi_mcu.cdc_rx.pos >= cdc_packet_size) {
+        uint32_t len = Comm_RecvBytes(packet, cdc_packet_size);
+        if (len) {
+            spi_buffer_push(&spi_mcu.cdc_rx, packet, len);
+            received = true;
+        }
+    }
+
+    if (spi_mcu.cdc_tx.pos) {
+        uint32_t len = spi_buffer_peek_bytes(&spi_mcu.cdc_tx, 0, packet, cdc_packet_size);
+        spi_buffer_pop(&spi_mcu.cdc_tx, NULL, Comm_SendBytes(packet, len));
+    }
+
+    return received;
+}
+
+/*
+ * Like spi_buffer_sanitize(), but also limits a CDC FIFO to cdc_fifo_depth, which may be smaller than when the
+ * state was saved; the free space computations assume pos <= cdc_fifo_depth.
+ */
+static void cdc_fifo_sanitize(nile_spi_device_buffer_t *buffer) {
+    spi_buffer_sanitize(buffer);
+    if (buffer->pos > cdc_fifo_depth)
+        buffer->pos = cdc_fifo_depth;
+}
+
+void nile_spi_mcu_state_action(StateMem *sm, const unsigned load, const bool data_only) {
+    SFORMAT StateRegs[] = {
+        SFVARN(spi_mcu.tx.data, "tx.data"),
+        SFVARN(spi_mcu.tx.head, "tx.head"),
+        SFVARN(spi_mcu.tx.pos, "tx.pos"),
+        SFVARN(spi_mcu.rx.data, "rx.data"),
+        SFVARN(spi_mcu.rx.head, "rx.head"),
+        SFVARN(spi_mcu.rx.pos, "rx.pos"),
+        SFVARN(spi_mcu.boot_mode, "boot_mode"),
+        SFVARN(spi_mcu.boot_started, "boot_started"),
+        SFVARN(spi_mcu.boot_waiting_ack, "boot_waiting_ack"),
+        SFVARN(spi_mcu.boot_cmd, "boot_cmd"),
+        SFVARN(spi_mcu.boot_step, "boot_step"),
+        SFVARN(spi_mcu.boot_erase_count, "boot_erase_count"),
+        SFVARN(spi_mcu.boot_dest_address, "boot_dest_address"),
+        SFVARN(spi_mcu.cdc_rx.data, "cdc_rx.data"),
+        SFVARN(spi_mcu.cdc_rx.head, "cdc_rx.head"),
+        SFVARN(spi_mcu.cdc_rx.pos, "cdc_rx.pos"),
+        SFVARN(spi_mcu.cdc_tx.data, "cdc_tx.data"),
+        SFVARN(spi_mcu.cdc_tx.head, "cdc_tx.head"),
+        SFVARN(spi_mcu.cdc_tx.pos, "cdc_tx.pos"),
+        SFVARN(spi_mcu_persistent.eeprom_mode, "eeprom_mode"),
+        SFVARN(spi_mcu_persistent.save_id, "save_id"),
+        SFVARN(spi_mcu_persistent.eeprom_data, "eeprom_data"),
+        SFEND
+    };
+
+    MDFNSS_StateAction(sm, load, data_only, StateRegs, "NILEMCU");
+
+    if (load) {
+        spi_buffer_sanitize(&spi_mcu.tx);
+        spi_buffer_sanitize(&spi_mcu.rx);
+        cdc_fifo_sanitize(&spi_mcu.cdc_rx);
+        cdc_fifo_sanitize(&spi_mcu.cdc_tx);
+    }
 }
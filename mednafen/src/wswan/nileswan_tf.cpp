@@ -25,8 +25,36 @@ struct {
 
     bool reading;
     uint8_t writing;
+    uint32_t address;
 } spi_tf;
-FILE *file_tf;
+nile_image_t *image_tf;
+
+static void spi_tf_read_sector(uint8_t *data) {
+    if (image_tf != NULL) {
+        nile_image_read(image_tf, spi_tf.address, data, 512);
+    } else {
+        for (int i = 0; i < 512; i++)
+            data[i] = i;
+    }
+    spi_tf.address += 512;
+}
+
+static void spi_tf_write_sector(const uint8_t *data) {
+    if (image_tf != NULL)
+        nile_image_write(image_tf, spi_tf.address, data, 512);
+    spi_tf.address += 512;
+}
+
+static void spi_tf_queue_next_block(void) {
+    uint8_t response[515];
+
+    response[0] = 0xFE;
+    spi_tf_read_sector(response + 1);
+    // TODO: CRC
+    response[513] = 0xFF;
+    response[514] = 0xFF;
+    spi_buffer_push(&spi_tf.tx, response, 515);
+}
 
 uint8_t nile_spi_tf_exchange(uint8_t tx) {
     uint8_t rx;
@@ -45,7 +73,7 @@ uint8_t nile_spi_tf_exchange(uint8_t tx) {
             return rx;
 
         // remove stall bytes
-        while (spi_tf.rx.data[0] == 0xFF && spi_tf.rx.pos)
+        while (spi_buffer_peek(&spi_tf.rx, 0) == 0xFF && spi_tf.rx.pos)
             spi_buffer_pop(&spi_tf.rx, NULL, 1);
 
         // data token present?
@@ -53,8 +81,8 @@ uint8_t nile_spi_tf_exchange(uint8_t tx) {
             return 0xFF;
 
         if (spi_tf.writing == SPI_TF_WRITING_SINGLE) {
-            if (spi_tf.rx.data[0] != 0xFE) {
-                printf("nileswan/spi/tf: unexpected data block start %02x\n", spi_tf.rx.data[0]);
+            if (spi_buffer_peek(&spi_tf.rx, 0) != 0xFE) {
+                NILE_TRACE(NILE_TRACE_TF, NILE_TRACE_ERROR, "unexpected data block start %02x", spi_buffer_peek(&spi_tf.rx, 0));
                 spi_tf.writing = 0;
                 spi_buffer_pop(&spi_tf.rx, NULL, 1);
                 return 0xFF;
@@ -62,19 +90,18 @@ uint8_t nile_spi_tf_exchange(uint8_t tx) {
             // write data block
             if (spi_tf.rx.pos < 515)
                 return 0xFF;
-            if (!feof(file_tf))
-                fwrite(spi_tf.rx.data + 1, 512, 1, file_tf);
+            spi_buffer_pop(&spi_tf.rx, response, 515);
+            spi_tf_write_sector(response + 1);
             spi_tf.writing = 0;
-            spi_buffer_pop(&spi_tf.rx, NULL, 515);
 
             response[0] = 0xE5;
             spi_buffer_push(&spi_tf.tx, response, 1);
         }
 
         if (spi_tf.writing == SPI_TF_WRITING_MULTIPLE) {
-            if (spi_tf.rx.data[0] != 0xFC) {
-                if (spi_tf.rx.data[0] != 0xFD)
-                    printf("nileswan/spi/tf: unexpected data block start %02x\n", spi_tf.rx.data[0]);
+            if (spi_buffer_peek(&spi_tf.rx, 0) != 0xFC) {
+                if (spi_buffer_peek(&spi_tf.rx, 0) != 0xFD)
+                    NILE_TRACE(NILE_TRACE_TF, NILE_TRACE_ERROR, "unexpected data block start %02x", spi_buffer_peek(&spi_tf.rx, 0));
                 spi_tf.writing = 0;
                 spi_buffer_pop(&spi_tf.rx, NULL, 1);
                 return 0xFF;
@@ -82,49 +109,42 @@ uint8_t nile_spi_tf_exchange(uint8_t tx) {
             // write data block
             if (spi_tf.rx.pos < 515)
                 return 0xFF;
-            if (!feof(file_tf))
-                fwrite(spi_tf.rx.data + 1, 512, 1, file_tf);
-            spi_buffer_pop(&spi_tf.rx, NULL, 515);
+            spi_buffer_pop(&spi_tf.rx, response, 515);
+            spi_tf_write_sector(response + 1);
 
             response[0] = 0xE5;
             spi_buffer_push(&spi_tf.tx, response, 1);
         }
     }
 
-    if (spi_tf.reading && !spi_tf.tx.pos) {
-        response[0] = 0xFE;
-        for (int i = 0; i < 512; i++) {
-            response[1 + i] = file_tf != NULL ? fgetc(file_tf) : i;
-        }
-        // TODO: CRC
-        spi_buffer_push(&spi_tf.tx, response, 515);
-    }
+    if (spi_tf.reading && !spi_tf.tx.pos)
+        spi_tf_queue_next_block();
 
     while (spi_tf.rx.pos >= 6) {
-        while (spi_tf.rx.data[0] >= 0x80 && spi_tf.rx.pos)
+        while (spi_buffer_peek(&spi_tf.rx, 0) >= 0x80 && spi_tf.rx.pos)
             spi_buffer_pop(&spi_tf.rx, NULL, 1);
         if (spi_tf.rx.pos < 6)
             break;
 
-        uint8_t cmd = spi_tf.rx.data[0];
+        uint8_t cmd = spi_buffer_peek(&spi_tf.rx, 0);
         uint32_t arg = 
-            (spi_tf.rx.data[1] << 24) | 
-            (spi_tf.rx.data[2] << 16) | 
-            (spi_tf.rx.data[3] << 8) | 
-            spi_tf.rx.data[4];
+            (spi_buffer_peek(&spi_tf.rx, 1) << 24) | 
+            (spi_buffer_peek(&spi_tf.rx, 2) << 16) | 
+            (spi_buffer_peek(&spi_tf.rx, 3) << 8) | 
+            spi_buffer_peek(&spi_tf.rx, 4);
         uint32_t response_length = 1;
         response[0] = 0;
         switch (cmd & 0x3F) {
             case 0:
-                printf("nileswan/spi/tf: reset\n");
+                NILE_TRACE(NILE_TRACE_TF, NILE_TRACE_INFO, "reset");
                 spi_tf.status = 0x01;
                 break;
             case 1:
-                printf("nileswan/spi/tf: init\n");
+                NILE_TRACE(NILE_TRACE_TF, NILE_TRACE_INFO, "init");
                 spi_tf.status = 0x00;
                 break;
             case 8:
-                printf("nileswan/spi/tf: read interface configuration\n");
+                NILE_TRACE(NILE_TRACE_TF, NILE_TRACE_INFO, "read interface configuration");
                 response[1] = 0;
                 response[2] = 0;
                 response[3] = 0x1;
@@ -132,9 +152,9 @@ uint8_t nile_spi_tf_exchange(uint8_t tx) {
                 response_length = 5;
                 break;
             case 12:
-                printf("nileswan/spi/tf: stop reading\n");
+                NILE_TRACE(NILE_TRACE_TF, NILE_TRACE_INFO, "stop reading");
                 spi_tf.reading = false;
-                spi_tf.tx.pos = 0;
+                spi_buffer_clear(&spi_tf.tx);
                 response[0] = 0xFF; // skipped byte
 		response[1] = 0xFF; // command processing delay
 		response[2] = 0x00; // command response
@@ -143,25 +163,21 @@ uint8_t nile_spi_tf_exchange(uint8_t tx) {
                 response_length = 4 + TF_STOP_TRANSFER_BUSY_DELAY_BYTES;
                 break;
             case 16:
-                printf("nileswan/spi/tf: set block length = %d\n", arg);
+                NILE_TRACE(NILE_TRACE_TF, NILE_TRACE_INFO, "set block length = %d", arg);
                 if (arg != 512)
                     response[0] |= TF_PARAMETER_ERROR;
                 break;
             case 17:
             case 18: {
-                printf("nileswan/spi/tf: reading %s @ %08X\n",
+                NILE_TRACE(NILE_TRACE_TF, NILE_TRACE_INFO, "reading %s @ %08X",
                     (cmd & 0x3F) == 18 ? "multiple sectors" : "single sector",
                     arg);
                 int data_ofs = TF_DATA_BLOCK_READ_DELAY_BYTES;
                 response_length = data_ofs + 515;
                 memset(response + 1, 0xFF, response_length - 1);
-                if (file_tf != NULL) {
-                    fseek(file_tf, arg, SEEK_SET);
-                }
+                spi_tf.address = arg;
                 response[data_ofs] = 0xFE;
-                for (int i = 0; i < 512; i++) {
-                    response[data_ofs + 1 + i] = file_tf != NULL ? fgetc(file_tf) : i;
-                }
+                spi_tf_read_sector(response + data_ofs + 1);
                 // TODO: CRC
                 if ((cmd & 0x3F) == 18) {
                     spi_tf.reading = true;
@@ -169,16 +185,14 @@ uint8_t nile_spi_tf_exchange(uint8_t tx) {
             } break;
             case 24:
             case 25: {
-                printf("nileswan/spi/tf: writing %s @ %08X\n",
+                NILE_TRACE(NILE_TRACE_TF, NILE_TRACE_INFO, "writing %s @ %08X",
                     (cmd & 0x3F) == 25 ? "multiple sectors" : "single sector",
                     arg);
-                if (file_tf != NULL) {
-                    fseek(file_tf, arg, SEEK_SET);
-                }
+                spi_tf.address = arg;
                 spi_tf.writing = (cmd & 0x3F) == 25 ? SPI_TF_WRITING_MULTIPLE : SPI_TF_WRITING_SINGLE;
             } break;
             default:
-                printf("nileswan/spi/tf: unknown command %d\n", cmd & 0x3F);
+                NILE_TRACE(NILE_TRACE_TF, NILE_TRACE_ERROR, "unknown command %d", cmd & 0x3F);
                 response[0] |= TF_ILLEGAL_COMMAND;
                 break;
         }
@@ -189,8 +203,86 @@ uint8_t nile_spi_tf_exchange(uint8_t tx) {
     return rx;
 }
 
+void nile_spi_tf_exchange_block(const uint8_t *tx, uint8_t *rx, uint32_t length) {
+    uint32_t pos = 0;
+
+    if (!nileswan_is_tf_powered()) {
+        if (rx != NULL)
+            memset(rx, 0xFF, length);
+        return;
+    }
+
+    while (pos < length) {
+        if (!spi_tf.writing && !spi_tf.rx.pos) {
+            // fast path: no command pending, stream out the card's response
+            uint32_t run = length - pos;
+            if (tx != NULL) {
+                run = 0;
+                while (pos + run < length && tx[pos + run] >= 0x80)
+                    run++;
+            }
+            while (run > 0) {
+                uint32_t chunk = spi_tf.tx.pos;
+                if (!chunk) {
+                    if (rx != NULL)
+                        memset(rx + pos, 0xFF, run);
+                    pos += run;
+                    break;
+                }
+                if (chunk > run)
+                    chunk = run;
+                spi_buffer_pop(&spi_tf.tx, rx != NULL ? rx + pos : NULL, chunk);
+                pos += chunk;
+                run -= chunk;
+                if (spi_tf.reading && !spi_tf.tx.pos)
+                    spi_tf_queue_next_block();
+            }
+        } else if (spi_tf.writing && !spi_tf.tx.pos && spi_tf.rx.pos
+            && spi_buffer_peek(&spi_tf.rx, 0) == (spi_tf.writing == SPI_TF_WRITING_SINGLE ? 0xFE : 0xFC)
+            && spi_tf.rx.pos < 514) {
+            // fast path: accumulate a data block, leaving the final byte to the byte-level path
+            uint32_t chunk = 514 - spi_tf.rx.pos;
+            if (chunk > length - pos)
+                chunk = length - pos;
+            spi_buffer_push(&spi_tf.rx, tx != NULL ? tx + pos : NULL, chunk);
+            if (rx != NULL)
+                memset(rx + pos, 0xFF, chunk);
+            pos += chunk;
+        }
+
+        if (pos < length) {
+            uint8_t value = nile_spi_tf_exchange(tx != NULL ? tx[pos] : 0xFF);
+            if (rx != NULL) rx[pos] = value;
+            pos++;
+        }
+    }
+}
+
 void nile_spi_tf_reset(bool full) {
     if (full) {
         memset(&spi_tf, 0, sizeof(spi_tf));
     }
 }
+
+void nile_spi_tf_state_action(StateMem *sm, const unsigned load, const bool data_only) {
+    SFORMAT StateRegs[] = {
+        SFVARN(spi_tf.tx.data, "tx.data"),
+        SFVARN(spi_tf.tx.head, "tx.head"),
+        SFVARN(spi_tf.tx.pos, "tx.pos"),
+        SFVARN(spi_tf.rx.data, "rx.data"),
+        SFVARN(spi_tf.rx.head, "rx.head"),
+        SFVARN(spi_tf.rx.pos, "rx.pos"),
+        SFVARN(spi_tf.status, "status"),
+        SFVARN(spi_tf.reading, "reading"),
+        SFVARN(spi_tf.writing, "writing"),
+        SFVARN(spi_tf.address, "address"),
+        SFEND
+    };
+
+    MDFNSS_StateAction(sm, load, data_only, StateRegs, "NILETF");
+
+    if (load) {
+        spi_buffer_sanitize(&spi_tf.tx);
+        spi_buffer_sanitize(&spi_tf.rx);
+    }
+}
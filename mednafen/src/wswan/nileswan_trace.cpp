@@ -0,0 +1,223 @@
+#include "wswan.h"
+#include "v30mz.h"
+#include <mednafen/AtomicFIFO.h>
+#include <mednafen/MThreading.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <atomic>
+#include "nileswan.h"
+
+using namespace MDFN_IEN_WSWAN;
+
+#define TRACE_FIFO_RECORDS 8192
+#define TRACE_DRAIN_INTERVAL_MS 10
+
+typedef struct {
+    uint8_t category;
+    uint8_t level;
+    uint32_t timestamp;
+    char text[NILE_TRACE_TEXT_SIZE];
+} nile_trace_record_t;
+
+static const char *const trace_category_names[NILE_TRACE_CATEGORY_COUNT] = {
+    "spi", "tf", "flash", "mcu", "cdc", "fpga"
+};
+
+static const char *const trace_level_names[] = {
+    "off", "error", "info", "debug"
+};
+
+uint8_t nile_trace_levels[NILE_TRACE_CATEGORY_COUNT];
+
+static AtomicFIFO<nile_trace_record_t, TRACE_FIFO_RECORDS> trace_fifo;
+static std::atomic<uint32_t> trace_dropped;
+
+/* Consumer side; the emulation thread only ever writes to trace_fifo. */
+static MThreading::Mutex *trace_drain_mutex;
+static MThreading::Sem *trace_exit_sem;
+static MThreading::Thread *trace_thread;
+static FILE *trace_file;
+static void (*trace_log_func)(const char *type, const char *text);
+
+void nile_trace_printf(uint8_t category, uint8_t level, const char *format, ...) {
+    if (!trace_fifo.CanWrite()) {
+        trace_dropped.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+
+    nile_trace_record_t record;
+    va_list ap;
+    record.category = category;
+    record.level = level;
+    record.timestamp = v30mz_timestamp;
+    va_start(ap, format);
+    vsnprintf(record.text, sizeof(record.text), format, ap);
+    va_end(ap);
+    trace_fifo.Write(record);
+}
+
+void nile_trace_hexdump(uint8_t category, uint8_t level, const uint8_t *data, uint32_t length) {
+    char line[NILE_TRACE_TEXT_SIZE];
+
+    for (uint32_t pos = 0; pos < length; pos += 32) {
+        uint32_t line_length = length - pos > 32 ? 32 : length - pos;
+        char *p = line;
+        for (uint32_t i = 0; i < line_length; i++) {
+            snprintf(p, 4, i ? " %02x" : "%02x", data[pos + i]);
+            p += i ? 3 : 2;
+        }
+        nile_trace_printf(category, level, "  %03X: %s", pos, line);
+    }
+}
+
+// Must be called with trace_drain_mutex held.
+static void trace_drain_locked(bool to_log_func) {
+    char type[32];
+    uint32_t dropped = trace_dropped.exchange(0, std::memory_order_relaxed);
+
+    if (dropped) {
+        if (trace_file != NULL)
+            fprintf(trace_file, "nileswan/trace: %u messages dropped\n", dropped);
+        if (to_log_func && trace_log_func != NULL)
+            trace_log_func("nileswan/trace", "messages dropped");
+    }
+
+    size_t count = trace_fifo.CanRead();
+    while (count--) {
+        const nile_trace_record_t record = trace_fifo.Read();
+        const char *category_name = trace_category_names[record.category];
+        if (trace_file != NULL)
+            fprintf(trace_file, "[%10u] nileswan/%s: %s\n", record.timestamp, category_name, record.text);
+        if (to_log_func && trace_log_func != NULL) {
+            snprintf(type, sizeof(type), "nileswan/%s", category_name);
+            trace_log_func(type, record.text);
+        }
+    }
+
+    if (trace_file != NULL)
+        fflush(trace_file);
+}
+
+static int trace_thread_entry(void *data) {
+    bool exiting = false;
+
+    while (!exiting) {
+        exiting = MThreading::Sem_TimedWait(trace_exit_sem, TRACE_DRAIN_INTERVAL_MS);
+        MThreading::Mutex_Lock(trace_drain_mutex);
+        // while the log debugger is attached, the game thread drains the FIFO
+        if (trace_log_func == NULL)
+            trace_drain_locked(false);
+        MThreading::Mutex_Unlock(trace_drain_mutex);
+    }
+    return 0;
+}
+
+static int trace_parse_level(const char *name, size_t length) {
+    for (int i = 0; i < (int) (sizeof(trace_level_names) / sizeof(trace_level_names[0])); i++) {
+        if (strlen(trace_level_names[i]) == length && !strncmp(trace_level_names[i], name, length))
+            return i;
+    }
+    if (length == 1 && name[0] >= '0' && name[0] <= '3')
+        return name[0] - '0';
+    return -1;
+}
+
+/*
+ * Parse a trace specification such as "error" or "info,tf=debug,cdc=off".
+ * A bare level applies to all categories; "category=level" overrides one category.
+ */
+static void trace_parse_spec(const char *spec) {
+    memset(nile_trace_levels, NILE_TRACE_ERROR, sizeof(nile_trace_levels));
+
+    while (*spec) {
+        size_t length = strcspn(spec, ", ");
+        const char *equals = (const char*) memchr(spec, '=', length);
+        if (length > 0) {
+            if (equals == NULL) {
+                int level = trace_parse_level(spec, length);
+                if (level >= 0)
+                    memset(nile_trace_levels, level, sizeof(nile_trace_levels));
+                else
+                    printf("nileswan/trace: unknown level \"%.*s\"\n", (int) length, spec);
+            } else {
+                size_t name_length = equals - spec;
+                int level = trace_parse_level(equals + 1, length - name_length - 1);
+                bool found = false;
+                for (int i = 0; i < NILE_TRACE_CATEGORY_COUNT; i++) {
+                    if (strlen(trace_category_names[i]) == name_length && !strncmp(trace_category_names[i], spec, name_length)) {
+                        if (level >= 0)
+                            nile_trace_levels[i] = level;
+                        found = true;
+                    }
+                }
+                if (!found || level < 0)
+                    printf("nileswan/trace: invalid setting \"%.*s\"\n", (int) length, spec);
+            }
+        }
+        spec += length;
+        if (*spec)
+            spec++;
+    }
+}
+
+void nile_trace_init(const char *spec, const char *path) {
+    nile_trace_kill();
+    trace_parse_spec(spec);
+
+    trace_file = stdout;
+    if (path != NULL && *path) {
+        trace_file = fopen(path, "w");
+        if (trace_file == NULL) {
+            printf("nileswan/trace: could not open %s, tracing to stdout\n", path);
+            trace_file = stdout;
+        }
+    }
+
+    trace_drain_mutex = MThreading::Mutex_Create();
+    trace_exit_sem = MThreading::Sem_Create();
+    trace_thread = MThreading::Thread_Create(trace_thread_entry, NULL, "nileswan trace");
+}
+
+void nile_trace_kill(void) {
+    if (trace_thread != NULL) {
+        MThreading::Sem_Post(trace_exit_sem);
+        MThreading::Thread_Wait(trace_thread, NULL);
+        trace_thread = NULL;
+    }
+    if (trace_drain_mutex != NULL) {
+        trace_drain_locked(false);
+        MThreading::Mutex_Destroy(trace_drain_mutex);
+        trace_drain_mutex = NULL;
+    }
+    if (trace_exit_sem != NULL) {
+        MThreading::Sem_Destroy(trace_exit_sem);
+        trace_exit_sem = NULL;
+    }
+    if (trace_file != NULL && trace_file != stdout)
+        fclose(trace_file);
+    trace_file = NULL;
+    memset(nile_trace_levels, NILE_TRACE_OFF, sizeof(nile_trace_levels));
+}
+
+// Called from the game thread.
+void nile_trace_set_log_func(void (*func)(const char *type, const char *text)) {
+    if (trace_drain_mutex == NULL) {
+        trace_log_func = func;
+        return;
+    }
+    MThreading::Mutex_Lock(trace_drain_mutex);
+    trace_log_func = func;
+    MThreading::Mutex_Unlock(trace_drain_mutex);
+}
+
+// Called from the game thread, at the end of each frame.
+void nile_trace_frame_end(void) {
+    if (trace_drain_mutex == NULL || trace_log_func == NULL)
+        return;
+    MThreading::Mutex_Lock(trace_drain_mutex);
+    trace_drain_locked(true);
+    MThreading::Mutex_Unlock(trace_drain_mutex);
+}
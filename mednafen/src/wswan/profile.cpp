@@ -0,0 +1,418 @@
+/* Mednafen - Multi-system Emulator
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+//
+// Sampling profiler for guest code.  Every "interval" CPU cycles an event charges the interval to the linear PC the CPU
+// is at, and to the current node of a call tree that the CALL/RET hooks in the CPU core maintain with a shadow stack.
+// Nothing is done per instruction, so it can stay on while playing.  The results are written in callgrind format(for
+// KCachegrind, QCachegrind, gprof2dot...) when the game is closed, with functions taken from a symbol file when one
+// is given and from the call targets seen otherwise.
+//
+
+#include "wswan.h"
+#include "v30mz.h"
+#include "gfx.h"
+#include "profile.h"
+#include <mednafen/FileStream.h>
+#include <mednafen/string/string.h>
+
+#include <map>
+#include <tuple>
+#include <unordered_map>
+
+namespace MDFN_IEN_WSWAN
+{
+
+enum : uint32 { MAX_NODES = 1 << 20, MAX_DEPTH = 256 };
+
+struct CallNode
+{
+ uint32 parent;
+ uint32 site;		// Linear address of the CALL instruction(or of the interrupted one).
+ uint32 entry;		// Linear call target.
+ uint32 calls;
+ uint64 cycles;		// Sampled in this node itself, not in its callees.
+};
+
+struct StackFrame
+{
+ uint32 node;
+ uint16 sp;		// SP right after the return address was pushed.
+};
+
+struct Symbol
+{
+ uint32 addr;
+ std::string name;
+};
+
+static bool Active = false;
+static std::string OutPath;
+static uint32 Interval;
+static uint64 TotalCycles;
+static std::unique_ptr<uint64[]> PCCycles;	// Indexed by linear PC.
+static std::vector<CallNode> Nodes;		// Node 0 is the root; children always come after their parent.
+static std::unordered_map<uint64, uint32> NodeMap;
+static StackFrame Stack[MAX_DEPTH];
+static unsigned StackDepth;
+static std::vector<Symbol> Symbols;
+
+static INLINE uint32 CurNode(void)
+{
+ return StackDepth ? Stack[StackDepth - 1].node : 0;
+}
+
+static void CallHook(uint32 from, uint32 to, uint16 sp, bool interrupt)
+{
+ // Frames at or below the new return address are left over from code that didn't return normally.
+ while(StackDepth && Stack[StackDepth - 1].sp <= sp)
+  StackDepth--;
+
+ if(StackDepth == MAX_DEPTH)	// Deeper calls are charged to the caller; RET only unwinds frames below its SP, so this stays consistent.
+  return;
+
+ const uint32 parent = CurNode();
+ const uint32 site = interrupt ? from : ((from - 1) & 0xFFFFF);
+ const uint64 key = ((uint64)parent << 40) | ((uint64)site << 20) | to;
+ uint32 node = parent;
+
+ auto it = NodeMap.find(key);
+
+ if(it != NodeMap.end())
+  node = it->second;
+ else if(Nodes.size() < MAX_NODES)
+ {
+  node = Nodes.size();
+  Nodes.push_back({ parent, site, to, 0, 0 });
+  NodeMap[key] = node;
+ }
+
+ if(node != parent)
+  Nodes[node].calls++;
+
+ Stack[StackDepth].node = node;
+ Stack[StackDepth].sp = sp;
+ StackDepth++;
+}
+
+static void ReturnHook(uint16 sp)
+{
+ while(StackDepth && Stack[StackDepth - 1].sp < sp)
+  StackDepth--;
+}
+
+void WSwan_ProfileSample(uint32 timestamp)
+{
+ const uint32 pc = ((v30mz_get_reg(NEC_PS) << 4) + v30mz_get_reg(NEC_PC)) & 0xFFFFF;
+
+ PCCycles[pc] += Interval;
+ Nodes[CurNode()].cycles += Interval;
+ TotalCycles += Interval;
+
+ WSwan_SetEvent(WSEVENT_PROFILE, timestamp + Interval);
+}
+
+void WSwan_ProfileReset(void)
+{
+ if(!Active)
+  return;
+
+ StackDepth = 0;
+ WSwan_SetEvent(WSEVENT_PROFILE, v30mz_timestamp + Interval);
+}
+
+//
+// Symbol files: 32-bit ELF(.symtab), or text with one "address name" or "segment:offset name" per line, which covers GNU ld
+// map files and hand-written lists; "address type name" lines(nm output) are used for code(t/T/w/W) symbols.  ELF values
+// and flat addresses are taken as linear addresses, modulo 1MiB.
+//
+static bool ParseHex(const std::string& s, uint32* v)
+{
+ const char* p = s.c_str();
+ char* end;
+
+ if(!strncmp(p, "0x", 2) || !strncmp(p, "0X", 2))
+  p += 2;
+
+ if(!*p)
+  return false;
+
+ *v = strtoul(p, &end, 16);
+
+ return *end == 0;
+}
+
+static bool ParseAddress(const std::string& s, uint32* addr)
+{
+ const size_t colon = s.find(':');
+ uint32 seg, offs;
+
+ if(colon == std::string::npos)
+  return ParseHex(s, addr);
+
+ if(!ParseHex(s.substr(0, colon), &seg) || !ParseHex(s.substr(colon + 1), &offs) || seg > 0xFFFF || offs > 0xFFFF)
+  return false;
+
+ *addr = (seg << 4) + offs;
+
+ return true;
+}
+
+static bool IsIdentifier(const std::string& s)
+{
+ if(s.empty() || isdigit((unsigned char)s[0]))
+  return false;
+
+ for(char c : s)
+  if(!isalnum((unsigned char)c) && c != '_' && c != '.' && c != '$')
+   return false;
+
+ return true;
+}
+
+static void LoadELFSymbols(const std::vector<uint8>& f)
+{
+ if(f.size() < 0x34 || f[4] != 1 || f[5] != 1)
+  throw MDFN_Error(0, _("Only 32-bit little-endian ELF symbol files are supported."));
+
+ const uint32 shoff = MDFN_de32lsb(&f[0x20]);
+ const uint32 shentsize = MDFN_de16lsb(&f[0x2E]);
+ const uint32 shnum = MDFN_de16lsb(&f[0x30]);
+
+ if(shentsize < 0x28 || shoff > f.size() || (uint64)shnum * shentsize > f.size() - shoff)
+  throw MDFN_Error(0, _("Bad ELF section header table."));
+
+ for(uint32 i = 0; i < shnum; i++)
+ {
+  const uint8* sh = &f[shoff + i * shentsize];
+
+  if(MDFN_de32lsb(sh + 4) != 2)	// SHT_SYMTAB
+   continue;
+
+  const uint32 offs = MDFN_de32lsb(sh + 16);
+  const uint32 size = MDFN_de32lsb(sh + 20);
+  const uint32 link = MDFN_de32lsb(sh + 24);
+
+  if(link >= shnum || offs > f.size() || size > f.size() - offs)
+   throw MDFN_Error(0, _("Bad ELF symbol table."));
+
+  const uint8* strsh = &f[shoff + link * shentsize];
+  const uint32 stroffs = MDFN_de32lsb(strsh + 16);
+  const uint32 strsize = MDFN_de32lsb(strsh + 20);
+
+  if(stroffs > f.size() || strsize > f.size() - stroffs)
+   throw MDFN_Error(0, _("Bad ELF string table."));
+
+  for(uint32 s = 0; s + 16 <= size; s += 16)
+  {
+   const uint8* sym = &f[offs + s];
+   const uint32 name = MDFN_de32lsb(sym + 0);
+   const uint32 value = MDFN_de32lsb(sym + 4);
+   const unsigned type = sym[12] & 0xF;
+   const uint16 shndx = MDFN_de16lsb(sym + 14);
+
+   if((type != 0 && type != 2) || shndx == 0 || shndx >= 0xFF00 || name >= strsize)	// STT_NOTYPE/STT_FUNC, defined in a section
+    continue;
+
+   const char* np = (const char*)&f[stroffs + name];
+   const std::string n(np, strnlen(np, strsize - name));
+
+   if(IsIdentifier(n) && n[0] != '.' && n[0] != '$')
+    Symbols.push_back({ value & 0xFFFFF, n });
+  }
+ }
+}
+
+static void LoadTextSymbols(const std::vector<uint8>& f)
+{
+ size_t pos = 0;
+
+ while(pos < f.size())
+ {
+  size_t eol = pos;
+  std::vector<std::string> tok;
+  uint32 addr;
+
+  while(eol < f.size() && f[eol] != '\n')
+   eol++;
+
+  const std::string line((const char*)&f[pos], eol - pos);
+
+  pos = eol + 1;
+
+  for(size_t i = 0; i < line.size();)
+  {
+   const size_t b = line.find_first_not_of(" \t\r", i);
+
+   if(b == std::string::npos)
+    break;
+
+   i = line.find_first_of(" \t\r", b);
+   tok.push_back(line.substr(b, (i == std::string::npos) ? std::string::npos : (i - b)));
+  }
+
+  if(tok.size() == 3 && tok[1].size() == 1 && strchr("tTwW", tok[1][0]))
+   tok.erase(tok.begin() + 1);
+
+  if(tok.size() == 2 && ParseAddress(tok[0], &addr) && IsIdentifier(tok[1]))
+   Symbols.push_back({ addr & 0xFFFFF, tok[1] });
+ }
+}
+
+static void LoadSymbols(const std::string& path)
+{
+ FileStream fp(path, FileStream::MODE_READ);
+ std::vector<uint8> f(fp.size());
+
+ fp.read(f.data(), f.size());
+
+ if(f.size() >= 4 && !memcmp(f.data(), "\x7F" "ELF", 4))
+  LoadELFSymbols(f);
+ else
+  LoadTextSymbols(f);
+
+ std::stable_sort(Symbols.begin(), Symbols.end(), [](const Symbol& a, const Symbol& b) { return a.addr < b.addr; });
+ Symbols.erase(std::unique(Symbols.begin(), Symbols.end(), [](const Symbol& a, const Symbol& b) { return a.addr == b.addr; }), Symbols.end());
+
+ MDFN_printf(_("Profiler: %u symbols loaded from \"%s\".\n"), (unsigned)Symbols.size(), MDFN_strhumesc(path).c_str());
+}
+
+void WSwan_ProfileInit(const std::string& path, const std::string& symbols_path, uint32 interval)
+{
+ WSwan_ProfileKill();
+
+ if(symbols_path.size())
+  LoadSymbols(symbols_path);
+
+ OutPath = path;
+ Interval = interval;
+ TotalCycles = 0;
+ PCCycles.reset(new uint64[0x100000]());
+ Nodes.push_back({ 0, 0, 0, 0, 0 });
+ StackDepth = 0;
+
+ v30mz_set_call_hooks(CallHook, ReturnHook);
+ Active = true;
+}
+
+void WSwan_ProfileKill(void)
+{
+ if(Active)
+  v30mz_set_call_hooks(NULL, NULL);
+
+ Active = false;
+ PCCycles.reset(nullptr);
+ Nodes.clear();
+ NodeMap.clear();
+ Symbols.clear();
+ StackDepth = 0;
+}
+
+void WSwan_ProfileSave(void)
+{
+ if(!Active)
+  return;
+
+ // Without a symbol file, every call target starts a function.
+ std::vector<Symbol> funcs = Symbols;
+
+ if(funcs.empty())
+ {
+  std::vector<uint32> entries;
+
+  for(size_t i = 1; i < Nodes.size(); i++)
+   entries.push_back(Nodes[i].entry);
+
+  std::sort(entries.begin(), entries.end());
+  entries.erase(std::unique(entries.begin(), entries.end()), entries.end());
+
+  for(uint32 e : entries)
+   funcs.push_back({ e, MDFN_sprintf("sub_%05X", e) });
+ }
+
+ auto resolve = [&](uint32 addr) -> int
+ {
+  auto it = std::upper_bound(funcs.begin(), funcs.end(), addr, [](uint32 a, const Symbol& s) { return a < s.addr; });
+
+  return (int)(it - funcs.begin()) - 1;
+ };
+ auto fname = [&](int fn) -> const char* { return (fn >= 0) ? funcs[fn].name.c_str() : "(unknown)"; };
+
+ // Inclusive cycles per node, and call edges merged by call site and target.  A call into a function that is already
+ // further up the tree only adds its call count, so recursion isn't counted twice.
+ std::vector<uint64> incl(Nodes.size());
+ std::vector<int> callee(Nodes.size());
+ std::map<std::tuple<uint32, uint32>, std::pair<uint64, uint64>> edges;
+
+ for(size_t i = 0; i < Nodes.size(); i++)
+ {
+  incl[i] = Nodes[i].cycles;
+  callee[i] = resolve(Nodes[i].entry);
+ }
+
+ for(size_t i = Nodes.size() - 1; i > 0; i--)
+  incl[Nodes[i].parent] += incl[i];
+
+ for(size_t i = 1; i < Nodes.size(); i++)
+ {
+  auto& e = edges[std::make_tuple(Nodes[i].site, Nodes[i].entry)];
+  bool recursive = false;
+
+  for(uint32 p = Nodes[i].parent; p && !recursive; p = Nodes[p].parent)
+   recursive = (callee[p] == callee[i]);
+
+  e.first += Nodes[i].calls;
+  if(!recursive)
+   e.second += incl[i];
+ }
+
+ FileStream fp(OutPath, FileStream::MODE_WRITE);
+ int cur_fn = -2;
+
+ fp.print_format("# callgrind format\nversion: 1\ncreator: Mednafen WonderSwan profiler\n");
+ fp.print_format("positions: instr\nevents: Cycles\nsummary: %llu\n\n", (unsigned long long)TotalCycles);
+
+ for(uint32 pc = 0; pc < 0x100000; pc++)
+ {
+  if(!PCCycles[pc])
+   continue;
+
+  const int fn = resolve(pc);
+
+  if(fn != cur_fn)
+  {
+   fp.print_format("\nfn=%s\n", fname(fn));
+   cur_fn = fn;
+  }
+
+  fp.print_format("0x%05X %llu\n", pc, (unsigned long long)PCCycles[pc]);
+ }
+
+ for(auto const& e : edges)
+ {
+  const uint32 site = std::get<0>(e.first);
+  const uint32 entry = std::get<1>(e.first);
+
+  fp.print_format("\nfn=%s\ncfn=%s\ncalls=%llu 0x%05X\n0x%05X %llu\n", fname(resolve(site)), fname(resolve(entry)), (unsigned long long)e.second.first, entry, site, (unsigned long long)e.second.second);
+ }
+
+ fp.close();
+
+ MDFN_printf(_("Profiler: %llu cycles sampled, %u call paths; written to \"%s\".\n"), (unsigned long long)TotalCycles, (unsigned)Nodes.size() - 1, MDFN_strhumesc(OutPath).c_str());
+}
+
+}
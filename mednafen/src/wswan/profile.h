@@ -0,0 +1,33 @@
+/* Mednafen - Multi-system Emulator
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef __WSWAN_PROFILE_H
+#define __WSWAN_PROFILE_H
+
+namespace MDFN_IEN_WSWAN
+{
+
+void WSwan_ProfileInit(const std::string& path, const std::string& symbols_path, uint32 interval) MDFN_COLD;
+void WSwan_ProfileSave(void) MDFN_COLD;
+void WSwan_ProfileKill(void) MDFN_COLD;
+
+void WSwan_ProfileReset(void);
+void WSwan_ProfileSample(uint32 timestamp);
+
+}
+
+#endif
@@ -28,6 +28,8 @@
 
 #include "wswan.h"
 #include "rtc.h"
+#include "gfx.h"
+#include "v30mz.h"
 #include <mednafen/Time.h>
 #include <limits.h>
 
@@ -37,7 +39,7 @@ using namespace CDUtility;
 namespace MDFN_IEN_WSWAN
 {
 
-static uint32 ClockCycleCounter;
+static uint32 NextClockTS;	// When the next second ends; the RTC runs at 3072000 cycles a second, through resets.
 
 static uint8 Command;
 static uint8 CommandBuffer[7];
@@ -224,21 +226,23 @@ uint8 RTC_Read(uint8 A)
  return(ret);
 }
 
-void RTC_Clock(uint32 cycles)
+void RTC_Event(uint32 timestamp)
 {
- ClockCycleCounter += cycles;
+ RTC.Clock();
 
- while(ClockCycleCounter >= 3072000)
- {
-  ClockCycleCounter -= 3072000;
-  RTC.Clock();
- }
+ NextClockTS = timestamp + 3072000;
+ WSwan_SetEvent(WSEVENT_RTC, NextClockTS);
+}
+
+void RTC_ResetTS(uint32 timestamp)
+{
+ NextClockTS -= timestamp;
 }
 
-void RTC_Init(void)
+void RTC_Init(int64 epoch)
 {
- RTC.Init(Time::LocalTime());
- ClockCycleCounter = 0;
+ RTC.Init((epoch < 0) ? Time::LocalTime() : Time::UTCTime(epoch));
+ NextClockTS = 3072000;
 
 #if 0
  {
@@ -274,10 +278,17 @@ void RTC_Reset(void)
  memset(CommandBuffer, 0, sizeof(CommandBuffer));
  CommandIndex = 0;
  CommandCount = 0;
+
+ // The CPU restarts its timestamps at the start of a line, so the second keeps ending at one.
+ NextClockTS = (NextClockTS + 255) &~ 255;
+ WSwan_SetEvent(WSEVENT_RTC, NextClockTS);
 }
 
 void RTC_StateAction(StateMem *sm, const unsigned load, const bool data_only)
 {
+ // Cycles into the current second.
+ uint32 ClockCycleCounter = 3072000 - (NextClockTS - (v30mz_timestamp + v30mz_ICount));
+
  SFORMAT StateRegs[] =
  {
   SFVAR(RTC.sec),
@@ -302,6 +313,9 @@ void RTC_StateAction(StateMem *sm, const unsigned load, const bool data_only)
  if(load)
  {
   CommandCount = std::min<unsigned>(CommandCount, sizeof(CommandBuffer));
+
+  NextClockTS = v30mz_timestamp + v30mz_ICount + 3072000 - std::min<uint32>(ClockCycleCounter, 3072000);
+  WSwan_SetEvent(WSEVENT_RTC, NextClockTS);
  }
 }
 
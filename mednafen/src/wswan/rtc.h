@@ -48,10 +48,11 @@ GenericRTC *RTC_Get(void);
 void RTC_Write(uint8 A, uint8 V);
 uint8 RTC_Read(uint8 A);
 
-void RTC_Init(void) MDFN_COLD;
+void RTC_Init(int64 epoch) MDFN_COLD;
 void RTC_Reset(void);
 
-void RTC_Clock(uint32 cycles);
+void RTC_Event(uint32 timestamp);
+void RTC_ResetTS(uint32 timestamp);
 void RTC_StateAction(StateMem *sm, const unsigned load, const bool data_only);
 
 }
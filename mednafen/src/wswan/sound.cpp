@@ -49,6 +49,10 @@ static uint8 SampleRAMPos;
 
 static int32 sample_cache[4][2];
 
+static int32 wave_cache[4][32][2];	// MK_SAMPLE_CACHE results for each sample position, l&r
+static uint8 wave_cache_dirty;		// One bit per channel; volume or wavetable RAM changed
+static uint8 wave_cache_flat;		// One bit per channel; all 32 positions give the same output
+
 static int32 last_v_val;
 
 static uint8 HyperVoice;
@@ -64,10 +68,8 @@ static uint32 last_ts;
 
 #define MK_SAMPLE_CACHE	\
    {    \
-    int sample; \
-    sample = (((wsRAM[((SampleRAMPos << 6) + (sample_pos[ch] >> 1) + (ch << 4)) ] >> ((sample_pos[ch] & 1) ? 4 : 0)) & 0x0F)); \
-    sample_cache[ch][0] = sample * ((volume[ch] >> 4) & 0x0F); \
-    sample_cache[ch][1] = sample * ((volume[ch] >> 0) & 0x0F); \
+    sample_cache[ch][0] = wave_cache[ch][sample_pos[ch]][0]; \
+    sample_cache[ch][1] = wave_cache[ch][sample_pos[ch]][1]; \
    }
 
 #define MK_SAMPLE_CACHE_NOISE \
@@ -88,42 +90,122 @@ static uint32 last_ts;
    }
 
 
+// Zero deltas are dropped; they would not change the Blip_Buffer contents.
 #define SYNCSAMPLE(wt)	\
    {	\
     int32 left = sample_cache[ch][0], right = sample_cache[ch][1];	\
-    WaveSynth.offset_inline(wt, left - last_val[ch][0], sbuf[0]);	\
-    WaveSynth.offset_inline(wt, right - last_val[ch][1], sbuf[1]);	\
-    last_val[ch][0] = left;	\
-    last_val[ch][1] = right;	\
+    if(left != last_val[ch][0])	\
+    {	\
+     WaveSynth.offset_inline(wt, left - last_val[ch][0], sbuf[0]);	\
+     last_val[ch][0] = left;	\
+    }	\
+    if(right != last_val[ch][1])	\
+    {	\
+     WaveSynth.offset_inline(wt, right - last_val[ch][1], sbuf[1]);	\
+     last_val[ch][1] = right;	\
+    }	\
    }
 
 #define SYNCSAMPLE_NOISE(wt) SYNCSAMPLE(wt)
 
-void WSwan_SoundUpdate(void)
+static void UpdateWaveCache(const unsigned ch)
+{
+ const uint8* wave = &wsRAM[(SampleRAMPos << 6) + (ch << 4)];
+ bool flat = true;
+
+ for(unsigned pos = 0; pos < 32; pos++)
+ {
+  const int32 sample = (wave[pos >> 1] >> ((pos & 1) ? 4 : 0)) & 0x0F;
+
+  wave_cache[ch][pos][0] = sample * ((volume[ch] >> 4) & 0x0F);
+  wave_cache[ch][pos][1] = sample * ((volume[ch] >> 0) & 0x0F);
+
+  flat &= (wave_cache[ch][pos][0] == wave_cache[ch][0][0]) && (wave_cache[ch][pos][1] == wave_cache[ch][0][1]);
+ }
+
+ wave_cache_dirty &= ~(1U << ch);
+ wave_cache_flat = (wave_cache_flat & ~(1U << ch)) | (flat << ch);
+}
+
+// Steps a wavetable channel past all the ticks due in this update in one go when none of them can
+// change its output, i.e. every sample position gives the value it is already outputting.
+static INLINE void SkipSilentTicks(const unsigned ch, const uint32 tmp_pt)
+{
+ if(period_counter[ch] > 0 || !(wave_cache_flat & (1U << ch)))
+  return;
+
+ if(wave_cache[ch][0][0] != last_val[ch][0] || wave_cache[ch][0][1] != last_val[ch][1])
+  return;
+
+ const uint32 ticks = (uint32)-period_counter[ch] / tmp_pt + 1;
+
+ sample_pos[ch] = (sample_pos[ch] + ticks) & 0x1F;
+ period_counter[ch] += ticks * tmp_pt;
+}
+
+// Outputs that follow register values directly rather than running on a period counter:
+// channel 1 in D/A (voice) mode, and HyperVoice.
+static void SyncDirectOutputs(const uint32 timestamp)
+{
+ if(control & 0x20) // Direct D/A mode?
+ {
+  const unsigned ch = 1;
+
+  MK_SAMPLE_CACHE_VOICE;
+  SYNCSAMPLE(timestamp);
+ }
+
+ if(HVoiceCtrl & 0x80)
+ {
+  int16 sample = (uint8)HyperVoice;
+
+  switch(HVoiceCtrl & 0xC)
+  {
+   case 0x0: sample = (uint16)sample << (8 - (HVoiceCtrl & 3)); break;
+   case 0x4: sample = (uint16)(sample | -0x100) << (8 - (HVoiceCtrl & 3)); break;
+   case 0x8: sample = (uint16)((int8)sample) << (8 - (HVoiceCtrl & 3)); break;
+   case 0xC: sample = (uint16)sample << 8; break;
+  }
+  // bring back to 11bit, keeping signedness
+  sample >>= 5;
+
+  int32 left, right;
+  left  = (HVoiceChanCtrl & 0x40) ? sample : 0;
+  right = (HVoiceChanCtrl & 0x20) ? sample : 0;
+
+  if(left != last_hv_val[0])
+   WaveSynth.offset_inline(timestamp, left - last_hv_val[0], sbuf[0]);
+  if(right != last_hv_val[1])
+   WaveSynth.offset_inline(timestamp, right - last_hv_val[1], sbuf[1]);
+  last_hv_val[0] = left;
+  last_hv_val[1] = right;
+ }
+}
+
+static void WSwan_SoundUpdate(const uint32 timestamp)
 {
  int32 run_time;
 
  //printf("%d\n", v30mz_timestamp);
  //printf("%02x %02x\n", control, noise_control);
- run_time = v30mz_timestamp - last_ts;
+ run_time = timestamp - last_ts;
 
  for(unsigned int ch = 0; ch < 4; ch++)
  {
-  if(ch == 1 && (control & 0x20)) // Direct D/A mode?
-  {
-   MK_SAMPLE_CACHE_VOICE;
-   SYNCSAMPLE(v30mz_timestamp);
+  if(ch == 1 && (control & 0x20)) // Direct D/A mode, see SyncDirectOutputs()
    continue;
-  }
 
   // Channel is disabled?
   if(!(control & (1 << ch)))
    continue;
 
+  if(wave_cache_dirty & (1U << ch))
+   UpdateWaveCache(ch);
+
   if(ch == 2 && (control & 0x40) && sweep_value) // Sweep
   {
    uint32 tmp_pt = 2048 - period[ch];
-   uint32 meow_timestamp = v30mz_timestamp - run_time;
+   uint32 meow_timestamp = timestamp - run_time;
    uint32 tmp_run_time = run_time;
 
    while(tmp_run_time)
@@ -149,6 +231,7 @@ void WSwan_SoundUpdate(void)
     if(tmp_pt > 4)
     {
      period_counter[ch] -= sub_run_time;
+     SkipSilentTicks(ch, tmp_pt);
      while(period_counter[ch] <= 0)
      {
       sample_pos[ch] = (sample_pos[ch] + 1) & 0x1F;
@@ -175,13 +258,13 @@ void WSwan_SoundUpdate(void)
     if(control & 0x80)
     {
      MK_SAMPLE_CACHE_NOISE;
-     SYNCSAMPLE_NOISE(v30mz_timestamp + period_counter[ch]);
+     SYNCSAMPLE_NOISE(timestamp + period_counter[ch]);
     }
     else if(tmp_pt > 4)
     {
      sample_pos[ch] = (sample_pos[ch] + 1) & 0x1F;
      MK_SAMPLE_CACHE;
-     SYNCSAMPLE(v30mz_timestamp + period_counter[ch]);
+     SYNCSAMPLE(timestamp + period_counter[ch]);
     }
     period_counter[ch] += tmp_pt;
    }
@@ -193,47 +276,26 @@ void WSwan_SoundUpdate(void)
    if(tmp_pt > 4)
    {
     period_counter[ch] -= run_time;
+    SkipSilentTicks(ch, tmp_pt);
     while(period_counter[ch] <= 0)
     {
      sample_pos[ch] = (sample_pos[ch] + 1) & 0x1F;
 
      MK_SAMPLE_CACHE;
-     SYNCSAMPLE(v30mz_timestamp + period_counter[ch]); // - period_counter[ch]);
+     SYNCSAMPLE(timestamp + period_counter[ch]); // - period_counter[ch]);
      period_counter[ch] += tmp_pt;
     }
    }
   }
  }
 
- if(HVoiceCtrl & 0x80)
- {
-  int16 sample = (uint8)HyperVoice;
-
-  switch(HVoiceCtrl & 0xC)
-  {
-   case 0x0: sample = (uint16)sample << (8 - (HVoiceCtrl & 3)); break;
-   case 0x4: sample = (uint16)(sample | -0x100) << (8 - (HVoiceCtrl & 3)); break;
-   case 0x8: sample = (uint16)((int8)sample) << (8 - (HVoiceCtrl & 3)); break;
-   case 0xC: sample = (uint16)sample << 8; break;
-  }
-  // bring back to 11bit, keeping signedness
-  sample >>= 5;
-
-  int32 left, right;
-  left  = (HVoiceChanCtrl & 0x40) ? sample : 0;
-  right = (HVoiceChanCtrl & 0x20) ? sample : 0;
-
-  WaveSynth.offset_inline(v30mz_timestamp, left - last_hv_val[0], sbuf[0]);
-  WaveSynth.offset_inline(v30mz_timestamp, right - last_hv_val[1], sbuf[1]);
-  last_hv_val[0] = left;
-  last_hv_val[1] = right;
- }
- last_ts = v30mz_timestamp;
+ SyncDirectOutputs(timestamp);
+ last_ts = timestamp;
 }
 
 void WSwan_SoundWrite(uint32 A, uint8 V)
 {
- WSwan_SoundUpdate();
+ WSwan_SoundUpdate(v30mz_timestamp);
 
  if(A >= 0x80 && A <= 0x87)
  {
@@ -249,6 +311,7 @@ void WSwan_SoundWrite(uint32 A, uint8 V)
  else if(A >= 0x88 && A <= 0x8B)
  {
   volume[A - 0x88] = V;
+  wave_cache_dirty |= 1U << (A - 0x88);
  }
  else if(A == 0x8C)
   sweep_value = V;
@@ -297,16 +360,40 @@ void WSwan_SoundWrite(uint32 A, uint8 V)
  {
   case 0x6A: HVoiceCtrl = V; break;
   case 0x6B: HVoiceChanCtrl = V & 0x6F; break;
-  case 0x8F: SampleRAMPos = V; break;
+  case 0x8F: SampleRAMPos = V; wave_cache_dirty = 0xF; break;
   case 0x95: HyperVoice = V; break; // Pick a port, any port?!
   //default: printf("%04x:%02x\n", A, V); break;
  }
- WSwan_SoundUpdate();
+
+ // The channels have already been run up to v30mz_timestamp, so only the outputs that follow the
+ // registers directly can change here.
+ SyncDirectOutputs(v30mz_timestamp);
+}
+
+// Sound DMA store to 0x89 (channel 1 volume, i.e. the D/A voice sample) or 0x95 (HyperVoice),
+// taking effect at "timestamp", which may be a little behind v30mz_timestamp.
+void WSwan_SoundDMAWrite(uint32 A, uint8 V, uint32 timestamp)
+{
+ timestamp = std::max<uint32>(timestamp, last_ts);
+ WSwan_SoundUpdate(timestamp);
+
+ if(A == 0x95)
+  HyperVoice = V;
+ else
+ {
+  volume[1] = V;
+  wave_cache_dirty |= 1U << 1;
+ }
+
+ SyncDirectOutputs(timestamp);
 }
 
 uint8 WSwan_SoundRead(uint32 A)
 {
- WSwan_SoundUpdate();
+ // Only the noise LFSR and a running sweep change on their own over time.  (A swept period takes
+ // effect at the next update, so keep updating on every read while the sweep runs.)
+ if(A == 0x92 || A == 0x93 || ((control & 0x40) && sweep_value))
+  WSwan_SoundUpdate(v30mz_timestamp);
 
  if(A >= 0x80 && A <= 0x87)
  {
@@ -341,7 +428,7 @@ int32 WSwan_SoundFlush(int16 *SoundBuf, const int32 MaxSoundFrames)
 {
 	int32 FrameCount = 0;
 
-	WSwan_SoundUpdate();
+	WSwan_SoundUpdate(v30mz_timestamp);
 
 	if(SoundBuf)
 	{
@@ -361,7 +448,10 @@ int32 WSwan_SoundFlush(int16 *SoundBuf, const int32 MaxSoundFrames)
 void WSwan_SoundCheckRAMWrite(uint32 A)
 {
  if((A >> 6) == SampleRAMPos)
-  WSwan_SoundUpdate();
+ {
+  WSwan_SoundUpdate(v30mz_timestamp);
+  wave_cache_dirty |= 1U << ((A >> 4) & 0x3);
+ }
 }
 
 static void RedoVolume(void)
@@ -435,6 +525,8 @@ void WSwan_SoundStateAction(StateMem *sm, const unsigned load, const bool data_o
   if(sweep_8192_divider < 1)
    sweep_8192_divider = 1;
 
+  wave_cache_dirty = 0xF;
+
   for(unsigned ch = 0; ch < 4; ch++)
   {
    period[ch] &= 0x7FF;
@@ -469,6 +561,7 @@ void WSwan_SoundReset(void)
  nreg = 0;
 
  memset(sample_cache, 0, sizeof(sample_cache));
+ wave_cache_dirty = 0xF;
  memset(last_val, 0, sizeof(last_val));
  last_v_val = 0;
 
@@ -34,6 +34,7 @@ bool WSwan_SetSoundRate(uint32 rate);
 void WSwan_SoundStateAction(StateMem *sm, const unsigned load, const bool data_only);
 
 void WSwan_SoundWrite(uint32, uint8);
+void WSwan_SoundDMAWrite(uint32 A, uint8 V, uint32 timestamp);
 uint8 WSwan_SoundRead(uint32);
 void WSwan_SoundReset(void);
 void WSwan_SoundCheckRAMWrite(uint32 A);
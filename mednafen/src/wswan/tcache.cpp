@@ -26,283 +26,88 @@ namespace MDFN_IEN_WSWAN
 {
 
 
-static uint8	tiles[256][256][2][8];
-uint8	wsTCache[512*64];			
-uint8	wsTCache2[512*64];			
+// Decoded tiles, 8x8 bytes each; wsTCache*2 hold the second tile bank in color modes.
+uint8	wsTCache[512*64];
+uint8	wsTCache2[512*64];
 uint8	wsTCacheFlipped[512*64];
 uint8	wsTCacheFlipped2[512*64];
-uint8	wsTCacheUpdate[512];		
-uint8	wsTCacheUpdate2[512];		  
-uint8	wsTileRow[8];
-int	wsVMode;				
+uint8	wsTCacheDirty[0x10000 >> 7];	// one bit per 16 bytes of wsRAM, set by WSWan_TCacheInvalidByAddr()
+int	wsVMode;
 
-void WSWan_TCacheInvalidByAddr(uint32 ws_offset)
-{
-  if(wsIs4bpp() && (ws_offset>=0x4000)&&(ws_offset<0x8000))
-  {
-   wsTCacheUpdate[(ws_offset-0x4000)>>5]=false; /*invalidate tile*/
-   return;
-  }
-  else if((ws_offset>=0x2000)&&(ws_offset<0x4000))
-  {
-   wsTCacheUpdate[(ws_offset-0x2000)>>4]=false; /*invalidate tile*/
-   return;
-  }
-
-  if(wsIs4bpp() && (ws_offset>=0x8000)&&(ws_offset<0xc000))
-  {
-   wsTCacheUpdate2[(ws_offset-0x8000)>>5]=false; /*invalidate tile*/
-   return;
-  }
-  else if(wsIsColor() && (ws_offset>=0x4000)&&(ws_offset<0x6000))
-  {
-   wsTCacheUpdate2[(ws_offset-0x4000)>>4]=false; /*invalidate tile*/
-   return;
-  }
-}
+static uint64 PlaneExpand[256];	// bit (7 - i) of the index in byte i(LSB first)
+static uint16 NibbleSplit[256];	// high nibble of the index in the low byte, low nibble in the high byte
 
 void wsSetVideo(int number,bool force)
 {
  if((number!=wsVMode)||(force))
  { 
   wsVMode=number;
-  memset(wsTCacheUpdate,0,512);
-  memset(wsTCacheUpdate2,0,512);
+  memset(wsTCacheDirty, 0xFF, sizeof(wsTCacheDirty));
  }
 }
 
 void wsMakeTiles(void)
 {
- int	x,y,b0,b1,b2,b3,b4,b5,b6,b7;
- for(x=0;x<256;x++)
-	 for(y=0;y<256;y++)
-	 {
-		b0=(x&128)>>7;b1=(x&64)>>6;b2=(x&32)>>5;b3=(x&16)>>4;b4=(x&8)>>3;b5=(x&4)>>2;b6=(x&2)>>1;b7=(x&1);
-		b0|=(y&128)>>6;b1|=(y&64)>>5;b2|=(y&32)>>4;b3|=(y&16)>>3;b4|=(y&8)>>2;b5|=(y&4)>>1;b6|=(y&2);b7|=(y&1)<<1;
-		tiles[x][y][0][0]=b0;
-		tiles[x][y][0][1]=b1;
-		tiles[x][y][0][2]=b2;
-		tiles[x][y][0][3]=b3;
-		tiles[x][y][0][4]=b4;
-		tiles[x][y][0][5]=b5;
-		tiles[x][y][0][6]=b6;
-		tiles[x][y][0][7]=b7;
-		tiles[x][y][1][0]=b7;
-		tiles[x][y][1][1]=b6;
-		tiles[x][y][1][2]=b5;
-		tiles[x][y][1][3]=b4;
-		tiles[x][y][1][4]=b3;
-		tiles[x][y][1][5]=b2;
-		tiles[x][y][1][6]=b1;
-		tiles[x][y][1][7]=b0;
-	 }
+ for(unsigned x = 0; x < 256; x++)
+ {
+  uint64 e = 0;
+
+  for(unsigned i = 0; i < 8; i++)
+   e |= (uint64)((x >> (7 - i)) & 1) << (i * 8);
+
+  PlaneExpand[x] = e;
+  NibbleSplit[x] = (x >> 4) | ((x & 0xF) << 8);
+ }
 }
 
-void wsGetTile(uint32 number,uint32 line,int flipv,int fliph,int bank)
+static INLINE uint64 DecodeTileRow(const uint8* src)
 {
- uint32		t_adr,t_index,i;
- uint8		byte0,byte1,byte2,byte3;
-
- if((!bank)||(!(wsVMode &0x07)))
+ switch(wsVMode)
  {
+  case 7:
+	return NibbleSplit[src[0]] | ((uint64)NibbleSplit[src[1]] << 16) | ((uint64)NibbleSplit[src[2]] << 32) | ((uint64)NibbleSplit[src[3]] << 48);
 
-#ifdef TCACHE_OFF
- wsTCacheUpdate[number]=false;
-#endif
-	 
-  if(!wsTCacheUpdate[number])
-  {
-   wsTCacheUpdate[number]=true;
-   switch(wsVMode)
-   {
-	case 7:
-	 t_adr=0x4000+(number<<5);
-	 t_index=number<<6;
-	 for(i=0;i<8;i++)
-	 {
-	  byte0=wsRAM[t_adr++];
-	  byte1=wsRAM[t_adr++];
-	  byte2=wsRAM[t_adr++];
-	  byte3=wsRAM[t_adr++];
-	  wsTCache[t_index]=byte0>>4;
-	  wsTCacheFlipped[t_index++]=byte3&15;
-	  wsTCache[t_index]=byte0&15;
-	  wsTCacheFlipped[t_index++]=byte3>>4;
-	  wsTCache[t_index]=byte1>>4;
-	  wsTCacheFlipped[t_index++]=byte2&15;
-      wsTCache[t_index]=byte1&15;
-	  wsTCacheFlipped[t_index++]=byte2>>4;
-	  wsTCache[t_index]=byte2>>4;
-	  wsTCacheFlipped[t_index++]=byte1&15;
-	  wsTCache[t_index]=byte2&15;
-	  wsTCacheFlipped[t_index++]=byte1>>4;
-	  wsTCache[t_index]=byte3>>4;
-	  wsTCacheFlipped[t_index++]=byte0&15;
-	  wsTCache[t_index]=byte3&15;
-	  wsTCacheFlipped[t_index++]=byte0>>4;
-	 }
-	break;
-
-	case 6:
-     t_adr=0x4000+(number<<5);
-	 t_index=number<<6;
-	 for(i=0;i<8;i++)
-	 {
-	  byte0=wsRAM[t_adr++];
-	  byte1=wsRAM[t_adr++];
-	  byte2=wsRAM[t_adr++];
-	  byte3=wsRAM[t_adr++];
-	  wsTCache[t_index]=((byte0>>7)&1)|(((byte1>>7)&1)<<1)|(((byte2>>7)&1)<<2)|(((byte3>>7)&1)<<3);
-	  wsTCacheFlipped[t_index++]=((byte0)&1)|(((byte1)&1)<<1)|(((byte2)&1)<<2)|(((byte3)&1)<<3);
-	  wsTCache[t_index]=((byte0>>6)&1)|(((byte1>>6)&1)<<1)|(((byte2>>6)&1)<<2)|(((byte3>>6)&1)<<3);
-	  wsTCacheFlipped[t_index++]=((byte0>>1)&1)|(((byte1>>1)&1)<<1)|(((byte2>>1)&1)<<2)|(((byte3>>1)&1)<<3);
-	  wsTCache[t_index]=((byte0>>5)&1)|(((byte1>>5)&1)<<1)|(((byte2>>5)&1)<<2)|(((byte3>>5)&1)<<3);
-	  wsTCacheFlipped[t_index++]=((byte0>>2)&1)|(((byte1>>2)&1)<<1)|(((byte2>>2)&1)<<2)|(((byte3>>2)&1)<<3);
-	  wsTCache[t_index]=((byte0>>4)&1)|(((byte1>>4)&1)<<1)|(((byte2>>4)&1)<<2)|(((byte3>>4)&1)<<3);
-	  wsTCacheFlipped[t_index++]=((byte0>>3)&1)|(((byte1>>3)&1)<<1)|(((byte2>>3)&1)<<2)|(((byte3>>3)&1)<<3);
-	  wsTCache[t_index]=((byte0>>3)&1)|(((byte1>>3)&1)<<1)|(((byte2>>3)&1)<<2)|(((byte3>>3)&1)<<3);
-	  wsTCacheFlipped[t_index++]=((byte0>>4)&1)|(((byte1>>4)&1)<<1)|(((byte2>>4)&1)<<2)|(((byte3>>4)&1)<<3);
-	  wsTCache[t_index]=((byte0>>2)&1)|(((byte1>>2)&1)<<1)|(((byte2>>2)&1)<<2)|(((byte3>>2)&1)<<3);
-	  wsTCacheFlipped[t_index++]=((byte0>>5)&1)|(((byte1>>5)&1)<<1)|(((byte2>>5)&1)<<2)|(((byte3>>5)&1)<<3);
-	  wsTCache[t_index]=((byte0>>1)&1)|(((byte1>>1)&1)<<1)|(((byte2>>1)&1)<<2)|(((byte3>>1)&1)<<3);
-	  wsTCacheFlipped[t_index++]=((byte0>>6)&1)|(((byte1>>6)&1)<<1)|(((byte2>>6)&1)<<2)|(((byte3>>6)&1)<<3);
-	  wsTCache[t_index]=((byte0)&1)|(((byte1)&1)<<1)|(((byte2)&1)<<2)|(((byte3)&1)<<3);
-	  wsTCacheFlipped[t_index++]=((byte0>>7)&1)|(((byte1>>7)&1)<<1)|(((byte2>>7)&1)<<2)|(((byte3>>7)&1)<<3);
-	 }
-    break;
+  case 6:
+	return PlaneExpand[src[0]] | (PlaneExpand[src[1]] << 1) | (PlaneExpand[src[2]] << 2) | (PlaneExpand[src[3]] << 3);
 
-	default:
-	 t_adr=0x2000+(number<<4);
-	 t_index=number<<6;
-	 for(i=0;i<8;i++)
-	 {
-	  byte0=wsRAM[t_adr++];
-	  byte1=wsRAM[t_adr++];
-	  wsTCache[t_index]=tiles[byte0][byte1][0][0];
-	  wsTCacheFlipped[t_index++]=tiles[byte0][byte1][1][0];
-          wsTCache[t_index]=tiles[byte0][byte1][0][1];
-	  wsTCacheFlipped[t_index++]=tiles[byte0][byte1][1][1];
-          wsTCache[t_index]=tiles[byte0][byte1][0][2];
- 	  wsTCacheFlipped[t_index++]=tiles[byte0][byte1][1][2];
-          wsTCache[t_index]=tiles[byte0][byte1][0][3];
-	  wsTCacheFlipped[t_index++]=tiles[byte0][byte1][1][3];
-          wsTCache[t_index]=tiles[byte0][byte1][0][4];
-	  wsTCacheFlipped[t_index++]=tiles[byte0][byte1][1][4];
-          wsTCache[t_index]=tiles[byte0][byte1][0][5];
-	  wsTCacheFlipped[t_index++]=tiles[byte0][byte1][1][5];
-          wsTCache[t_index]=tiles[byte0][byte1][0][6];
-	  wsTCacheFlipped[t_index++]=tiles[byte0][byte1][1][6];
-          wsTCache[t_index]=tiles[byte0][byte1][0][7];
-	  wsTCacheFlipped[t_index++]=tiles[byte0][byte1][1][7];
-	 }
-	}
-  }
-  if(flipv)
-   line=7-line;
-  if(fliph)
-   memcpy(&wsTileRow[0],&wsTCacheFlipped[(number<<6)|(line<<3)],8);
-  else
-   memcpy(&wsTileRow[0],&wsTCache[(number<<6)|(line<<3)],8);
+  default:
+	return PlaneExpand[src[0]] | (PlaneExpand[src[1]] << 1);
  }
- else
- {
+}
+
+// Returns the 8 pixels of row "line" of the tile, decoding it first if its wsRAM was written.
+const uint8* wsGetTile(uint32 number,uint32 line,int flipv,int fliph,int bank)
+{
+ const bool bank2 = bank && (wsVMode & 0x07);
+ const bool is4bpp = (wsVMode == 6 || wsVMode == 7);
+ const uint32 t_adr = is4bpp ? ((bank2 ? 0x8000 : 0x4000) + (number << 5)) : ((bank2 ? 0x4000 : 0x2000) + (number << 4));
+ const uint8 dirty_mask = (is4bpp ? 0x3 : 0x1) << ((t_adr >> 4) & 7);
+ uint8* const tc = (bank2 ? wsTCache2 : wsTCache) + (number << 6);
+ uint8* const tc_flipped = (bank2 ? wsTCacheFlipped2 : wsTCacheFlipped) + (number << 6);
 
 #ifdef TCACHE_OFF
- wsTCacheUpdate2[number]=false;
+ wsTCacheDirty[t_adr >> 7] |= dirty_mask;
 #endif
-	 
-  if(!wsTCacheUpdate2[number])
+
+ if(wsTCacheDirty[t_adr >> 7] & dirty_mask)
+ {
+  const uint32 row_bytes = is4bpp ? 4 : 2;
+
+  wsTCacheDirty[t_adr >> 7] &= ~dirty_mask;
+
+  for(unsigned y = 0; y < 8; y++)
   {
-   wsTCacheUpdate2[number]=true;
-   switch(wsVMode)
-   {
-	case 7:
-     t_adr=0x8000+(number<<5);
-	 t_index=number<<6;
-	 for(i=0;i<8;i++)
-	 {
-	  byte0=wsRAM[t_adr++];
-	  byte1=wsRAM[t_adr++];
-	  byte2=wsRAM[t_adr++];
-	  byte3=wsRAM[t_adr++];
-	  wsTCache2[t_index]=byte0>>4;
-	  wsTCacheFlipped2[t_index++]=byte3&15;
-	  wsTCache2[t_index]=byte0&15;
-	  wsTCacheFlipped2[t_index++]=byte3>>4;
-	  wsTCache2[t_index]=byte1>>4;
-	  wsTCacheFlipped2[t_index++]=byte2&15;
-	  wsTCache2[t_index]=byte1&15;
-	  wsTCacheFlipped2[t_index++]=byte2>>4;
-	  wsTCache2[t_index]=byte2>>4;
-	  wsTCacheFlipped2[t_index++]=byte1&15;
-	  wsTCache2[t_index]=byte2&15;
-	  wsTCacheFlipped2[t_index++]=byte1>>4;
-	  wsTCache2[t_index]=byte3>>4;
-	  wsTCacheFlipped2[t_index++]=byte0&15;
-	  wsTCache2[t_index]=byte3&15;
-	  wsTCacheFlipped2[t_index++]=byte0>>4;
-	 }
-	break;
-    case 6:
-	 t_adr=0x8000+(number<<5);
-	 t_index=number<<6;
-	 for(i=0;i<8;i++)
-	 {
-	  byte0=wsRAM[t_adr++];
-	  byte1=wsRAM[t_adr++];
-	  byte2=wsRAM[t_adr++];
-	  byte3=wsRAM[t_adr++];
-	  wsTCache2[t_index]=((byte0>>7)&1)|(((byte1>>7)&1)<<1)|(((byte2>>7)&1)<<2)|(((byte3>>7)&1)<<3);
-	  wsTCacheFlipped2[t_index++]=((byte0)&1)|(((byte1)&1)<<1)|(((byte2)&1)<<2)|(((byte3)&1)<<3);
-	  wsTCache2[t_index]=((byte0>>6)&1)|(((byte1>>6)&1)<<1)|(((byte2>>6)&1)<<2)|(((byte3>>6)&1)<<3);
-	  wsTCacheFlipped2[t_index++]=((byte0>>1)&1)|(((byte1>>1)&1)<<1)|(((byte2>>1)&1)<<2)|(((byte3>>1)&1)<<3);
-	  wsTCache2[t_index]=((byte0>>5)&1)|(((byte1>>5)&1)<<1)|(((byte2>>5)&1)<<2)|(((byte3>>5)&1)<<3);
-	  wsTCacheFlipped2[t_index++]=((byte0>>2)&1)|(((byte1>>2)&1)<<1)|(((byte2>>2)&1)<<2)|(((byte3>>2)&1)<<3);
-	  wsTCache2[t_index]=((byte0>>4)&1)|(((byte1>>4)&1)<<1)|(((byte2>>4)&1)<<2)|(((byte3>>4)&1)<<3);
-	  wsTCacheFlipped2[t_index++]=((byte0>>3)&1)|(((byte1>>3)&1)<<1)|(((byte2>>3)&1)<<2)|(((byte3>>3)&1)<<3);
-	  wsTCache2[t_index]=((byte0>>3)&1)|(((byte1>>3)&1)<<1)|(((byte2>>3)&1)<<2)|(((byte3>>3)&1)<<3);
-	  wsTCacheFlipped2[t_index++]=((byte0>>4)&1)|(((byte1>>4)&1)<<1)|(((byte2>>4)&1)<<2)|(((byte3>>4)&1)<<3);
-	  wsTCache2[t_index]=((byte0>>2)&1)|(((byte1>>2)&1)<<1)|(((byte2>>2)&1)<<2)|(((byte3>>2)&1)<<3);
-	  wsTCacheFlipped2[t_index++]=((byte0>>5)&1)|(((byte1>>5)&1)<<1)|(((byte2>>5)&1)<<2)|(((byte3>>5)&1)<<3);
-	  wsTCache2[t_index]=((byte0>>1)&1)|(((byte1>>1)&1)<<1)|(((byte2>>1)&1)<<2)|(((byte3>>1)&1)<<3);
-	  wsTCacheFlipped2[t_index++]=((byte0>>6)&1)|(((byte1>>6)&1)<<1)|(((byte2>>6)&1)<<2)|(((byte3>>6)&1)<<3);
-	  wsTCache2[t_index]=((byte0)&1)|(((byte1)&1)<<1)|(((byte2)&1)<<2)|(((byte3)&1)<<3);
-	  wsTCacheFlipped2[t_index++]=((byte0>>7)&1)|(((byte1>>7)&1)<<1)|(((byte2>>7)&1)<<2)|(((byte3>>7)&1)<<3);
-	 }
-	break;
-   default:
-	t_adr=0x4000+(number<<4);
-	t_index=number<<6;
- 	for(i=0;i<8;i++)
-	{
-	 byte0=wsRAM[t_adr++];
-	 byte1=wsRAM[t_adr++];
-	 wsTCache2[t_index]=tiles[byte0][byte1][0][0];
-	 wsTCacheFlipped2[t_index++]=tiles[byte0][byte1][1][0];
-	 wsTCache2[t_index]=tiles[byte0][byte1][0][1];
-	 wsTCacheFlipped2[t_index++]=tiles[byte0][byte1][1][1];
-	 wsTCache2[t_index]=tiles[byte0][byte1][0][2];
-	 wsTCacheFlipped2[t_index++]=tiles[byte0][byte1][1][2];
-	 wsTCache2[t_index]=tiles[byte0][byte1][0][3];
-	 wsTCacheFlipped2[t_index++]=tiles[byte0][byte1][1][3];
-	 wsTCache2[t_index]=tiles[byte0][byte1][0][4];
-	 wsTCacheFlipped2[t_index++]=tiles[byte0][byte1][1][4];
-	 wsTCache2[t_index]=tiles[byte0][byte1][0][5];
-	 wsTCacheFlipped2[t_index++]=tiles[byte0][byte1][1][5];
-	 wsTCache2[t_index]=tiles[byte0][byte1][0][6];
-	 wsTCacheFlipped2[t_index++]=tiles[byte0][byte1][1][6];
-	 wsTCache2[t_index]=tiles[byte0][byte1][0][7];
-	 wsTCacheFlipped2[t_index++]=tiles[byte0][byte1][1][7];
-	}
-   }	
+   const uint64 pixels = DecodeTileRow(&wsRAM[t_adr + y * row_bytes]);
+
+   MDFN_en64lsb(&tc[y << 3], pixels);
+   MDFN_en64msb(&tc_flipped[y << 3], pixels);
   }
-  if(flipv)
-   line=7-line;
-  if(fliph)
-   memcpy(&wsTileRow[0],&wsTCacheFlipped2[(number<<6)|(line<<3)],8);
-  else
-   memcpy(&wsTileRow[0],&wsTCache2[(number<<6)|(line<<3)],8);
  }
+
+ if(flipv)
+  line=7-line;
+
+ return (fliph ? tc_flipped : tc) + (line << 3);
 }
 
 }
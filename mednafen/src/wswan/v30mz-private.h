@@ -72,34 +72,35 @@ typedef enum { AH,AL,CH,CL,DH,DL,BH,BL,SPH,SPL,BPH,BPL,IXH,IXL,IYH,IYL } BREGS;
 #define GetMemB(Seg,Off) ((uint8)PhysRead8((DefaultBase(Seg)+(Off))))
 #define GetMemW(Seg,Off) ((uint16)PhysRead16((DefaultBase(Seg)+(Off))))
 
-#define PutMemB(Seg,Off,x) { cpu_writemem20((DefaultBase(Seg)+(Off)),(x)); }
+#define PutMemB(Seg,Off,x) { PhysWrite8((DefaultBase(Seg)+(Off)),(x)); }
 #define PutMemW(Seg,Off,x) { PutMemB(Seg,Off,(x)&0xff); PutMemB(Seg,(Off)+1,(uint8)((x)>>8)); }
 
 /* Todo:  Remove these later - plus readword could overflow */
 #define ReadByte(ea) ((uint8)PhysRead8((ea)))
 #define ReadWord(ea) (PhysRead16((ea)))
-#define WriteByte(ea,val) { cpu_writemem20((ea),val); }
-#define WriteWord(ea,val) { cpu_writemem20((ea),(uint8)(val)); cpu_writemem20(((ea)+1),(val)>>8); }
+#define WriteByte(ea,val) { PhysWrite8((ea),val); }
+#define WriteWord(ea,val) { PhysWrite8((ea),(uint8)(val)); PhysWrite8(((ea)+1),(val)>>8); }
 
-#define read_port(port) cpu_readport(port)
-#define write_port(port,val) cpu_writeport(port,val)
+#define read_port(port) PortRead(port)
+#define write_port(port,val) PortWrite(port,val)
 
-#define FETCH (PhysRead8((I.sregs[PS]<<4)+I.pc++))
-#define FETCHOP (PhysRead8((I.sregs[PS]<<4)+I.pc++))
-#define FETCHuint16(var) { var=PhysRead16((((I.sregs[PS]<<4)+I.pc))); I.pc+=2; }
+// In DoOP<true>, operands come from the decode cache entry instead; see DecodedOp.
+#define FETCH (decoded ? DecodedByte(operands) : FetchByte())
+#define FETCHOP (FetchByte())
+#define FETCHuint16(var) { var = decoded ? DecodedWord(operands) : FetchWord(); }
 #define PUSH(val) { I.regs.w[SP]-=2; WriteWord((((I.sregs[SS]<<4)+I.regs.w[SP])),val); }
 #define POP(var) { var = ReadWord((((I.sregs[SS]<<4)+I.regs.w[SP]))); I.regs.w[SP]+=2; }
 #define PEEK(addr) ((uint8)PhysRead8(addr))
 #define PEEKOP(addr) ((uint8)PhysRead8(addr))
 
-#define GetModRM uint32 ModRM=PhysRead8((I.sregs[PS]<<4)+I.pc++)
+#define GetModRM uint32 ModRM=FETCH
 
 /* Cycle count macros:
 	CLK  - cycle count is the same on all processors
 	CLKM - cycle count for reg/mem instructions
 
 
-	Prefetch & buswait time is not emulated.
+	Prefetch & buswait time is not emulated(the prefetch queue contents optionally are).
 	Extra cycles for PUSH'ing or POP'ing registers to odd addresses is not emulated.
 */
 
@@ -155,6 +156,8 @@ typedef enum { AH,AL,CH,CL,DH,DL,BH,BL,SPH,SPL,BPH,BPL,IXH,IXL,IYH,IYL } BREGS;
 		I.pc = (uint16)(I.pc+tmp);			\
 		CLK(3);	\
 		ADDBRANCHTRACE(I.sregs[PS], I.pc);		\
+		if(tmp < 0 && idle_skip)				\
+			IdleCheck();					\
 		return;								\
 	}
 
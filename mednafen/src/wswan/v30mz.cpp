@@ -24,7 +24,7 @@
 	
 	Implement better prefix emulation.  It's extremely kludgey right now.
 
-	Implement prefetch/pipeline emulation.
+	Implement prefetch/pipeline timing emulation(the queue contents are modelled optionally, see FetchPrefetch()).
 */
 
 #include "wswan.h"
@@ -74,21 +74,131 @@ static uint8 (MDFN_FASTCALL *cpu_readport)(uint32) = NULL;
 static void (MDFN_FASTCALL *cpu_writeport)(uint32, uint8) = NULL;
 static uint8 (MDFN_FASTCALL *cpu_readmem20)(uint32) = NULL;
 
-static INLINE uint8 PhysRead8(uint32 addr)
+// Host pointers for each 64KiB page; NULL pages go through the handlers above.  page_*map are
+// what the memory module set, cpu_*map what is used: watched pages are NULL in the latter, so
+// every access to them reaches the debugger hooks.
+static uint8* page_readmap[16];
+static uint8* page_writemap[16];
+static uint8* cpu_readmap[16];
+static uint8* cpu_writemap[16];
+
+#ifdef WANT_DEBUGGER
+static void (*cpu_hook)(uint32) = NULL;
+static void (*read_hook)(uint32) = NULL;
+static void (*write_hook)(uint32, uint8) = NULL;
+static void (*port_read_hook)(uint32) = NULL;
+static void (*port_write_hook)(uint32, uint8) = NULL;
+static uint16 watch_read_pages, watch_write_pages;
+static void (*branch_trace_hook)(uint16 from_CS, uint16 from_IP, uint16 to_CS, uint16 to_IP, bool interrupt) = NULL;
+#endif
+
+// Profiler hooks, see v30mz_set_call_hooks().  "from" is the linear return address.
+static void (*call_hook)(uint32 from, uint32 to, uint16 sp, bool interrupt) = NULL;
+static void (*return_hook)(uint16 sp) = NULL;
+
+#define CALLHOOK(from_CS, from_IP, to_CS, to_IP, interrupt) { if(MDFN_UNLIKELY(call_hook != NULL)) call_hook((((from_CS) << 4) + (from_IP)) & 0xFFFFF, (((to_CS) << 4) + (to_IP)) & 0xFFFFF, I.regs.w[SP], interrupt); }
+#define RETURNHOOK() { if(MDFN_UNLIKELY(return_hook != NULL)) return_hook(I.regs.w[SP]); }
+
+// Bus statistics hook, see v30mz_set_bus_hook().  While it's set every page is NULL in cpu_*map, so all accesses
+// take the slow paths below.
+static void (*bus_hook)(uint32 addr, unsigned type) = NULL;
+
+// Idle loop skipping state, see IdleCheck().  idle_dirty is set by anything an idle loop may not do:
+// memory/port writes, reads through the memory handlers and reads of ports not in idle_pure_ports.
+static bool idle_skip;
+static bool idle_dirty;
+static bool idle_pure_ports[256];
+static uint32 idle_target = ~0U;
+static uint32 idle_ts;
+static uint64 idle_skips, idle_skipped_cycles;
+
+static INLINE uint8 PhysRead8(uint32 addr, unsigned bus_type = V30MZ_BUS_READ)
 {
+ uint8* const p = cpu_readmap[(addr >> 16) & 0xF];
+
+ if(MDFN_LIKELY(p != NULL))
+  return p[addr & 0xFFFF];
+
+ idle_dirty = true;
+
+ if(MDFN_UNLIKELY(bus_hook != NULL))
+  bus_hook(addr, bus_type);
+
+ #ifdef WANT_DEBUGGER
+ if(MDFN_UNLIKELY((watch_read_pages >> ((addr >> 16) & 0xF)) & 1))
+  read_hook(addr);
+ #endif
+
  return cpu_readmem20(addr);
 }
 
 static INLINE uint16 PhysRead16(uint32 addr)
 {
+ uint8* const p = cpu_readmap[(addr >> 16) & 0xF];
  uint16 ret;
 
- ret = cpu_readmem20(addr);
- ret |= cpu_readmem20(addr + 1) << 8;
+ if(MDFN_LIKELY(p != NULL && (addr & 0xFFFF) != 0xFFFF))
+  return MDFN_de16lsb(p + (addr & 0xFFFF));
+
+ ret = PhysRead8(addr);
+ ret |= PhysRead8(addr + 1) << 8;
 
  return ret;
 }
 
+static INLINE void PhysWrite8(uint32 addr, uint8 val)
+{
+ uint8* const p = cpu_writemap[(addr >> 16) & 0xF];
+
+ idle_dirty = true;
+
+ if(MDFN_LIKELY(p != NULL))
+  p[addr & 0xFFFF] = val;
+ else
+ {
+  if(MDFN_UNLIKELY(bus_hook != NULL))
+   bus_hook(addr, V30MZ_BUS_WRITE);
+
+  #ifdef WANT_DEBUGGER
+  if(MDFN_UNLIKELY((watch_write_pages >> ((addr >> 16) & 0xF)) & 1))
+   write_hook(addr, val);
+  #endif
+
+  cpu_writemem20(addr, val);
+ }
+}
+
+static INLINE uint8 PortRead(uint32 port)
+{
+ if(!idle_pure_ports[port & 0xFF])
+  idle_dirty = true;
+
+ if(MDFN_UNLIKELY(bus_hook != NULL))
+  bus_hook(port, V30MZ_BUS_PORT_READ);
+
+ #ifdef WANT_DEBUGGER
+ if(MDFN_UNLIKELY(port_read_hook != NULL))
+  port_read_hook(port);
+ #endif
+
+ return cpu_readport(port);
+}
+
+static INLINE void PortWrite(uint32 port, uint8 val)
+{
+ idle_dirty = true;
+
+ if(MDFN_UNLIKELY(bus_hook != NULL))
+  bus_hook(port, V30MZ_BUS_PORT_WRITE);
+
+ #ifdef WANT_DEBUGGER
+ if(MDFN_UNLIKELY(port_write_hook != NULL))
+  port_write_hook(port, val);
+ #endif
+
+ cpu_writeport(port, val);
+}
+
 /***************************************************************************/
 /* cpu state                                                               */
 /***************************************************************************/
@@ -102,19 +212,325 @@ static bool InHLT;
 static uint32 prefix_base;	/* base address of the latest prefix segment */
 static int8 seg_prefix;		/* prefix segment indicator */
 
-#ifdef WANT_DEBUGGER
-static void (*cpu_hook)(uint32) = NULL;
-static uint8 (*read_hook)(uint32) = NULL;
-static void (*write_hook)(uint32, uint8) = NULL;
-static uint8 (*port_read_hook)(uint32) = NULL;
-static void (*port_write_hook)(uint32, uint8) = NULL;
-static bool hookie_hickey = 0;
-static void (*branch_trace_hook)(uint16 from_CS, uint16 from_IP, uint16 to_CS, uint16 to_IP, bool interrupt) = NULL;
-#endif
+// Instruction fetch window: code_page[(uint16)(pc + code_off)] is the byte at CS:pc
+// while CS == code_cs and code_lo <= pc < code_lo + code_len.  Rebuilt on a miss;
+// code_cs = ~0U forces a rebuild(page table change, debugger pass, state load).  code_len2 and
+// code_len8 are the limits on pc - code_lo for the 2 or 8 bytes from pc to be in the window.
+static uint32 code_cs = ~0U;
+static uint32 code_lo, code_len, code_len2, code_len8, code_off;
+static uint8* code_page;
+
+// Optional prefetch queue model: pq_buf[pc & 7] holds the byte at pq_cs:pc for
+// pq_pc <= pc < pq_pc + pq_len, as it was when it was fetched into the queue.
+// Only the contents are modelled(stale bytes seen by self-modifying code), not
+// the bus timing.
+enum { V30MZ_PREFETCH_SIZE = 8 };
+static bool prefetch_enabled;
+static uint8 pq_buf[V30MZ_PREFETCH_SIZE];
+static uint16 pq_cs, pq_pc;
+static uint8 pq_len;
+
+static NO_INLINE uint8 FetchPrefetch(void)
+{
+ uint8 ret;
+
+ if(I.sregs[PS] != pq_cs || I.pc != pq_pc)
+ {
+  pq_cs = I.sregs[PS];
+  pq_pc = I.pc;
+  pq_len = 0;
+ }
+
+ while(pq_len < V30MZ_PREFETCH_SIZE)
+ {
+  const uint16 pc = pq_pc + pq_len;
+
+  pq_buf[pc & (V30MZ_PREFETCH_SIZE - 1)] = PhysRead8((pq_cs << 4) + pc, V30MZ_BUS_FETCH);
+  pq_len++;
+ }
+
+ ret = pq_buf[pq_pc & (V30MZ_PREFETCH_SIZE - 1)];
+ pq_pc++;
+ pq_len--;
+ I.pc++;
+
+ return ret;
+}
+
+static NO_INLINE uint8 FetchSlow(void)
+{
+ if(prefetch_enabled)
+  return FetchPrefetch();
+
+ const uint32 addr = (I.sregs[PS] << 4) + I.pc;
+ uint8* const p = cpu_readmap[(addr >> 16) & 0xF];
+
+ code_cs = I.sregs[PS];
+ code_off = (I.sregs[PS] << 4) & 0xFFFF;
+ code_page = p;
+
+ if(p == NULL)
+  code_len = 0;
+ else if(I.pc < 0x10000 - code_off)
+ {
+  code_lo = 0;
+  code_len = 0x10000 - code_off;
+ }
+ else
+ {
+  code_lo = 0x10000 - code_off;
+  code_len = code_off;
+ }
+
+ code_len2 = (code_len > 1) ? code_len - 1 : 0;
+ code_len8 = (code_len > 7) ? code_len - 7 : 0;
+
+ I.pc++;
+
+ return PhysRead8(addr, V30MZ_BUS_FETCH);
+}
+
+static INLINE uint8 FetchByte(void)
+{
+ if(MDFN_LIKELY(I.sregs[PS] == code_cs && (uint32)(I.pc - code_lo) < code_len))
+ {
+  const uint8 ret = code_page[(uint16)(I.pc + code_off)];
+
+  I.pc++;
+  return ret;
+ }
+
+ return FetchSlow();
+}
+
+static INLINE uint16 FetchWord(void)
+{
+ if(MDFN_LIKELY(I.sregs[PS] == code_cs && (uint32)(I.pc - code_lo) < code_len2))
+ {
+  const uint16 ret = MDFN_de16lsb(code_page + (uint16)(I.pc + code_off));
+
+  I.pc += 2;
+  return ret;
+ }
+
+ uint16 ret = FetchByte();
+ ret |= FetchByte() << 8;
+
+ return ret;
+}
+
+static v30mz_regs_t idle_regs;
+
+// Called on taken backward short branches.  Reaching the same branch target twice with identical
+// registers and nothing in idle_dirty in between means the loop only polls memory or ports; those
+// only change between v30mz_execute() calls(line processing, events), so every further iteration
+// in this slice is the same and whole iterations can be skipped up to the end of the slice.
+static NO_INLINE void IdleCheck(void)
+{
+ const uint32 target = (I.sregs[PS] << 4) + I.pc;
+
+ #ifdef WANT_DEBUGGER
+ if(cpu_hook)
+  return;
+ #endif
+
+ if(target == idle_target && !idle_dirty && !memcmp(&I, &idle_regs, sizeof(I)))
+ {
+  const uint32 iter = v30mz_timestamp - idle_ts;
+
+  if(iter && v30mz_ICount >= (int32)iter)
+  {
+   const int32 skip = (v30mz_ICount / iter) * iter;
+
+   CLK(skip);
+   idle_skips++;
+   idle_skipped_cycles += skip;
+  }
+ }
+
+ idle_target = target;
+ idle_regs = I;
+ idle_dirty = false;
+ idle_ts = v30mz_timestamp;
+}
 
 #include "v30mz-ea.inc"
 #include "v30mz-modrm.inc"
 
+// Predecoded instruction cache, indexed by the low bits of the physical address.  An entry holds the instruction's bytes and what DoOP()
+// fetches after the opcode through FETCH: the ModRM byte and immediates, with the displacement already folded into
+// ea_rm/disp for DecodedEA().  Prefixes are one byte long, as the prefixed instruction is fetched by FETCHOP.
+// The bytes are compared against memory each time the entry is used, so writes from anywhere(CPU, DMA, cheats, the
+// debugger) and page table changes invalidate it; a mismatch redecodes it in place.
+struct DecodedOp
+{
+ uint64 bytes;
+ uint64 mask;	// Covers the len bytes of the instruction.
+ uint64 operands;
+ uint16 disp;
+ uint8 len;
+ uint8 ea_rm;	// 0-7 as in the ModRM byte, 8 for the disp16-only form.
+ uint8 ea_seg;
+};
+
+enum { DECODE_CACHE_SIZE = 4096 };
+static bool decode_cache_enabled;
+static DecodedOp decode_cache[DECODE_CACHE_SIZE];
+
+static INLINE uint8 DecodedByte(uint64& operands)
+{
+ const uint8 ret = operands;
+
+ operands >>= 8;
+
+ return ret;
+}
+
+static INLINE uint16 DecodedWord(uint64& operands)
+{
+ const uint16 ret = operands;
+
+ operands >>= 16;
+
+ return ret;
+}
+
+static INLINE unsigned DecodedEA(const DecodedOp* dc)
+{
+ uint16 base = 0;
+
+ switch(dc->ea_rm)
+ {
+  case 0: base = I.regs.w[BW] + I.regs.w[IX]; break;
+  case 1: base = I.regs.w[BW] + I.regs.w[IY]; break;
+  case 2: base = I.regs.w[BP] + I.regs.w[IX]; break;
+  case 3: base = I.regs.w[BP] + I.regs.w[IY]; break;
+  case 4: base = I.regs.w[IX]; break;
+  case 5: base = I.regs.w[IY]; break;
+  case 6: base = I.regs.w[BP]; break;
+  case 7: base = I.regs.w[BW]; break;
+ }
+
+ EO = base + dc->disp;
+ EA = DefaultBase(dc->ea_seg) + EO;
+
+ return EA;
+}
+
+// Whether an opcode is followed by a ModRM byte, and how many bytes of immediate data follow that.
+static void ClassifyOP(const uint8 op, const uint8 modrm, bool* has_modrm_out, unsigned* imm_out)
+{
+ bool has_modrm = false;
+ unsigned imm = 0;
+
+ switch(op)
+ {
+  case 0x00: case 0x01: case 0x02: case 0x03: case 0x08: case 0x09: case 0x0a: case 0x0b:
+  case 0x10: case 0x11: case 0x12: case 0x13: case 0x18: case 0x19: case 0x1a: case 0x1b:
+  case 0x20: case 0x21: case 0x22: case 0x23: case 0x28: case 0x29: case 0x2a: case 0x2b:
+  case 0x30: case 0x31: case 0x32: case 0x33: case 0x38: case 0x39: case 0x3a: case 0x3b:
+  case 0x62: case 0x84: case 0x85: case 0x86: case 0x87: case 0x88: case 0x89: case 0x8a: case 0x8b:
+  case 0x8c: case 0x8d: case 0x8e: case 0x8f: case 0xc4: case 0xc5:
+  case 0xd0: case 0xd1: case 0xd2: case 0xd3: case 0xfe: case 0xff:
+	has_modrm = true;
+	break;
+
+  case 0x6b: case 0x80: case 0x82: case 0x83: case 0xc0: case 0xc1: case 0xc6:
+	has_modrm = true;
+	imm = 1;
+	break;
+
+  case 0x69: case 0x81: case 0xc7:
+	has_modrm = true;
+	imm = 2;
+	break;
+
+  // Only TEST has an immediate.
+  case 0xf6: case 0xf7:
+	has_modrm = true;
+	imm = (modrm & 0x38) ? 0 : (op & 1) + 1;
+	break;
+
+  // FPO fetches its ModRM byte, but not the displacement.
+  case 0xd8: case 0xd9: case 0xda: case 0xdb: case 0xdc: case 0xdd: case 0xde: case 0xdf:
+	imm = 1;
+	break;
+
+  case 0x04: case 0x0c: case 0x14: case 0x1c: case 0x24: case 0x2c: case 0x34: case 0x3c:
+  case 0x6a: case 0xa8: case 0xcd: case 0xd4: case 0xd5: case 0xeb:
+  case 0x70: case 0x71: case 0x72: case 0x73: case 0x74: case 0x75: case 0x76: case 0x77:
+  case 0x78: case 0x79: case 0x7a: case 0x7b: case 0x7c: case 0x7d: case 0x7e: case 0x7f:
+  case 0xb0: case 0xb1: case 0xb2: case 0xb3: case 0xb4: case 0xb5: case 0xb6: case 0xb7:
+  case 0xe0: case 0xe1: case 0xe2: case 0xe3: case 0xe4: case 0xe5: case 0xe6: case 0xe7:
+	imm = 1;
+	break;
+
+  case 0x05: case 0x0d: case 0x15: case 0x1d: case 0x25: case 0x2d: case 0x35: case 0x3d:
+  case 0x68: case 0xa0: case 0xa1: case 0xa2: case 0xa3: case 0xa9: case 0xc2: case 0xca: case 0xe8: case 0xe9:
+  case 0xb8: case 0xb9: case 0xba: case 0xbb: case 0xbc: case 0xbd: case 0xbe: case 0xbf:
+	imm = 2;
+	break;
+
+  case 0xc8:
+	imm = 3;
+	break;
+
+  case 0x9a: case 0xea:
+	imm = 4;
+	break;
+ }
+
+ *has_modrm_out = has_modrm;
+ *imm_out = imm;
+}
+
+static NO_INLINE void Decode(DecodedOp* e, const uint64 raw)
+{
+ const uint8 modrm = raw >> 8;
+ bool has_modrm;
+ unsigned imm;
+ unsigned len = 1;
+
+ ClassifyOP(raw, modrm, &has_modrm, &imm);
+
+ e->operands = 0;
+ e->disp = 0;
+ e->ea_rm = modrm & 7;
+ e->ea_seg = DS0;
+
+ if(has_modrm)
+ {
+  unsigned disp_len = 0;
+
+  switch(modrm >> 6)
+  {
+   case 0: if(e->ea_rm == 6) { e->ea_rm = 8; disp_len = 2; } break;
+   case 1: disp_len = 1; break;
+   case 2: disp_len = 2; break;
+  }
+
+  if(e->ea_rm == 2 || e->ea_rm == 3 || e->ea_rm == 6)
+   e->ea_seg = SS;
+
+  if(disp_len == 1)
+   e->disp = (int8)(raw >> 16);
+  else if(disp_len == 2)
+   e->disp = raw >> 16;
+
+  e->operands = modrm;
+  len += 1 + disp_len;
+ }
+
+ if(imm)
+  e->operands |= ((raw >> (len * 8)) & ((1ULL << (imm * 8)) - 1)) << (has_modrm ? 8 : 0);
+
+ len += imm;
+
+ e->len = len;
+ e->mask = ~0ULL >> (64 - len * 8);
+ e->bytes = raw & e->mask;
+}
+
 static uint8 parity_table[256];
 
 static INLINE void i_real_pushf(void)
@@ -135,6 +551,13 @@ static INLINE void i_real_popf(void)
 
 void v30mz_init(uint8 (MDFN_FASTCALL *readmem20)(uint32), void (MDFN_FASTCALL *writemem20)(uint32,uint8), uint8 (MDFN_FASTCALL *readport)(uint32), void (MDFN_FASTCALL *writeport)(uint32, uint8))
 {
+ // Matches nothing until decoded.
+ for(unsigned i = 0; i < DECODE_CACHE_SIZE; i++)
+ {
+  decode_cache[i].bytes = ~0ULL;
+  decode_cache[i].mask = 0;
+ }
+
  cpu_readmem20 = readmem20;
  cpu_writemem20 = writemem20;
 
@@ -142,6 +565,61 @@ void v30mz_init(uint8 (MDFN_FASTCALL *readmem20)(uint32), void (MDFN_FASTCALL *w
  cpu_writeport = writeport;
 }
 
+static void UpdateMap(unsigned page)
+{
+ cpu_readmap[page] = page_readmap[page];
+ cpu_writemap[page] = page_writemap[page];
+
+ #ifdef WANT_DEBUGGER
+ if((watch_read_pages >> page) & 1)
+  cpu_readmap[page] = NULL;
+
+ if((watch_write_pages >> page) & 1)
+  cpu_writemap[page] = NULL;
+ #endif
+
+ if(bus_hook)
+  cpu_readmap[page] = cpu_writemap[page] = NULL;
+
+ code_cs = ~0U;
+}
+
+void v30mz_set_page(unsigned page, uint8* read_ptr, uint8* write_ptr)
+{
+ page_readmap[page & 0xF] = read_ptr;
+ page_writemap[page & 0xF] = write_ptr;
+ UpdateMap(page & 0xF);
+}
+
+void v30mz_set_idle_skip(bool enabled)
+{
+ idle_skip = enabled;
+ idle_target = ~0U;
+}
+
+void v30mz_set_idle_ports(const bool* pure_ports)
+{
+ memcpy(idle_pure_ports, pure_ports, sizeof(idle_pure_ports));
+}
+
+void v30mz_get_idle_stats(uint64* skips, uint64* cycles)
+{
+ *skips = idle_skips;
+ *cycles = idle_skipped_cycles;
+}
+
+void v30mz_set_prefetch(bool enabled)
+{
+ prefetch_enabled = enabled;
+ code_cs = ~0U;
+ pq_len = 0;
+}
+
+void v30mz_set_decode_cache(bool enabled)
+{
+ decode_cache_enabled = enabled;
+}
+
 void v30mz_reset(void)
 {
  const BREGS reg_name[8] = { AL, CL, DL, BL, AH, CH, DH, BH };
@@ -153,6 +631,9 @@ void v30mz_reset(void)
 
  I.sregs[PS] = 0xffff;
 
+ code_cs = ~0U;
+ pq_len = 0;
+
 
  for(unsigned int i = 0; i < 256; i++)
  {
@@ -196,6 +677,7 @@ void v30mz_int(uint32 vector, bool IgnoreIF)
 		dest_seg = ReadWord(vector+2);
 		PUSH(I.sregs[PS]);
 		PUSH(I.pc);
+		CALLHOOK(I.sregs[PS], I.pc, dest_seg, dest_off, true);
 		I.pc = (uint16)dest_off;
 		I.sregs[PS] = (uint16)dest_seg;
 		ADDBRANCHTRACE_INT(I.sregs[PS], I.pc);
@@ -219,6 +701,7 @@ static void nec_interrupt(unsigned int_num)
 
 	PUSH(I.sregs[PS]);
 	PUSH(I.pc);
+	CALLHOOK(I.sregs[PS], I.pc, dest_seg, dest_off, false);
 	I.pc = (uint16)dest_off;
 	I.sregs[PS] = (uint16)dest_seg;
 	ADDBRANCHTRACE(I.sregs[PS], I.pc);
@@ -335,8 +818,11 @@ static INLINE void i_real_scasw(void)
  I.regs.w[IY] += -4 * I.DF + 2; CLK(4); 
 }
 
-static void DoOP(uint8 opcode)
+template<bool decoded>
+static void DoOP(uint8 opcode, const DecodedOp* dc = NULL)
 {
+ uint64 operands = decoded ? dc->operands : 0;
+
  //#define OP(num,func_name) static void func_name(void)
  #define OP(num, func_name) case num: 
  #define OP8(base, func_name) case (base): case (base)+1: case (base)+2: case (base)+3: case (base)+4: case (base)+5: case (base)+6: case (base)+7:
@@ -390,7 +876,7 @@ OP( 0x22, i_and_r8b  ) { DEF_r8b;	ANDB;	RegByte(ModRM)=dst;			CLKM(2,1);		} OP_E
 OP( 0x23, i_and_r16w ) { DEF_r16w;	ANDW;	RegWord(ModRM)=dst;			CLKM(2,1);	} OP_EPILOGUE;
 OP( 0x24, i_and_ald8 ) { DEF_ald8;	ANDB;	I.regs.b[AL]=dst;			CLK(1);				} OP_EPILOGUE;
 OP( 0x25, i_and_axd16) { DEF_axd16;	ANDW;	I.regs.w[AW]=dst;			CLK(1);	} OP_EPILOGUE;
-OP( 0x26, i_ds1      ) { seg_prefix=true;	prefix_base=I.sregs[DS1]<<4;	CLK(1);		DoOP(FETCHOP);	seg_prefix=false; } OP_EPILOGUE;
+OP( 0x26, i_ds1      ) { seg_prefix=true;	prefix_base=I.sregs[DS1]<<4;	CLK(1);		DoOP<false>(FETCHOP);	seg_prefix=false; } OP_EPILOGUE;
 OP( 0x27, i_daa      ) { ADJ4(6,0x60);									CLK(10);	} OP_EPILOGUE;
 
 OP( 0x28, i_sub_br8  ) { DEF_br8;	SUBB;	PutbackRMByte(ModRM,dst);	CLKM(3,1); 		} OP_EPILOGUE;
@@ -399,7 +885,7 @@ OP( 0x2a, i_sub_r8b  ) { DEF_r8b;	SUBB;	RegByte(ModRM)=dst;			CLKM(2,1); 		} OP_
 OP( 0x2b, i_sub_r16w ) { DEF_r16w;	SUBW;	RegWord(ModRM)=dst;			CLKM(2,1);	} OP_EPILOGUE;
 OP( 0x2c, i_sub_ald8 ) { DEF_ald8;	SUBB;	I.regs.b[AL]=dst;			CLK(1); 	} OP_EPILOGUE;
 OP( 0x2d, i_sub_axd16) { DEF_axd16;	SUBW;	I.regs.w[AW]=dst;			CLK(1);		} OP_EPILOGUE;
-OP( 0x2e, i_ps       ) { seg_prefix=true;	prefix_base=I.sregs[PS]<<4;	CLK(1);		DoOP(FETCHOP);	seg_prefix=false; } OP_EPILOGUE;
+OP( 0x2e, i_ps       ) { seg_prefix=true;	prefix_base=I.sregs[PS]<<4;	CLK(1);		DoOP<false>(FETCHOP);	seg_prefix=false; } OP_EPILOGUE;
 OP( 0x2f, i_das      ) { ADJ4(-6,-0x60);						CLK(10);	} OP_EPILOGUE;
 
 OP( 0x30, i_xor_br8  ) { DEF_br8;	XORB;	PutbackRMByte(ModRM,dst);	CLKM(3,1);		} OP_EPILOGUE;
@@ -408,7 +894,7 @@ OP( 0x32, i_xor_r8b  ) { DEF_r8b;	XORB;	RegByte(ModRM)=dst;			CLKM(2,1); 	} OP_E
 OP( 0x33, i_xor_r16w ) { DEF_r16w;	XORW;	RegWord(ModRM)=dst;			CLKM(2,1);	} OP_EPILOGUE;
 OP( 0x34, i_xor_ald8 ) { DEF_ald8;	XORB;	I.regs.b[AL]=dst;			CLK(1); 	} OP_EPILOGUE;
 OP( 0x35, i_xor_axd16) { DEF_axd16;	XORW;	I.regs.w[AW]=dst;			CLK(1);		} OP_EPILOGUE;
-OP( 0x36, i_ss       ) { seg_prefix=true;	prefix_base=I.sregs[SS]<<4;	CLK(1);		DoOP(FETCHOP);	seg_prefix=false; } OP_EPILOGUE;
+OP( 0x36, i_ss       ) { seg_prefix=true;	prefix_base=I.sregs[SS]<<4;	CLK(1);		DoOP<false>(FETCHOP);	seg_prefix=false; } OP_EPILOGUE;
 OP( 0x37, i_aaa      ) { ADJB(6,1);						CLK(9);			} OP_EPILOGUE;
 
 OP( 0x38, i_cmp_br8  ) { DEF_br8;	SUBB;					CLKM(2,1); 		} OP_EPILOGUE;
@@ -417,7 +903,7 @@ OP( 0x3a, i_cmp_r8b  ) { DEF_r8b;	SUBB;					CLKM(2,1); 		} OP_EPILOGUE;
 OP( 0x3b, i_cmp_r16w ) { DEF_r16w;	SUBW;					CLKM(2,1); 		} OP_EPILOGUE;
 OP( 0x3c, i_cmp_ald8 ) { DEF_ald8;	SUBB;					CLK(1); 		} OP_EPILOGUE;
 OP( 0x3d, i_cmp_axd16) { DEF_axd16;	SUBW;					CLK(1);			} OP_EPILOGUE;
-OP( 0x3e, i_ds0      ) { seg_prefix=true;	prefix_base=I.sregs[DS0]<<4;	CLK(1);		DoOP(FETCHOP);	seg_prefix=false; } OP_EPILOGUE;
+OP( 0x3e, i_ds0      ) { seg_prefix=true;	prefix_base=I.sregs[DS0]<<4;	CLK(1);		DoOP<false>(FETCHOP);	seg_prefix=false; } OP_EPILOGUE;
 OP( 0x3f, i_aas      ) { ADJB(-6,-1);						CLK(9);	} OP_EPILOGUE;
 
 OP( 0x40, i_inc_ax  ) { IncWordReg(AW);		CLK(1);	} OP_EPILOGUE;
@@ -591,7 +1077,7 @@ OP( 0x89, i_mov_wr16  ) { uint16 src; GetModRM; src = RegWord(ModRM); 	PutRMWord
 OP( 0x8a, i_mov_r8b   ) { uint8  src; GetModRM; src = GetRMByte(ModRM);	RegByte(ModRM)=src;	CLK(1);	} OP_EPILOGUE;
 OP( 0x8b, i_mov_r16w  ) { uint16 src; GetModRM; src = GetRMWord(ModRM);	RegWord(ModRM)=src; 	CLK(1); } OP_EPILOGUE;
 OP( 0x8c, i_mov_wsreg ) { GetModRM; PutRMWord(ModRM,I.sregs[(ModRM & 0x38) >> 3]);		CLK(1);	} OP_EPILOGUE;
-OP( 0x8d, i_lea       ) { uint16 ModRM = FETCH; if(ModRM >= 192) { printf("LEA Error: %02x\n", ModRM);} else { (void)(*GetEA[ModRM])(); } RegWord(ModRM)=EO; 	CLK(1);	} OP_EPILOGUE;
+OP( 0x8d, i_lea       ) { uint16 ModRM = FETCH; if(ModRM >= 192) { printf("LEA Error: %02x\n", ModRM);} else { (void)GETEA(ModRM); } RegWord(ModRM)=EO; 	CLK(1);	} OP_EPILOGUE;
 OP( 0x8e, i_mov_sregw ) { uint16 src; GetModRM; src = GetRMWord(ModRM); CLKM(3,2);
     switch (ModRM & 0x38) {
 	    case 0x00: I.sregs[DS1] = src; break; /* mov ds1,ew */
@@ -618,7 +1104,7 @@ OP( 0x98, i_cbw       ) { I.regs.b[AH] = (I.regs.b[AL] & 0x80) ? 0xff : 0;	CLK(1
 // AKA CVTWL
 OP( 0x99, i_cwd       ) { I.regs.w[DW] = (I.regs.b[AH] & 0x80) ? 0xffff : 0;	CLK(1);	} OP_EPILOGUE;
 
-OP( 0x9a, i_call_far  ) { uint32 tmp, tmp2;	FETCHuint16(tmp); FETCHuint16(tmp2); PUSH(I.sregs[PS]); PUSH(I.pc); I.pc = (uint16)tmp; I.sregs[PS] = (uint16)tmp2; ADDBRANCHTRACE(I.sregs[PS], I.pc); CLK(10); } OP_EPILOGUE;
+OP( 0x9a, i_call_far  ) { uint32 tmp, tmp2;	FETCHuint16(tmp); FETCHuint16(tmp2); PUSH(I.sregs[PS]); PUSH(I.pc); CALLHOOK(I.sregs[PS], I.pc, tmp2, tmp, false); I.pc = (uint16)tmp; I.sregs[PS] = (uint16)tmp2; ADDBRANCHTRACE(I.sregs[PS], I.pc); CLK(10); } OP_EPILOGUE;
 OP( 0x9b, i_poll      ) { puts("POLL"); } OP_EPILOGUE;
 OP( 0x9c, i_pushf     ) { i_real_pushf(); } OP_EPILOGUE;
 OP( 0x9d, i_popf      ) { i_real_popf();  } OP_EPILOGUE;
@@ -699,8 +1185,8 @@ OP( 0xc1, i_rotshft_wd8 ) {
 	}
 } OP_EPILOGUE;
 
-OP( 0xc2, i_ret_d16  ) { uint32 count = FETCH; count += FETCH << 8; POP(I.pc); I.regs.w[SP]+=count; CLK(6); ADDBRANCHTRACE(I.sregs[PS], I.pc); } OP_EPILOGUE;
-OP( 0xc3, i_ret      ) { POP(I.pc); CLK(6); ADDBRANCHTRACE(I.sregs[PS], I.pc); } OP_EPILOGUE;
+OP( 0xc2, i_ret_d16  ) { uint32 count = FETCH; count += FETCH << 8; POP(I.pc); I.regs.w[SP]+=count; RETURNHOOK(); CLK(6); ADDBRANCHTRACE(I.sregs[PS], I.pc); } OP_EPILOGUE;
+OP( 0xc3, i_ret      ) { POP(I.pc); RETURNHOOK(); CLK(6); ADDBRANCHTRACE(I.sregs[PS], I.pc); } OP_EPILOGUE;
 OP( 0xc4, i_les_dw   ) { GetModRM; uint16 tmp = GetRMWord(ModRM); RegWord(ModRM)=tmp; I.sregs[DS1] = GetnextRMWord; CLK(6); } OP_EPILOGUE;
 OP( 0xc5, i_lds_dw   ) { GetModRM; uint16 tmp = GetRMWord(ModRM); RegWord(ModRM)=tmp; I.sregs[DS0] = GetnextRMWord; CLK(6); } OP_EPILOGUE;
 OP( 0xc6, i_mov_bd8  ) { GetModRM; PutImmRMByte(ModRM); CLK(1); } OP_EPILOGUE;
@@ -733,12 +1219,12 @@ OP( 0xc9, i_leave ) {
 	CLK(2);
 } OP_EPILOGUE;
 
-OP( 0xca, i_retf_d16  ) { uint32 count = FETCH; count += FETCH << 8; POP(I.pc); POP(I.sregs[PS]); I.regs.w[SP]+=count; CLK(9); ADDBRANCHTRACE(I.sregs[PS], I.pc); } OP_EPILOGUE;
-OP( 0xcb, i_retf      ) { POP(I.pc); POP(I.sregs[PS]); CLK(8); ADDBRANCHTRACE(I.sregs[PS], I.pc); } OP_EPILOGUE;
+OP( 0xca, i_retf_d16  ) { uint32 count = FETCH; count += FETCH << 8; POP(I.pc); POP(I.sregs[PS]); I.regs.w[SP]+=count; RETURNHOOK(); CLK(9); ADDBRANCHTRACE(I.sregs[PS], I.pc); } OP_EPILOGUE;
+OP( 0xcb, i_retf      ) { POP(I.pc); POP(I.sregs[PS]); RETURNHOOK(); CLK(8); ADDBRANCHTRACE(I.sregs[PS], I.pc); } OP_EPILOGUE;
 OP( 0xcc, i_int3      ) { nec_interrupt(3); CLK(9); } OP_EPILOGUE;
 OP( 0xcd, i_int       ) { nec_interrupt(FETCH); CLK(10); } OP_EPILOGUE;
 OP( 0xce, i_into      ) { if (FLAG_O) { nec_interrupt(4); CLK(13); } else CLK(6); } OP_EPILOGUE;
-OP( 0xcf, i_iret      ) { POP(I.pc); POP(I.sregs[PS]); i_real_popf(); CLK(10); ADDBRANCHTRACE(I.sregs[PS], I.pc); } OP_EPILOGUE;
+OP( 0xcf, i_iret      ) { POP(I.pc); POP(I.sregs[PS]); i_real_popf(); RETURNHOOK(); CLK(10); ADDBRANCHTRACE(I.sregs[PS], I.pc); } OP_EPILOGUE;
 
 OP( 0xd0, i_rotshft_b ) {
 	uint32 src, dst; GetModRM; src = (uint32)GetRMByte(ModRM); dst=src;
@@ -820,10 +1306,10 @@ OP( 0xe5, i_inax   ) { uint8 port = FETCH; I.regs.b[AL] = read_port(port); I.reg
 OP( 0xe6, i_outal  ) { uint8 port = FETCH; write_port(port, I.regs.b[AL]); CLK(6);				     	} OP_EPILOGUE;
 OP( 0xe7, i_outax  ) { uint8 port = FETCH; write_port(port, I.regs.b[AL]); write_port(port+1, I.regs.b[AH]); CLK(6);	} OP_EPILOGUE;
 
-OP( 0xe8, i_call_d16 ) { uint32 tmp; FETCHuint16(tmp); PUSH(I.pc); I.pc = (uint16)(I.pc+(int16)tmp); ADDBRANCHTRACE(I.sregs[PS], I.pc); CLK(5); } OP_EPILOGUE;
+OP( 0xe8, i_call_d16 ) { uint32 tmp; FETCHuint16(tmp); PUSH(I.pc); CALLHOOK(I.sregs[PS], I.pc, I.sregs[PS], (uint16)(I.pc+(int16)tmp), false); I.pc = (uint16)(I.pc+(int16)tmp); ADDBRANCHTRACE(I.sregs[PS], I.pc); CLK(5); } OP_EPILOGUE;
 OP( 0xe9, i_jmp_d16  ) { uint32 tmp; FETCHuint16(tmp); I.pc = (uint16)(I.pc+(int16)tmp); ADDBRANCHTRACE(I.sregs[PS], I.pc); CLK(4); } OP_EPILOGUE;
 OP( 0xea, i_jmp_far  ) { uint32 tmp,tmp1; FETCHuint16(tmp); FETCHuint16(tmp1); I.sregs[PS] = (uint16)tmp1; I.pc = (uint16)tmp; ; ADDBRANCHTRACE(I.sregs[PS], I.pc); CLK(7);  } OP_EPILOGUE;
-OP( 0xeb, i_jmp_d8   ) { int tmp = (int)((int8)FETCH); CLK(4);I.pc = (uint16)(I.pc+tmp); ADDBRANCHTRACE(I.sregs[PS], I.pc); } OP_EPILOGUE;
+OP( 0xeb, i_jmp_d8   ) { int tmp = (int)((int8)FETCH); CLK(4);I.pc = (uint16)(I.pc+tmp); ADDBRANCHTRACE(I.sregs[PS], I.pc); if(tmp < 0 && idle_skip) IdleCheck(); } OP_EPILOGUE;
 
 OP( 0xec, i_inaldx   ) { I.regs.b[AL] = read_port(I.regs.w[DW]); CLK(6);} OP_EPILOGUE;
 OP( 0xed, i_inaxdx   ) { uint32 port = I.regs.w[DW];	I.regs.b[AL] = read_port(port);	I.regs.b[AH] = read_port(port+1); CLK(6); } OP_EPILOGUE;
@@ -832,7 +1318,7 @@ OP( 0xee, i_outdxal  ) { write_port(I.regs.w[DW], I.regs.b[AL]); CLK(6); } OP_EP
 OP( 0xef, i_outdxax  ) { uint32 port = I.regs.w[DW];	write_port(port, I.regs.b[AL]);	write_port(port+1, I.regs.b[AH]); CLK(6); } OP_EPILOGUE;
 
 // NEC calls it "BUSLOCK"
-OP( 0xf0, i_lock     ) { CLK(1); DoOP(FETCHOP); } OP_EPILOGUE;
+OP( 0xf0, i_lock     ) { CLK(1); DoOP<false>(FETCHOP); } OP_EPILOGUE;
 
 // We put CHK_ICOUNT *after* the first iteration has completed, to match real behavior.
 #define CHK_ICOUNT(cond) if(v30mz_ICount < 0 && (cond)) { I.pc -= seg_prefix ? 3 : 2; break; }
@@ -863,7 +1349,7 @@ OP( 0xf2, i_repne    )
 	    case 0xad:  CLK(5); if (I.regs.w[CW]) do { i_real_lodsw(); I.regs.w[CW]--; CHK_ICOUNT(I.regs.w[CW]); } while (I.regs.w[CW]>0); break;
 	    case 0xae:	CLK(5); if (I.regs.w[CW]) do { i_real_scasb(); I.regs.w[CW]--; CHK_ICOUNT(I.regs.w[CW] && ZF == 0); } while (I.regs.w[CW]>0 && ZF==0); break;
 	    case 0xaf:	CLK(5); if (I.regs.w[CW]) do { i_real_scasw(); I.regs.w[CW]--; CHK_ICOUNT(I.regs.w[CW] && ZF == 0); } while (I.regs.w[CW]>0 && ZF==0); break;
-	    default: DoOP(next); break;
+	    default: DoOP<false>(next); break;
     }
 	seg_prefix=false;
 } OP_EPILOGUE;
@@ -893,7 +1379,7 @@ OP( 0xf3, i_repe)
 	    case 0xad:  CLK(5); if (I.regs.w[CW]) do { i_real_lodsw(); I.regs.w[CW]--; CHK_ICOUNT(I.regs.w[CW]); } while (I.regs.w[CW]>0); break;
 	    case 0xae:	CLK(5); if (I.regs.w[CW]) do { i_real_scasb(); I.regs.w[CW]--; CHK_ICOUNT(I.regs.w[CW] && ZF == 1); } while (I.regs.w[CW]>0 && ZF==1); break;
 	    case 0xaf:	CLK(5); if (I.regs.w[CW]) do { i_real_scasw(); I.regs.w[CW]--; CHK_ICOUNT(I.regs.w[CW] && ZF == 1); } while (I.regs.w[CW]>0 && ZF==1); break;
-	    default: DoOP(next); break;
+	    default: DoOP<false>(next); break;
     }
 	seg_prefix=false;
 } OP_EPILOGUE;
@@ -954,8 +1440,8 @@ OP( 0xfe, i_fepre ) { uint32 tmp, tmp1; GetModRM; tmp=GetRMByte(ModRM);
     	case 0x00: tmp1 = tmp+1; I.OverVal = (tmp==0x7f); SetAF(tmp1,tmp,1); SetSZPF_Byte(tmp1); PutbackRMByte(ModRM,(uint8)tmp1); CLKM(3,1); break; /* INC */
 		case 0x08: tmp1 = tmp-1; I.OverVal = (tmp==0x80); SetAF(tmp1,tmp,1); SetSZPF_Byte(tmp1); PutbackRMByte(ModRM,(uint8)tmp1); CLKM(3,1); break; /* DEC */
 
-		case 0x10: PUSH(I.pc);	I.pc = (uint16)tmp; ADDBRANCHTRACE(I.sregs[PS], I.pc); CLKM(6,5); break; /* CALL */
-		case 0x18: tmp1 = I.sregs[PS]; I.sregs[PS] = GetnextRMWord; PUSH(tmp1); PUSH(I.pc); I.pc = tmp; ADDBRANCHTRACE(I.sregs[PS], I.pc); CLKM(12,1); break; /* CALL FAR */
+		case 0x10: PUSH(I.pc);	CALLHOOK(I.sregs[PS], I.pc, I.sregs[PS], tmp, false); I.pc = (uint16)tmp; ADDBRANCHTRACE(I.sregs[PS], I.pc); CLKM(6,5); break; /* CALL */
+		case 0x18: tmp1 = I.sregs[PS]; I.sregs[PS] = GetnextRMWord; PUSH(tmp1); PUSH(I.pc); CALLHOOK(tmp1, I.pc, I.sregs[PS], tmp, false); I.pc = tmp; ADDBRANCHTRACE(I.sregs[PS], I.pc); CLKM(12,1); break; /* CALL FAR */
 		case 0x20: I.pc = tmp; ADDBRANCHTRACE(I.sregs[PS], I.pc); CLKM(5,4); break; /* JMP */
 		case 0x28: I.pc = tmp; I.sregs[PS] = GetnextRMWord; ADDBRANCHTRACE(I.sregs[PS], I.pc); CLKM(10,1); break; /* JMP FAR */
 		case 0x30: PUSH(tmp); CLKM(2,1); break;
@@ -966,8 +1452,8 @@ OP( 0xff, i_ffpre ) { uint32 tmp, tmp1; GetModRM; tmp=GetRMWord(ModRM);
     switch(ModRM & 0x38) {
     	case 0x00: tmp1 = tmp+1; I.OverVal = (tmp==0x7fff); SetAF(tmp1,tmp,1); SetSZPF_Word(tmp1); PutbackRMWord(ModRM,(uint16)tmp1); CLKM(3,1); break; /* INC */
 		case 0x08: tmp1 = tmp-1; I.OverVal = (tmp==0x8000); SetAF(tmp1,tmp,1); SetSZPF_Word(tmp1); PutbackRMWord(ModRM,(uint16)tmp1); CLKM(3,1); break; /* DEC */
-		case 0x10: PUSH(I.pc);	I.pc = (uint16)tmp; ADDBRANCHTRACE(I.sregs[PS], I.pc); CLKM(6,5); break; /* CALL */
-		case 0x18: tmp1 = I.sregs[PS]; I.sregs[PS] = GetnextRMWord; PUSH(tmp1); PUSH(I.pc); I.pc = tmp; ADDBRANCHTRACE(I.sregs[PS], I.pc); CLKM(12,1); break; /* CALL FAR */
+		case 0x10: PUSH(I.pc);	CALLHOOK(I.sregs[PS], I.pc, I.sregs[PS], tmp, false); I.pc = (uint16)tmp; ADDBRANCHTRACE(I.sregs[PS], I.pc); CLKM(6,5); break; /* CALL */
+		case 0x18: tmp1 = I.sregs[PS]; I.sregs[PS] = GetnextRMWord; PUSH(tmp1); PUSH(I.pc); CALLHOOK(tmp1, I.pc, I.sregs[PS], tmp, false); I.pc = tmp; ADDBRANCHTRACE(I.sregs[PS], I.pc); CLKM(12,1); break; /* CALL FAR */
 		case 0x20: I.pc = tmp; ADDBRANCHTRACE(I.sregs[PS], I.pc); CLKM(5,4); break; /* JMP */
 		case 0x28: I.pc = tmp; I.sregs[PS] = GetnextRMWord; ADDBRANCHTRACE(I.sregs[PS], I.pc); CLKM(10,1); break; /* JMP FAR */
 		case 0x30: PUSH(tmp); CLKM(2,1); break;
@@ -1028,44 +1514,51 @@ void v30mz_set_reg(int regnum, unsigned val)
     }
 }
 
-#ifdef WANT_DEBUGGER
-static void (MDFN_FASTCALL *save_cpu_writemem20)(uint32,uint8);
-static uint8 (MDFN_FASTCALL *save_cpu_readport)(uint32);
-static void (MDFN_FASTCALL *save_cpu_writeport)(uint32, uint8);
-static uint8 (MDFN_FASTCALL *save_cpu_readmem20)(uint32);
-
-static MDFN_FASTCALL void test_cpu_writemem20(uint32 A, uint8 V)
+// Runs one instruction from the decode cache.  Instructions that may not be wholly inside the fetch window(page ends,
+// pages without a host pointer, the prefetch queue model, which never sets the window up) take the normal path.
+static INLINE void DoCachedOP(void)
 {
- if(write_hook)
-  write_hook(A, V);
-}
+ if(MDFN_LIKELY(I.sregs[PS] == code_cs && (uint32)(I.pc - code_lo) < code_len8))
+ {
+  const uint32 offs = (uint16)(I.pc + code_off);
+  const uint64 raw = MDFN_de64lsb(code_page + offs);
+  DecodedOp* e = &decode_cache[offs & (DECODE_CACHE_SIZE - 1)];
 
-static MDFN_FASTCALL uint8 test_cpu_readmem20(uint32 A)
-{
- if(read_hook)
-  return(read_hook(A));
- else
-  return(save_cpu_readmem20(A));
-}
+  if(MDFN_UNLIKELY((raw & e->mask) != e->bytes))
+   Decode(e, raw);
 
-static MDFN_FASTCALL void test_cpu_writeport(uint32 A, uint8 V)
-{
- if(port_write_hook)
-  port_write_hook(A, V);
+  I.pc += e->len;
+  DoOP<true>(raw, e);
+  return;
+ }
+
+ DoOP<false>(FETCHOP);
 }
 
-static MDFN_FASTCALL uint8 test_cpu_readport(uint32 A)
+#ifdef WANT_DEBUGGER
+// Same as the loop in v30mz_execute(), with the debugger's CPU hook called before each instruction.
+// Watchpoint hooks run during the instruction itself(see PhysRead8() etc.), so a hit is reported
+// at the following cpu_hook call, once the accessing instruction has completed.
+static NO_INLINE void ExecuteHooked(void)
 {
- if(port_read_hook)
-  return(port_read_hook(A));
- else
-  return(save_cpu_readport(A));
+ while(v30mz_ICount > 0)
+ {
+  SETOLDCSIP();
+
+  WSwan_InterruptCheck();
+
+  if(cpu_hook)
+   cpu_hook(I.pc);
+
+  DoOP<false>(FETCHOP);
+ }
 }
 #endif
 
 void v30mz_execute(int cycles)
 {
  v30mz_ICount += cycles;
+ idle_target = ~0U;
 
  if(InHLT)
  {
@@ -1086,61 +1579,56 @@ void v30mz_execute(int cycles)
   }
  }
 
- while(v30mz_ICount > 0) 
+ #ifdef WANT_DEBUGGER
+ if(MDFN_UNLIKELY(cpu_hook != NULL))
  {
-  SETOLDCSIP();
-
-  WSwan_InterruptCheck();
+  ExecuteHooked();
+  return;
+ }
+ #endif
 
-  #ifdef WANT_DEBUGGER
-  if(hookie_hickey)
+ if(decode_cache_enabled)
+ {
+  while(v30mz_ICount > 0)
   {
-   uint32 save_timestamp = v30mz_timestamp;
-   int32 save_ICount = v30mz_ICount;
-   v30mz_regs_t save_I = I;
-   uint32 save_prefix_base = prefix_base;
-   char save_seg_prefix = seg_prefix;
-   void (*save_branch_trace_hook)(uint16 from_CS, uint16 from_IP, uint16 to_CS, uint16 to_IP, bool interrupt) = branch_trace_hook;
-
-   branch_trace_hook = NULL;
-
-   save_cpu_writemem20 = cpu_writemem20;
-   save_cpu_readport = cpu_readport;
-   save_cpu_writeport = cpu_writeport;
-   save_cpu_readmem20 = cpu_readmem20;
-
-   cpu_writemem20 = test_cpu_writemem20;
-   cpu_readmem20 = test_cpu_readmem20;
-   cpu_writeport = test_cpu_writeport;
-   cpu_readport = test_cpu_readport;
-
-   DoOP(FETCHOP);
-
-   branch_trace_hook = save_branch_trace_hook;
-   v30mz_timestamp = save_timestamp;
-   v30mz_ICount = save_ICount;
-   I = save_I;
-   prefix_base = save_prefix_base;
-   seg_prefix = save_seg_prefix;
-   cpu_readmem20 = save_cpu_readmem20;
-   cpu_writemem20 = save_cpu_writemem20;
-   cpu_readport = save_cpu_readport;
-   cpu_writeport = save_cpu_writeport;
-   InHLT = false;
+   SETOLDCSIP();
+
+   WSwan_InterruptCheck();
+
+   DoCachedOP();
   }
+ }
+ else
+ {
+  while(v30mz_ICount > 0)
+  {
+   SETOLDCSIP();
 
-  if(cpu_hook)
-   cpu_hook(I.pc);
-  #endif
+   WSwan_InterruptCheck();
 
-  DoOP(FETCHOP);
+   DoOP<false>(FETCHOP);
+  }
  }
+}
 
+void v30mz_set_call_hooks(void (*CallHook)(uint32 from, uint32 to, uint16 sp, bool interrupt), void (*ReturnHook)(uint16 sp))
+{
+ call_hook = CallHook;
+ return_hook = ReturnHook;
+}
+
+void v30mz_set_bus_hook(void (*BusHook)(uint32 addr, unsigned type))
+{
+ bus_hook = BusHook;
+
+ for(unsigned page = 0; page < 16; page++)
+  UpdateMap(page);
 }
 
 #ifdef WANT_DEBUGGER
-void v30mz_debug(void (*CPUHook)(uint32), uint8 (*ReadHook)(uint32), void (*WriteHook)(uint32, uint8), uint8 (*PortReadHook)(uint32), 
-	void (*PortWriteHook)(uint32, uint8), void (*BranchTraceHook)(uint16 from_CS, uint16 from_IP, uint16 to_CS, uint16 to_IP, bool interrupt))
+void v30mz_debug(void (*CPUHook)(uint32), void (*ReadHook)(uint32), void (*WriteHook)(uint32, uint8), void (*PortReadHook)(uint32),
+	void (*PortWriteHook)(uint32, uint8), void (*BranchTraceHook)(uint16 from_CS, uint16 from_IP, uint16 to_CS, uint16 to_IP, bool interrupt),
+	uint16 ReadWatchPages, uint16 WriteWatchPages)
 {
  cpu_hook = CPUHook;
  read_hook = ReadHook;
@@ -1148,7 +1636,11 @@ void v30mz_debug(void (*CPUHook)(uint32), uint8 (*ReadHook)(uint32), void (*Writ
  port_read_hook = PortReadHook;
  port_write_hook = PortWriteHook;
 
- hookie_hickey = read_hook || write_hook || port_read_hook || port_write_hook;
+ watch_read_pages = ReadHook ? ReadWatchPages : 0;
+ watch_write_pages = WriteHook ? WriteWatchPages : 0;
+
+ for(unsigned page = 0; page < 16; page++)
+  UpdateMap(page);
 
  branch_trace_hook = BranchTraceHook;
 }
@@ -1169,6 +1661,11 @@ void v30mz_StateAction(StateMem *sm, const unsigned load, const bool data_only)
   SFVARN(prefix_base, "prefix_base"),
   SFVARN(seg_prefix, "seg_prefix"),
   SFVAR(PSW),
+
+  SFPTR8(pq_buf, V30MZ_PREFETCH_SIZE),
+  SFVAR(pq_cs),
+  SFVAR(pq_pc),
+  SFVAR(pq_len),
   SFEND
  };
 
@@ -1179,6 +1676,10 @@ void v30mz_StateAction(StateMem *sm, const unsigned load, const bool data_only)
  if(load)
  {
   ExpandFlags(PSW);
+  code_cs = ~0U;
+
+  if(pq_len > V30MZ_PREFETCH_SIZE)
+   pq_len = 0;
  }
 }
 
@@ -20,6 +20,28 @@ void v30mz_set_reg(int, unsigned);
 unsigned v30mz_get_reg(int regnum);
 void v30mz_reset(void);
 void v30mz_init(uint8 (MDFN_FASTCALL *readmem20)(uint32), void (MDFN_FASTCALL *writemem20)(uint32,uint8), uint8 (MDFN_FASTCALL *readport)(uint32), void (MDFN_FASTCALL *writeport)(uint32, uint8)) MDFN_COLD;
+void v30mz_set_page(unsigned page, uint8* read_ptr, uint8* write_ptr);
+void v30mz_set_prefetch(bool enabled);
+void v30mz_set_decode_cache(bool enabled);
+void v30mz_set_idle_skip(bool enabled);
+void v30mz_set_idle_ports(const bool* pure_ports);
+void v30mz_get_idle_stats(uint64* skips, uint64* cycles);
+
+// CallHook is called for CALL, INT and hardware interrupts(interrupt = true) once the return address is pushed, with the
+// linear return address, the linear target and SP; ReturnHook after RET/RETF/IRET, with SP.
+void v30mz_set_call_hooks(void (*CallHook)(uint32 from, uint32 to, uint16 sp, bool interrupt), void (*ReturnHook)(uint16 sp));
+
+// BusHook is called for every memory and port access the CPU makes, with the physical address(or port) and one of the
+// V30MZ_BUS_* types; setting it turns off the direct page mappings, so emulation is considerably slower while it's set.
+enum
+{
+ V30MZ_BUS_READ = 0,
+ V30MZ_BUS_WRITE,
+ V30MZ_BUS_FETCH,
+ V30MZ_BUS_PORT_READ,
+ V30MZ_BUS_PORT_WRITE
+};
+void v30mz_set_bus_hook(void (*BusHook)(uint32 addr, unsigned type));
 
 void v30mz_int(uint32 vector, bool IgnoreIF = false);
 
@@ -27,8 +49,10 @@ void v30mz_StateAction(StateMem *sm, const unsigned load, const bool data_only);
 
 
 #ifdef WANT_DEBUGGER
-void v30mz_debug(void (*CPUHook)(uint32), uint8 (*ReadHook)(uint32), void (*WriteHook)(uint32, uint8), uint8 (*PortReadHook)(uint32), void (*PortWriteHook)(uint32, uint8),
-			void (*BranchTraceHook)(uint16 from_CS, uint16 from_IP, uint16 to_CS, uint16 to_IP, bool interrupt) );
+// ReadHook/WriteHook are only called for accesses within the 64KiB pages set in ReadWatchPages/WriteWatchPages.
+void v30mz_debug(void (*CPUHook)(uint32), void (*ReadHook)(uint32), void (*WriteHook)(uint32, uint8), void (*PortReadHook)(uint32), void (*PortWriteHook)(uint32, uint8),
+			void (*BranchTraceHook)(uint16 from_CS, uint16 from_IP, uint16 to_CS, uint16 to_IP, bool interrupt),
+			uint16 ReadWatchPages, uint16 WriteWatchPages);
 #endif
 #endif
 
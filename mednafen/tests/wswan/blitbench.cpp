@@ -0,0 +1,137 @@
+//
+// g++ -Wall -O2 -DHAVE_CONFIG_H -DMDFN_DISABLE_PICPIE_ERRWARN -I../../include -o blitbench blitbench.cpp
+//
+// (after configure; the blit comes from the emulator source tree)
+//
+// Times the WonderSwan scanline blit(src/wswan/blit.inc) in each version the CPU can run, for 16 and 32-bit
+// output, and checks that each gives the same pixels as the scalar version:
+//
+//  blitbench		(lines with a background palette per 8-pixel tile, and some sprites)
+//  blitbench mixed	(a random palette per pixel, so the SIMD versions fall back to the table throughout)
+//
+#include <mednafen/types.h>
+#include <mednafen/cputest/cputest.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <algorithm>
+
+#include "../../src/wswan/blit.inc"
+
+enum { LINES = 144, FRAMES = 50, PASSES = 50 };
+
+static uint8 bg[LINES][224];
+static uint8 bg_pal[LINES][224];
+
+static double now(void)
+{
+ struct timespec ts;
+
+ clock_gettime(CLOCK_MONOTONIC, &ts);
+
+ return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+template<typename T>
+static void RunAll(const BlitMap* bm)
+{
+ static T target[LINES][224];
+ static T expected[LINES][224];
+ const char* names[3] = { "scalar" };
+ BlitFuncs<T> bf[3];
+ unsigned count = 1;
+
+ Blit_Select(&bf[0], 0);
+#ifdef WSWAN_BLIT_SIMD
+ if(__builtin_cpu_supports("ssse3"))
+ {
+  names[count] = "ssse3";
+  Blit_Select(&bf[count++], CPUTEST_FLAG_SSSE3);
+ }
+
+ if(__builtin_cpu_supports("avx2"))
+ {
+  names[count] = "avx2";
+  Blit_Select(&bf[count++], CPUTEST_FLAG_AVX2);
+ }
+#endif
+
+ for(unsigned color = 0; color < 2; color++)
+ {
+  double best[3] = { 1e9, 1e9, 1e9 };
+
+  for(unsigned y = 0; y < LINES; y++)
+   bf[0].Line[color](bm, expected[y], bg[y], bg_pal[y]);
+
+  for(unsigned i = 1; i < count; i++)
+  {
+   for(unsigned y = 0; y < LINES; y++)
+    bf[i].Line[color](bm, target[y], bg[y], bg_pal[y]);
+
+   if(memcmp(target, expected, sizeof(target)))
+   {
+    printf("%-6s %2u-bit %-5s: MISMATCH\n", names[i], (unsigned)sizeof(T) * 8, color ? "color" : "mono");
+    exit(1);
+   }
+  }
+
+  // Best of several passes, taking turns, as the machine may be busy with other things.
+  for(unsigned pass = 0; pass < PASSES; pass++)
+  {
+   for(unsigned i = 0; i < count; i++)
+   {
+    const double start = now();
+
+    for(unsigned f = 0; f < FRAMES; f++)
+    {
+     for(unsigned y = 0; y < LINES; y++)
+      bf[i].Line[color](bm, target[y], bg[y], bg_pal[y]);
+     asm volatile("" : : "r"(target) : "memory");
+    }
+    best[i] = std::min<double>(best[i], now() - start);
+   }
+  }
+
+  for(unsigned i = 0; i < count; i++)
+   printf("%-6s %2u-bit %-5s: %6.1f ns/line\n", names[i], (unsigned)sizeof(T) * 8, color ? "color" : "mono", best[i] * 1e9 / (FRAMES * LINES));
+ }
+}
+
+int main(int argc, char* argv[])
+{
+ const bool mixed = (argc > 1 && !strcmp(argv[1], "mixed"));
+ static BlitMap bm;
+
+ srand(1);
+
+ for(unsigned i = 0; i < 17 * 16; i++)
+  BlitMap_Set(&bm, i, ((uint32)rand() << 16) ^ rand());
+
+ for(unsigned y = 0; y < LINES; y++)
+ {
+  for(unsigned x = 0; x < 224; x++)
+  {
+   bg[y][x] = rand() & 0xFF;	// Upper bits set, as the blit must ignore them.
+   bg_pal[y][x] = mixed ? (rand() & 0xF) : ((y * 3 + (x + y) / 8) & 0x7);
+  }
+
+  // A few sprites, at any x, with palettes 8-15.
+  if(!mixed)
+  {
+   for(unsigned s = 0; s < 3; s++)
+   {
+    const unsigned sx = rand() % (224 - 8);
+    const unsigned pal = 8 + (rand() & 0x7);
+
+    for(unsigned x = sx; x < sx + 8; x++)
+     bg_pal[y][x] = pal;
+   }
+  }
+ }
+
+ RunAll<uint32>(&bm);
+ RunAll<uint16>(&bm);
+
+ return 0;
+}
@@ -0,0 +1,184 @@
+//
+// g++ -Wall -O2 -o cdcbench cdcbench.cpp
+//
+// Measures nileswan USB CDC throughput through the emulator's serial transport, e.g. with
+// -wswan.excomm 1 -wswan.excomm.transport unix -wswan.excomm.path /tmp/ws.sock:
+//
+//  cdcbench /tmp/ws.sock send 1048576	(cart reads and discards, e.g. an upload)
+//  cdcbench /tmp/ws.sock recv 1048576	(cart writes)
+//  cdcbench /tmp/ws.sock echo 65536	(cart writes back everything it reads; data is checked)
+//
+// A TCP transport is given as [host:]port instead of a path.  Times are host wall-clock, so run
+// the emulator unthrottled (or at 1x) depending on what is being measured.
+//
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <inttypes.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <poll.h>
+#include <algorithm>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netdb.h>
+
+static double now(void)
+{
+ struct timespec ts;
+
+ clock_gettime(CLOCK_MONOTONIC, &ts);
+
+ return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int connect_to(const char* addr)
+{
+ int fd = -1;
+
+ if(strchr(addr, '/'))
+ {
+  struct sockaddr_un sa;
+
+  memset(&sa, 0, sizeof(sa));
+  sa.sun_family = AF_UNIX;
+  snprintf(sa.sun_path, sizeof(sa.sun_path), "%s", addr);
+
+  if((fd = socket(AF_UNIX, SOCK_STREAM, 0)) != -1 && connect(fd, (struct sockaddr*)&sa, sizeof(sa)) == -1)
+  {
+   close(fd);
+   fd = -1;
+  }
+ }
+ else
+ {
+  char host[256] = "localhost";
+  const char* port = addr;
+  const char* colon = strrchr(addr, ':');
+  struct addrinfo hints, *res;
+
+  if(colon)
+  {
+   snprintf(host, sizeof(host), "%.*s", (int)(colon - addr), addr);
+   port = colon + 1;
+  }
+
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+
+  if(getaddrinfo(host, port, &hints, &res))
+   return -1;
+
+  if((fd = socket(res->ai_family, res->ai_socktype, res->ai_protocol)) != -1 && connect(fd, res->ai_addr, res->ai_addrlen) == -1)
+  {
+   close(fd);
+   fd = -1;
+  }
+  freeaddrinfo(res);
+ }
+
+ return fd;
+}
+
+static uint8_t pattern(uint64_t i)
+{
+ return (uint8_t)(i * 7 + (i >> 8));
+}
+
+int main(int argc, char* argv[])
+{
+ if(argc < 4 || (strcmp(argv[2], "send") && strcmp(argv[2], "recv") && strcmp(argv[2], "echo")))
+ {
+  printf("Usage: %s <socket path | [host:]port> <send | recv | echo> <bytes> [chunk size]\n", argv[0]);
+  return -1;
+ }
+ //
+ const bool sending = strcmp(argv[2], "recv") != 0;
+ const bool receiving = strcmp(argv[2], "send") != 0;
+ const bool checking = !strcmp(argv[2], "echo");
+ const uint64_t total = strtoull(argv[3], NULL, 0);
+ const size_t chunk = (argc > 4) ? strtoul(argv[4], NULL, 0) : 4096;
+ uint64_t sent = 0, received = 0, mismatches = 0;
+ double start, first_byte = 0, end;
+ uint8_t buf[65536];
+ int fd;
+
+ if(!chunk || chunk > sizeof(buf))
+ {
+  printf("Chunk size must be between 1 and %u.\n", (unsigned)sizeof(buf));
+  return -1;
+ }
+
+ if((fd = connect_to(argv[1])) == -1)
+ {
+  printf("Error connecting to \"%s\": %s\n", argv[1], strerror(errno));
+  return -1;
+ }
+
+ start = now();
+
+ while((sending && sent < total) || (receiving && received < total))
+ {
+  struct pollfd pfd;
+
+  pfd.fd = fd;
+  pfd.events = ((sending && sent < total) ? POLLOUT : 0) | ((receiving && received < total) ? POLLIN : 0);
+  pfd.revents = 0;
+
+  if(poll(&pfd, 1, 10000) <= 0)
+  {
+   printf("Timed out after %" PRIu64 " bytes sent, %" PRIu64 " received.\n", sent, received);
+   return -1;
+  }
+
+  if(pfd.revents & POLLOUT)
+  {
+   const size_t len = (size_t)std::min<uint64_t>(chunk, total - sent);
+   ssize_t done;
+
+   for(size_t i = 0; i < len; i++)
+    buf[i] = pattern(sent + i);
+
+   if((done = send(fd, buf, len, 0)) > 0)
+    sent += done;
+  }
+
+  if(pfd.revents & (POLLIN | POLLHUP | POLLERR))
+  {
+   const ssize_t done = recv(fd, buf, (size_t)std::min<uint64_t>(sizeof(buf), total - received), 0);
+
+   if(done <= 0)
+   {
+    printf("Connection closed after %" PRIu64 " bytes sent, %" PRIu64 " received.\n", sent, received);
+    return -1;
+   }
+
+   if(!received)
+    first_byte = now();
+
+   if(checking)
+   {
+    for(ssize_t i = 0; i < done; i++)
+     mismatches += (buf[i] != pattern(received + i));
+   }
+
+   received += done;
+  }
+ }
+
+ end = now();
+ close(fd);
+
+ printf("%" PRIu64 " bytes in %.3f s: %.1f KiB/s\n", total, end - start, total / 1024.0 / (end - start));
+
+ if(receiving)
+  printf("First byte after %.1f ms.\n", (first_byte - start) * 1000);
+
+ if(checking)
+  printf("%" PRIu64 " mismatched bytes.\n", mismatches);
+
+ return mismatches ? 1 : 0;
+}
@@ -0,0 +1,211 @@
+//
+// g++ -Wall -O2 -DHAVE_CONFIG_H -DMDFN_DISABLE_PICPIE_ERRWARN -I../../include -o tracedis tracedis.cpp ../../src/wswan/dis/*.cpp -lz
+//
+// (after configure; the disassembler comes from the emulator source tree)
+//
+// Disassembles a WonderSwan binary CPU trace, as recorded by entering a file name ending in ".bintrace" at the
+// debugger's trace log prompt:
+//
+//  tracedis boot.bintrace		(one line per instruction: cycle, PS:IP, disassembly, registers before it executes)
+//  tracedis boot.bintrace -n		(without registers)
+//  tracedis boot.bintrace -s		(summary only)
+//
+// Cycles count from the start of the trace.  See the format description in src/wswan/debug.cpp.
+//
+#include "../../src/wswan/dis/disasm.h"	// Includes mednafen/types.h, which must come first.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <zlib.h>
+
+enum
+{
+ BT_CS = 0x01,
+ BT_CODE = 0x02,
+ BT_REGS = 0x04
+};
+
+static const char* const reg_names[12] = { "AW", "CW", "DW", "BW", "SP", "BP", "IX", "IY", "DS1", "SS", "DS0", "PSW" };
+
+static gzFile in;
+static uint8 buf[65536];
+static size_t buf_pos, buf_len;
+
+static bool get_bytes(uint8* p, size_t n)
+{
+ while(n)
+ {
+  if(buf_pos == buf_len)
+  {
+   const int done = gzread(in, buf, sizeof(buf));
+
+   if(done <= 0)
+    return false;
+
+   buf_pos = 0;
+   buf_len = done;
+  }
+
+  const size_t count = (n < buf_len - buf_pos) ? n : (buf_len - buf_pos);
+
+  memcpy(p, &buf[buf_pos], count);
+  buf_pos += count;
+  p += count;
+  n -= count;
+ }
+
+ return true;
+}
+
+static bool get_varint(uint32* v)
+{
+ uint8 b;
+
+ *v = 0;
+ for(unsigned shift = 0; shift < 35; shift += 7)
+ {
+  if(!get_bytes(&b, 1))
+   return false;
+
+  *v |= (uint32)(b & 0x7F) << shift;
+
+  if(!(b & 0x80))
+   return true;
+ }
+
+ return false;
+}
+
+static bool get_u16(uint16* v)
+{
+ uint8 b[2];
+
+ if(!get_bytes(b, 2))
+  return false;
+
+ *v = b[0] | (b[1] << 8);
+
+ return true;
+}
+
+int main(int argc, char* argv[])
+{
+ if(argc < 2 || (argc > 2 && strcmp(argv[2], "-n") && strcmp(argv[2], "-s")))
+ {
+  printf("Usage: %s <trace file> [-n | -s]\n", argv[0]);
+  return -1;
+ }
+ //
+ const bool show_regs = (argc == 2);
+ const bool summary = (argc > 2 && !strcmp(argv[2], "-s"));
+ static uint8 shadow[0x100000];
+ uint8 magic[8];
+ uint16 cs = 0, ip = 0;
+ uint16 regs[12] = { 0 };
+ uint64_t cycles = 0, records = 0, code_records = 0;
+ disassembler dis;
+ bool truncated = false;
+
+ if(!(in = gzopen(argv[1], "rb")))
+ {
+  printf("Error opening \"%s\".\n", argv[1]);
+  return -1;
+ }
+
+ if(!get_bytes(magic, sizeof(magic)) || memcmp(magic, "WSTRACE", 7) || magic[7] != 1)
+ {
+  printf("\"%s\" is not a version 1 WonderSwan binary CPU trace.\n", argv[1]);
+  return -1;
+ }
+
+ for(;;)
+ {
+  uint8 flags;
+  uint32 ip_zz, cycle_delta;
+
+  if(!get_bytes(&flags, 1))
+   break;
+
+  if((flags & ~(BT_CS | BT_CODE | BT_REGS)) || ((flags & BT_CS) && !get_u16(&cs)) || !get_varint(&ip_zz) || !get_varint(&cycle_delta))
+  {
+   truncated = true;
+   break;
+  }
+
+  ip += (uint16)((ip_zz >> 1) ^ -(ip_zz & 1));
+  cycles += cycle_delta;
+
+  if(flags & BT_CODE)
+  {
+   uint8 code[16];
+
+   if(!get_bytes(code, sizeof(code)))
+   {
+    truncated = true;
+    break;
+   }
+
+   for(unsigned i = 0; i < 16; i++)
+    shadow[((cs << 4) + (uint16)(ip + i)) & 0xFFFFF] = code[i];
+
+   code_records++;
+  }
+
+  if(flags & BT_REGS)
+  {
+   uint16 mask;
+
+   if(!get_u16(&mask))
+   {
+    truncated = true;
+    break;
+   }
+
+   for(unsigned i = 0; i < 12; i++)
+   {
+    if((mask & (1U << i)) && !get_u16(&regs[i]))
+    {
+     truncated = true;
+     break;
+    }
+   }
+
+   if(truncated)
+    break;
+  }
+
+  records++;
+
+  if(!summary)
+  {
+   uint8 instr[16];
+   char text[256];
+
+   for(unsigned i = 0; i < 16; i++)
+    instr[i] = shadow[((cs << 4) + (uint16)(ip + i)) & 0xFFFFF];
+
+   dis.disasm(0x0000, ip, instr, text);
+
+   printf("%12" PRIu64 " %04X:%04X: %-32s", cycles, cs, ip, text);
+
+   if(show_regs)
+   {
+    for(unsigned i = 0; i < 12; i++)
+     printf(" %s=%04X", reg_names[i], regs[i]);
+   }
+
+   putchar('\n');
+  }
+ }
+
+ gzclose(in);
+
+ if(truncated)
+  printf("Trace truncated after %" PRIu64 " instructions.\n", records);
+
+ if(summary || truncated)
+  printf("%" PRIu64 " instructions, %" PRIu64 " cycles, %" PRIu64 " code updates.\n", records, cycles, code_records);
+
+ return truncated ? 1 : 0;
+}
@@ -0,0 +1,100 @@
+//
+// g++ -Wall -O2 -o wsrstress wsrstress.cpp
+//
+// Writes a WonderSwan sound rip(WSR) that loads the sound emulation as heavily as it can, for benchmarking it
+// with the headless runner:
+//
+//  wsrstress stress.wsr
+//  mednafen -headless -frames 7500 -basedir /tmp/wsrstress stress.wsr	(prints frames per second)
+//
+// All four channels run at period 0x7F8(384KHz ticks) on an uneven wavetable, with the sweep on channel 2
+// and noise on channel 3.  The main loop writes a HyperVoice sample and reads the noise LFSR, so each
+// iteration forces two sound updates; every 256 iterations it also rewrites a wave RAM byte and the
+// volume of channel 0.  Interrupts stay off and nothing is drawn.
+//
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+static const uint8_t code[] =
+{
+ 0xFA,				// cli
+ 0x31, 0xC0,			// xor ax, ax
+ 0x8E, 0xD0,			// mov ss, ax
+ 0x8E, 0xD8,			// mov ds, ax
+ 0x8E, 0xC0,			// mov es, ax
+ 0xBC, 0x00, 0x20,		// mov sp, 0x2000
+ 0xFC,				// cld
+ 0xBF, 0x00, 0x01,		// mov di, 0x0100
+ 0xB9, 0x20, 0x00,		// mov cx, 32
+ 0xB8, 0x0F, 0xA5,		// mov ax, 0xA50F
+ 0xF3, 0xAB,			// rep stosw		(wavetables, 0x0100-0x013F)
+ 0xB0, 0x04, 0xE6, 0x8F,	// out 0x8F, 4		(wavetables at 4 << 6)
+ 0xB8, 0xF8, 0x07,		// mov ax, 0x07F8
+ 0xE7, 0x80, 0xE7, 0x82,	// out 0x80, ax; out 0x82, ax
+ 0xE7, 0x84, 0xE7, 0x86,	// out 0x84, ax; out 0x86, ax
+ 0xB0, 0xFF,			// mov al, 0xFF
+ 0xE6, 0x88, 0xE6, 0x89,	// out 0x88, al; out 0x89, al
+ 0xE6, 0x8A, 0xE6, 0x8B,	// out 0x8A, al; out 0x8B, al
+ 0xB0, 0x01, 0xE6, 0x8C,	// out 0x8C, 1		(sweep value)
+ 0xB0, 0x00, 0xE6, 0x8D,	// out 0x8D, 0		(sweep step)
+ 0xB0, 0x14, 0xE6, 0x8E,	// out 0x8E, 0x14	(noise on, tap 4)
+ 0xB0, 0x0F, 0xE6, 0x91,	// out 0x91, 0x0F	(outputs)
+ 0xB0, 0xCF, 0xE6, 0x90,	// out 0x90, 0xCF	(channels, sweep, noise)
+ 0xB0, 0x80, 0xE6, 0x6A,	// out 0x6A, 0x80	(HyperVoice)
+ 0xB0, 0x60, 0xE6, 0x6B,	// out 0x6B, 0x60
+ // loop:
+ 0xFE, 0xC3,			// inc bl
+ 0x88, 0xD8,			// mov al, bl
+ 0xE6, 0x95,			// out 0x95, al
+ 0xE4, 0x92,			// in al, 0x92
+ 0x84, 0xDB,			// test bl, bl
+ 0x75, 0xF4,			// jnz loop
+ 0xF6, 0x16, 0x00, 0x01,	// not byte [0x0100]
+ 0xE4, 0x88,			// in al, 0x88
+ 0x34, 0x11,			// xor al, 0x11
+ 0xE6, 0x88,			// out 0x88, al
+ 0xEB, 0xE8,			// jmp loop
+};
+
+int main(int argc, char* argv[])
+{
+ static uint8_t rom[0x10000];
+ FILE* fp;
+
+ if(argc != 2)
+ {
+  fprintf(stderr, "Usage: %s <output.wsr>\n", argv[0]);
+  return 1;
+ }
+
+ memset(rom, 0xFF, sizeof(rom));
+ memcpy(rom, code, sizeof(code));
+
+ // WSR footer, song 0; its last 16 bytes are the cartridge header, jumping to F000:0000.
+ {
+  static const uint8_t footer[0x20] =
+  {
+   'W', 'S', 'R', 'F', 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+   0xEA, 0x00, 0x00, 0x00, 0xF0, 0x00, 0x01, 0x00, 0x01, 0x00, 0x00, 0x00, 0x04, 0x00, 0x00, 0x00
+  };
+  uint16_t sum = 0;
+
+  memcpy(rom + sizeof(rom) - sizeof(footer), footer, sizeof(footer));
+
+  for(size_t i = 0; i < sizeof(rom) - 2; i++)
+   sum += rom[i];
+
+  rom[sizeof(rom) - 2] = sum;
+  rom[sizeof(rom) - 1] = sum >> 8;
+ }
+
+ if(!(fp = fopen(argv[1], "wb")) || fwrite(rom, 1, sizeof(rom), fp) != sizeof(rom) || fclose(fp))
+ {
+  perror(argv[1]);
+  return 1;
+ }
+
+ return 0;
+}